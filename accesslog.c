@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "accesslog.h"
+#include "log.h"
+
+#ifdef _WIN32
+#   ifndef localtime_r
+#       define localtime_r(x, y) localtime_s(y, x)
+#   endif
+#endif
+
+// 编译参数 -- 单条访问记录的最大长度, 超出部分截断
+#ifndef ACCESSLOG_LINE_MAX
+#   define ACCESSLOG_LINE_MAX 2048
+#endif
+// 格式模板允许的最大指令数量
+#define ACCESSLOG_MAX_OPS 64
+
+// 指令类型
+typedef enum {
+    OP_TEXT,            // 固定文本
+    OP_REMOTE,          // %h
+    OP_DASH,            // %l %u
+    OP_TIME,            // %t
+    OP_REQUEST,         // %r
+    OP_METHOD,          // %m
+    OP_PATH,            // %U
+    OP_QUERY,           // %q
+    OP_PROTOCOL,        // %H
+    OP_STATUS,          // %s
+    OP_BODY_CLF,        // %b
+    OP_BODY,            // %B
+    OP_BYTES_IN,        // %I
+    OP_BYTES_OUT,       // %O
+    OP_MICROS,          // %D
+    OP_SECONDS,         // %T
+    OP_HEADER,          // %{Name}i
+} _op_type_t;
+
+// 编译后的指令
+typedef struct _op_t {
+    uint8_t         type;               // 指令类型
+    uint16_t        len;                // 固定文本或头部名称的长度
+    const char*     text;               // 固定文本或头部名称
+} _op_t;
+
+bool _accesslog_enabled = false;
+
+static _op_t _ops[ACCESSLOG_MAX_OPS];
+static uint32_t _op_count = 0;
+static char* _pattern = NULL;           // 模板副本, 固定文本和头部名称指向该副本
+
+/** 添加一条指令 */
+static bool add_op(uint8_t type, const char* text, size_t len) {
+    if (_op_count == ACCESSLOG_MAX_OPS) return false;
+    // 相邻的固定文本合并
+    if (type == OP_TEXT && _op_count && _ops[_op_count - 1].type == OP_TEXT
+            && _ops[_op_count - 1].text + _ops[_op_count - 1].len == text) {
+        _ops[_op_count - 1].len += (uint16_t) len;
+        return true;
+    }
+    _ops[_op_count++] = (_op_t) { type, (uint16_t) len, text };
+    return true;
+}
+
+/** 编译格式模板 */
+static bool compile(const char* pattern) {
+    free(_pattern);
+    size_t plen = strlen(pattern);
+    _pattern = malloc(plen + 1);
+    memcpy(_pattern, pattern, plen + 1);
+    _op_count = 0;
+
+    for (const char* p = _pattern; *p; ) {
+        if (*p != '%') {
+            const char* s = p;
+            while (*p && *p != '%') ++p;
+            if (!add_op(OP_TEXT, s, p - s)) return false;
+            continue;
+        }
+
+        char c = *++p;
+        uint8_t type;
+        if (c == '{') {
+            // %{Name}i 请求头部
+            const char* name = ++p;
+            while (*p && *p != '}') ++p;
+            if (*p != '}' || p[1] != 'i' || p == name) {
+                log_error("access log pattern: bad directive at %s", name - 2);
+                return false;
+            }
+            if (!add_op(OP_HEADER, name, p - name)) return false;
+            p += 2;
+            continue;
+        }
+
+        switch (c) {
+            case '%': type = OP_TEXT; break;
+            case 'h': type = OP_REMOTE; break;
+            case 'l': case 'u': type = OP_DASH; break;
+            case 't': type = OP_TIME; break;
+            case 'r': type = OP_REQUEST; break;
+            case 'm': type = OP_METHOD; break;
+            case 'U': type = OP_PATH; break;
+            case 'q': type = OP_QUERY; break;
+            case 'H': type = OP_PROTOCOL; break;
+            case 's': type = OP_STATUS; break;
+            case 'b': type = OP_BODY_CLF; break;
+            case 'B': type = OP_BODY; break;
+            case 'I': type = OP_BYTES_IN; break;
+            case 'O': type = OP_BYTES_OUT; break;
+            case 'D': type = OP_MICROS; break;
+            case 'T': type = OP_SECONDS; break;
+            default:
+                log_error("access log pattern: unsupported directive %%%c", c ? c : ' ');
+                return false;
+        }
+        if (!add_op(type, p, type == OP_TEXT ? 1 : 0)) return false;
+        ++p;
+    }
+    return true;
+}
+
+bool accesslog_start(const char* filename, const char* pattern) {
+    if (!compile(pattern ? pattern : ACCESSLOG_COMBINED)) return false;
+    if (!log_access_start(filename)) return false;
+    _accesslog_enabled = true;
+    log_info("access log to %s, pattern: %s", filename, _pattern);
+    return true;
+}
+
+// 生成记录的缓冲区, 超出部分截断
+typedef struct _line_t {
+    char*           pos;
+    char*           end;
+} _line_t;
+
+inline static void put(_line_t* l, const void* src, size_t len) {
+    if (len > (size_t) (l->end - l->pos)) len = l->end - l->pos;
+    memcpy(l->pos, src, len);
+    l->pos += len;
+}
+
+inline static void put_char(_line_t* l, char c) {
+    if (l->pos < l->end) *l->pos++ = c;
+}
+
+/** 写入无符号整数 */
+static void put_uint(_line_t* l, uint64_t v) {
+    char buf[20], *p = buf + sizeof(buf);
+    do {
+        *--p = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v);
+    put(l, p, buf + sizeof(buf) - p);
+}
+
+/** 写入客户端提供的字节, 与apache相同, 双引号和反斜杠前加反斜杠, 控制字符和非ascii字符写成\xhh,
+ *  避免客户端通过换行或引号伪造日志行, 转义后超出剩余空间的字符整体丢弃
+*/
+static void put_escape(_line_t* l, uint8_t c) {
+    static const char HEX[] = "0123456789abcdef";
+    char esc[4] = { '\\', (char) c };
+    size_t len = 2;
+    switch (c) {
+        case '"': case '\\': break;
+        case '\b': esc[1] = 'b'; break;
+        case '\n': esc[1] = 'n'; break;
+        case '\r': esc[1] = 'r'; break;
+        case '\t': esc[1] = 't'; break;
+        case '\v': esc[1] = 'v'; break;
+        default:
+            if (c >= 0x20 && c < 0x7f) {
+                put_char(l, (char) c);
+                return;
+            }
+            esc[1] = 'x';
+            esc[2] = HEX[c >> 4];
+            esc[3] = HEX[c & 15];
+            len = 4;
+    }
+    if (len <= (size_t) (l->end - l->pos)) put(l, esc, len);
+    else l->pos = l->end;
+}
+
+/** 复制请求缓冲区中的内容, 内容来自客户端, 需要转义 */
+static void put_value(_line_t* l, dynmem_t* pbuf, const http_value_t* val) {
+    char buf[256];
+    for (uint32_t off = 0; off < val->len && l->pos < l->end;) {
+        uint32_t n = val->len - off;
+        if (n > sizeof(buf)) n = sizeof(buf);
+        n = dynmem_read(pbuf, val->pos + off, n, buf);
+        if (!n) break;
+        off += n;
+        for (uint32_t i = 0; i < n; ++i)
+            put_escape(l, (uint8_t) buf[i]);
+    }
+}
+
+/** 写入客户端发送的原始url, 路径规范化之前的内容 */
+static void put_url(_line_t* l, httpctx_t* ctx) {
+    httpreq_t* req = &ctx->req;
+    if (!req->raw_path) {
+        put_value(l, &req->data, &req->url);
+        return;
+    }
+    char url[req->url.len];
+    uint32_t len = httpctx_read_url(ctx, url);
+    for (uint32_t i = 0; i < len && l->pos < l->end; ++i)
+        put_escape(l, (uint8_t) url[i]);
+}
+
+/** 写入请求时间, 同一秒内重复使用上次的格式化结果 */
+static void put_time(_line_t* l) {
+    static _Thread_local time_t last = -1;
+    static _Thread_local char cache[40];
+    static _Thread_local size_t cache_len;
+    time_t t = time(NULL);
+    if (t != last) {
+        struct tm tm;
+        localtime_r(&t, &tm);
+        cache_len = strftime(cache, sizeof(cache), "[%d/%b/%Y:%H:%M:%S %z]", &tm);
+        last = t;
+    }
+    put(l, cache, cache_len);
+}
+
+/** 写入客户端地址, 每个连接只获取一次 */
+static void put_remote(_line_t* l, httpctx_t* ctx) {
+    if (!ctx->remote_addr[0]) {
+        struct sockaddr_storage addr;
+        int len = sizeof(addr);
+        int r = -1;
+        if (!uv_tcp_getpeername(&ctx->tcp, (struct sockaddr*) &addr, &len)) {
+            if (addr.ss_family == AF_INET6)
+                r = uv_ip6_name((struct sockaddr_in6*) &addr, ctx->remote_addr, sizeof(ctx->remote_addr));
+            else
+                r = uv_ip4_name((struct sockaddr_in*) &addr, ctx->remote_addr, sizeof(ctx->remote_addr));
+        }
+        if (r) strcpy(ctx->remote_addr, "-");
+    }
+    put(l, ctx->remote_addr, strlen(ctx->remote_addr));
+}
+
+inline static void put_protocol(_line_t* l, httpctx_t* ctx) {
+    char ver[8] = "HTTP/1.1";
+    ver[5] = (char) ('0' + ctx->req.parser.http_major % 10);
+    ver[7] = (char) ('0' + ctx->req.parser.http_minor % 10);
+    put(l, ver, 8);
+}
+
+/** 头部名称比较, 不区分大小写 */
+static bool name_equal(const char* a, const char* b, uint32_t len) {
+    for (uint32_t i = 0; i < len; ++i) {
+        char x = a[i], y = b[i];
+        if (x >= 'A' && x <= 'Z') x += 'a' - 'A';
+        if (y >= 'A' && y <= 'Z') y += 'a' - 'A';
+        if (x != y) return false;
+    }
+    return true;
+}
+
+/** 查找请求头部, 名称不区分大小写 */
+static void put_header(_line_t* l, httpctx_t* ctx, const _op_t* op) {
+    dynmem_t* pbuf = &ctx->req.data;
+    http_header_node_t* pos;
+    list_foreach(pos, &ctx->req.headers) {
+        if (pos->data.field.len != op->len) continue;
+        char name[op->len];
+        dynmem_read(pbuf, pos->data.field.pos, op->len, name);
+        if (name_equal(name, op->text, op->len)) {
+            put_value(l, pbuf, &pos->data.value);
+            return;
+        }
+    }
+    put_char(l, '-');
+}
+
+void accesslog_request(httpctx_t* ctx) {
+    char buf[ACCESSLOG_LINE_MAX];
+    _line_t line = { buf, buf + sizeof(buf) }, *l = &line;
+    httpreq_t* req = &ctx->req;
+    httpctx_timing_t* t = &ctx->timing;
+    uint32_t body = ctx->res.body_type == HC_BODY_MEMORY ? ctx->res.body.len : 0;
+
+    for (uint32_t i = 0; i < _op_count; ++i) {
+        const _op_t* op = &_ops[i];
+        switch (op->type) {
+            case OP_TEXT:
+                put(l, op->text, op->len);
+                break;
+            case OP_REMOTE:
+                put_remote(l, ctx);
+                break;
+            case OP_DASH:
+                put_char(l, '-');
+                break;
+            case OP_TIME:
+                put_time(l);
+                break;
+            case OP_REQUEST: {
+                const char* m = http_method_str(req->parser.method);
+                put(l, m, strlen(m));
+                put_char(l, ' ');
+                put_url(l, ctx);
+                put_char(l, ' ');
+                put_protocol(l, ctx);
+                break;
+            }
+            case OP_METHOD: {
+                const char* m = http_method_str(req->parser.method);
+                put(l, m, strlen(m));
+                break;
+            }
+            case OP_PATH:
+                put_value(l, &req->data, &req->path);
+                break;
+            case OP_QUERY:
+                if (req->url_param.len) {
+                    put_char(l, '?');
+                    put_value(l, &req->data, &req->url_param);
+                }
+                break;
+            case OP_PROTOCOL:
+                put_protocol(l, ctx);
+                break;
+            case OP_STATUS:
+                put_uint(l, ctx->res.status);
+                break;
+            case OP_BODY_CLF:
+                if (body) put_uint(l, body);
+                else put_char(l, '-');
+                break;
+            case OP_BODY:
+                put_uint(l, body);
+                break;
+            case OP_BYTES_IN:
+                put_uint(l, t->req_size);
+                break;
+            case OP_BYTES_OUT:
+                put_uint(l, t->res_size);
+                break;
+            case OP_MICROS:
+                put_uint(l, (t->handler_end - t->first_byte) / 1000);
+                break;
+            case OP_SECONDS:
+                put_uint(l, (t->handler_end - t->first_byte) / 1000000000);
+                break;
+            case OP_HEADER:
+                put_header(l, ctx, op);
+                break;
+        }
+    }
+
+    log_access(buf, line.pos - buf);
+}
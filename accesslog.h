@@ -0,0 +1,57 @@
+/** http访问日志, 按启动时编译的格式模板输出每个请求的访问记录, 通过异步日志的后台线程写入文件
+ *
+ *  格式模板使用Apache mod_log_config的指令, 例如combined格式:
+ *      %h %l %u %t "%r" %s %b "%{Referer}i" "%{User-Agent}i"
+ *  支持的指令:
+ *      %h 客户端地址, %l %u 固定输出"-", %t 请求时间[18/Oct/2021:10:00:00 +0800],
+ *      %r 请求行, %m 请求方法, %U 请求路径, %q 查询字符串(包括?), %H 协议版本,
+ *      %s 状态码, %b 回复内容字节数(0输出"-"), %B 回复内容字节数, %I 请求报文字节数, %O 回复报文字节数,
+ *      %D 处理耗时(微秒, 读取到第一个字节到退出服务回调), %T 处理耗时(秒), %{Name}i 请求头部, %% 百分号
+ *  模板只在启动时解析一次, 生成记录时按指令直接从请求缓冲区复制内容, 不经过printf格式化,
+ *  %r %U %q %{Name}i 等客户端提供的内容与Apache一样转义: \" \\ 以及控制字符和非ascii字符的\xhh
+ * @file accesslog.h
+ * @author Kiven Lee
+ * @date 2021-08-07
+ * @version 1.0
+*/
+
+#pragma once
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "httpctx.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Apache combined日志格式 */
+#define ACCESSLOG_COMBINED "%h %l %u %t \"%r\" %s %b \"%{Referer}i\" \"%{User-Agent}i\""
+
+/** 访问日志状态, 由accesslog_start设置, 请求处理流程中通过accesslog_enabled判断 */
+extern bool _accesslog_enabled;
+
+/** 编译格式模板并开启访问日志, 必须在服务启动前调用
+ * @param filename      访问日志文件名
+ * @param pattern       格式模板, NULL表示使用ACCESSLOG_COMBINED
+ * @return              成功返回true, 模板包含不支持的指令或文件无法打开返回false
+*/
+extern bool accesslog_start(const char* filename, const char* pattern);
+
+/** 判断是否开启了访问日志
+ * @return              true: 已开启, false: 未开启
+*/
+inline static bool accesslog_enabled() { return _accesslog_enabled; }
+
+/** 输出一个请求的访问记录, 在回复写入队列之后、请求缓冲区释放之前调用
+ * @param ctx           请求上下文对象
+*/
+extern void accesslog_request(httpctx_t* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __ACCESSLOG_H__
@@ -31,6 +31,16 @@
 
 #include "aes.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#   include <wmmintrin.h>
+#   define AES_HW 1
+#endif
+
+// 编译参数 -- AES-NI并行处理的块数, CBC解密和CTR的各块互不依赖, 同时计算以掩盖aesdec/aesenc指令的延迟
+#ifndef AES_HW_WIDTH
+#   define AES_HW_WIDTH 8
+#endif
+
 /*
  * 32-bit integer manipulation macros (little endian)
  */
@@ -451,11 +461,154 @@ bool aes_setkey_dec(aes_ctx_t* pctx, const unsigned char *key, unsigned int keys
                  RT3[ ( Y0 >> 24 ) & 0xFF ];    \
 }
 
+#ifdef AES_HW
+
+/** cpu支持AES-NI指令时为true, 程序启动时检测 */
+static bool aes_hw = false;
+
+/** 程序启动时检测cpu是否支持AES-NI, 之后只读访问, 可以在多线程中使用 */
+__attribute__((constructor))
+static void aes_hw_init() {
+    __builtin_cpu_init();
+    aes_hw = __builtin_cpu_supports("aes");
+}
+
+/** 载入轮秘钥. 查表实现的秘钥在内存中的字节序与AES-NI相同, 解密秘钥已经倒序并做了InvMixColumns, 可以直接使用 */
+__attribute__((target("aes,sse2")))
+inline static void aesni_load_keys(const aes_ctx_t* pctx, __m128i rk[15]) {
+    rk[0] = _mm_loadu_si128((const __m128i*) pctx->rk);
+    for (int i = 1; i <= pctx->nr; ++i)
+        rk[i] = _mm_loadu_si128((const __m128i*) (pctx->rk + i * 4));
+}
+
+__attribute__((target("aes,sse2")))
+inline static __m128i aesni_enc(const __m128i* rk, int nr, __m128i b) {
+    b = _mm_xor_si128(b, rk[0]);
+    for (int r = 1; r < nr; ++r)
+        b = _mm_aesenc_si128(b, rk[r]);
+    return _mm_aesenclast_si128(b, rk[nr]);
+}
+
+__attribute__((target("aes,sse2")))
+inline static __m128i aesni_dec(const __m128i* rk, int nr, __m128i b) {
+    b = _mm_xor_si128(b, rk[0]);
+    for (int r = 1; r < nr; ++r)
+        b = _mm_aesdec_si128(b, rk[r]);
+    return _mm_aesdeclast_si128(b, rk[nr]);
+}
+
+__attribute__((target("aes,sse2")))
+static void aesni_ecb(aes_ctx_t* pctx, const unsigned char input[16], unsigned char output[16]) {
+    __m128i rk[15];
+    aesni_load_keys(pctx, rk);
+    __m128i b = _mm_loadu_si128((const __m128i*) input);
+    b = pctx->mode == AES_DECRYPT ? aesni_dec(rk, pctx->nr, b) : aesni_enc(rk, pctx->nr, b);
+    _mm_storeu_si128((__m128i*) output, b);
+}
+
+/** CBC加密每块依赖上一块的结果只能逐块计算, 解密时密文都已知, 每次同时解密AES_HW_WIDTH块 */
+__attribute__((target("aes,sse2")))
+static void aesni_cbc(aes_ctx_t* pctx, size_t length, unsigned char iv[16], const unsigned char *input, unsigned char *output) {
+    __m128i rk[15], prev = _mm_loadu_si128((const __m128i*) iv);
+    int nr = pctx->nr;
+    aesni_load_keys(pctx, rk);
+
+    if (pctx->mode == AES_ENCRYPT) {
+        for (; length; length -= 16, input += 16, output += 16) {
+            prev = aesni_enc(rk, nr, _mm_xor_si128(prev, _mm_loadu_si128((const __m128i*) input)));
+            _mm_storeu_si128((__m128i*) output, prev);
+        }
+        _mm_storeu_si128((__m128i*) iv, prev);
+        return;
+    }
+
+    // 先读入全部密文再写出, 输入输出可以是同一个缓冲区
+    for (; length >= 16 * AES_HW_WIDTH; length -= 16 * AES_HW_WIDTH, input += 16 * AES_HW_WIDTH, output += 16 * AES_HW_WIDTH) {
+        __m128i c[AES_HW_WIDTH], b[AES_HW_WIDTH];
+        for (int i = 0; i < AES_HW_WIDTH; ++i) {
+            c[i] = _mm_loadu_si128((const __m128i*) input + i);
+            b[i] = _mm_xor_si128(c[i], rk[0]);
+        }
+        for (int r = 1; r < nr; ++r)
+            for (int i = 0; i < AES_HW_WIDTH; ++i)
+                b[i] = _mm_aesdec_si128(b[i], rk[r]);
+        for (int i = 0; i < AES_HW_WIDTH; ++i) {
+            b[i] = _mm_aesdeclast_si128(b[i], rk[nr]);
+            _mm_storeu_si128((__m128i*) output + i, _mm_xor_si128(b[i], i ? c[i - 1] : prev));
+        }
+        prev = c[AES_HW_WIDTH - 1];
+    }
+    for (; length; length -= 16, input += 16, output += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*) input);
+        _mm_storeu_si128((__m128i*) output, _mm_xor_si128(aesni_dec(rk, nr, c), prev));
+        prev = c;
+    }
+    _mm_storeu_si128((__m128i*) iv, prev);
+}
+
+/** 大端序128位计数器加1后转换为计数器块 */
+__attribute__((target("aes,sse2")))
+inline static __m128i aesni_counter(uint64_t* hi, uint64_t* lo) {
+    __m128i b = _mm_set_epi64x((long long) __builtin_bswap64(*lo), (long long) __builtin_bswap64(*hi));
+    if (!++*lo) ++*hi;
+    return b;
+}
+
+/** CTR各块只依赖计数器, 每次同时加密AES_HW_WIDTH个计数器块 */
+__attribute__((target("aes,sse2")))
+static void aesni_ctr(aes_ctx_t* pctx, size_t length, unsigned char nonce_counter[16], const unsigned char *input, unsigned char *output) {
+    __m128i rk[15];
+    int nr = pctx->nr;
+    uint64_t hi, lo;
+    aesni_load_keys(pctx, rk);
+    memcpy(&hi, nonce_counter, 8);
+    memcpy(&lo, nonce_counter + 8, 8);
+    hi = __builtin_bswap64(hi);
+    lo = __builtin_bswap64(lo);
+
+    for (; length >= 16 * AES_HW_WIDTH; length -= 16 * AES_HW_WIDTH, input += 16 * AES_HW_WIDTH, output += 16 * AES_HW_WIDTH) {
+        __m128i b[AES_HW_WIDTH];
+        for (int i = 0; i < AES_HW_WIDTH; ++i)
+            b[i] = _mm_xor_si128(aesni_counter(&hi, &lo), rk[0]);
+        for (int r = 1; r < nr; ++r)
+            for (int i = 0; i < AES_HW_WIDTH; ++i)
+                b[i] = _mm_aesenc_si128(b[i], rk[r]);
+        for (int i = 0; i < AES_HW_WIDTH; ++i) {
+            b[i] = _mm_aesenclast_si128(b[i], rk[nr]);
+            _mm_storeu_si128((__m128i*) output + i, _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i*) input + i)));
+        }
+    }
+    for (; length >= 16; length -= 16, input += 16, output += 16) {
+        __m128i b = aesni_enc(rk, nr, aesni_counter(&hi, &lo));
+        _mm_storeu_si128((__m128i*) output, _mm_xor_si128(b, _mm_loadu_si128((const __m128i*) input)));
+    }
+    if (length) {
+        unsigned char stream[16];
+        _mm_storeu_si128((__m128i*) stream, aesni_enc(rk, nr, aesni_counter(&hi, &lo)));
+        for (size_t i = 0; i < length; i++)
+            output[i] = (unsigned char)(input[i] ^ stream[i]);
+    }
+
+    hi = __builtin_bswap64(hi);
+    lo = __builtin_bswap64(lo);
+    memcpy(nonce_counter, &hi, 8);
+    memcpy(nonce_counter + 8, &lo, 8);
+}
+
+#endif // AES_HW
+
 /** AES-ECB block encryption/decryption */
 void aes_crypt_ecb(aes_ctx_t* pctx, const unsigned char input[16], unsigned char output[16]) {
     int i;
     uint32_t *RK, X0, X1, X2, X3, Y0, Y1, Y2, Y3;
 
+#ifdef AES_HW
+    if (aes_hw) {
+        aesni_ecb(pctx, input, output);
+        return;
+    }
+#endif
+
     RK = pctx->rk;
 
     GET_UINT32_LE( X0, input,  0 ); X0 ^= *RK++;
@@ -541,6 +694,13 @@ bool aes_crypt_cbc(aes_ctx_t* pctx, size_t length, unsigned char iv[16], const u
 
     if(length % 16) return false;
 
+#ifdef AES_HW
+    if (aes_hw) {
+        aesni_cbc(pctx, length, iv, input, output);
+        return true;
+    }
+#endif
+
     if(pctx->mode == AES_DECRYPT) {
         while(length > 0) {
             memcpy(temp, input, 16);
@@ -573,6 +733,32 @@ bool aes_crypt_cbc(aes_ctx_t* pctx, size_t length, unsigned char iv[16], const u
     return true;
 }
 
+void aes_crypt_ctr(aes_ctx_t* pctx, size_t length, unsigned char nonce_counter[16], const unsigned char *input, unsigned char *output) {
+    unsigned char stream[16];
+
+#ifdef AES_HW
+    if (aes_hw) {
+        aesni_ctr(pctx, length, nonce_counter, input, output);
+        return;
+    }
+#endif
+
+    while(length > 0) {
+        size_t n = length < 16 ? length : 16;
+        aes_crypt_ecb(pctx, nonce_counter, stream);
+        // 计数器按大端序加1
+        for(int i = 16; i > 0; i--)
+            if(++nonce_counter[i - 1] != 0) break;
+
+        for(size_t i = 0; i < n; i++)
+            output[i] = (unsigned char)(input[i] ^ stream[i]);
+
+        input  += n;
+        output += n;
+        length -= n;
+    }
+}
+
 void aes_init(aes_ctx_t* pctx, int mode, const unsigned char *key, uint32_t keysize, const unsigned char iv[16]) {
     pctx->mode = mode;
     memcpy(pctx->iv, iv, 16);
@@ -631,6 +817,13 @@ size_t aes_final(aes_ctx_t* pctx, const void* input, size_t input_len, void* out
     return op - (uint8_t*) output;
 }
 
+const char* aes_impl_name() {
+#ifdef AES_HW
+    if (aes_hw) return "aesni";
+#endif
+    return "table";
+}
+
 
 
 //---------------------------------------------------------------------
@@ -672,5 +865,62 @@ int main() {
     } else {
         printf("aes dec succeed!\n");
     }
+
+    // NIST SP800-38A F.5.1 CTR-AES128
+    static const unsigned char ctr_key[16] = {
+        0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+    static const unsigned char ctr_plain[32] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+        0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51 };
+    static const unsigned char ctr_cipher[32] = {
+        0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+        0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff };
+    unsigned char counter[16] = {
+        0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff };
+    unsigned char ctr_out[32];
+    aes_init(&ctx, AES_ENCRYPT, ctr_key, 128, iv);
+    aes_crypt_ctr(&ctx, 32, counter, ctr_plain, ctr_out);
+    printf("aes ctr %s, impl %s\n", memcmp(ctr_out, ctr_cipher, 32) || counter[15] != 0x01 ? "fail!" : "succeed!", aes_impl_name());
+
+#ifdef AES_HW
+    // AES-NI与查表实现逐字节比较, 覆盖各种秘钥长度、不满并行宽度的长度、原地解密和计数器进位
+    if (aes_hw) {
+        enum { MAX = 16 * AES_HW_WIDTH * 3 + 16 };
+        static unsigned char src[MAX], out_sw[MAX], out_hw[MAX], key[32];
+        unsigned char iv_sw[16], iv_hw[16], ctr_sw[16], ctr_hw[16];
+        int errors = 0;
+        for (size_t i = 0; i < MAX; ++i) src[i] = (unsigned char) (i * 131 + 7);
+        for (int i = 0; i < 32; ++i) key[i] = (unsigned char) (i * 17 + 3);
+        for (unsigned int keysize = 128; keysize <= 256; keysize += 64) {
+            for (size_t len = 0; len <= MAX; len += len < 40 ? 1 : 13) {
+                for (int mode = AES_DECRYPT; mode <= AES_ENCRYPT; ++mode) {
+                    for (int impl = 0; impl < 2; ++impl) {
+                        aes_hw = impl;
+                        unsigned char* out = impl ? out_hw : out_sw;
+                        unsigned char* v = impl ? iv_hw : iv_sw;
+                        aes_init(&ctx, mode, key, keysize, iv);
+                        memcpy(v, iv, 16);
+                        memcpy(out, src, len);
+                        // 原地处理
+                        aes_crypt_cbc(&ctx, len & ~(size_t) 15, v, out, out);
+                    }
+                    if (memcmp(out_sw, out_hw, len & ~(size_t) 15) || memcmp(iv_sw, iv_hw, 16)) ++errors;
+                }
+                for (int impl = 0; impl < 2; ++impl) {
+                    aes_hw = impl;
+                    unsigned char* c = impl ? ctr_hw : ctr_sw;
+                    aes_init(&ctx, AES_ENCRYPT, key, keysize, iv);
+                    memset(c, 0xff, 16);
+                    c[0] = (unsigned char) len;
+                    c[8] = 0xfe;
+                    aes_crypt_ctr(&ctx, len, c, src, impl ? out_hw : out_sw);
+                }
+                if (memcmp(out_sw, out_hw, len) || memcmp(ctr_sw, ctr_hw, 16)) ++errors;
+            }
+        }
+        aes_hw = true;
+        printf("aesni vs table: %s, %d errors\n", errors ? "fail!" : "succeed!", errors);
+    }
+#endif
 }
 #endif
\ No newline at end of file
@@ -119,6 +119,20 @@ void aes_crypt_ecb(aes_ctx_t* pctx, const unsigned char input[16], unsigned char
  */
 bool aes_crypt_cbc(aes_ctx_t* pctx, size_t length, unsigned char iv[16], const unsigned char *input, unsigned char *output);
 
+/** AES-CTR buffer encryption/decryption, 加密和解密是同一个操作, 长度不需要是16的倍数
+ *  上下文必须使用AES_ENCRYPT模式初始化, 每处理16字节(包括最后不足16字节的部分)计数器加1
+ * @param pctx          AES context
+ * @param length        length of the input data
+ * @param nonce_counter 128位大端序计数器 (updated after use)
+ * @param input         buffer holding the input data
+ * @param output        buffer holding the output data
+ */
+void aes_crypt_ctr(aes_ctx_t* pctx, size_t length, unsigned char nonce_counter[16], const unsigned char *input, unsigned char *output);
+
+/** 当前使用的实现名称, cpu支持AES-NI指令时为"aesni", 否则为"table"
+ *  AES-NI的ECB/CBC/CTR与查表实现结果完全相同, 程序启动时自动选择 */
+const char* aes_impl_name();
+
 /** AES-CBC-PKCS7_PADDING require len
  * @param len      data len
  * @return         padding require len
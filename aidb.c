@@ -1,16 +1,46 @@
+// 32位系统上fseeko, ftruncate和mmap也使用64位的文件偏移, 必须在所有头文件之前定义
+#ifndef _WIN32
+#   define _FILE_OFFSET_BITS 64
+#endif
 #include <time.h>
-#include "sharedptr.h"
+#include <stdlib.h>
+#include <string.h>
 #include "crc32.h"
 #include "md5.h"
 #include "aes.h"
 #include "aidb.h"
+#include "uv.h"
 
 #include <stdio.h>
+#ifdef _WIN32
+#   include <io.h>
+#   include <windows.h>
+#else
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/file.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#endif
 
 /* aidb文件结构:
-        文件   = 文件头 + 记录...
-        文件头 = AIDB标志 + 版本 + 保留字段 + CRC32校验值 + 最后更新时间 
-        记录   = 记录大小 + 记录内容
+        文件   = 文件头 + 提交...
+        文件头 = AIDB标志 + 版本 + 保留字段 + 创建时间 + 口令校验值
+        提交   = (段 | 索引块)... + 提交标记(本次提交的起始偏移 + CRC32)
+        记录   = 记录头(明文长度 + 加密长度 + 删除标志) + 加密内容
+    文件只追加, 文件头创建后不再改写, 已写入的内容不会被修改或截断, 只读映射的句柄可以和追加写入同时使用.
+    每次提交的内容与提交标记一起写入后再同步到磁盘, 打开时以最后一个完整的提交标记为准,
+    之后未完成的内容忽略, 追加写入时截断; 最后一次提交的段校验失败时(写入中途崩溃)回退到上一个提交标记.
+    记录按段保存, 每段可以单独校验和解密:
+        段     = 段开始标记(随机数) + 记录... + 段结束标记(段长度 + 段CRC32C)
+        段标记、索引块和提交标记都有记录头, 删除标志为3~6, 记录遍历时与已删除的记录一样跳过
+        加密内容为AES-128-CTR, 不需要填充, 计数器为段随机数 + 记录在文件中的偏移
+        段内容由各自的CRC32C校验, 打开时多个线程同时校验
+    设置了键提取函数时, 每次aidb_flush在提交标记之前写入包含全部记录的索引块, 之前的索引块不再使用:
+        索引块 = 记录头 + 哈希槽(记录偏移 + 哈希值)... + 索引尾(索引块偏移 + 槽掩码 + 条目数 + CRC32 + 索引标志)
+        哈希槽采用线性探测, 记录偏移为0表示空槽, 最后一个索引块之后的记录在打开时生成内存索引
+    旧格式(aidb_load_legacy, aidb_import)没有文件头和记录结构, 整个文件是一个AES-128-CBC-PKCS7流,
+    使用固定向量IV加密, 明文为文本, 每行作为一条记录
 */
 
 /** 获取"MEMBER成员"在"结构体TYPE"中的位置偏移 */
@@ -20,48 +50,182 @@
 
 // aidb文件魔法值
 #define AIDB_MAGIC 0x42444941
-#define AIDB_VERSION 0x01
+#define AIDB_VERSION 0x02
 #define AIDB_INDEX_END 0xFFFFFFFF
 #define AIDB_MAX_BLOCK 0xFFFFFFFF
+// 索引尾的魔法值"AIDX"
+#define AIDB_INDEX_MAGIC 0x58444941
+// 索引的最小哈希槽数量, 槽数量保持为条目数的2倍以上
+#define AIDB_INDEX_MIN_SLOTS 16
+// 删除标志 -- 记录已删除
+#define AIDB_DELETED 1
+// 删除标志 -- 删除标记, 记录内容为被删除的键, 追加写入时用来删除之前的记录
+#define AIDB_TOMBSTONE 2
+// 删除标志 -- 段开始标记, 内容为段随机数
+#define AIDB_SEG_BEGIN 3
+// 删除标志 -- 段结束标记, 内容为段长度和CRC32C
+#define AIDB_SEG_END 4
+// 删除标志 -- 索引块, 内容为哈希槽和索引尾
+#define AIDB_INDEX_BLOCK 5
+// 删除标志 -- 提交标记, 内容为本次提交的起始偏移和CRC32
+#define AIDB_COMMIT 6
+// 段标记的长度
+#define AIDB_MARKER_SIZE (sizeof(aidb_record_t) + 8)
+// 提交标记的长度
+#define AIDB_COMMIT_SIZE (sizeof(aidb_record_t) + sizeof(aidb_commit_t))
+// 编译参数 -- 段内记录达到该长度后开始新的段, 单条记录超过时该段只有一条记录
+#ifndef AIDB_SEGMENT_SIZE
+#   define AIDB_SEGMENT_SIZE (64 * 1024)
+#endif
+// 编译参数 -- 打开文件时校验段内容的最大线程数(包括调用线程)
+#ifndef AIDB_VERIFY_THREADS
+#   define AIDB_VERIFY_THREADS 4
+#endif
+// 压缩时临时文件的后缀, 压缩完成后改名为原文件
+#define AIDB_COMPACT_SUFFIX ".compact"
+// 写入锁文件的后缀, 同一个文件同时只能有一个写入句柄, 锁文件保留在磁盘上, 进程退出时锁自动释放
+#define AIDB_LOCK_SUFFIX ".lock"
+// 编译参数 -- 流式加载时每次读取的长度(必须是16的倍数)
+#ifndef AIDB_LOAD_CHUNK
+#   define AIDB_LOAD_CHUNK (256 * 1024)
+#endif
+// 编译参数 -- 流式加载的读取缓冲区数量, 读取线程最多领先解密这么多个缓冲区
+#ifndef AIDB_LOAD_CHUNKS
+#   define AIDB_LOAD_CHUNKS 4
+#endif
+
+// aidb记录的内部结构定义
+typedef struct aidb_record_t {
+    uint32_t    size;           // 记录大小
+    uint32_t    capacity;       // 记录容量大小
+    uint8_t     deleted;        // 删除标志, 0: 未删除, 1: 已删除, 2: 删除标记, 3/4: 段标记, 5: 索引块, 6: 提交标记
+} __attribute__ ((packed)) aidb_record_t;
+
+// 段结束标记的内容
+typedef struct aidb_seg_end_t {
+    uint32_t    len;            // 段内记录的总长度, 不包括段标记
+    uint32_t    crc;            // 段内记录的CRC32C
+} __attribute__ ((packed)) aidb_seg_end_t;
+
+// 提交标记的内容
+typedef struct aidb_commit_t {
+    uint64_t    start;          // 本次提交的起始偏移, 即上一个提交标记的结束位置
+    uint32_t    crc;            // start的CRC32
+} __attribute__ ((packed)) aidb_commit_t;
+
+// 打开时生成的段信息
+typedef struct aidb_segment_t {
+    uint64_t    start;          // 段内第一条记录的偏移
+    uint64_t    end;            // 段结束标记的偏移
+    uint8_t     nonce[8];       // 段随机数
+    uint32_t    crc;            // 段内记录的CRC32C
+} aidb_segment_t;
+
+// 索引的哈希槽
+typedef struct aidb_slot_t {
+    uint64_t    offset;         // 记录所在文件偏移位置, 0表示空槽
+    uint32_t    hash;           // 键的哈希值
+} __attribute__ ((packed)) aidb_slot_t;
+
+// 索引尾, 位于索引块末尾
+typedef struct aidb_index_tail_t {
+    uint64_t    offset;         // 索引块记录头的文件偏移
+    uint32_t    mask;           // 哈希槽数量 - 1
+    uint32_t    count;          // 索引条目数
+    uint32_t    crc;            // 哈希槽和以上字段的CRC32
+    uint32_t    magic;          // 固定为"AIDX"
+} __attribute__ ((packed)) aidb_index_tail_t;
+
+// 写入锁的文件句柄
+#ifdef _WIN32
+typedef HANDLE aidb_lock_t;
+#else
+typedef int aidb_lock_t;
+#endif
 
 // aidb句柄的内部结构定义
 struct aidb_t {
-    // FILE*       fp;             // 已打开的文件指针
     char*       filename;       // 文件名
-    uint64_t    size;           // 文件长度
+    FILE*       fp;             // 创建时写入使用的文件指针, 只读打开时为NULL
+    aidb_lock_t lock_file;      // 写入锁, locked为1时有效
+    _Bool       locked;
+    const uint8_t* map;         // 只读打开时的文件映射
+    _Bool       shared;         // 映射属于aidb_clone的源句柄, 关闭时不释放
+    uint8_t     version;        // 文件版本
+    aidb_segment_t* segs;       // 只读打开时的段信息, 按偏移排序
+    uint32_t    seg_count;
+    uint32_t    seg_cap;
+    _Bool       seg_open;       // 写入时有未结束的段
+    uint64_t    seg_start;      // 未结束的段的第一条记录偏移
+    uint32_t    seg_crc;        // 未结束的段已写入记录的CRC32C
+    uint8_t     seg_nonce[8];   // 未结束的段的随机数
+    uint64_t    size;           // 文件长度, 只读打开时为映射长度
+    uint64_t    end;            // 记录区结束位置, 即最后一个完整提交标记的结束位置
+    uint64_t    commit_start;   // 写入时未提交内容的起始位置
+    AIDB_ERROR  rollback;       // 只读打开时丢弃记录区之后内容的原因, 没有丢弃时为AIDB_OK
     uint32_t    count;          // 记录总数
+    _Bool       modified;       // 文件变动标志
     uint8_t     key[16];        // 秘钥
+    char*       password;       // 口令, 写入文件头的口令校验值时使用
+    aes_ctx_t   aes;            // 加解密上下文, 秘钥只展开一次, 每条记录重置向量
+    aidb_key_func key_func;     // 键提取函数, 为NULL时不建立索引
+    const aidb_slot_t* index;   // 只读打开时最后一个索引块的哈希槽, 指向文件映射, 没有索引时为NULL
+    uint32_t    index_mask;     // 哈希槽数量 - 1
+    uint64_t    index_end;      // 最后一个索引块的结束位置, 之后的记录不在索引中
+    aidb_slot_t* tail_index;    // 只读打开时index_end之后的记录生成的内存索引, 设置键提取函数时生成
+    uint32_t    tail_mask;
+    aidb_slot_t* entries;       // 创建时按写入顺序保存的索引条目, 关闭时生成哈希槽
+    uint32_t    entry_count;
+    uint32_t    entry_cap;
+    uint8_t*    plain;          // aidb_get最后解密的记录内容, aidb_fetch直接复制
+    uint32_t    plain_cap;
+    uint64_t    plain_off;      // plain对应的记录偏移, 0表示无效
+    _Bool       failed;         // 写入出错
+    // 组提交, 开启后记录只写入待提交缓冲区, 由提交线程批量写入文件
+    _Bool       group;          // 已开启组提交
+    _Bool       stopping;       // 正在关闭, 提交线程写完剩余内容后退出
+    _Bool       sync_req;       // 有调用者在等待提交完成, 不再等待提交间隔
+    uint32_t    interval;       // 提交间隔, 毫秒
+    uint8_t*    pending;        // 待提交缓冲区
+    uint32_t    pending_len;
+    uint32_t    pending_cap;
+    uint8_t*    spare;          // 提交线程写入时交换出来的缓冲区, 写完后重复使用
+    uint32_t    spare_cap;
+    uint64_t    committed;      // 已写入并同步到磁盘的文件长度
+    uv_mutex_t  lock;           // 保护写入状态和待提交缓冲区
+    uv_cond_t   commit_cond;    // 通知提交线程
+    uv_cond_t   done_cond;      // 通知等待提交完成的调用者
+    uv_thread_t committer;      // 提交线程
 };
 
 // aidb文件头定义
 typedef struct aidb_header_t {
     uint32_t    magic;          // aidb文件魔法值, 固定为"AIDB"
     uint8_t     version;        // 版本号, 最大版本号255
-    uint8_t     unused[3];      // 保留值
-    uint32_t    crc32;          // 文件头以外的文件内容CRC32校验值
-    int64_t     updated;        // 最后更新日期, 采用time函数返回的时间
-    uint8_t     pwd[16]         // 秘钥MD5校验值, password + updated生成
+    uint8_t     flags;          // 标志位, 保留
+    uint8_t     unused[6];      // 保留值
+    int64_t     updated;        // 创建时间, 采用time函数返回的时间, 文件头创建后不再改写
+    uint8_t     pwd[16];        // 秘钥MD5校验值, password + updated生成
 } __attribute__ ((packed)) aidb_header_t;
 
-// aidb记录的内部结构定义
-typedef struct aidb_record_t {
-    uint32_t    size;           // 记录大小
-    uint32_t    capacity;       // 记录容量大小
-    uint8_t     deleted;        // 删除标志, 0: 未删除, 1: 已删除
-} __attribute__ ((packed)) aidb_record_t;
-
 // aidb记录的内部结构定义
 struct aidb_iterator_t {
-    uint32_t        offset;     // 记录所在文件偏移位置(包含本记录头)
+    uint64_t        offset;     // 记录所在文件偏移位置(包含本记录头), 0表示在第一条记录之前
     aidb_t*         aidb;       // aidb句柄
-    aidb_record_t*  record;     // 记录结构
-} __attribute__ ((packed));
+    const aidb_record_t* record; // 记录头, 指向文件映射
+};
 
-// 区块结构定义
-typedef struct aidb_block_t {
-    int32_t     next;           // 下个块序号, 小于0表示是被删除的块
-    _Bool       deleted;        // 删除标志, 0: 使用中, 1: 已删除
-} __attribute__ ((packed)) aidb_block_t;
+// 流式加载的读取流水线, 读取线程填充缓冲区, 调用线程解密, 通过两个信号量轮转使用缓冲区
+typedef struct _load_t {
+    FILE*           fp;
+    uint8_t*        mem;                        // 全部读取缓冲区的内存
+    uv_thread_t     reader;                     // 读取线程
+    uint8_t*        chunks[AIDB_LOAD_CHUNKS];   // 读取缓冲区
+    uint32_t        lens[AIDB_LOAD_CHUNKS];     // 缓冲区读入的长度, 小于AIDB_LOAD_CHUNK表示文件结束
+    uv_sem_t        free_sem;                   // 可以读入的空闲缓冲区
+    uv_sem_t        full_sem;                   // 已读入等待解密的缓冲区
+    _Bool           stop;                       // 调用线程要求提前结束
+} _load_t;
 
 // AES加密向量
 const static unsigned char IV[16] = {
@@ -77,53 +241,1847 @@ inline static void gen_pwd(const char* key, uint64_t updated, uint8_t out[16]) {
     md5_final(&ctx, out);
 }
 
-// 校验aidb文件头部
-inline static AIDB_ERROR aidb_check_header(FILE *fp, const char* key) {
-    // 获取文件长度
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+// 将用户输入的秘钥进行变换，生成实际的秘钥
+inline static void gen_key(const char* key, uint8_t out[16]) {
+    md5_ctx_t ctx;
+    md5_init(&ctx);
+    md5_update(&ctx, key, strlen(key));
+    md5_final(&ctx, out);
+}
 
-    aidb_header_t header;
-    // 读取文件头
-    if (!fread(&header, sizeof(aidb_header_t), 1, fp))
+/** 记录计数器初值, 段随机数 + 大端序的记录偏移, 记录占用的计数不超过记录长度, 不会与下一条记录重叠 */
+inline static void init_counter(uint8_t counter[16], const uint8_t nonce[8], uint64_t off) {
+    memcpy(counter, nonce, 8);
+    for (int i = 15; i >= 8; --i, off >>= 8)
+        counter[i] = (uint8_t) off;
+}
+
+/** 记录加解密, 可以只处理记录的前一部分 */
+static void ctr_crypt(aes_ctx_t* ctx, const uint8_t nonce[8], uint64_t off, const void* input, void* output, uint32_t len) {
+    uint8_t counter[16];
+    init_counter(counter, nonce, off);
+    aes_crypt_ctr(ctx, len, counter, input, output);
+}
+
+/** 生成新段的随机数, 系统随机数不可用时使用高精度时间和计数 */
+static void make_nonce(uint8_t nonce[8]) {
+    static uint64_t seq = 0;
+    uint64_t v = uv_hrtime() ^ ((uint64_t) time(NULL) << 32) ^ __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED);
+    uint8_t rnd[8];
+    if (uv_random(NULL, NULL, rnd, 8, 0, NULL))
+        memset(rnd, 0, 8);
+    for (int i = 0; i < 8; ++i, v >>= 8)
+        nonce[i] = rnd[i] ^ (uint8_t) v;
+}
+
+/** 查找记录所在的段, 段按偏移排序 */
+static const aidb_segment_t* find_segment(aidb_t* aidb, uint64_t off) {
+    uint32_t lo = 0, hi = aidb->seg_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) >> 1;
+        if (aidb->segs[mid].end <= off) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < aidb->seg_count && aidb->segs[lo].start <= off ? &aidb->segs[lo] : NULL;
+}
+
+/** 映射文件内容, 不支持mmap的平台读入内存 */
+static const uint8_t* map_file(const char* filename, uint64_t* out_size) {
+#ifdef _WIN32
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+    _fseeki64(fp, 0, SEEK_END);
+    uint64_t size = _ftelli64(fp);
+    _fseeki64(fp, 0, SEEK_SET);
+    uint8_t* ret = malloc(size ? size : 1);
+    if (ret && fread(ret, 1, size, fp) != size) {
+        free(ret);
+        ret = NULL;
+    }
+    fclose(fp);
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    uint8_t* ret = NULL;
+    uint64_t size = 0;
+    if (!fstat(fd, &st) && st.st_size) {
+        size = st.st_size;
+        ret = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (ret == MAP_FAILED) ret = NULL;
+    }
+    // 映射建立后即可关闭文件描述符
+    close(fd);
+#endif
+    *out_size = size;
+    return ret;
+}
+
+static void unmap_file(const uint8_t* map, uint64_t size) {
+    if (!map) return;
+#ifdef _WIN32
+    free((void*) map);
+#else
+    munmap((void*) map, size);
+#endif
+}
+
+/** 设置映射区域的访问方式提示, 不支持的平台忽略 */
+static void advise_range(const uint8_t* addr, uint64_t len, AIDB_ADVISE advise) {
+#ifndef _WIN32
+    static const int ADVICES[] = {
+        POSIX_MADV_NORMAL, POSIX_MADV_SEQUENTIAL, POSIX_MADV_RANDOM, POSIX_MADV_WILLNEED, POSIX_MADV_DONTNEED };
+    // 起始地址需要按页对齐
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) addr & ~(page - 1);
+    posix_madvise((void*) start, (uintptr_t) addr + len - start, ADVICES[advise]);
+#endif
+}
+
+// 校验aidb文件头部, 包括魔法值、版本和口令, CRC在定位段之后校验
+static AIDB_ERROR aidb_check_header(const uint8_t* map, uint64_t size, const char* key) {
+    if (size < sizeof(aidb_header_t))
         return AIDB_ERR_TOO_SMALL;
+
+    aidb_header_t header;
+    memcpy(&header, map, sizeof(aidb_header_t));
     // 校验魔法值
     if (header.magic != AIDB_MAGIC)
         return AIDB_ERR_MAGIC;
     // 校验版本号
     if (header.version != AIDB_VERSION)
         return AIDB_ERR_VERSION;
-    
+
     // 校验密码
     uint8_t md5[16];
     gen_pwd(key, header.updated, md5);
     if (memcmp(md5, header.pwd, 16))
         return AIDB_ERR_PWD;
 
-    // 读取记录内容
-    size_t blen = size - sizeof(aidb_header_t);
-    uint8_t *buf = malloc(blen);
-    if (!fread(buf, blen, 1, fp))
-        return AIDB_ERR_READ;
+    return AIDB_OK;
+}
+
+// 键的哈希值, FNV-1a
+static uint32_t key_hash(const void* key, uint32_t len) {
+    uint32_t h = 2166136261u;
+    for (const uint8_t *p = key, *end = p + len; p < end; ++p)
+        h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+/** 检查索引块的结构和CRC32, pos为索引块记录头的偏移, 记录头已确认在文件范围内 */
+static _Bool check_index(aidb_t* aidb, uint64_t pos) {
+    const aidb_record_t* rec = (const aidb_record_t*) (aidb->map + pos);
+    if (rec->capacity < sizeof(aidb_index_tail_t) + AIDB_INDEX_MIN_SLOTS * sizeof(aidb_slot_t)
+            || (rec->capacity - sizeof(aidb_index_tail_t)) % sizeof(aidb_slot_t))
+        return 0;
+    uint32_t slots = (uint32_t) ((rec->capacity - sizeof(aidb_index_tail_t)) / sizeof(aidb_slot_t));
+    aidb_index_tail_t tail;
+    memcpy(&tail, (const uint8_t*) (rec + 1) + rec->capacity - sizeof(aidb_index_tail_t), sizeof(aidb_index_tail_t));
+    if (tail.magic != AIDB_INDEX_MAGIC || tail.offset != pos || tail.mask != slots - 1 || (slots & tail.mask))
+        return 0;
+    uint32_t crc = crc32_update(0, rec + 1, slots * sizeof(aidb_slot_t));
+    return crc32_update(crc, &tail, offsetof(aidb_index_tail_t, crc)) == tail.crc;
+}
+
+/** 检查提交标记, start为本次提交应有的起始偏移 */
+static _Bool check_commit(const aidb_record_t* rec, uint64_t start) {
+    aidb_commit_t c;
+    if (rec->deleted != AIDB_COMMIT || rec->capacity != sizeof(aidb_commit_t)) return 0;
+    memcpy(&c, rec + 1, sizeof(aidb_commit_t));
+    return (!start || c.start == start) && c.crc == crc32(&c.start, sizeof(uint64_t));
+}
+
+/** 解析pos处开始的段, 逐条检查记录头, 段内只能是普通记录、已删除的记录和删除标记
+ * @param count     输入输出参数, 累加段内未删除的记录数
+ * @return          段结束标记之后的偏移, 结构错误或者段不完整时返回0
+ */
+static uint64_t parse_segment(aidb_t* aidb, uint64_t pos, aidb_segment_t* seg, uint32_t* count) {
+    memcpy(seg->nonce, aidb->map + pos + sizeof(aidb_record_t), 8);
+    uint64_t off = pos + AIDB_MARKER_SIZE;
+    uint32_t n = 0;
+    seg->start = off;
+    while (aidb->size - off >= AIDB_MARKER_SIZE) {
+        const aidb_record_t* rec = (const aidb_record_t*) (aidb->map + off);
+        if (rec->deleted == AIDB_SEG_END) {
+            aidb_seg_end_t e;
+            memcpy(&e, rec + 1, sizeof(aidb_seg_end_t));
+            if (rec->size != 8 || rec->capacity != 8 || e.len != off - seg->start) return 0;
+            seg->end = off;
+            seg->crc = e.crc;
+            *count += n;
+            return off + AIDB_MARKER_SIZE;
+        }
+        if (rec->deleted > AIDB_TOMBSTONE || rec->size != rec->capacity
+                || rec->capacity > aidb->size - off - sizeof(aidb_record_t))
+            return 0;
+        if (!rec->deleted) ++n;
+        off += sizeof(aidb_record_t) + rec->capacity;
+    }
+    return 0;
+}
+
+// 多线程校验段内容的共享状态
+typedef struct _verify_t {
+    aidb_t*         aidb;
+    uint32_t        next;               // 下一个要校验的段
+    uint32_t        bad;                // 校验失败的第一个段, 没有时为UINT32_MAX
+} _verify_t;
+
+static void verify_worker(void* arg) {
+    _verify_t* v = (_verify_t*) arg;
+    aidb_t* aidb = v->aidb;
+    for (uint32_t i; (i = __atomic_fetch_add(&v->next, 1, __ATOMIC_RELAXED)) < aidb->seg_count; ) {
+        const aidb_segment_t* seg = &aidb->segs[i];
+        const uint8_t* p = aidb->map + seg->start;
+        if (crc32c(p, seg->end - seg->start) != seg->crc) {
+            uint32_t bad = __atomic_load_n(&v->bad, __ATOMIC_RELAXED);
+            while (i < bad && !__atomic_compare_exchange_n(&v->bad, &bad, i, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+        }
+        advise_range(p, seg->end - seg->start, AIDB_ADVISE_DONTNEED);
+    }
+}
+
+// 解析到某个提交标记为止的状态
+typedef struct _commit_state_t {
+    uint64_t        end;                // 提交标记的结束位置
+    uint64_t        index;              // 最后一个索引块的偏移, 0表示没有
+    uint32_t        segs;               // 段数量
+    uint32_t        count;              // 记录数量
+} _commit_state_t;
 
-    // 校验CRC32
-    if (header.crc32 != crc32(buf, blen))
-        return AIDB_ERR_CRC32;
+/** 按顺序解析段、索引块和提交标记, 校验各段内容, 记录区到最后一个完整的提交为止.
+ *  写入中途崩溃时文件末尾是不完整的提交, 只影响最后一次提交, 之前的提交在开始下一次提交前已经同步到磁盘;
+ *  最后一次提交之前的内容出错表示文件损坏, 返回错误.
+ *  已经打开的句柄重新映射后从原来的记录区结束位置继续解析, 之前的内容不再解析和校验
+ */
+static AIDB_ERROR load_units(aidb_t* aidb) {
+    _commit_state_t cur = { sizeof(aidb_header_t), 0, 0, 0 }, last, prev;
+    if (aidb->end) {
+        cur.end = aidb->end;
+        cur.index = aidb->index ? (uint64_t) ((const uint8_t*) aidb->index - aidb->map) - sizeof(aidb_record_t) : 0;
+        cur.segs = aidb->seg_count;
+        cur.count = aidb->count;
+    }
+    last = prev = cur;
+    uint32_t first = cur.segs;
+    uint64_t pos = cur.end;
+    AIDB_ERROR broken = AIDB_OK;
+    while (aidb->size - pos >= sizeof(aidb_record_t)) {
+        const aidb_record_t* rec = (const aidb_record_t*) (aidb->map + pos);
+        if (rec->size != rec->capacity || rec->capacity > aidb->size - pos - sizeof(aidb_record_t)) {
+            broken = AIDB_ERR_FORMAT;
+            break;
+        }
+        uint64_t next = pos + sizeof(aidb_record_t) + rec->capacity;
+        if (rec->deleted == AIDB_SEG_BEGIN && rec->capacity == 8) {
+            if (aidb->seg_count == aidb->seg_cap) {
+                uint32_t cap = aidb->seg_cap ? aidb->seg_cap * 2 : 64;
+                aidb_segment_t* p = realloc(aidb->segs, cap * sizeof(aidb_segment_t));
+                if (!p) return AIDB_ERR_READ;
+                aidb->segs = p;
+                aidb->seg_cap = cap;
+            }
+            next = parse_segment(aidb, pos, &aidb->segs[aidb->seg_count], &cur.count);
+            if (!next) {
+                broken = AIDB_ERR_FORMAT;
+                break;
+            }
+            ++aidb->seg_count;
+        } else if (rec->deleted == AIDB_INDEX_BLOCK) {
+            if (!check_index(aidb, pos)) {
+                broken = AIDB_ERR_CRC32;
+                break;
+            }
+            cur.index = pos;
+        } else if (check_commit(rec, cur.end)) {
+            cur.end = next;
+            cur.segs = aidb->seg_count;
+            prev = last;
+            last = cur;
+        } else {
+            broken = AIDB_ERR_FORMAT;
+            break;
+        }
+        pos = next;
+    }
 
+    // 结构错误之后无法继续解析, 文件末尾是完整的提交标记并且提交开始于出错位置之后, 说明出错的内容已经提交过
+    if (broken && aidb->size - sizeof(aidb_header_t) >= AIDB_COMMIT_SIZE) {
+        const aidb_record_t* tail = (const aidb_record_t*) (aidb->map + aidb->size - AIDB_COMMIT_SIZE);
+        aidb_commit_t c;
+        memcpy(&c, tail + 1, sizeof(aidb_commit_t));
+        if (tail->size == tail->capacity && check_commit(tail, 0) && c.start > last.end)
+            return broken;
+    }
+
+    // 段内容互相独立, 调用线程和辅助线程一起按顺序领取校验, 只校验新解析的已提交的段
+    aidb->seg_count = last.segs;
+    _verify_t v = { aidb, first, UINT32_MAX };
+    uv_thread_t threads[AIDB_VERIFY_THREADS];
+    uint32_t todo = last.segs - first;
+    uint32_t n = todo < AIDB_VERIFY_THREADS ? todo : AIDB_VERIFY_THREADS, started = 0;
+    while (started + 1 < n && !uv_thread_create(&threads[started], verify_worker, &v))
+        ++started;
+    verify_worker(&v);
+    for (uint32_t i = 0; i < started; ++i)
+        uv_thread_join(&threads[i]);
+    if (v.bad != UINT32_MAX) {
+        // 最后一次提交的段可能没有完整写入磁盘, 回退到上一个提交标记
+        if (v.bad < prev.segs) return AIDB_ERR_CRC32;
+        last = prev;
+        aidb->seg_count = last.segs;
+        broken = AIDB_ERR_CRC32;
+    }
+
+    aidb->end = last.end;
+    aidb->count = last.count;
+    aidb->rollback = last.end < aidb->size ? (broken ? broken : AIDB_ERR_FORMAT) : AIDB_OK;
+    aidb->index = NULL;
+    aidb->index_end = sizeof(aidb_header_t);
+    if (last.index) {
+        const aidb_record_t* rec = (const aidb_record_t*) (aidb->map + last.index);
+        aidb->index = (const aidb_slot_t*) (rec + 1);
+        aidb->index_mask = (uint32_t) ((rec->capacity - sizeof(aidb_index_tail_t)) / sizeof(aidb_slot_t)) - 1;
+        aidb->index_end = last.index + sizeof(aidb_record_t) + rec->capacity;
+    }
     return AIDB_OK;
 }
 
+/** 获取文件的写入锁, 锁文件名为filename加AIDB_LOCK_SUFFIX
+ * @param out       输出参数, 锁文件句柄, 关闭句柄即释放锁
+ * @return          成功返回AIDB_OK, 已被其它句柄锁定时返回AIDB_ERR_LOCKED
+ */
+static AIDB_ERROR lock_writer(const char* filename, aidb_lock_t* out) {
+    size_t name_len = strlen(filename);
+    char name[name_len + sizeof(AIDB_LOCK_SUFFIX)];
+    memcpy(name, filename, name_len);
+    memcpy(name + name_len, AIDB_LOCK_SUFFIX, sizeof(AIDB_LOCK_SUFFIX));
+#ifdef _WIN32
+    // 不共享打开, 其它句柄打开时失败
+    HANDLE h = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return GetLastError() == ERROR_SHARING_VIOLATION ? AIDB_ERR_LOCKED : AIDB_ERR_OPEN;
+    *out = h;
+#else
+    // flock属于打开的文件描述, 同一进程内的其它句柄同样无法获取
+    int fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return AIDB_ERR_OPEN;
+    if (flock(fd, LOCK_EX | LOCK_NB)) {
+        close(fd);
+        return AIDB_ERR_LOCKED;
+    }
+    *out = fd;
+#endif
+    return AIDB_OK;
+}
+
+static void unlock_writer(aidb_lock_t lock) {
+#ifdef _WIN32
+    CloseHandle(lock);
+#else
+    close(lock);
+#endif
+}
+
+/** 写入文件缓冲区的内容并同步到磁盘 */
+static _Bool sync_file(FILE* fp) {
+    if (fflush(fp)) return 0;
+#ifdef _WIN32
+    return !_commit(_fileno(fp));
+#else
+    return !fsync(fileno(fp));
+#endif
+}
+
+/** 定位到文件的指定偏移, windows下long只有32位, 使用64位偏移的版本 */
+static _Bool seek_file(FILE* fp, uint64_t off) {
+#ifdef _WIN32
+    return !_fseeki64(fp, (__int64) off, SEEK_SET);
+#else
+    return !fseeko(fp, (off_t) off, SEEK_SET);
+#endif
+}
+
+/** 截断文件到指定长度 */
+static _Bool truncate_file(FILE* fp, uint64_t size) {
+    if (fflush(fp)) return 0;
+#ifdef _WIN32
+    return !_chsize_s(_fileno(fp), (__int64) size);
+#else
+    return !ftruncate(fileno(fp), (off_t) size);
+#endif
+}
+
+/** 创建时写入文件头, 之后不再改写 */
+static _Bool aidb_write_header(aidb_t* aidb) {
+    aidb_header_t header;
+    memset(&header, 0, sizeof(aidb_header_t));
+    header.magic = AIDB_MAGIC;
+    header.version = aidb->version;
+    header.updated = (int64_t) time(NULL);
+    gen_pwd(aidb->password, header.updated, header.pwd);
+    return fwrite(&header, sizeof(aidb_header_t), 1, aidb->fp) == 1;
+}
+
+static void append_bytes(aidb_t* aidb, const void* data, uint32_t len, _Bool payload);
+
+/** 生成哈希槽, 按写入顺序倒序插入, 同一个键的新记录在探测序列中排在旧记录之前
+ * @param mask      输出参数, 哈希槽数量 - 1
+ * @return          哈希槽数组, 由调用者释放, 内存不足时返回NULL
+ */
+static aidb_slot_t* build_table(aidb_t* aidb, uint32_t* mask) {
+    uint32_t slots = AIDB_INDEX_MIN_SLOTS;
+    while (slots < aidb->entry_count * 2) slots <<= 1;
+    aidb_slot_t* table = calloc(slots, sizeof(aidb_slot_t));
+    if (!table) return NULL;
+    *mask = slots - 1;
+    for (uint32_t i = aidb->entry_count; i--; ) {
+        uint32_t pos = aidb->entries[i].hash & *mask;
+        while (table[pos].offset) pos = (pos + 1) & *mask;
+        table[pos] = aidb->entries[i];
+    }
+    return table;
+}
+
+/** 在记录之后追加索引块, 包含到目前为止的全部索引条目, 内存不足时不写索引 */
+static void aidb_write_index(aidb_t* aidb) {
+    uint32_t mask;
+    aidb_slot_t* table = build_table(aidb, &mask);
+    if (!table) return;
+    uint32_t slots_len = (mask + 1) * (uint32_t) sizeof(aidb_slot_t);
+    uint32_t len = slots_len + (uint32_t) sizeof(aidb_index_tail_t);
+    aidb_record_t rec = { len, len, AIDB_INDEX_BLOCK };
+    aidb_index_tail_t tail = { aidb->size, mask, aidb->entry_count, 0, AIDB_INDEX_MAGIC };
+    tail.crc = crc32_update(crc32_update(0, table, slots_len), &tail, offsetof(aidb_index_tail_t, crc));
+
+    append_bytes(aidb, &rec, sizeof(aidb_record_t), 0);
+    append_bytes(aidb, table, slots_len, 0);
+    append_bytes(aidb, &tail, sizeof(aidb_index_tail_t), 0);
+    aidb->size += sizeof(aidb_record_t) + len;
+    free(table);
+}
+
+/** 追加提交标记, 之前的内容同步到磁盘后成为已提交的状态, 组提交时需要在锁内调用 */
+static void commit_marker(aidb_t* aidb) {
+    uint8_t marker[AIDB_COMMIT_SIZE];
+    aidb_record_t rec = { sizeof(aidb_commit_t), sizeof(aidb_commit_t), AIDB_COMMIT };
+    aidb_commit_t c = { aidb->commit_start, 0 };
+    c.crc = crc32(&c.start, sizeof(uint64_t));
+    memcpy(marker, &rec, sizeof(aidb_record_t));
+    memcpy(marker + sizeof(aidb_record_t), &c, sizeof(aidb_commit_t));
+    append_bytes(aidb, marker, AIDB_COMMIT_SIZE, 0);
+    aidb->size += AIDB_COMMIT_SIZE;
+    aidb->commit_start = aidb->size;
+}
+
+size_t aidb_sizeof() { return sizeof(aidb_t); }
+size_t aidb_iterator_sizeof() { return sizeof(aidb_iterator_t); }
+
 AIDB_ERROR aidb_check(const char* filename, const char* key) {
-    // 打开文件
-    FILE *fp = fopen(filename, "rb");
+    // 需要定位段之后才能校验, 与打开的校验过程相同, 打开时回退了未完成的提交也作为错误返回
+    aidb_t aidb;
+    AIDB_ERROR ret_code = aidb_open(&aidb, filename, key);
+    if (ret_code == AIDB_OK) {
+        ret_code = aidb.rollback;
+        aidb_close(&aidb);
+    }
+    return ret_code;
+}
+
+/** 创建文件并写入文件头, 不获取写入锁 */
+static AIDB_ERROR create_file(aidb_t* aidb, const char* filename, const char* key) {
+    memset(aidb, 0, sizeof(aidb_t));
+
+    FILE *fp = fopen(filename, "wb+");
     if (!fp) return AIDB_ERR_OPEN;
+    aidb->fp = fp;
+    aidb->filename = strdup(filename);
+    aidb->password = strdup(key);
+    aidb->version = AIDB_VERSION;
+    aidb->size = sizeof(aidb_header_t);
+    aidb->commit_start = aidb->size;
+    gen_key(key, aidb->key);
+    aes_init(&aidb->aes, AES_ENCRYPT, aidb->key, 128, IV);
 
-    // 校验文件头
-    AIDB_ERROR ret_code = aidb_check_header(fp, key);
+    if (!aidb_write_header(aidb)) {
+        aidb_close(aidb);
+        return AIDB_ERR_WRITE;
+    }
+    aidb->modified = 1;
+    return AIDB_OK;
+}
 
-    fclose(fp);
+AIDB_ERROR aidb_create(aidb_t* aidb, const char* filename, const char* key) {
+    // 先获取写入锁再截断文件, 不会破坏其它句柄正在写入的文件
+    aidb_lock_t lock;
+    AIDB_ERROR ret_code = lock_writer(filename, &lock);
+    if (ret_code != AIDB_OK) {
+        memset(aidb, 0, sizeof(aidb_t));
+        return ret_code;
+    }
+    ret_code = create_file(aidb, filename, key);
+    if (ret_code != AIDB_OK) {
+        unlock_writer(lock);
+        return ret_code;
+    }
+    aidb->lock_file = lock;
+    aidb->locked = 1;
+    return AIDB_OK;
+}
+
+AIDB_ERROR aidb_open(aidb_t* aidb, const char* filename, const char* key) {
+    memset(aidb, 0, sizeof(aidb_t));
+
+    aidb->map = map_file(filename, &aidb->size);
+    if (!aidb->map) return AIDB_ERR_OPEN;
+    aidb->filename = strdup(filename);
+
+    AIDB_ERROR ret_code = aidb_check_header(aidb->map, aidb->size, key);
+    if (ret_code == AIDB_OK) {
+        aidb->version = ((const aidb_header_t*) aidb->map)->version;
+        ret_code = load_units(aidb);
+    }
+
+    if (ret_code == AIDB_OK) {
+        gen_key(key, aidb->key);
+        // CTR模式加解密都使用加密方向的秘钥
+        aes_init(&aidb->aes, AES_ENCRYPT, aidb->key, 128, IV);
+    } else {
+        aidb_close(aidb);
+    }
+
+    return ret_code;
+}
+
+static void commit_stop(aidb_t* aidb);
+static void close_segment(aidb_t* aidb);
+
+void aidb_close(aidb_t* aidb) {
+    if (aidb->group) commit_stop(aidb);
+    if (aidb->fp) {
+        aidb_flush(aidb);
+        fclose(aidb->fp);
+    }
+    if (aidb->locked) unlock_writer(aidb->lock_file);
+    if (!aidb->shared) {
+        unmap_file(aidb->map, aidb->size);
+        free(aidb->segs);
+        free(aidb->tail_index);
+    }
+    free(aidb->filename);
+    free(aidb->password);
+    free(aidb->entries);
+    free(aidb->plain);
+    free(aidb->pending);
+    free(aidb->spare);
+    memset(aidb, 0, sizeof(aidb_t));
+}
+
+void aidb_flush(aidb_t* aidb) {
+    if (aidb->group) {
+        // 组提交期间不写索引, 只等待已写入的记录提交
+        aidb_sync(aidb);
+        return;
+    }
+    if (aidb->fp && aidb->modified) {
+        close_segment(aidb);
+        if (aidb->key_func) aidb_write_index(aidb);
+        commit_marker(aidb);
+        if (!sync_file(aidb->fp))
+            aidb->failed = 1;
+        aidb->modified = 0;
+    }
+}
+
+AIDB_ERROR aidb_clone(aidb_t* dst, const aidb_t* src) {
+    memset(dst, 0, sizeof(aidb_t));
+    if (!src->map) return AIDB_ERR_OPEN;
+    dst->filename = strdup(src->filename);
+    dst->map = src->map;
+    dst->shared = 1;
+    dst->version = src->version;
+    dst->segs = src->segs;
+    dst->seg_count = src->seg_count;
+    dst->size = src->size;
+    dst->end = src->end;
+    dst->rollback = src->rollback;
+    dst->count = src->count;
+    dst->key_func = src->key_func;
+    dst->index = src->index;
+    dst->index_mask = src->index_mask;
+    dst->index_end = src->index_end;
+    dst->tail_index = src->tail_index;
+    dst->tail_mask = src->tail_mask;
+    memcpy(dst->key, src->key, 16);
+    // 加解密上下文内部有指针指向自身, 不能直接复制
+    aes_init(&dst->aes, AES_ENCRYPT, dst->key, 128, IV);
+    return AIDB_OK;
+}
+
+static _Bool scan_entries(aidb_t* aidb, uint64_t from);
+
+void aidb_set_key(aidb_t* aidb, aidb_key_func key_func) {
+    aidb->key_func = key_func;
+    if (!aidb->map || aidb->shared) return;
+    // 最后一个索引块之后的记录生成内存索引, 内存不足时aidb_get逐条比较这部分记录
+    free(aidb->tail_index);
+    aidb->tail_index = NULL;
+    if (key_func && aidb->index_end < aidb->end) {
+        if (scan_entries(aidb, aidb->index_end))
+            aidb->tail_index = build_table(aidb, &aidb->tail_mask);
+        free(aidb->entries);
+        aidb->entries = NULL;
+        aidb->entry_count = aidb->entry_cap = 0;
+    }
+}
+
+void aidb_advise(aidb_t* aidb, AIDB_ADVISE advise) {
+    if (aidb->map) advise_range(aidb->map, aidb->size, advise);
+}
+
+/** 读取线程, 按顺序将文件内容读入空闲的缓冲区, 读到文件末尾或被要求停止时结束 */
+static void load_reader(void* arg) {
+    _load_t* ld = (_load_t*) arg;
+    for (uint32_t i = 0; ; i = (i + 1) % AIDB_LOAD_CHUNKS) {
+        uv_sem_wait(&ld->free_sem);
+        uint32_t n = 0;
+        if (!__atomic_load_n(&ld->stop, __ATOMIC_ACQUIRE))
+            n = (uint32_t) fread(ld->chunks[i], 1, AIDB_LOAD_CHUNK, ld->fp);
+        ld->lens[i] = n;
+        uv_sem_post(&ld->full_sem);
+        if (n < AIDB_LOAD_CHUNK) break;
+    }
+}
+
+/** 打开文件并启动读取线程, 从offset开始读取 */
+static AIDB_ERROR load_start(_load_t* ld, const char* filename, uint64_t offset) {
+    memset(ld, 0, sizeof(_load_t));
+    ld->fp = fopen(filename, "rb");
+    if (!ld->fp) return AIDB_ERR_OPEN;
+    // 只有读取线程使用文件缓冲区, 每次读取整块, 不需要stdio再缓冲一次
+    setvbuf(ld->fp, NULL, _IONBF, 0);
+
+    ld->mem = malloc((size_t) AIDB_LOAD_CHUNK * AIDB_LOAD_CHUNKS);
+    if (!ld->mem || !seek_file(ld->fp, offset)) {
+        free(ld->mem);
+        fclose(ld->fp);
+        return AIDB_ERR_READ;
+    }
+    for (uint32_t i = 0; i < AIDB_LOAD_CHUNKS; ++i)
+        ld->chunks[i] = ld->mem + (size_t) i * AIDB_LOAD_CHUNK;
+    uv_sem_init(&ld->free_sem, AIDB_LOAD_CHUNKS);
+    uv_sem_init(&ld->full_sem, 0);
+    if (uv_thread_create(&ld->reader, load_reader, ld)) {
+        uv_sem_destroy(&ld->free_sem);
+        uv_sem_destroy(&ld->full_sem);
+        free(ld->mem);
+        fclose(ld->fp);
+        return AIDB_ERR_READ;
+    }
+    return AIDB_OK;
+}
+
+/** 等待下一个读入的缓冲区
+ * @param i         缓冲区序号, 按顺序轮转
+ * @return          读入的长度, 小于AIDB_LOAD_CHUNK表示文件结束
+*/
+inline static uint32_t load_wait(_load_t* ld, uint32_t i) {
+    uv_sem_wait(&ld->full_sem);
+    return ld->lens[i];
+}
+
+/** 归还处理完的缓冲区, 结束时通知读取线程停止, 多释放一个缓冲区保证读取线程不会阻塞 */
+inline static void load_release(_load_t* ld, _Bool stop) {
+    if (stop) __atomic_store_n(&ld->stop, 1, __ATOMIC_RELEASE);
+    uv_sem_post(&ld->free_sem);
+}
+
+/** 等待读取线程结束并释放资源, 返回读取过程中是否出错 */
+static _Bool load_finish(_load_t* ld) {
+    uv_thread_join(&ld->reader);
+    _Bool failed = ferror(ld->fp);
+    uv_sem_destroy(&ld->free_sem);
+    uv_sem_destroy(&ld->full_sem);
+    free(ld->mem);
+    fclose(ld->fp);
+    return failed;
+}
+
+AIDB_ERROR aidb_load(aidb_t* aidb, void* param, aidb_read_func on_read, aidb_read_finish_func on_finish) {
+    if (!aidb->map) return AIDB_ERR_OPEN;
+    _load_t ld;
+    AIDB_ERROR ret_code = load_start(&ld, aidb->filename, sizeof(aidb_header_t));
+    if (ret_code != AIDB_OK) return ret_code;
+
+    // 记录可能跨越缓冲区, 记录头和记录内容先拼接完整, 再按记录偏移解密, 段随机数取自读到的段开始标记
+    uint8_t* rec_buf = NULL;
+    uint32_t rec_cap = 0;
+    aidb_record_t rec;
+    uint32_t head_len = 0, left = 0, done = 0;
+    _Bool in_body = 0, stopped = 0, keep = 0;
+    uint64_t rec_off = 0, next_off = sizeof(aidb_header_t);
+    uint8_t nonce[8] = { 0 };
+    // 只处理记录区, 不读取记录之后的索引
+    uint64_t remain = aidb->end - sizeof(aidb_header_t);
+    for (uint32_t i = 0; ; i = (i + 1) % AIDB_LOAD_CHUNKS) {
+        uint32_t n_read = load_wait(&ld, i);
+        uint32_t len = n_read < remain ? n_read : (uint32_t) remain;
+        remain -= len;
+        const uint8_t *p = ld.chunks[i], *end = p + len;
+        _Bool eof = n_read < AIDB_LOAD_CHUNK || !remain;
+        // 空记录在记录头之后立即完成
+        while ((p < end || (in_body && !left)) && ret_code == AIDB_OK && !stopped) {
+            if (!in_body) {
+                uint32_t n = sizeof(aidb_record_t) - head_len;
+                if (n > end - p) n = (uint32_t) (end - p);
+                memcpy((uint8_t*) &rec + head_len, p, n);
+                head_len += n;
+                p += n;
+                if (head_len < sizeof(aidb_record_t)) continue;
+                head_len = 0;
+                if (rec.size != rec.capacity) {
+                    ret_code = AIDB_ERR_FORMAT;
+                    break;
+                }
+                keep = !rec.deleted || rec.deleted == AIDB_SEG_BEGIN;
+                if (keep && (rec.capacity > rec_cap || !rec_buf)) {
+                    free(rec_buf);
+                    rec_cap = rec.capacity < 16 ? 16 : rec.capacity;
+                    rec_buf = malloc(rec_cap);
+                    if (!rec_buf) {
+                        ret_code = AIDB_ERR_READ;
+                        break;
+                    }
+                }
+                in_body = 1;
+                left = rec.capacity;
+                done = 0;
+                rec_off = next_off;
+                next_off += sizeof(aidb_record_t) + (uint64_t) rec.capacity;
+            } else {
+                uint32_t n = left < end - p ? left : (uint32_t) (end - p);
+                if (keep) {
+                    memcpy(rec_buf + done, p, n);
+                    done += n;
+                }
+                p += n;
+                left -= n;
+                if (left) continue;
+                in_body = 0;
+                if (!keep) continue;
+                if (rec.deleted) {
+                    memcpy(nonce, rec_buf, 8);
+                    continue;
+                }
+                ctr_crypt(&aidb->aes, nonce, rec_off, rec_buf, rec_buf, rec.size);
+                if (!on_read(param, (const char*) rec_buf, rec.size))
+                    stopped = 1;
+            }
+        }
+
+        // 文件在记录中间结束
+        if (eof && ret_code == AIDB_OK && !stopped && (in_body || remain))
+            ret_code = AIDB_ERR_FORMAT;
+        _Bool stop = eof || ret_code != AIDB_OK || stopped;
+        load_release(&ld, stop);
+        if (stop) break;
+    }
 
+    if (load_finish(&ld)) ret_code = AIDB_ERR_READ;
+    if (ret_code == AIDB_OK && !stopped && on_finish)
+        on_finish(param);
+    free(rec_buf);
     return ret_code;
 }
 
+// 旧格式的明文按行拆分为记录
+typedef struct _lines_t {
+    void*           param;
+    aidb_read_func  on_read;
+    uint8_t*        buf;                // 跨越解密块的行先拼接完整
+    uint32_t        len;
+    uint32_t        cap;
+    _Bool           stopped;            // 回调函数要求停止
+    _Bool           failed;             // 内存不足
+} _lines_t;
+
+/** 明文中完整的行直接回调, 不完整的部分保存到buf, 行不包括结尾的换行符 */
+static void split_lines(_lines_t* l, const uint8_t* p, uint32_t n) {
+    const uint8_t* end = p + n;
+    while (p < end && !l->stopped && !l->failed) {
+        const uint8_t* nl = memchr(p, '\n', end - p);
+        const uint8_t* e = nl ? nl : end;
+        uint32_t seg = (uint32_t) (e - p);
+        if (nl && !l->len) {
+            // 空行不作为记录
+            if (seg) l->stopped = !l->on_read(l->param, (const char*) p, seg);
+        } else {
+            if (l->len + seg > l->cap) {
+                uint32_t cap = l->cap ? l->cap : 4096;
+                while (cap < l->len + seg) cap <<= 1;
+                uint8_t* b = realloc(l->buf, cap);
+                if (!b) {
+                    l->failed = 1;
+                    break;
+                }
+                l->buf = b;
+                l->cap = cap;
+            }
+            memcpy(l->buf + l->len, p, seg);
+            l->len += seg;
+            if (nl) {
+                l->stopped = !l->on_read(l->param, (const char*) l->buf, l->len);
+                l->len = 0;
+            }
+        }
+        p = nl ? nl + 1 : end;
+    }
+}
+
+AIDB_ERROR aidb_load_legacy(const char* filename, const char* key, void* param, aidb_read_func on_read, aidb_read_finish_func on_finish) {
+    uint8_t* plain = malloc(AIDB_LOAD_CHUNK);
+    if (!plain) return AIDB_ERR_READ;
+    _load_t ld;
+    AIDB_ERROR ret_code = load_start(&ld, filename, 0);
+    if (ret_code != AIDB_OK) {
+        free(plain);
+        return ret_code;
+    }
+
+    _lines_t lines = { param, on_read, NULL, 0, 0, 0, 0 };
+    aes_ctx_t aes;
+    uint8_t k[16], last[16];
+    gen_key(key, k);
+    aes_init(&aes, AES_DECRYPT, k, 128, IV);
+
+    // 最后一块包含填充, 每次解密后保留最后一块, 读到文件末尾才能确定填充长度
+    uint64_t total = 0;
+    for (uint32_t i = 0; ; i = (i + 1) % AIDB_LOAD_CHUNKS) {
+        uint32_t len = load_wait(&ld, i);
+        _Bool eof = len < AIDB_LOAD_CHUNK;
+        if (len & 15) {
+            ret_code = AIDB_ERR_FORMAT;
+        } else if (len) {
+            aes_crypt_cbc(&aes, len, aes.iv, ld.chunks[i], plain);
+            if (total) split_lines(&lines, last, 16);
+            split_lines(&lines, plain, len - 16);
+            memcpy(last, plain + len - 16, 16);
+            total += len;
+        }
+        if (eof && ret_code == AIDB_OK) {
+            uint8_t pad = last[15];
+            if (!total) {
+                ret_code = AIDB_ERR_TOO_SMALL;
+            } else if (!pad || pad > 16) {
+                ret_code = AIDB_ERR_PWD;
+            } else {
+                for (uint32_t j = 16 - pad; j < 15; ++j)
+                    if (last[j] != pad) ret_code = AIDB_ERR_PWD;
+                if (ret_code == AIDB_OK) split_lines(&lines, last, 16 - pad);
+                // 最后一行没有换行符
+                if (ret_code == AIDB_OK && lines.len && !lines.stopped && !lines.failed)
+                    lines.stopped = !on_read(param, (const char*) lines.buf, lines.len);
+            }
+        }
+        if (lines.failed) ret_code = AIDB_ERR_READ;
+        _Bool stop = eof || ret_code != AIDB_OK || lines.stopped;
+        load_release(&ld, stop);
+        if (stop) break;
+    }
+
+    if (load_finish(&ld)) ret_code = AIDB_ERR_READ;
+    if (ret_code == AIDB_OK && !lines.stopped && on_finish)
+        on_finish(param);
+    free(lines.buf);
+    free(plain);
+    return ret_code;
+}
+
+/** 导入旧格式的记录回调, 写入失败时停止 */
+static _Bool on_import(void* param, const char* src, uint32_t len) {
+    aidb_t* aidb = (aidb_t*) param;
+    aidb_put(aidb, src, len);
+    return !aidb->failed;
+}
+
+AIDB_ERROR aidb_import(aidb_t* aidb, const char* filename, const char* key) {
+    if (!aidb->fp) return AIDB_ERR_OPEN;
+    AIDB_ERROR ret_code = aidb_load_legacy(filename, key, aidb, on_import, NULL);
+    return ret_code == AIDB_OK && aidb->failed ? AIDB_ERR_WRITE : ret_code;
+}
+
+uint32_t aidb_record_count(aidb_t* aidb) {
+    return aidb->count;
+}
+
+void aidb_foreach(aidb_t* aidb, aidb_iterator_t* iterator) {
+    memset(iterator, 0, sizeof(aidb_iterator_t));
+    iterator->aidb = aidb;
+}
+
+/** 从指定位置开始查找第一条未删除的记录, 找不到返回0 */
+static uint64_t find_record(aidb_t* aidb, uint64_t off) {
+    while (off < aidb->end) {
+        const aidb_record_t* rec = (const aidb_record_t*) (aidb->map + off);
+        if (!rec->deleted) return off;
+        off += sizeof(aidb_record_t) + rec->capacity;
+    }
+    return 0;
+}
+
+uint32_t aidb_next(aidb_iterator_t* iterator) {
+    aidb_t* aidb = iterator->aidb;
+    if (!aidb->map) return 0;
+    uint64_t off = iterator->record
+        ? iterator->offset + sizeof(aidb_record_t) + iterator->record->capacity
+        : sizeof(aidb_header_t);
+    off = find_record(aidb, off);
+    if (!off) {
+        // 已经到文件末尾
+        iterator->record = NULL;
+        iterator->offset = 0;
+        return 0;
+    }
+    iterator->offset = off;
+    iterator->record = (const aidb_record_t*) (aidb->map + off);
+    return iterator->record->size;
+}
+
+uint32_t aidb_prev(aidb_iterator_t* iterator) {
+    aidb_t* aidb = iterator->aidb;
+    if (!aidb->map || !iterator->record) return 0;
+    uint64_t prev = 0;
+    for (uint64_t off = find_record(aidb, sizeof(aidb_header_t)); off && off < iterator->offset; ) {
+        prev = off;
+        off = find_record(aidb, off + sizeof(aidb_record_t) + ((const aidb_record_t*) (aidb->map + off))->capacity);
+    }
+    iterator->offset = prev;
+    iterator->record = prev ? (const aidb_record_t*) (aidb->map + prev) : NULL;
+    return prev ? iterator->record->size : 0;
+}
+
+const void* aidb_record_data(aidb_iterator_t* iterator, uint32_t* size) {
+    if (!iterator->record) {
+        *size = 0;
+        return NULL;
+    }
+    *size = iterator->record->capacity;
+    return iterator->record + 1;
+}
+
+uint32_t aidb_fetch(aidb_iterator_t* iterator, void* output, uint32_t size) {
+    const aidb_record_t* rec = iterator->record;
+    if (!rec) return 0;
+    if (size > rec->size) size = rec->size;
+
+    // aidb_get查找时已经解密过的记录直接复制
+    aidb_t* aidb = iterator->aidb;
+    if (aidb->plain_off && aidb->plain_off == iterator->offset) {
+        memcpy(output, aidb->plain, size);
+        return size;
+    }
+
+    const aidb_segment_t* seg = find_segment(aidb, iterator->offset);
+    if (!seg) return 0;
+    // CTR模式可以只解密需要的长度
+    ctr_crypt(&aidb->aes, seg->nonce, iterator->offset, (const uint8_t*) (rec + 1), output, size);
+    return size;
+}
+
+/** 解密记录到plain中, 容量不足时扩大plain, 失败返回NULL */
+static const uint8_t* decrypt_record(aidb_t* aidb, uint64_t off) {
+    const aidb_record_t* rec = (const aidb_record_t*) (aidb->map + off);
+    if (rec->capacity > aidb->plain_cap || !aidb->plain) {
+        uint32_t cap = rec->capacity < 16 ? 16 : rec->capacity;
+        uint8_t* p = realloc(aidb->plain, cap);
+        if (!p) return NULL;
+        aidb->plain = p;
+        aidb->plain_cap = cap;
+    }
+    const aidb_segment_t* seg = find_segment(aidb, off);
+    if (!seg) return NULL;
+    ctr_crypt(&aidb->aes, seg->nonce, off, (const uint8_t*) (rec + 1), aidb->plain, rec->size);
+    aidb->plain_off = off;
+    return aidb->plain;
+}
+
+/** 获取已解密记录的键, 删除标记记录的内容就是被删除的键 */
+inline static uint32_t record_key(aidb_t* aidb, const aidb_record_t* rec, const uint8_t* plain, const char** key) {
+    if (rec->deleted == AIDB_TOMBSTONE) {
+        *key = (const char*) plain;
+        return rec->size;
+    }
+    return aidb->key_func((const char*) plain, rec->size, key);
+}
+
+/** 解密记录并提取键与查找的键比较, 解密内容保留在plain中
+ * @return          1: 键相同, -1: 键相同的删除标记, 0: 键不同或者是已删除的记录
+ */
+static int match_record(aidb_t* aidb, uint64_t off, const void* key, uint32_t key_len) {
+    if (off < sizeof(aidb_header_t) || off >= aidb->end) return 0;
+    const aidb_record_t* rec = (const aidb_record_t*) (aidb->map + off);
+    if (rec->deleted && rec->deleted != AIDB_TOMBSTONE) return 0;
+    const uint8_t* plain = decrypt_record(aidb, off);
+    if (!plain) return 0;
+
+    const char* k;
+    uint32_t len = record_key(aidb, rec, plain, &k);
+    if (len != key_len || memcmp(k, key, len)) return 0;
+    return rec->deleted ? -1 : 1;
+}
+
+/** 定位迭代器到记录并返回记录长度 */
+inline static uint32_t seek_record(aidb_iterator_t* iterator, uint64_t off) {
+    iterator->offset = off;
+    iterator->record = (const aidb_record_t*) (iterator->aidb->map + off);
+    return iterator->record->size;
+}
+
+/** 在哈希槽中查找键, 同一个键的新记录在探测序列中排在前面
+ * @param found     输出参数, 找到的记录偏移
+ * @return          1: 找到记录, -1: 最新的记录是删除标记, 0: 没有找到
+ */
+static int probe_index(aidb_t* aidb, const aidb_slot_t* index, uint32_t mask, uint32_t hash,
+        const void* key, uint32_t key_len, uint64_t* found) {
+    for (uint32_t pos = hash & mask, n = 0; n <= mask; pos = (pos + 1) & mask, ++n) {
+        const aidb_slot_t* slot = &index[pos];
+        if (!slot->offset) break;
+        if (slot->hash != hash) continue;
+        int m = match_record(aidb, slot->offset, key, key_len);
+        if (m) {
+            *found = slot->offset;
+            return m;
+        }
+    }
+    return 0;
+}
+
+uint32_t aidb_get(aidb_t* aidb, aidb_iterator_t* iterator, const void* key, uint32_t key_len) {
+    aidb_foreach(aidb, iterator);
+    if (!aidb->map || !aidb->key_func) return 0;
+
+    // 最后一个索引块之后的记录较新, 先查这部分记录, 没有内存索引时逐条解密比较, 同一个键以最后写入的记录为准
+    uint32_t hash = key_hash(key, key_len);
+    uint64_t found = 0;
+    int m = 0;
+    if (aidb->tail_index) {
+        m = probe_index(aidb, aidb->tail_index, aidb->tail_mask, hash, key, key_len, &found);
+    } else {
+        for (uint64_t off = aidb->index_end; off < aidb->end;
+                off += sizeof(aidb_record_t) + ((const aidb_record_t*) (aidb->map + off))->capacity) {
+            int r = match_record(aidb, off, key, key_len);
+            if (r) {
+                m = r;
+                found = off;
+            }
+        }
+        // 逐条比较后plain中不一定是找到的记录
+        if (m > 0) match_record(aidb, found, key, key_len);
+    }
+    if (!m && aidb->index)
+        m = probe_index(aidb, aidb->index, aidb->index_mask, hash, key, key_len, &found);
+    // 最新的记录是删除标记时表示键已被删除
+    return m > 0 ? seek_record(iterator, found) : 0;
+}
+
+/** 增加一个索引条目, 条目按写入顺序保存 */
+static _Bool push_entry(aidb_t* aidb, uint64_t offset, uint32_t hash) {
+    if (aidb->entry_count == aidb->entry_cap) {
+        uint32_t cap = aidb->entry_cap ? aidb->entry_cap * 2 : 1024;
+        aidb_slot_t* p = realloc(aidb->entries, cap * sizeof(aidb_slot_t));
+        if (!p) return 0;
+        aidb->entries = p;
+        aidb->entry_cap = cap;
+    }
+    aidb_slot_t* e = &aidb->entries[aidb->entry_count++];
+    e->offset = offset;
+    e->hash = hash;
+    return 1;
+}
+
+/** 追加写入数据, 组提交时写入待提交缓冲区, 否则直接写入文件
+ * @param payload   段内的记录数据, 计入段的CRC32C
+ */
+static void append_bytes(aidb_t* aidb, const void* data, uint32_t len, _Bool payload) {
+    if (payload)
+        aidb->seg_crc = crc32c_update(aidb->seg_crc, data, len);
+    if (!aidb->group) {
+        if (fwrite(data, 1, len, aidb->fp) != len) aidb->failed = 1;
+        return;
+    }
+    if (aidb->pending_len + len > aidb->pending_cap) {
+        uint32_t cap = aidb->pending_cap ? aidb->pending_cap : 64 * 1024;
+        while (cap < aidb->pending_len + len) cap <<= 1;
+        uint8_t* p = realloc(aidb->pending, cap);
+        if (!p) {
+            aidb->failed = 1;
+            return;
+        }
+        aidb->pending = p;
+        aidb->pending_cap = cap;
+    }
+    memcpy(aidb->pending + aidb->pending_len, data, len);
+    aidb->pending_len += len;
+}
+
+/** 开始新的段, 写入段开始标记 */
+static void open_segment(aidb_t* aidb) {
+    uint8_t marker[AIDB_MARKER_SIZE];
+    aidb_record_t rec = { 8, 8, AIDB_SEG_BEGIN };
+    make_nonce(aidb->seg_nonce);
+    memcpy(marker, &rec, sizeof(aidb_record_t));
+    memcpy(marker + sizeof(aidb_record_t), aidb->seg_nonce, 8);
+    append_bytes(aidb, marker, AIDB_MARKER_SIZE, 0);
+    aidb->size += AIDB_MARKER_SIZE;
+    aidb->seg_start = aidb->size;
+    aidb->seg_crc = 0;
+    aidb->seg_open = 1;
+}
+
+/** 结束未结束的段, 写入段结束标记, 组提交时需要在锁内调用 */
+static void close_segment(aidb_t* aidb) {
+    if (!aidb->seg_open) return;
+    uint8_t marker[AIDB_MARKER_SIZE];
+    aidb_record_t rec = { 8, 8, AIDB_SEG_END };
+    aidb_seg_end_t e = { (uint32_t) (aidb->size - aidb->seg_start), aidb->seg_crc };
+    memcpy(marker, &rec, sizeof(aidb_record_t));
+    memcpy(marker + sizeof(aidb_record_t), &e, sizeof(aidb_seg_end_t));
+    append_bytes(aidb, marker, AIDB_MARKER_SIZE, 0);
+    aidb->size += AIDB_MARKER_SIZE;
+    aidb->seg_open = 0;
+}
+
+/** 加密并追加一条记录, 组提交时需要在锁内调用
+ * @param deleted   删除标志, 0或者AIDB_TOMBSTONE
+ * @param key       记录的键, 长度为0时不加入索引
+ */
+static void put_record(aidb_t* aidb, const void* data, uint32_t size, uint8_t deleted, const char* key, uint32_t key_len) {
+    if (!aidb->seg_open) open_segment(aidb);
+    uint64_t off = aidb->size;
+    if (key_len && !push_entry(aidb, off, key_hash(key, key_len))) {
+        aidb->failed = 1;
+        return;
+    }
+
+    aidb_record_t rec = { size, size, deleted };
+    append_bytes(aidb, &rec, sizeof(aidb_record_t), 1);
+
+    // 分段加密写入, 不需要与记录等长的缓冲区, 每段长度是16的倍数, 计数器可以接着使用
+    uint8_t buf[4096], counter[16];
+    const uint8_t* p = data;
+    init_counter(counter, aidb->seg_nonce, off);
+    for (uint32_t left = size; left; ) {
+        uint32_t n = left < 4096 ? left : 4096;
+        aes_crypt_ctr(&aidb->aes, n, counter, p, buf);
+        append_bytes(aidb, buf, n, 1);
+        p += n;
+        left -= n;
+    }
+
+    aidb->size += sizeof(aidb_record_t) + rec.capacity;
+    if (!deleted) ++aidb->count;
+    aidb->modified = 1;
+    if (aidb->size - aidb->seg_start >= AIDB_SEGMENT_SIZE) close_segment(aidb);
+}
+
+void aidb_put(aidb_t* aidb, const void* data, uint32_t size) {
+    if (!aidb->fp) return;
+    const char* key = NULL;
+    uint32_t key_len = aidb->key_func ? aidb->key_func(data, size, &key) : 0;
+    if (aidb->group) uv_mutex_lock(&aidb->lock);
+    // 待提交缓冲区为空时才需要唤醒提交线程开始计时, 提交间隔内的其它写入不唤醒
+    _Bool first = aidb->group && !aidb->pending_len;
+    put_record(aidb, data, size, 0, key, key_len);
+    if (aidb->group) {
+        if (first) uv_cond_signal(&aidb->commit_cond);
+        uv_mutex_unlock(&aidb->lock);
+    }
+}
+
+void aidb_delete(aidb_t* aidb, const void* key, uint32_t key_len) {
+    if (!aidb->fp || !aidb->key_func || !key_len) return;
+    if (aidb->group) uv_mutex_lock(&aidb->lock);
+    _Bool first = aidb->group && !aidb->pending_len;
+    put_record(aidb, key, key_len, AIDB_TOMBSTONE, key, key_len);
+    if (aidb->group) {
+        if (first) uv_cond_signal(&aidb->commit_cond);
+        uv_mutex_unlock(&aidb->lock);
+    }
+}
+
+/** 组提交线程, 收集一个提交间隔内的写入, 一次写入文件并同步到磁盘 */
+static void commit_thread(void* arg) {
+    aidb_t* aidb = (aidb_t*) arg;
+    uv_mutex_lock(&aidb->lock);
+    for (;;) {
+        while (!aidb->pending_len && !aidb->stopping)
+            uv_cond_wait(&aidb->commit_cond, &aidb->lock);
+        if (!aidb->pending_len) break;
+        // 等满一个提交间隔, 有调用者等待或者正在关闭时立即提交, 其它原因的唤醒继续等待
+        uint64_t deadline = uv_hrtime() + (uint64_t) aidb->interval * 1000000;
+        for (uint64_t now; !aidb->sync_req && !aidb->stopping && (now = uv_hrtime()) < deadline;)
+            uv_cond_timedwait(&aidb->commit_cond, &aidb->lock, deadline - now);
+        // 每次提交的内容以完整的段和提交标记结束, 提交后的文件可以直接打开
+        close_segment(aidb);
+        commit_marker(aidb);
+
+        // 交换缓冲区, 写入期间其它线程可以继续写入另一个缓冲区
+        uint8_t* buf = aidb->pending;
+        uint32_t len = aidb->pending_len, cap = aidb->pending_cap;
+        uint64_t end = aidb->size;
+        aidb->pending = aidb->spare;
+        aidb->pending_cap = aidb->spare_cap;
+        aidb->pending_len = 0;
+        aidb->sync_req = 0;
+        uv_mutex_unlock(&aidb->lock);
+
+        // 只追加不改写, 中途崩溃时打开回退到上一个提交标记
+        _Bool ok = seek_file(aidb->fp, end - len)
+            && fwrite(buf, 1, len, aidb->fp) == len
+            && sync_file(aidb->fp);
+
+        uv_mutex_lock(&aidb->lock);
+        aidb->spare = buf;
+        aidb->spare_cap = cap;
+        if (!ok) aidb->failed = 1;
+        aidb->committed = end;
+        uv_cond_broadcast(&aidb->done_cond);
+    }
+    uv_mutex_unlock(&aidb->lock);
+}
+
+AIDB_ERROR aidb_commit_start(aidb_t* aidb, uint32_t interval_ms) {
+    if (!aidb->fp || aidb->group) return AIDB_ERR_OPEN;
+    // 之前写入的内容先提交, 之后由提交线程独占文件
+    close_segment(aidb);
+    if (aidb->size > aidb->commit_start) commit_marker(aidb);
+    if (aidb->failed || !sync_file(aidb->fp))
+        return AIDB_ERR_WRITE;
+    aidb->interval = interval_ms;
+    aidb->committed = aidb->size;
+    uv_mutex_init(&aidb->lock);
+    uv_cond_init(&aidb->commit_cond);
+    uv_cond_init(&aidb->done_cond);
+    aidb->group = 1;
+    if (uv_thread_create(&aidb->committer, commit_thread, aidb)) {
+        aidb->group = 0;
+        uv_cond_destroy(&aidb->done_cond);
+        uv_cond_destroy(&aidb->commit_cond);
+        uv_mutex_destroy(&aidb->lock);
+        return AIDB_ERR_WRITE;
+    }
+    return AIDB_OK;
+}
+
+/** 停止组提交线程, 待提交的内容全部写入后返回 */
+static void commit_stop(aidb_t* aidb) {
+    uv_mutex_lock(&aidb->lock);
+    aidb->stopping = 1;
+    uv_cond_signal(&aidb->commit_cond);
+    uv_mutex_unlock(&aidb->lock);
+    uv_thread_join(&aidb->committer);
+    uv_cond_destroy(&aidb->done_cond);
+    uv_cond_destroy(&aidb->commit_cond);
+    uv_mutex_destroy(&aidb->lock);
+    aidb->group = 0;
+    aidb->stopping = 0;
+    seek_file(aidb->fp, aidb->size);
+}
+
+AIDB_ERROR aidb_sync(aidb_t* aidb) {
+    if (!aidb->fp) return AIDB_ERR_OPEN;
+    if (!aidb->group) {
+        aidb_flush(aidb);
+    } else {
+        uv_mutex_lock(&aidb->lock);
+        uint64_t target = aidb->size;
+        if (aidb->committed < target) {
+            aidb->sync_req = 1;
+            uv_cond_signal(&aidb->commit_cond);
+            while (aidb->committed < target)
+                uv_cond_wait(&aidb->done_cond, &aidb->lock);
+        }
+        uv_mutex_unlock(&aidb->lock);
+    }
+    return aidb->failed ? AIDB_ERR_WRITE : AIDB_OK;
+}
+
+/** 按记录偏移排序, 即写入顺序 */
+static int slot_cmp(const void* v1, const void* v2) {
+    uint64_t o1 = ((const aidb_slot_t*) v1)->offset, o2 = ((const aidb_slot_t*) v2)->offset;
+    return o1 < o2 ? -1 : o1 > o2;
+}
+
+/** 从指定位置开始逐条解密记录生成索引条目 */
+static _Bool scan_entries(aidb_t* aidb, uint64_t from) {
+    for (uint64_t off = from; off < aidb->end; ) {
+        const aidb_record_t* rec = (const aidb_record_t*) (aidb->map + off);
+        // 跳过已删除的记录、段标记、索引块和提交标记
+        if (!rec->deleted || rec->deleted == AIDB_TOMBSTONE) {
+            const uint8_t* plain = decrypt_record(aidb, off);
+            if (!plain) return 0;
+            const char* key;
+            uint32_t key_len = record_key(aidb, rec, plain, &key);
+            if (key_len && !push_entry(aidb, off, key_hash(key, key_len))) return 0;
+        }
+        off += sizeof(aidb_record_t) + rec->capacity;
+    }
+    return 1;
+}
+
+/** 恢复打开的文件的索引条目, 最后一个索引块的条目直接取哈希槽, 之后的记录逐条解密生成 */
+static _Bool restore_entries(aidb_t* aidb) {
+    if (aidb->index) {
+        for (uint32_t i = 0; i <= aidb->index_mask; ++i) {
+            const aidb_slot_t* slot = &aidb->index[i];
+            if (slot->offset && !push_entry(aidb, slot->offset, slot->hash)) return 0;
+        }
+        qsort(aidb->entries, aidb->entry_count, sizeof(aidb_slot_t), slot_cmp);
+    }
+    return scan_entries(aidb, aidb->index_end);
+}
+
+AIDB_ERROR aidb_append(aidb_t* aidb, const char* filename, const char* key, aidb_key_func key_func) {
+    // 打开之前获取写入锁, 打开时确定的记录区结束位置之后不会再有其它句柄写入
+    aidb_lock_t lock;
+    AIDB_ERROR ret_code = lock_writer(filename, &lock);
+    if (ret_code != AIDB_OK) {
+        memset(aidb, 0, sizeof(aidb_t));
+        return ret_code;
+    }
+    ret_code = aidb_open(aidb, filename, key);
+    if (ret_code != AIDB_OK) {
+        unlock_writer(lock);
+        return ret_code;
+    }
+    aidb->lock_file = lock;
+    aidb->locked = 1;
+
+    aidb->key_func = key_func;
+    if (key_func && !restore_entries(aidb)) {
+        aidb_close(aidb);
+        return AIDB_ERR_READ;
+    }
+    uint64_t file_size = aidb->size;
+    unmap_file(aidb->map, aidb->size);
+    aidb->map = NULL;
+    aidb->index = NULL;
+    aidb->plain_off = 0;
+    aidb->size = aidb->end;
+    aidb->commit_start = aidb->end;
+    aidb->password = strdup(key);
+    aes_init(&aidb->aes, AES_ENCRYPT, aidb->key, 128, IV);
+
+    aidb->fp = fopen(filename, "rb+");
+    if (!aidb->fp) {
+        aidb_close(aidb);
+        return AIDB_ERR_OPEN;
+    }
+    // 只截断最后一个提交标记之后未完成的内容, 只读句柄的记录区不包括这部分, 已提交的内容保持不变
+    if ((file_size > aidb->size && (!truncate_file(aidb->fp, aidb->size) || !sync_file(aidb->fp)))
+            || !seek_file(aidb->fp, aidb->size)) {
+        aidb_close(aidb);
+        return AIDB_ERR_WRITE;
+    }
+    return AIDB_OK;
+}
+
+/** 只读句柄重新映射文件, 继续解析之后新提交的内容, 之前的内容在只追加的文件中不会改变 */
+static AIDB_ERROR load_more(aidb_t* aidb) {
+    uint64_t size, index_pos = aidb->index ? (uint64_t) ((const uint8_t*) aidb->index - aidb->map) : 0;
+    const uint8_t* map = map_file(aidb->filename, &size);
+    if (!map) return AIDB_ERR_OPEN;
+    unmap_file(aidb->map, aidb->size);
+    aidb->map = map;
+    aidb->size = size;
+    if (index_pos) aidb->index = (const aidb_slot_t*) (map + index_pos);
+    return load_units(aidb);
+}
+
+/** 按写入顺序复制from之后的记录, 包括删除标记, 用于复制压缩期间新提交的内容 */
+static void copy_records(aidb_t* src, uint64_t from, aidb_t* dst) {
+    for (uint64_t off = from; off < src->end && !dst->failed; ) {
+        const aidb_record_t* rec = (const aidb_record_t*) (src->map + off);
+        if (!rec->deleted || rec->deleted == AIDB_TOMBSTONE) {
+            const uint8_t* plain = decrypt_record(src, off);
+            if (!plain) {
+                dst->failed = 1;
+                break;
+            }
+            if (rec->deleted) aidb_delete(dst, plain, rec->size);
+            else aidb_put(dst, plain, rec->size);
+        }
+        off += sizeof(aidb_record_t) + rec->capacity;
+    }
+}
+
+/** 只保留未删除且是同一个键最后写入的记录 */
+static AIDB_ERROR compact_records(aidb_t* src, aidb_t* dst) {
+    uint8_t* buf = NULL;
+    uint32_t buf_cap = 0;
+    aidb_iterator_t it, latest;
+    aidb_foreach(src, &it);
+    for (uint32_t len; (len = aidb_next(&it)); ) {
+        if (len > buf_cap) {
+            free(buf);
+            buf_cap = len;
+            buf = malloc(buf_cap);
+            if (!buf) return AIDB_ERR_READ;
+        }
+        aidb_fetch(&it, buf, len);
+        if (src->key_func) {
+            const char* k;
+            uint32_t klen = src->key_func((const char*) buf, len, &k);
+            if (klen && (!aidb_get(src, &latest, k, klen) || latest.offset != it.offset)) continue;
+        }
+        aidb_put(dst, buf, len);
+    }
+    free(buf);
+    return dst->failed ? AIDB_ERR_WRITE : AIDB_OK;
+}
+
+/** 临时文件改名为原文件, 同一文件系统内的改名是原子操作, 已打开的只读映射仍然指向原文件的内容 */
+static _Bool replace_file(const char* tmp, const char* filename) {
+#ifdef _WIN32
+    return MoveFileExA(tmp, filename, MOVEFILE_REPLACE_EXISTING);
+#else
+    return !rename(tmp, filename);
+#endif
+}
+
+AIDB_ERROR aidb_compact(aidb_t* aidb) {
+    if (!aidb->fp) return AIDB_ERR_OPEN;
+    // 已写入的内容先提交, 快照包括到目前为止的全部记录
+    if (aidb_sync(aidb) != AIDB_OK) return AIDB_ERR_WRITE;
+
+    aidb_t src, dst;
+    AIDB_ERROR ret_code = aidb_open(&src, aidb->filename, aidb->password);
+    if (ret_code != AIDB_OK) return ret_code;
+    aidb_set_key(&src, aidb->key_func);
+
+    size_t name_len = strlen(aidb->filename);
+    char tmp[name_len + sizeof(AIDB_COMPACT_SUFFIX)];
+    memcpy(tmp, aidb->filename, name_len);
+    memcpy(tmp + name_len, AIDB_COMPACT_SUFFIX, sizeof(AIDB_COMPACT_SUFFIX));
+    ret_code = create_file(&dst, tmp, aidb->password);
+    if (ret_code != AIDB_OK) {
+        aidb_close(&src);
+        return ret_code;
+    }
+    dst.key_func = aidb->key_func;
+
+    // 快照的压缩和第一次追赶不加锁, 组提交的其它线程继续写入原文件
+    ret_code = compact_records(&src, &dst);
+    uint64_t from = src.end;
+    if (ret_code == AIDB_OK && (ret_code = load_more(&src)) == AIDB_OK)
+        copy_records(&src, from, &dst);
+
+    // 加锁后等待已写入的内容全部提交, 只需要复制第一次追赶之后的少量记录
+    if (aidb->group) {
+        uv_mutex_lock(&aidb->lock);
+        while (aidb->committed < aidb->size) {
+            aidb->sync_req = 1;
+            uv_cond_signal(&aidb->commit_cond);
+            uv_cond_wait(&aidb->done_cond, &aidb->lock);
+        }
+    }
+    from = src.end;
+    if (ret_code == AIDB_OK && (ret_code = load_more(&src)) == AIDB_OK) {
+        copy_records(&src, from, &dst);
+        // 文件中已提交的内容应该正好是写入句柄写入的全部内容
+        if (src.end != aidb->size) ret_code = AIDB_ERR_FORMAT;
+    }
+    if (aidb->failed) ret_code = AIDB_ERR_WRITE;
+    aidb_close(&src);
+
+    if (ret_code == AIDB_OK) {
+        aidb_flush(&dst);
+        if (dst.failed) ret_code = AIDB_ERR_WRITE;
+    }
+    // 写入句柄改为使用压缩后的文件和索引条目, 原来的条目由dst释放
+    uint64_t size = dst.size;
+    uint32_t count = dst.count;
+    if (ret_code == AIDB_OK) {
+        aidb_slot_t* entries = aidb->entries;
+        uint32_t entry_count = aidb->entry_count, entry_cap = aidb->entry_cap;
+        aidb->entries = dst.entries;
+        aidb->entry_count = dst.entry_count;
+        aidb->entry_cap = dst.entry_cap;
+        dst.entries = entries;
+        dst.entry_count = entry_count;
+        dst.entry_cap = entry_cap;
+    }
+    aidb_close(&dst);
+
+    FILE* fp = NULL;
+    if (ret_code == AIDB_OK && !replace_file(tmp, aidb->filename))
+        ret_code = AIDB_ERR_WRITE;
+    if (ret_code != AIDB_OK) {
+        remove(tmp);
+    } else if (!(fp = fopen(aidb->filename, "rb+")) || !seek_file(fp, size)) {
+        // 压缩后的文件已经替换原文件, 写入句柄无法继续使用
+        if (fp) fclose(fp);
+        aidb->failed = 1;
+        ret_code = AIDB_ERR_OPEN;
+    } else {
+        fclose(aidb->fp);
+        aidb->fp = fp;
+        aidb->size = aidb->commit_start = aidb->committed = size;
+        aidb->count = count;
+        aidb->modified = 0;
+    }
+    if (aidb->group) uv_mutex_unlock(&aidb->lock);
+    return ret_code;
+}
+
+AIDB_ERROR aidb_compact_file(const char* filename, const char* key, aidb_key_func key_func) {
+    aidb_t aidb;
+    AIDB_ERROR ret_code = aidb_append(&aidb, filename, key, key_func);
+    if (ret_code != AIDB_OK) return ret_code;
+    ret_code = aidb_compact(&aidb);
+    aidb_close(&aidb);
+    return ret_code;
+}
+
+#ifdef TEST_AIDB
+typedef struct { int count, errors, limit; } load_arg_t;
+
+static _Bool on_test_read(void* param, const char* src, uint32_t len) {
+    load_arg_t* arg = param;
+    char rec[8192];
+    int i = arg->count++;
+    int n = snprintf(rec, sizeof(rec), "record %d ", i);
+    memset(rec + n, 'a' + i % 26, i * 7 % 5000);
+    if (len != (uint32_t) (n + i * 7 % 5000) || memcmp(src, rec, len)) ++arg->errors;
+    return arg->count != arg->limit;
+}
+
+static uint32_t test_key(const char* src, uint32_t len, const char** key) {
+    if (len < 7) return 0;
+    const char* p = memchr(src + 7, ' ', len - 7);
+    *key = src;
+    return p ? (uint32_t) (p - src) : len;
+}
+
+typedef struct { aidb_t* db; int from; } put_arg_t;
+
+static void test_put_thread(void* param) {
+    put_arg_t* arg = param;
+    char rec[64];
+    for (int i = arg->from; i < arg->from + 250; ++i) {
+        int n = snprintf(rec, sizeof(rec), "record %d %d", i, i * 3);
+        aidb_put(arg->db, rec, n);
+        if (i % 50 == 0) aidb_sync(arg->db);
+    }
+}
+
+static int test_get(aidb_t* db, int i, const char* expect) {
+    char key[32], buf[64];
+    aidb_iterator_t it;
+    int kn = snprintf(key, sizeof(key), "record %d", i);
+    uint32_t len = aidb_get(db, &it, key, kn);
+    if (!expect) return len != 0;
+    return len != strlen(expect) || aidb_fetch(&it, buf, sizeof(buf)) != len || memcmp(buf, expect, len);
+}
+
+static _Bool on_test_finish(void* param) {
+    ((load_arg_t*) param)->limit = -1;
+    return 1;
+}
+
+/** 修改文件中的一个字节, 模拟损坏 */
+static void test_flip(const char* file, uint64_t off) {
+    FILE* fp = fopen(file, "rb+");
+    seek_file(fp, off);
+    int c = fgetc(fp);
+    seek_file(fp, off);
+    fputc(c ^ 0x5a, fp);
+    fclose(fp);
+}
+
+/** 统计文件中的提交标记数 */
+static int test_commits(const char* file) {
+    FILE* fp = fopen(file, "rb");
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t* data = malloc(size);
+    int count = 0;
+    if (fread(data, 1, size, fp) == (size_t) size) {
+        for (long pos = sizeof(aidb_header_t); pos + (long) AIDB_COMMIT_SIZE <= size; ++pos) {
+            count += check_commit((const aidb_record_t*) (data + pos), 0);
+        }
+    }
+    free(data);
+    fclose(fp);
+    return count;
+}
+
+int main() {
+    const char* file = "test.aidb";
+    char buf[8192], rec[8192];
+    aidb_t db;
+    if (aidb_create(&db, file, "password") != AIDB_OK) return 1;
+    for (int i = 0; i < 1000; ++i) {
+        int n = snprintf(rec, sizeof(rec), "record %d ", i);
+        memset(rec + n, 'a' + i % 26, i * 7 % 5000);
+        aidb_put(&db, rec, n + i * 7 % 5000);
+    }
+    aidb_close(&db);
+
+    printf("check: %d, wrong password: %d\n", aidb_check(file, "password"), aidb_check(file, "wrong"));
+    AIDB_ERROR err = aidb_open(&db, file, "password");
+    printf("open: %d, count: %u\n", err, aidb_record_count(&db));
+    aidb_advise(&db, AIDB_ADVISE_SEQUENTIAL);
+
+    aidb_iterator_t it;
+    int errors = 0, i = 0;
+    aidb_foreach(&db, &it);
+    for (uint32_t len; (len = aidb_next(&it)); ++i) {
+        int n = snprintf(rec, sizeof(rec), "record %d ", i);
+        memset(rec + n, 'a' + i % 26, i * 7 % 5000);
+        if (len != (uint32_t) (n + i * 7 % 5000) || aidb_fetch(&it, buf, sizeof(buf)) != len || memcmp(buf, rec, len))
+            ++errors;
+    }
+    // 反向遍历一条, 截断读取
+    aidb_foreach(&db, &it);
+    aidb_next(&it);
+    aidb_next(&it);
+    if (aidb_prev(&it) != 9 || aidb_fetch(&it, buf, 6) != 6 || memcmp(buf, "record", 6)) ++errors;
+    if (aidb_prev(&it) != 0) ++errors;
+    printf("read %d records, %s, %d errors\n", i, errors ? "FAIL" : "OK", errors);
+
+    load_arg_t arg = { 0, 0, 0 };
+    err = aidb_load(&db, &arg, on_test_read, on_test_finish);
+    printf("load: %d, %d records, %d errors, finished: %d\n", err, arg.count, arg.errors, arg.limit == -1);
+    errors += arg.errors + (arg.count != 1000) + (arg.limit != -1);
+    load_arg_t stop = { 0, 0, 10 };
+    err = aidb_load(&db, &stop, on_test_read, on_test_finish);
+    printf("load with stop: %d, %d records, finished: %d\n", err, stop.count, stop.limit == -1);
+    errors += stop.errors + (stop.count != 10) + (stop.limit == -1);
+
+    // 没有索引块的文件设置键提取函数时生成内存索引
+    aidb_set_key(&db, test_key);
+    uint32_t len = aidb_get(&db, &it, "record 500", 10);
+    if (len != 11 + 500 * 7 % 5000 || aidb_fetch(&it, buf, sizeof(buf)) != len || memcmp(buf, "record 500 ", 11)) ++errors;
+    aidb_close(&db);
+
+    // 带索引的文件
+    const char* file2 = "test2.aidb";
+    aidb_create(&db, file2, "password");
+    aidb_set_key(&db, test_key);
+    for (i = 0; i < 1000; ++i) {
+        int n = snprintf(rec, sizeof(rec), "record %d %d", i, i * 3);
+        aidb_put(&db, rec, n);
+        // 中途写入一次索引, 后续记录覆盖
+        if (i == 500) aidb_flush(&db);
+    }
+    aidb_put(&db, "record 5 new", 12);
+    aidb_close(&db);
+    err = aidb_open(&db, file2, "password");
+    aidb_set_key(&db, test_key);
+    int get_errors = 0;
+    for (i = 0; i < 1000; ++i) {
+        char key[32], expect[32];
+        int kn = snprintf(key, sizeof(key), "record %d", i);
+        int n = i == 5 ? snprintf(expect, sizeof(expect), "record 5 new") : snprintf(expect, sizeof(expect), "record %d %d", i, i * 3);
+        len = aidb_get(&db, &it, key, kn);
+        if (len != (uint32_t) n || aidb_fetch(&it, buf, sizeof(buf)) != len || memcmp(buf, expect, n)) ++get_errors;
+    }
+    if (aidb_get(&db, &it, "record 1000", 11) || aidb_get(&db, &it, "nothing", 7)) ++get_errors;
+    load_arg_t cnt = { 0, 0, 0 };
+    aidb_load(&db, &cnt, on_test_read, on_test_finish);
+    printf("indexed open: %d, count: %u, loaded: %d, get errors: %d\n", err, aidb_record_count(&db), cnt.count, get_errors);
+    errors += get_errors + (aidb_record_count(&db) != 1001) + (cnt.count != 1001);
+    aidb_close(&db);
+
+    // 追加写入, 多线程组提交
+    err = aidb_append(&db, file2, "password", test_key);
+    aidb_commit_start(&db, 5);
+    uv_thread_t threads[4];
+    put_arg_t put_args[4];
+    for (i = 0; i < 4; ++i) {
+        put_args[i].db = &db;
+        put_args[i].from = 1000 + i * 250;
+        uv_thread_create(&threads[i], test_put_thread, &put_args[i]);
+    }
+    for (i = 0; i < 4; ++i) uv_thread_join(&threads[i]);
+    aidb_delete(&db, "record 7", 8);
+    aidb_close(&db);
+    printf("append: %d, check: %d\n", err, aidb_check(file2, "password"));
+
+    get_errors = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        err = aidb_open(&db, file2, "password");
+        aidb_set_key(&db, test_key);
+        for (i = 0; i < 2000; ++i) {
+            char expect[32];
+            snprintf(expect, sizeof(expect), "record %d %d", i, i * 3);
+            get_errors += test_get(&db, i, i == 5 ? "record 5 new" : i == 7 ? NULL : expect);
+        }
+        uint32_t expect_count = pass ? 1999 : 2001;
+        printf("%s: %d, count: %u, size: %llu, get errors: %d\n", pass ? "compacted" : "appended", err,
+            aidb_record_count(&db), (unsigned long long) db.size, get_errors);
+        errors += aidb_record_count(&db) != expect_count;
+        aidb_close(&db);
+        if (!pass) printf("compact: %d\n", aidb_compact_file(file2, "password", test_key));
+    }
+    errors += get_errors;
+
+    // 追加写入期间只读句柄的映射不受影响
+    aidb_t rd;
+    aidb_open(&rd, file2, "password");
+    aidb_set_key(&rd, test_key);
+    uint64_t committed = rd.end;
+    aidb_append(&db, file2, "password", test_key);
+    aidb_put(&db, "record 5 torn", 13);
+    aidb_close(&db);
+    get_errors = test_get(&rd, 5, "record 5 new") + test_get(&rd, 1999, "record 1999 5997");
+    get_errors += aidb_record_count(&rd) != 1999;
+    aidb_close(&rd);
+
+    // 写入中途崩溃, 最后一次提交不完整时回退到上一次提交, 追加写入时截断未完成的内容
+    FILE* fp = fopen(file2, "rb+");
+    fseek(fp, 0, SEEK_END);
+    truncate_file(fp, (uint64_t) ftell(fp) - 3);
+    fclose(fp);
+    AIDB_ERROR torn = aidb_check(file2, "password");
+    err = aidb_open(&db, file2, "password");
+    aidb_set_key(&db, test_key);
+    get_errors += db.end != committed || test_get(&db, 5, "record 5 new");
+    aidb_close(&db);
+    err |= aidb_append(&db, file2, "password", test_key);
+    aidb_put(&db, "record 5 torn", 13);
+    aidb_close(&db);
+    AIDB_ERROR fixed = aidb_check(file2, "password");
+    err |= aidb_open(&db, file2, "password");
+    aidb_set_key(&db, test_key);
+    get_errors += test_get(&db, 5, "record 5 torn");
+    aidb_close(&db);
+
+    // 最后一次提交有提交标记但段内容没有完整写入, 回退到上一次提交
+    test_flip(file2, committed + AIDB_MARKER_SIZE + sizeof(aidb_record_t));
+    AIDB_ERROR rolled = aidb_check(file2, "password");
+    err |= aidb_open(&db, file2, "password");
+    aidb_set_key(&db, test_key);
+    get_errors += db.end != committed || test_get(&db, 5, "record 5 new");
+    aidb_close(&db);
+    // 之前的提交出错表示文件损坏, 不能回退
+    test_flip(file2, sizeof(aidb_header_t) + AIDB_MARKER_SIZE + sizeof(aidb_record_t));
+    AIDB_ERROR corrupted = aidb_open(&db, file2, "password");
+    printf("torn: %d, fixed: %d, rolled back: %d, corrupted: %d, get errors: %d\n", torn, fixed, rolled, corrupted, get_errors);
+    errors += get_errors + (err != AIDB_OK) + (torn != AIDB_ERR_FORMAT) + (fixed != AIDB_OK)
+        + (rolled != AIDB_ERR_CRC32) + (corrupted != AIDB_ERR_CRC32);
+    remove(file2);
+
+    // 持续写入时按提交间隔批量提交, 不因每次写入提前提交
+    aidb_create(&db, file2, "password");
+    aidb_commit_start(&db, 50);
+    uint64_t begin = uv_hrtime();
+    for (i = 0; i < 100; ++i) {
+        int n = snprintf(rec, sizeof(rec), "record %d %d", i, i * 3);
+        aidb_put(&db, rec, n);
+        uv_sleep(2);
+    }
+    aidb_close(&db);
+    int commits = test_commits(file2);
+    int expect_commits = (int) ((uv_hrtime() - begin) / 50000000) + 3;
+    printf("steady commits: %d, expect at most: %d\n", commits, expect_commits);
+    errors += commits > expect_commits || commits < 1;
+    remove(file2);
+
+    // 组提交期间通过写入句柄压缩, 其它线程同时写入, 已打开的只读句柄不受影响, 不能再有其它写入句柄
+    const char* file4 = "test4.aidb";
+    aidb_create(&db, file4, "password");
+    aidb_set_key(&db, test_key);
+    for (i = 0; i < 2000; ++i) {
+        int n = snprintf(rec, sizeof(rec), "record %d old", i % 1000);
+        aidb_put(&db, rec, n);
+    }
+    aidb_flush(&db);
+    aidb_open(&rd, file4, "password");
+    aidb_set_key(&rd, test_key);
+    aidb_commit_start(&db, 2);
+    aidb_t other;
+    AIDB_ERROR locked = aidb_append(&other, file4, "password", test_key);
+    locked |= aidb_compact_file(file4, "password", test_key) << 8;
+    for (i = 0; i < 4; ++i) {
+        put_args[i].from = i * 250;
+        uv_thread_create(&threads[i], test_put_thread, &put_args[i]);
+    }
+    err = aidb_compact(&db);
+    for (i = 0; i < 4; ++i) uv_thread_join(&threads[i]);
+    aidb_delete(&db, "record 7", 8);
+    aidb_close(&db);
+    get_errors = test_get(&rd, 5, "record 5 old");
+    aidb_close(&rd);
+    err |= aidb_check(file4, "password");
+    err |= aidb_open(&db, file4, "password");
+    aidb_set_key(&db, test_key);
+    for (i = 0; i < 1000; ++i) {
+        char expect[32];
+        snprintf(expect, sizeof(expect), "record %d %d", i, i * 3);
+        get_errors += test_get(&db, i, i == 7 ? NULL : expect);
+    }
+    // 压缩前的旧记录全部去掉, 压缩期间写入的记录只有一份
+    printf("compact with writers: %d, locked: %x, count: %u, get errors: %d\n", err, locked, aidb_record_count(&db), get_errors);
+    errors += get_errors + (err != AIDB_OK) + (locked != (AIDB_ERR_LOCKED | AIDB_ERR_LOCKED << 8))
+        + (aidb_record_count(&db) > 1000 + 1000);
+    aidb_close(&db);
+    remove(file4);
+
+    aidb_open(&db, file, "password");
+    printf("segments: %u\n", db.seg_count);
+    errors += db.seg_count < 2;
+    aidb_close(&db);
+
+    // 旧格式(整个文件一个CBC流)的导入, 行数足够多以跨越多个读取块
+    const char* file3 = "test3.aidb";
+    const char* legacy = "test3.xml.aidb";
+    aes_ctx_t aes;
+    uint8_t k[16], out[4096 + 16];
+    gen_key("password", k);
+    aes_init(&aes, AES_ENCRYPT, k, 128, IV);
+    fp = fopen(legacy, "wb");
+    for (i = 0; i < 100000; ++i) {
+        int n = snprintf(rec, sizeof(rec), i == 99999 ? "record %d %d" : "record %d %d\n", i, i * 3);
+        fwrite(out, 1, aes_update(&aes, rec, n, out), fp);
+    }
+    fwrite(out, 1, aes_final(&aes, "", 0, out), fp);
+    fclose(fp);
+    aidb_create(&db, file3, "password");
+    aidb_set_key(&db, test_key);
+    err = aidb_import(&db, legacy, "password");
+    aidb_close(&db);
+    get_errors = 0;
+    err |= aidb_open(&db, file3, "password");
+    aidb_set_key(&db, test_key);
+    for (i = 0; i < 100000; i += 99) {
+        char expect[32];
+        snprintf(expect, sizeof(expect), "record %d %d", i, i * 3);
+        get_errors += test_get(&db, i, expect);
+    }
+    get_errors += test_get(&db, 99999, "record 99999 299997");
+    get_errors += aidb_record_count(&db) != 100000;
+    aidb_close(&db);
+    load_arg_t wrong = { 0, 0, 0 };
+    AIDB_ERROR bad = aidb_load_legacy(legacy, "wrong", &wrong, on_test_read, NULL);
+    printf("legacy import: %d, wrong key: %d, get errors: %d\n", err, bad, get_errors);
+    errors += get_errors + (err != AIDB_OK) + (bad == AIDB_OK);
+    remove(legacy);
+    remove(file3);
+
+    // 损坏的文件
+    fp = fopen(file, "rb+");
+    fseek(fp, 1000, SEEK_SET);
+    fputc(0, fp);
+    fclose(fp);
+    printf("corrupted check: %d\n", aidb_check(file, "password"));
+    remove(file);
+    // 锁文件保留在磁盘上, 测试结束时删除
+    const char* locks[] = { "test.aidb.lock", "test2.aidb.lock", "test3.aidb.lock", "test4.aidb.lock" };
+    for (i = 0; i < 4; ++i) remove(locks[i]);
+    return errors != 0;
+}
+#endif
@@ -3,6 +3,7 @@
 #define __AIDB_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,14 +20,32 @@ typedef enum {
     AIDB_ERR_PWD,       // 口令校验错误
     AIDB_ERR_WRITE,     // 写入文件错误
     AIDB_ERR_READ,      // 读取文件错误, 无法读取预期的长度
+    AIDB_ERR_FORMAT,    // 记录结构错误, 记录长度超出文件范围
+    AIDB_ERR_LOCKED,    // 已有其它句柄在写入该文件
 } AIDB_ERROR;
 
+// 文件映射的访问方式提示, 对应madvise的参数
+typedef enum {
+    AIDB_ADVISE_NORMAL,     // 缺省方式
+    AIDB_ADVISE_SEQUENTIAL, // 顺序扫描, 内核加大预读并尽快回收已读过的页
+    AIDB_ADVISE_RANDOM,     // 随机访问, 内核不做预读
+    AIDB_ADVISE_WILLNEED,   // 即将访问, 内核提前读入
+    AIDB_ADVISE_DONTNEED,   // 暂不访问, 已读入的页不再计入进程的常驻内存
+} AIDB_ADVISE;
+
 // 内部实现的结构，隐藏实现细节
 // extern struct aidb_t;
 // extern struct aidb_iterator_t;
 
 typedef _Bool (*aidb_read_func) (void* param, const char* src, uint32_t len);
 typedef _Bool (*aidb_read_finish_func) (void* param);
+/** 键提取函数, 从记录明文中找出记录的键
+ * @param src       记录内容
+ * @param len       记录长度
+ * @param key       输出参数, 键的地址, 指向src内部
+ * @return          键的长度, 返回0表示该记录没有键, 不加入索引
+*/
+typedef uint32_t (*aidb_key_func) (const char* src, uint32_t len, const char** key);
 
 // 定义aidb_t类型
 typedef struct aidb_t aidb_t;
@@ -40,36 +59,135 @@ extern size_t aidb_sizeof();
 /** 获取aidb_iterator_t迭代器内部结构的长度(字节为单位), 以便于用户自行分配aidb_iterator_t类型的内存 */
 extern size_t aidb_iterator_sizeof();
 
+/** 校验aidb文件, 包括文件头、口令和CRC32, 多个线程同时校验各段的CRC32C, 校验过程不把文件读入内存.
+ *  文件末尾有未完成的提交时(写入中途崩溃或者正在写入)返回AIDB_ERR_FORMAT或AIDB_ERR_CRC32, aidb_open仍然可以打开
+ * @param filename  数据库文件名
+ * @param key       秘钥
+ * @return          成功返回AIDB_OK, 失败返回错误代码, 参见AIDB_ERROR定义
+*/
 extern AIDB_ERROR aidb_check(const char* filename, const char* key);
 
+/** 流式加载全部记录, 读取线程按块读入文件的同时调用线程解密已读入的块, 读取与解密并行,
+ *  每条记录解密完成后立即回调, 内存占用为几个读取块加上最大的一条记录
+ * @param aidb      aidb_open打开的aidb句柄, 加载期间不能在其它线程使用该句柄
+ * @param param     回调函数的用户参数
+ * @param on_read   记录回调函数, src只在回调期间有效, 返回false时停止加载
+ * @param on_finish 全部记录加载完成后的回调函数, 可以为NULL, 出错或被on_read停止时不调用
+ * @return          成功返回AIDB_OK, 失败返回错误代码, 参见AIDB_ERROR定义
+*/
 extern AIDB_ERROR aidb_load(aidb_t* aidb, void* param, aidb_read_func on_read, aidb_read_finish_func on_finish);
 
-/** 创建aidb数据库
+/** 流式加载旧格式的文件, 旧格式整个文件是一个AES-128-CBC流, 明文每行作为一条记录(不包括换行符),
+ *  读取与解密并行, 内存占用为几个读取块加上最长的一行
+ * @param filename  旧格式的文件名
+ * @param key       秘钥
+ * @param param     回调函数的用户参数
+ * @param on_read   记录回调函数, src只在回调期间有效, 返回false时停止加载
+ * @param on_finish 全部记录加载完成后的回调函数, 可以为NULL, 出错或被on_read停止时不调用
+ * @return          成功返回AIDB_OK, 秘钥错误时返回AIDB_ERR_PWD, 失败返回错误代码, 参见AIDB_ERROR定义
+*/
+extern AIDB_ERROR aidb_load_legacy(const char* filename, const char* key, void* param, aidb_read_func on_read, aidb_read_finish_func on_finish);
+
+/** 把旧格式文件的全部记录导入到aidb_create或aidb_append打开的句柄, 用于旧格式文件的一次性转换
+ * @param aidb      aidb_create或aidb_append打开的aidb句柄
+ * @param filename  旧格式的文件名
+ * @param key       旧格式文件的秘钥
+ * @return          成功返回AIDB_OK, 失败返回错误代码, 参见AIDB_ERROR定义
+*/
+extern AIDB_ERROR aidb_import(aidb_t* aidb, const char* filename, const char* key);
+
+/** 创建aidb数据库, 同一个文件同时只能有一个写入句柄, 通过文件名加".lock"的锁文件保证
  * @param aidb      用户分配的aidb句柄地址
  * @param filename  数据库文件名
- * @param key       秘钥 
+ * @param key       秘钥
  * @return          成功返回AIDB_OK, 失败返回错误代码, 参见AIDB_ERROR定义
 */
 extern AIDB_ERROR aidb_create(aidb_t* aidb, const char* filename, const char* key);
 
-/** 打开aidb数据库
+/** 打开已有的aidb数据库追加记录, 记录追加在文件末尾, 已写入的内容不会改写, 关闭时在记录之后写入新的索引.
+ *  文件末尾有未完成的提交时先截断, 同一个文件同时只能有一个追加写入的句柄
+ * @param aidb      用户分配的aidb句柄地址
+ * @param filename  数据库文件名
+ * @param key       秘钥
+ * @param key_func  键提取函数, 为NULL时不建立索引
+ * @return          成功返回AIDB_OK, 失败返回错误代码, 参见AIDB_ERROR定义
+*/
+extern AIDB_ERROR aidb_append(aidb_t* aidb, const char* filename, const char* key, aidb_key_func key_func);
+
+/** 开启组提交. 开启后aidb_put和aidb_delete可以在多个线程中同时调用, 只写入内存缓冲区后立即返回,
+ *  提交线程每隔interval_ms毫秒把期间的所有写入合并为一次写入和一次fsync
+ * @param aidb          aidb_create或aidb_append打开的aidb句柄
+ * @param interval_ms   提交间隔, 毫秒, 间隔越大合并的写入越多, 单次写入的延迟也越大
+ * @return              成功返回AIDB_OK, 失败返回错误代码, 参见AIDB_ERROR定义
+*/
+extern AIDB_ERROR aidb_commit_start(aidb_t* aidb, uint32_t interval_ms);
+
+/** 等待之前的写入全部写入磁盘, 组提交时同时等待的多个调用者共用一次fsync
+ * @param aidb      aidb句柄
+ * @return          成功返回AIDB_OK, 之前有写入失败时返回AIDB_ERR_WRITE
+*/
+extern AIDB_ERROR aidb_sync(aidb_t* aidb);
+
+/** 通过写入句柄压缩aidb数据库, 只保留未删除且是同一个键最后写入的记录, 写入临时文件后原子替换原文件.
+ *  开启组提交时其它线程可以继续写入, 压缩快照期间的写入随后复制到新文件, 只在最后复制少量记录和替换文件时持有提交锁;
+ *  完成后写入句柄继续写入新文件. 已打开的只读句柄不受影响, 继续访问原来的内容.
+ *  压缩需要读写整个文件, 应该在后台线程中调用, 例如uv_queue_work
+ * @param aidb      aidb_create或aidb_append打开的aidb句柄, 使用句柄的键提取函数, 为NULL时只去掉已删除的记录
+ * @return          成功返回AIDB_OK, 失败返回错误代码, 参见AIDB_ERROR定义
+*/
+extern AIDB_ERROR aidb_compact(aidb_t* aidb);
+
+/** 没有写入句柄时压缩aidb数据库, 以aidb_append打开后调用aidb_compact, 已有其它写入句柄时返回AIDB_ERR_LOCKED
+ * @param filename  数据库文件名
+ * @param key       秘钥
+ * @param key_func  键提取函数, 为NULL时只去掉已删除的记录
+ * @return          成功返回AIDB_OK, 失败返回错误代码, 参见AIDB_ERROR定义
+*/
+extern AIDB_ERROR aidb_compact_file(const char* filename, const char* key, aidb_key_func key_func);
+
+/** 只读打开aidb数据库, 文件内容映射到内存, 按需由内核读入,
+ *  文件按段保存, 每段有自己的随机数和CRC32C, 打开时多个线程同时校验, 任意记录可以单独解密.
+ *  打开的内容到最后一个完整的提交为止, 写入中途崩溃时回退到上一次提交, 可以与追加写入的句柄同时使用
  * @param aidb      用户分配的aidb句柄地址
  * @param filename  数据库文件名
- * @param key       秘钥 
+ * @param key       秘钥
  * @return          成功返回AIDB_OK, 失败返回错误代码, 参见AIDB_ERROR定义
 */
 extern AIDB_ERROR aidb_open(aidb_t* aidb, const char* filename, const char* key);
 
+/** 复制只读句柄, 新句柄与源句柄共用文件映射和索引, 有自己的解密上下文, 可以在另一个线程中使用.
+ *  新句柄必须在源句柄之前关闭
+ * @param dst       用户分配的aidb句柄地址
+ * @param src       aidb_open打开的aidb句柄
+ * @return          成功返回AIDB_OK, 失败返回错误代码, 参见AIDB_ERROR定义
+*/
+extern AIDB_ERROR aidb_clone(aidb_t* dst, const aidb_t* src);
+
 /** 关闭aidb数据库
  * @param aidb      aidb句柄
 */
 extern void aidb_close(aidb_t* aidb);
 
-/** 缓存内容立即写入数据库
+/** 缓存内容立即写入数据库并同步到磁盘, 组提交时等同于aidb_sync.
+ *  设置了键提取函数时每次写入一个新的索引块, 之前的索引块成为无用的内容, 压缩时去掉
  * @param aidb      aidb句柄
 */
 extern void aidb_flush(aidb_t* aidb);
 
+/** 设置键提取函数. 创建时必须在第一次aidb_put之前设置, 关闭时在记录之后写入键索引;
+ *  打开时设置后aidb_get按索引查找, 最后一次写入索引之后的记录在设置时解密生成内存索引,
+ *  aidb_clone复制的句柄共用源句柄的内存索引, 需要在复制之前设置
+ * @param aidb      aidb句柄
+ * @param key_func  键提取函数, 创建和打开时必须使用相同的提取规则
+*/
+extern void aidb_set_key(aidb_t* aidb, aidb_key_func key_func);
+
+/** 设置文件映射的访问方式提示, 例如全量扫描前设置AIDB_ADVISE_SEQUENTIAL, 扫描后设置AIDB_ADVISE_DONTNEED
+ * @param aidb      aidb句柄
+ * @param advise    访问方式
+*/
+extern void aidb_advise(aidb_t* aidb, AIDB_ADVISE advise);
+
 /** 获取记录总数
  * @param aidb      aidb句柄
  * @return 记录数量
@@ -88,13 +206,20 @@ extern void aidb_foreach(aidb_t* aidb, aidb_iterator_t* iterator);
 */
 extern uint32_t aidb_next(aidb_iterator_t* iterator);
 
-/** 记录跳转至上一条, 并返回上一条记录的长度
+/** 记录跳转至上一条, 并返回上一条记录的长度, 记录没有反向链接, 需要从头扫描
  * @param iterator   记录结构指针
  * @return          上一条记录长度, 返回0表示到了头部
 */
 extern uint32_t aidb_prev(aidb_iterator_t* iterator);
 
-/** 加载当前记录内容
+/** 获取当前记录在文件映射中的加密内容, 不复制
+ * @param iterator   记录结构指针
+ * @param size      输出参数, 加密内容长度, 与记录长度相同
+ * @return          加密内容地址, 在aidb_close之前有效
+*/
+extern const void* aidb_record_data(aidb_iterator_t* iterator, uint32_t* size);
+
+/** 加载当前记录内容, 直接从文件映射解密到output
  * @param iterator   记录结构指针
  * @param output    读取内容写入的地址
  * @param size      output的大小, 如果记录内容比size大, 最多只读取size个字节
@@ -102,6 +227,16 @@ extern uint32_t aidb_prev(aidb_iterator_t* iterator);
 */
 extern uint32_t aidb_fetch(aidb_iterator_t* iterator, void* output, uint32_t size);
 
+/** 按键查找记录, 有索引时只解密哈希值相同的记录, 通常只需要一次解密.
+ *  同一个键有多条记录时返回最后写入的记录
+ * @param aidb      aidb_open打开并设置了键提取函数的aidb句柄
+ * @param iterator  记录结构指针, 找到时定位到该记录, 随后可以调用aidb_fetch读取内容(不再重复解密)
+ * @param key       要查找的键
+ * @param key_len   键的长度
+ * @return          记录长度, 返回0表示没有找到
+*/
+extern uint32_t aidb_get(aidb_t* aidb, aidb_iterator_t* iterator, const void* key, uint32_t key_len);
+
 /** 写入一条记录
  * @param aidb      aidb句柄
  * @param data      记录内容
@@ -109,8 +244,15 @@ extern uint32_t aidb_fetch(aidb_iterator_t* iterator, void* output, uint32_t siz
 */
 extern void aidb_put(aidb_t* aidb, const void* data, uint32_t size);
 
+/** 删除键对应的记录, 追加一条删除标记, 之后aidb_get找不到该键, 压缩时去掉被删除的记录
+ * @param aidb      设置了键提取函数的aidb句柄
+ * @param key       要删除的键
+ * @param key_len   键的长度
+*/
+extern void aidb_delete(aidb_t* aidb, const void* key, uint32_t key_len);
+
 #ifdef __cplusplus
 }
 #endif
 
-#endif // __AIDB_H__
\ No newline at end of file
+#endif // __AIDB_H__
@@ -0,0 +1,347 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "aidbsnap.h"
+#include "platform.h"
+#include "memtag.h"
+#include "log.h"
+
+// 编译参数 -- 检查旧快照能否关闭的间隔, 毫秒
+#ifndef AIDBSNAP_RECLAIM_MS
+#   define AIDBSNAP_RECLAIM_MS 100
+#endif
+
+// 数据库快照
+typedef struct _snap_t {
+    aidb_t*         db;                 // 只读句柄, 拥有文件映射
+    uint32_t        version;            // 版本号
+    uint64_t        retired;            // 被替换时的纪元, 0表示仍是当前快照
+    struct _snap_t* next;               // 等待关闭的快照链表
+} _snap_t;
+
+// 线程的读取状态, 只由所属线程写入
+typedef struct _reader_t {
+    uint64_t        active;             // 开始读取时的纪元, 0表示不在读取中
+    uint32_t        depth;              // 嵌套获取次数
+    uint32_t        version;            // clone对应的快照版本, 0表示没有复制
+    aidb_t*         clone;              // 本线程使用的句柄, 与快照共用文件映射
+    aidb_t*         cur;                // 本次获取返回的句柄, 嵌套获取时直接返回
+    struct _reader_t* next;             // 注册链表
+} _reader_t;
+
+/** 当前快照, 读取线程无锁读取 */
+static _snap_t* _current = NULL;
+/** 全局纪元, 每次切换快照加1 */
+static uint64_t _epoch = 1;
+/** 所有读取线程的状态链表, 只增加不删除 */
+static _reader_t* _readers = NULL;
+static _Thread_local _reader_t* _reader_local = NULL;
+
+// 以下变量只在事件循环线程中访问
+static _snap_t* _retired = NULL;        // 已被替换, 等待关闭的快照
+static uint32_t _version = 0;
+static uv_loop_t* _loop = NULL;
+static uv_fs_event_t _watch;
+static uv_timer_t _delay;
+static uv_timer_t _reclaim;
+static uv_work_t _work;
+static bool _loading = false;           // 后台正在加载
+static bool _again = false;             // 加载期间文件又发生了变化
+static _snap_t* _loaded = NULL;         // 后台加载的结果
+
+static char* _filename = NULL;
+static char* _basename = NULL;
+static char* _key = NULL;
+static aidb_key_func _key_func = NULL;
+
+/** 打开数据库文件生成快照, 失败时返回NULL */
+static _snap_t* open_snap() {
+    _snap_t* s = memtag_calloc(MEMTAG_APP, sizeof(_snap_t));
+    s->db = memtag_malloc(MEMTAG_APP, aidb_sizeof());
+    AIDB_ERROR err = aidb_open(s->db, _filename, _key);
+    if (err != AIDB_OK) {
+        log_warn("can't load aidb file %s, error %d", _filename, err);
+        memtag_free(s->db);
+        memtag_free(s);
+        return NULL;
+    }
+    aidb_set_key(s->db, _key_func);
+    // 请求按键查找, 不需要预读
+    aidb_advise(s->db, AIDB_ADVISE_RANDOM);
+    return s;
+}
+
+static void close_snap(_snap_t* s) {
+    aidb_close(s->db);
+    memtag_free(s->db);
+    memtag_free(s);
+}
+
+/** 关闭所有线程都已离开替换时纪元的旧快照 */
+static void reclaim() {
+    uint64_t min = UINT64_MAX;
+    for (_reader_t* r = __atomic_load_n(&_readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t a = __atomic_load_n(&r->active, __ATOMIC_SEQ_CST);
+        if (a && a < min) min = a;
+    }
+    for (_snap_t** pp = &_retired; *pp; ) {
+        _snap_t* s = *pp;
+        // 仍在读取的线程都是在替换之后开始的, 读到的一定是新快照
+        if (min >= s->retired) {
+            *pp = s->next;
+            log_debug("aidb snapshot %u closed", s->version);
+            close_snap(s);
+        } else {
+            pp = &s->next;
+        }
+    }
+    if (!_retired) uv_timer_stop(&_reclaim);
+}
+
+static void on_reclaim(uv_timer_t* handle) {
+    reclaim();
+}
+
+/** 发布新快照, 旧快照记录替换时的纪元后等待关闭 */
+static void publish(_snap_t* s) {
+    s->version = ++_version;
+    _snap_t* old = __atomic_exchange_n(&_current, s, __ATOMIC_SEQ_CST);
+    log_info("aidb %s loaded, version %u, %u records", _filename, s->version, aidb_record_count(s->db));
+    if (!old) return;
+    old->retired = __atomic_add_fetch(&_epoch, 1, __ATOMIC_SEQ_CST);
+    old->next = _retired;
+    _retired = old;
+    reclaim();
+    if (_retired && !uv_is_active((uv_handle_t*) &_reclaim))
+        uv_timer_start(&_reclaim, on_reclaim, AIDBSNAP_RECLAIM_MS, AIDBSNAP_RECLAIM_MS);
+}
+
+static void on_load_work(uv_work_t* req) {
+    _loaded = open_snap();
+}
+
+static void start_load();
+
+static void on_load_done(uv_work_t* req, int status) {
+    _loading = false;
+    if (_loaded) {
+        publish(_loaded);
+        _loaded = NULL;
+    }
+    if (_again) {
+        _again = false;
+        start_load();
+    }
+}
+
+/** 在线程池中重新打开文件, 打开时的CRC32校验和记录统计不占用事件循环 */
+static void start_load() {
+    if (_loading) {
+        _again = true;
+        return;
+    }
+    _loading = true;
+    uv_queue_work(_loop, &_work, on_load_work, on_load_done);
+}
+
+static void on_delay(uv_timer_t* handle) {
+    start_load();
+}
+
+/** 监视的是文件所在的目录, 文件被改名替换后仍然可以收到通知 */
+static void on_fs_event(uv_fs_event_t* handle, const char* filename, int events, int status) {
+    if (status || (filename && strcmp(filename, _basename))) return;
+    // 文件写入期间会连续收到通知, 最后一次通知之后等待一段时间再加载
+    uv_timer_start(&_delay, on_delay, AIDBSNAP_DELAY, 0);
+}
+
+bool aidbsnap_start(uv_loop_t* loop, const char* filename, const char* key, aidb_key_func key_func) {
+    _loop = loop;
+    _filename = strdup(filename);
+    _key = strdup(key);
+    _key_func = key_func;
+
+    _snap_t* s = open_snap();
+    if (!s) return false;
+    publish(s);
+
+    // 分离目录和文件名
+    const char* sep = strrchr(filename, PATH_SPEC);
+    if (PATH_SPEC != '/' && !sep) sep = strrchr(filename, '/');
+    _basename = strdup(sep ? sep + 1 : filename);
+    char dir[sep ? sep - filename + 2 : 2];
+    if (sep) {
+        memcpy(dir, filename, sep - filename + 1);
+        dir[sep - filename + (sep == filename)] = '\0';
+    } else {
+        strcpy(dir, ".");
+    }
+
+    uv_timer_init(loop, &_delay);
+    uv_timer_init(loop, &_reclaim);
+    uv_fs_event_init(loop, &_watch);
+    int err = uv_fs_event_start(&_watch, on_fs_event, dir, 0);
+    if (err) log_warn("can't watch %s: %s, aidb reload disabled", dir, uv_strerror(err));
+    // 监视不影响事件循环的退出
+    uv_unref((uv_handle_t*) &_watch);
+    uv_unref((uv_handle_t*) &_delay);
+    uv_unref((uv_handle_t*) &_reclaim);
+    return true;
+}
+
+void aidbsnap_stop() {
+    if (!_loop) return;
+    uv_fs_event_stop(&_watch);
+    uv_timer_stop(&_delay);
+    uv_timer_stop(&_reclaim);
+    uv_close((uv_handle_t*) &_watch, NULL);
+    uv_close((uv_handle_t*) &_delay, NULL);
+    uv_close((uv_handle_t*) &_reclaim, NULL);
+    while (_retired) {
+        _snap_t* s = _retired;
+        _retired = s->next;
+        close_snap(s);
+    }
+    _snap_t* s = __atomic_exchange_n(&_current, NULL, __ATOMIC_SEQ_CST);
+    if (s) close_snap(s);
+    free(_filename);
+    free(_basename);
+    free(_key);
+    _filename = _basename = _key = NULL;
+    _loop = NULL;
+}
+
+/** 获取当前线程的读取状态, 第一次使用时创建并注册到全局链表 */
+static _reader_t* local_reader() {
+    if (_reader_local) return _reader_local;
+    _reader_t* r = memtag_calloc(MEMTAG_APP, sizeof(_reader_t));
+    r->clone = memtag_malloc(MEMTAG_APP, aidb_sizeof());
+    r->next = __atomic_load_n(&_readers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&_readers, &r->next, r, true,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return _reader_local = r;
+}
+
+aidb_t* aidbsnap_acquire() {
+    _reader_t* r = local_reader();
+    if (r->depth++) return r->cur;
+
+    // 先公布纪元再读取快照, 读到旧快照时纪元一定小于旧快照被替换时的纪元
+    __atomic_store_n(&r->active, __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    _snap_t* s = __atomic_load_n(&_current, __ATOMIC_SEQ_CST);
+    if (!s) return r->cur = NULL;
+
+    if (r->version != s->version) {
+        // 旧的句柄只引用旧快照的映射, 关闭时不访问映射, 旧快照已关闭也没有关系
+        if (r->version) aidb_close(r->clone);
+        r->version = aidb_clone(r->clone, s->db) == AIDB_OK ? s->version : 0;
+    }
+    return r->cur = r->version ? r->clone : NULL;
+}
+
+void aidbsnap_release() {
+    _reader_t* r = _reader_local;
+    if (r && r->depth && !--r->depth)
+        __atomic_store_n(&r->active, 0, __ATOMIC_RELEASE);
+}
+
+uint32_t aidbsnap_version() {
+    _snap_t* s = __atomic_load_n(&_current, __ATOMIC_ACQUIRE);
+    return s ? s->version : 0;
+}
+
+#ifdef TEST_AIDBSNAP
+#include <stdio.h>
+#include <unistd.h>
+
+static const char* TEST_FILE = "snap_test.aidb";
+
+static uint32_t test_key(const char* src, uint32_t len, const char** key) {
+    const char* p = memchr(src, '=', len);
+    *key = src;
+    return p ? (uint32_t) (p - src) : len;
+}
+
+/** 生成测试文件, 每条记录为 key<i>=<gen> */
+static void make_file(const char* file, int gen, int count) {
+    aidb_t* db = malloc(aidb_sizeof());
+    aidb_create(db, file, "password");
+    aidb_set_key(db, test_key);
+    char rec[64];
+    for (int i = 0; i < count; ++i)
+        aidb_put(db, rec, snprintf(rec, sizeof(rec), "key%d=%d", i, gen));
+    aidb_close(db);
+    free(db);
+}
+
+static bool _stop = false;
+static uint64_t _reads = 0, _errors = 0;
+
+static void reader_thread(void* arg) {
+    aidb_iterator_t* it = malloc(aidb_iterator_sizeof());
+    char key[32], buf[64];
+    uint64_t reads = 0, errors = 0;
+    for (int i = 0; !__atomic_load_n(&_stop, __ATOMIC_RELAXED); i = (i + 1) % 1000) {
+        aidb_t* db = aidbsnap_acquire();
+        int kn = snprintf(key, sizeof(key), "key%d", i);
+        uint32_t len = db ? aidb_get(db, it, key, kn) : 0;
+        if (!len || aidb_fetch(it, buf, sizeof(buf)) != len || memcmp(buf, key, kn) || buf[kn] != '=')
+            ++errors;
+        aidbsnap_release();
+        ++reads;
+    }
+    __atomic_add_fetch(&_reads, reads, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_errors, errors, __ATOMIC_RELAXED);
+    free(it);
+}
+
+static uint32_t _target;
+
+static void on_check(uv_timer_t* handle) {
+    if (aidbsnap_version() >= _target) uv_stop(handle->loop);
+}
+
+/** 替换文件并等待重新加载 */
+static bool replace_and_wait(uv_loop_t* loop, int gen) {
+    make_file("snap_test.tmp", gen, 1000);
+    rename("snap_test.tmp", TEST_FILE);
+    _target = aidbsnap_version() + 1;
+    uv_timer_t check, timeout;
+    uv_timer_init(loop, &check);
+    uv_timer_start(&check, on_check, 10, 10);
+    uv_timer_init(loop, &timeout);
+    uv_timer_start(&timeout, (uv_timer_cb) uv_stop, 5000, 0);
+    uv_run(loop, UV_RUN_DEFAULT);
+    uv_close((uv_handle_t*) &check, NULL);
+    uv_close((uv_handle_t*) &timeout, NULL);
+    uv_run(loop, UV_RUN_NOWAIT);
+    return aidbsnap_version() >= _target;
+}
+
+int main() {
+    uv_loop_t* loop = uv_default_loop();
+    make_file(TEST_FILE, 0, 1000);
+    if (!aidbsnap_start(loop, TEST_FILE, "password", test_key)) return 1;
+    printf("version %u loaded\n", aidbsnap_version());
+
+    uv_thread_t threads[4];
+    for (int i = 0; i < 4; ++i) uv_thread_create(&threads[i], reader_thread, NULL);
+    int reloads = 0;
+    for (int gen = 1; gen <= 5; ++gen)
+        reloads += replace_and_wait(loop, gen);
+    // 等待最后一个旧快照关闭
+    usleep(300 * 1000);
+    __atomic_store_n(&_stop, true, __ATOMIC_RELAXED);
+    for (int i = 0; i < 4; ++i) uv_thread_join(&threads[i]);
+    uv_run(loop, UV_RUN_NOWAIT);
+    uv_run(loop, UV_RUN_NOWAIT);
+    reclaim();
+
+    printf("reloads: %d, version: %u, reads: %llu, errors: %llu, retired left: %d\n", reloads, aidbsnap_version(),
+        (unsigned long long) _reads, (unsigned long long) _errors, _retired != NULL);
+    aidbsnap_stop();
+    uv_run(loop, UV_RUN_NOWAIT);
+    remove(TEST_FILE);
+    return reloads == 5 && !_errors && !_retired ? 0 : 1;
+}
+#endif
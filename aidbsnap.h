@@ -0,0 +1,60 @@
+/** aidb数据库快照, 监视数据库文件, 文件被替换后在后台线程重新打开, 原子切换到新的快照
+ *
+ *  请求处理期间通过aidbsnap_acquire获取当前快照在本线程的只读句柄, 处理完成后aidbsnap_release.
+ *  获取和释放只写本线程的纪元值, 不加锁, 也不修改共享的引用计数. 切换快照时旧快照记录切换时的纪元,
+ *  等所有线程都离开了更早的纪元(之前开始的请求全部结束)后才关闭, 请求不会因为重新加载而等待,
+ *  重新加载期间最多同时存在新旧两份文件映射
+ * @file aidbsnap.h
+ * @author Kiven Lee
+ * @date 2021-08-20
+ * @version 1.0
+*/
+
+#pragma once
+#ifndef __AIDBSNAP_H__
+#define __AIDBSNAP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "uv.h"
+#include "aidb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** 文件变化后等待的毫秒数, 期间的多次变化只重新加载一次 */
+#ifndef AIDBSNAP_DELAY
+#   define AIDBSNAP_DELAY 500
+#endif
+
+/** 加载数据库并开始监视文件变化, 第一次加载在当前线程同步完成
+ * @param loop          监视文件和切换快照使用的事件循环
+ * @param filename      数据库文件名
+ * @param key           秘钥
+ * @param key_func      键提取函数, 可以为NULL
+ * @return              成功返回true, 第一次加载失败返回false
+*/
+extern bool aidbsnap_start(uv_loop_t* loop, const char* filename, const char* key, aidb_key_func key_func);
+
+/** 停止监视文件变化并关闭当前快照, 在事件循环线程中调用, 调用前所有请求必须已经释放快照 */
+extern void aidbsnap_stop();
+
+/** 获取当前快照在本线程的只读句柄, 可以嵌套调用, 每次调用都要对应一次aidbsnap_release
+ * @return              aidb句柄, 只能在本线程中使用, aidbsnap_release之后不能再使用; 没有加载时返回NULL
+*/
+extern aidb_t* aidbsnap_acquire();
+
+/** 释放aidbsnap_acquire获取的句柄 */
+extern void aidbsnap_release();
+
+/** 当前快照的版本号, 每次重新加载成功后加1
+ * @return              版本号, 从1开始, 没有加载时返回0
+*/
+extern uint32_t aidbsnap_version();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __AIDBSNAP_H__
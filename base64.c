@@ -24,10 +24,22 @@
  */
 
 #include <inttypes.h>
+#include <string.h>
 #include "base64.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#   include <immintrin.h>
+#   define BASE64_HW 1
+#endif
+
 #define PADDING_CHAR '='
 #define LINE_BREAK_COUNT 76
+// 解码表只有128项, 最高位为1的非法字符按去掉最高位后的字符查表, 不会越界读取
+#define DEC_CHAR(map, c) ((map)[(c) & 0x7f])
+// 回车换行在解码时忽略
+#define IS_CRLF(c) ((c) == '\r' || (c) == '\n')
+// 每行76个字符对应的原始字节数
+#define LINE_BREAK_BYTES (LINE_BREAK_COUNT / 4 * 3)
 
 static const uint8_t ENC_MAP[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
@@ -65,6 +77,206 @@ static const uint8_t URL_DEC_MAP[128] = {
      49,  50,  51, 127, 127, 127, 127, 127
 };
 
+#ifdef BASE64_HW
+
+/** 把一组12字节的原始内容拆分成16个6位索引, 再加上索引所在区间的偏移量转换成编码字符.
+ *  lut按区间编号查偏移量: 0 -> 'a'-26, 1~10 -> '0'-52, 11 -> 第62个字符, 12 -> 第63个字符, 13 -> 'A'
+*/
+__attribute__((target("ssse3")))
+inline static __m128i _enc_16(__m128i in, __m128i lut) {
+    in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+    __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+    __m128i idx = _mm_or_si128(t0, t1);
+    __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+    return _mm_add_epi8(_mm_shuffle_epi8(lut, r), idx);
+}
+
+__attribute__((target("avx2")))
+inline static __m256i _enc_32(__m256i in, __m256i lut) {
+    in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+    __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+    __m256i idx = _mm256_or_si256(t0, t1);
+    __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    r = _mm256_or_si256(r, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx), _mm256_set1_epi8(13)));
+    return _mm256_add_epi8(_mm256_shuffle_epi8(lut, r), idx);
+}
+
+__attribute__((target("ssse3")))
+inline static __m128i _enc_lut(uint8_t c62, uint8_t c63) {
+    return _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, (char) (c62 - 62), (char) (c63 - 63), 'A', 0, 0);
+}
+
+/** 每次读入16字节编码其中的12字节, 所以需要avail比n多出4字节可读.
+ *  强制内联到avx2的实现中使用VEX编码的指令, 避免256位指令之后执行传统SSE指令的状态切换开销
+ * @return          已编码的原始字节数, 12的倍数
+*/
+__attribute__((target("ssse3"), always_inline))
+inline static size_t _enc_loop16(uint8_t* d, const uint8_t* s, size_t n, size_t avail, __m128i lut) {
+    size_t i = 0;
+    for (; i + 12 <= n && i + 16 <= avail; i += 12, d += 16)
+        _mm_storeu_si128((__m128i*) d, _enc_16(_mm_loadu_si128((const __m128i*) (s + i)), lut));
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t _enc_ssse3(uint8_t* d, const uint8_t* s, size_t n, size_t avail, uint8_t c62, uint8_t c63) {
+    return _enc_loop16(d, s, n, avail, _enc_lut(c62, c63));
+}
+
+/** 两个128位通道各编码12字节, 每次24字节, 剩余部分按16字节处理 */
+__attribute__((target("avx2")))
+static size_t _enc_avx2(uint8_t* d, const uint8_t* s, size_t n, size_t avail, uint8_t c62, uint8_t c63) {
+    __m256i lut = _mm256_broadcastsi128_si256(_enc_lut(c62, c63));
+    size_t i = 0;
+    for (; i + 24 <= n && i + 28 <= avail; i += 24, d += 32) {
+        __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) (s + i))),
+                _mm_loadu_si128((const __m128i*) (s + i + 12)), 1);
+        _mm256_storeu_si256((__m256i*) d, _enc_32(in, lut));
+    }
+    return i + _enc_loop16(d, s + i, n - i, avail - i, _mm256_castsi256_si128(lut));
+}
+
+/** 批量解码的查找表, 按字符的高4位和低4位分别查表, 两个结果按位与为0时是字母表中的字符;
+ *  roll按高4位查出字符转换成6位值的偏移量, 第63个字符与同一行的其它字符偏移量不同, 单独修正
+*/
+typedef struct {
+    int8_t  lo[16];     // 低4位对应的非法行掩码
+    int8_t  hi[16];     // 高4位所在行的掩码
+    int8_t  roll[16];   // 高4位对应的偏移量
+    int8_t  c63;        // 第63个字符
+    int8_t  fix63;      // 第63个字符的偏移量修正值
+} _dec_lut_t;
+
+static const _dec_lut_t DEC_LUT = {
+    { 0x0b, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x07, 0x15, 0x17, 0x17, 0x17, 0x15 },
+    { 0x01, 0x01, 0x02, 0x04, 0x08, 0x10, 0x08, 0x10, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01 },
+    { 0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0 },
+    '/', -3
+};
+
+static const _dec_lut_t URL_DEC_LUT = {
+    { 0x0b, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x07, 0x37, 0x37, 0x35, 0x37, 0x27 },
+    { 0x01, 0x01, 0x02, 0x04, 0x08, 0x10, 0x08, 0x20, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01 },
+    { 0, 0, 17, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0 },
+    '_', 33
+};
+
+/** 16个字符转换成6位的值, 有不属于字母表的字符(包括'='和回车换行)时返回false */
+__attribute__((target("ssse3")))
+inline static bool _dec_16(__m128i v, __m128i* out, __m128i lut_lo, __m128i lut_hi, __m128i lut_roll, __m128i c63, __m128i fix63) {
+    // 0x2f只保留低4位和第6位, pshufb只使用低4位, 最高位清0后不会被当作置0的索引
+    __m128i hi = _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi8(0x2f));
+    __m128i lo = _mm_and_si128(v, _mm_set1_epi8(0x2f));
+    __m128i bad = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo), _mm_shuffle_epi8(lut_hi, hi));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) != 0xFFFF) return false;
+
+    __m128i roll = _mm_add_epi8(_mm_shuffle_epi8(lut_roll, hi), _mm_and_si128(_mm_cmpeq_epi8(v, c63), fix63));
+    v = _mm_add_epi8(v, roll);
+
+    // 相邻的6位值两两合并成12位, 再合并成24位, 最后按大端顺序取出每组的3个字节
+    v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+    v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+    *out = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    return true;
+}
+
+__attribute__((target("avx2")))
+inline static bool _dec_32(__m256i v, __m256i* out, __m256i lut_lo, __m256i lut_hi, __m256i lut_roll, __m256i c63, __m256i fix63) {
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), _mm256_set1_epi8(0x2f));
+    __m256i lo = _mm256_and_si256(v, _mm256_set1_epi8(0x2f));
+    __m256i bad = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo), _mm256_shuffle_epi8(lut_hi, hi));
+    if (!_mm256_testz_si256(bad, bad)) return false;
+
+    __m256i roll = _mm256_add_epi8(_mm256_shuffle_epi8(lut_roll, hi), _mm256_and_si256(_mm256_cmpeq_epi8(v, c63), fix63));
+    v = _mm256_add_epi8(v, roll);
+
+    v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+    v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+    v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    // 两个通道各12字节, 合并成连续的24字节
+    *out = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+    return true;
+}
+
+/** 每次解码16个字符, 遇到不属于字母表的字符时停止, 由调用者逐组处理. 只写入实际解码的字节, 可以原地解码
+ * @return          已解码的字符数, 16的倍数
+*/
+__attribute__((target("ssse3"), always_inline))
+inline static size_t _dec_loop16(uint8_t* d, const uint8_t* s, size_t n, const _dec_lut_t* lut) {
+    __m128i lut_lo = _mm_loadu_si128((const __m128i*) lut->lo), lut_hi = _mm_loadu_si128((const __m128i*) lut->hi);
+    __m128i lut_roll = _mm_loadu_si128((const __m128i*) lut->roll), out;
+    __m128i c63 = _mm_set1_epi8(lut->c63), fix63 = _mm_set1_epi8(lut->fix63);
+    size_t i = 0;
+    for (; i + 16 <= n && _dec_16(_mm_loadu_si128((const __m128i*) (s + i)), &out, lut_lo, lut_hi, lut_roll, c63, fix63); i += 16, d += 12) {
+        uint32_t tail = (uint32_t) _mm_cvtsi128_si32(_mm_srli_si128(out, 8));
+        _mm_storel_epi64((__m128i*) d, out);
+        memcpy(d + 8, &tail, 4);
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t _dec_ssse3(uint8_t* d, const uint8_t* s, size_t n, const _dec_lut_t* lut) {
+    return _dec_loop16(d, s, n, lut);
+}
+
+__attribute__((target("avx2")))
+static size_t _dec_avx2(uint8_t* d, const uint8_t* s, size_t n, const _dec_lut_t* lut) {
+    __m256i lut_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) lut->lo));
+    __m256i lut_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) lut->hi));
+    __m256i lut_roll = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) lut->roll)), out;
+    __m256i c63 = _mm256_set1_epi8(lut->c63), fix63 = _mm256_set1_epi8(lut->fix63);
+    size_t i = 0;
+    for (; i + 32 <= n && _dec_32(_mm256_loadu_si256((const __m256i*) (s + i)), &out, lut_lo, lut_hi, lut_roll, c63, fix63); i += 32, d += 24) {
+        _mm_storeu_si128((__m128i*) d, _mm256_castsi256_si128(out));
+        _mm_storel_epi64((__m128i*) (d + 16), _mm256_extracti128_si256(out, 1));
+    }
+    // 剩余不足32个字符或者后半部分有换行时, 前面的16个字符还可以批量解码
+    return i + _dec_loop16(d, s + i, n - i, lut);
+}
+
+/** 批量编码的实现, 参数n为要编码的字节数, avail为s开始可以读取的字节数, 返回已编码的字节数, 为NULL时只用查表实现 */
+static size_t (*base64_enc_impl) (uint8_t* d, const uint8_t* s, size_t n, size_t avail, uint8_t c62, uint8_t c63) = NULL;
+/** 批量解码的实现, 返回已解码的字符数, 为NULL时只用查表实现 */
+static size_t (*base64_dec_impl) (uint8_t* d, const uint8_t* s, size_t n, const _dec_lut_t* lut) = NULL;
+
+/** 程序启动时按cpu支持的指令集选择批量编解码的实现, 之后只读访问, 可以在多线程中使用 */
+__attribute__((constructor))
+static void base64_init() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        base64_enc_impl = _enc_avx2;
+        base64_dec_impl = _dec_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        base64_enc_impl = _enc_ssse3;
+        base64_dec_impl = _dec_ssse3;
+    }
+}
+
+#endif // BASE64_HW
+
+#ifdef BASE64_HW
+/** 判断编码表能否批量编码, 前62个字符必须是标准顺序, 最后两个字符可以任意指定(标准和URL变种都满足) */
+inline static bool _enc_batch(const uint8_t *map) {
+    return base64_enc_impl && (map == ENC_MAP || map == URL_ENC_MAP || !memcmp(map, ENC_MAP, 62));
+}
+
+/** 获取解码表对应的批量解码查找表, 只支持标准和URL变种两种解码表, 不支持时返回NULL */
+inline static const _dec_lut_t* _dec_batch(const uint8_t *map) {
+    if (base64_dec_impl) {
+        if (map == DEC_MAP || !memcmp(map, DEC_MAP, sizeof(DEC_MAP))) return &DEC_LUT;
+        if (map == URL_DEC_MAP || !memcmp(map, URL_DEC_MAP, sizeof(URL_DEC_MAP))) return &URL_DEC_LUT;
+    }
+    return NULL;
+}
+#endif
+
 size_t base64_encode_len(size_t srclen, bool padding, bool line_break) {
     size_t n = srclen / 3, m = srclen % 3, c = n << 2;
 
@@ -76,7 +288,8 @@ size_t base64_encode_len(size_t srclen, bool padding, bool line_break) {
         }
     }
 
-    if (line_break) c += (c / LINE_BREAK_COUNT) << 1;
+    // 只有完整的行才换行, 最后一行即使填充后正好76个字符也不换行
+    if (line_break) c += (srclen / LINE_BREAK_BYTES) << 1;
 
     return c;
 }
@@ -100,31 +313,50 @@ size_t base64_decode_len(uint8_t *src, size_t srclen) {
     return c;
 }
 
+const char* base64_impl_name() {
+#ifdef BASE64_HW
+    if (base64_enc_impl == _enc_avx2) return "avx2";
+    if (base64_enc_impl == _enc_ssse3) return "ssse3";
+#endif
+    return "table";
+}
+
 size_t base64_encode_custom(uint8_t* dst, const void* src, size_t slen, bool padding, bool line_break, const uint8_t *map) {
-    const uint8_t *s = (const uint8_t*)src, *src_max = (const uint8_t*)src + slen - 2;
+    const uint8_t *s = (const uint8_t*)src, *src_max = (const uint8_t*)src + slen;
     uint8_t *d = dst;
+#ifdef BASE64_HW
+    bool batch = _enc_batch(map);
+#endif
 
-    // 每3个字节处理一次，将3字节转换成4字节，剩余不足三个字节的后续处理
-    for (int line_count = 0; s < src_max; s += 3, d += 4) {
-        d[0] = map[s[0] >> 2];
-        d[1] = map[((s[0] & 3) << 4) | (s[1] >> 4)];
-        d[2] = map[((s[1] & 15) << 2) | (s[2] >> 6)];
-        d[3] = map[s[2] & 0x3F];
-
-        // 如果有换行需要，处理换行，76字节换行一次，所以肯定是4字节的倍数
-        if (line_break) {
-            line_count += 4;
-            if (line_count >= LINE_BREAK_COUNT) {
-                d[4] = '\r';
-                d[5] = '\n';
-                d += 2;
-                line_count = 0;
-            }
+    // 每3个字节处理一次，将3字节转换成4字节，需要换行时每次处理一行(76个字符), 剩余不足三个字节的后续处理
+    for (;;) {
+        size_t n = (size_t)(src_max - s) / 3 * 3;
+        bool full_line = line_break && n >= LINE_BREAK_BYTES;
+        if (full_line) n = LINE_BREAK_BYTES;
+        if (!n) break;
+
+        const uint8_t *line_end = s + n;
+#ifdef BASE64_HW
+        if (batch) {
+            size_t m = base64_enc_impl(d, s, n, src_max - s, map[62], map[63]);
+            s += m, d += m / 3 * 4;
+        }
+#endif
+        for (; s < line_end; s += 3, d += 4) {
+            d[0] = map[s[0] >> 2];
+            d[1] = map[((s[0] & 3) << 4) | (s[1] >> 4)];
+            d[2] = map[((s[1] & 15) << 2) | (s[2] >> 6)];
+            d[3] = map[s[2] & 0x3F];
         }
+
+        // 76字节换行一次，所以肯定是4字节的倍数
+        if (!full_line) break;
+        d[0] = '\r';
+        d[1] = '\n';
+        d += 2;
     }
 
     // 处理剩余不足3字节的内容，剩余字节肯定无需换行，所以无需考虑换行情况
-    src_max += 2;
     if (s < src_max) {
         *d++ = map[s[0] >> 2];
         if (s + 1 < src_max) {
@@ -148,34 +380,74 @@ size_t base64_url_encode(uint8_t* dst, const void* src, size_t slen, bool paddin
     return base64_encode_custom(dst, src, slen, padding, line_break, URL_ENC_MAP);
 }
 
-size_t base64_decode_custom(void* dst, const uint8_t* src, size_t slen, const uint8_t *map) {
-    // 删除末尾的回车换行和=号
-    while (slen--) {
-        uint8_t c = src[slen];
-        if (c != PADDING_CHAR && c != '\n' && c != '\r') break;
-    }
-    ++slen;
-
-    uint8_t *d = (uint8_t*)dst, c0, c1, c2, c3;
-    const uint8_t *src_max = src + slen - 3;
+/** 解码完整的4字符组, 忽略任意位置的回车换行, 剩余不足一组的字符由调用者处理.
+ *  解码结果只取决于去掉回车换行后的字符序列, 因此连续内存和逐页解码的结果相同
+ * @param pd        输入输出参数, 写入解码内容的地址, 返回时指向解码内容的末尾
+ * @return          已处理的字符数, 剩余的字符(不含回车换行)不足4个
+*/
+static size_t _decode_groups(uint8_t **pd, const uint8_t* src, size_t slen, const uint8_t *map) {
+    const uint8_t *s = src, *src_max = src + slen;
+    uint8_t *d = *pd, g[4];
+#ifdef BASE64_HW
+    const _dec_lut_t *lut = _dec_batch(map);
+#endif
 
-    // 每次解码4字节
-    for (; src < src_max; src += 4, d += 3) {
-        if (src[0] == '\r') src += 2;
-        c0 = map[src[0]], c1 = map[src[1]], c2 = map[src[2]], c3 = map[src[3]];
+    // 每次解码4字节, 批量解码遇到换行或非法字符时停止, 逐组处理后再继续批量解码
+    for (;;) {
+#ifdef BASE64_HW
+        if (lut) {
+            size_t m = base64_dec_impl(d, s, src_max - s, lut);
+            s += m, d += m / 4 * 3;
+        }
+#endif
+        while (s < src_max && IS_CRLF(*s)) ++s;
+        if (src_max - s < 4) break;
+        const uint8_t *p = s;
+        if (!IS_CRLF(s[1]) && !IS_CRLF(s[2]) && !IS_CRLF(s[3])) {
+            p += 4;
+        } else {
+            // 组内有回车换行, 逐个取出4个字符, 不足4个时留给调用者
+            uint32_t k = 0;
+            for (; k < 4 && p < src_max; ++p)
+                if (!IS_CRLF(*p)) g[k++] = *p;
+            if (k < 4) break;
+        }
+        const uint8_t *c = p == s + 4 ? s : g;
+        uint8_t c0 = DEC_CHAR(map, c[0]), c1 = DEC_CHAR(map, c[1]), c2 = DEC_CHAR(map, c[2]), c3 = DEC_CHAR(map, c[3]);
         d[0] = (c0 << 2) | (c1 >> 4);
         d[1] = (c1 << 4) | (c2 >> 2);
         d[2] = (c2 << 6) | c3;
+        s = p, d += 3;
     }
 
-    // 剩余不足4字节的内容解码
-    src_max += 3;
-    if (src + 1 < src_max) {
-        c0 = map[src[0]], c1 = map[src[1]];
-        *d++ = (c0 << 2) | (c1 >> 4);
-        if (src + 2 < src_max)
-            *d++ = (c1 << 4) | (map[src[2]] >> 2);
+    *pd = d;
+    return s - src;
+}
+
+/** 解码末尾不足4个字符的内容, 忽略其中的回车换行 */
+inline static void _decode_tail(uint8_t **pd, const uint8_t* src, size_t slen, const uint8_t *map) {
+    uint8_t c[3];
+    uint32_t n = 0;
+    for (size_t i = 0; i < slen && n < 3; ++i)
+        if (!IS_CRLF(src[i])) c[n++] = DEC_CHAR(map, src[i]);
+    if (n > 1) {
+        *(*pd)++ = (c[0] << 2) | (c[1] >> 4);
+        if (n > 2)
+            *(*pd)++ = (c[1] << 4) | (c[2] >> 2);
     }
+}
+
+size_t base64_decode_custom(void* dst, const uint8_t* src, size_t slen, const uint8_t *map) {
+    // 删除末尾的回车换行和=号
+    while (slen--) {
+        uint8_t c = src[slen];
+        if (c != PADDING_CHAR && !IS_CRLF(c)) break;
+    }
+    ++slen;
+
+    uint8_t *d = (uint8_t*)dst;
+    size_t n = _decode_groups(&d, src, slen, map);
+    _decode_tail(&d, src + n, slen - n, map);
 
     return d - (uint8_t*)dst;
 }
@@ -188,14 +460,209 @@ size_t base64_url_decode(void* dst, const uint8_t* src, size_t slen) {
     return base64_decode_custom(dst, src, slen, URL_DEC_MAP);
 }
 
+size_t base64_encode_dynmem(dynmem_t* dst, const void* src, size_t slen, bool padding, bool line_break, bool url) {
+    const uint8_t *s = (const uint8_t*)src, *map = url ? URL_ENC_MAP : ENC_MAP;
+    uint32_t start = dst->len;
+    uint8_t tmp[LINE_BREAK_COUNT + 2];
+
+    // 需要换行时每次编码一行, 否则每次编码当前页能容纳的全部3字节组, 跨页的内容先编码到临时缓冲区再追加
+    while (slen) {
+        uint8_t *page;
+        uint32_t surplus;
+        dynmem_lastpage(dst, &page, &surplus);
+
+        size_t n = line_break ? LINE_BREAK_BYTES : (size_t) surplus / 4 * 3;
+        if (!n) n = 3;
+        if (n > slen) n = slen;
+
+        size_t len = base64_encode_len(n, padding, line_break);
+        if (len <= surplus) {
+            base64_encode_custom(page, s, n, padding, line_break, map);
+            dynmem_set_len(dst, dst->len + len);
+        } else {
+            base64_encode_custom(tmp, s, n, padding, line_break, map);
+            dynmem_append(dst, tmp, len);
+        }
+        s += n, slen -= n;
+    }
+
+    return dst->len - start;
+}
+
+typedef struct {
+    uint8_t         *dst;       // 解码内容的写入位置
+    const uint8_t   *map;       // 解码表
+    uint32_t        count;      // carry中的字符数量
+    uint8_t         carry[4];   // 上一页末尾不足一组的字符
+} _decode_page_t;
+
+static uint32_t on_decode_page(void *arg, void *data, uint32_t len) {
+    _decode_page_t *dp = (_decode_page_t*) arg;
+    const uint8_t *s = (const uint8_t*) data, *src_max = s + len;
+
+    // 先用本页开头的字符补齐上一页剩下的不完整的组
+    if (dp->count) {
+        for (; dp->count < 4 && s < src_max; ++s)
+            if (!IS_CRLF(*s)) dp->carry[dp->count++] = *s;
+        if (dp->count < 4) return len;
+        _decode_groups(&dp->dst, dp->carry, 4, dp->map);
+        dp->count = 0;
+    }
+
+    s += _decode_groups(&dp->dst, s, src_max - s, dp->map);
+    for (; s < src_max; ++s)
+        if (!IS_CRLF(*s)) dp->carry[dp->count++] = *s;
+
+    return len;
+}
+
+size_t base64_decode_dynmem(void* dst, dynmem_t* src, uint32_t off, uint32_t len, bool url) {
+    if (off >= src->len) return 0;
+    if (len > src->len - off) len = src->len - off;
+
+    // 删除末尾的回车换行和=号
+    for (; len; --len) {
+        uint8_t c = *dynmem_get(src, off + len - 1);
+        if (c != PADDING_CHAR && !IS_CRLF(c)) break;
+    }
+
+    _decode_page_t dp = { .dst = (uint8_t*) dst, .map = url ? URL_DEC_MAP : DEC_MAP, .count = 0 };
+    dynmem_foreach(src, &dp, off, len, on_decode_page);
+    _decode_tail(&dp.dst, dp.carry, dp.count, dp.map);
+
+    return dp.dst - (uint8_t*)dst;
+}
 
 //---------------------------------------------------------------------
 #ifdef TEST_BASE64
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <memory.h>
 #include <assert.h>
 
+// 批量实现与查表实现比较, 覆盖各种长度、换行、填充和两种字母表, 以及原地解码和dynmem跨页编解码
+static int test_batch() {
+    static uint8_t data[1024], enc[1500], ref[1500], dec[1024];
+    for (size_t i = 0; i < sizeof(data); ++i) data[i] = (uint8_t) rand();
+    int errors = 0;
+
+    for (size_t len = 0; len <= sizeof(data); len += len < 200 ? 1 : 37) {
+        for (int opt = 0; opt < 8; ++opt) {
+            bool padding = opt & 1, line_break = opt & 2, url = opt & 4;
+            const uint8_t *emap = url ? URL_ENC_MAP : ENC_MAP, *dmap = url ? URL_DEC_MAP : DEC_MAP;
+            size_t elen = base64_encode_custom(enc, data, len, padding, line_break, emap);
+#ifdef BASE64_HW
+            size_t (*enc_impl) (uint8_t*, const uint8_t*, size_t, size_t, uint8_t, uint8_t) = base64_enc_impl;
+            base64_enc_impl = NULL;
+#endif
+            size_t rlen = base64_encode_custom(ref, data, len, padding, line_break, emap);
+#ifdef BASE64_HW
+            base64_enc_impl = enc_impl;
+#endif
+            if (elen != rlen || elen != base64_encode_len(len, padding, line_break) || memcmp(enc, ref, elen)) ++errors;
+
+            if (base64_decode_custom(dec, enc, elen, dmap) != len || memcmp(dec, data, len)) ++errors;
+            // 原地解码
+            memcpy(ref, enc, elen);
+            if (base64_decode_custom(ref, ref, elen, dmap) != len || memcmp(ref, data, len)) ++errors;
+
+            // 写入和读取都从页中间开始, 跨越多个页
+            dynmem_t dm;
+            dynmem_init(&dm, 64);
+            dynmem_append(&dm, "head", 4);
+            if (base64_encode_dynmem(&dm, data, len, padding, line_break, url) != elen
+                    || (elen && !dynmem_equal(&dm, 4, elen, enc)))
+                ++errors;
+            memset(dec, 0, len);
+            if (base64_decode_dynmem(dec, &dm, 4, elen, url) != len || memcmp(dec, data, len)) ++errors;
+            dynmem_clear(&dm);
+        }
+    }
+
+    // 含有非法字符时与查表实现的结果一致
+    size_t elen = base64_encode(enc, data, 300, false, false);
+    for (size_t pos = 0; pos < elen; pos += 7) {
+        memcpy(ref, enc, elen);
+        ref[pos] = '*';
+        size_t n = base64_decode(dec, ref, elen);
+#ifdef BASE64_HW
+        size_t (*dec_impl) (uint8_t*, const uint8_t*, size_t, const _dec_lut_t*) = base64_dec_impl;
+        base64_dec_impl = NULL;
+#endif
+        uint8_t expect[300];
+        size_t m = base64_decode(expect, ref, elen);
+#ifdef BASE64_HW
+        base64_dec_impl = dec_impl;
+#endif
+        if (n != m || memcmp(dec, expect, n)) ++errors;
+    }
+
+    return errors;
+}
+
+// 回车换行出现在任意位置(包括组内、开头和结尾)时, 两种字母表的连续内存和dynmem解码都得到原始内容
+static int test_line_breaks() {
+    static uint8_t data[600], enc[800], src[1600], dec[800];
+    int errors = 0;
+    for (int round = 0; round < 2000; ++round) {
+        size_t len = (size_t) rand() % sizeof(data);
+        bool url = round & 1;
+        for (size_t i = 0; i < len; ++i) data[i] = (uint8_t) rand();
+        size_t elen = (url ? base64_url_encode : base64_encode)(enc, data, len, round & 2, false);
+        size_t slen = 0;
+        for (size_t i = 0; i <= elen; ++i) {
+            if (rand() % 8 == 0) src[slen++] = '\r';
+            if (rand() % 8 == 0) src[slen++] = '\n';
+            if (i < elen) src[slen++] = enc[i];
+        }
+        size_t n = (url ? base64_url_decode : base64_decode)(dec, src, slen);
+        if (n != len || memcmp(dec, data, len)) ++errors;
+
+        dynmem_t dm;
+        dynmem_init(&dm, 64);
+        dynmem_append(&dm, "x", 1);
+        dynmem_append(&dm, src, slen);
+        memset(dec, 0, len);
+        n = base64_decode_dynmem(dec, &dm, 1, (uint32_t) slen, url);
+        if (n != len || memcmp(dec, data, len)) ++errors;
+        dynmem_clear(&dm);
+    }
+    return errors;
+}
+
+// 非法输入(非字母表字符, 最高位为1的字节, 中间的'='号, 任意位置的回车换行)的解码结果不确定,
+// 但连续内存和dynmem逐页解码的结果相同, 批量实现与查表实现的结果也相同
+static int test_invalid() {
+    static const uint8_t chars[] = "AZaz09+/-_=\r\n*\x80\xff";
+    static uint8_t src[300], dec[300], ref[300];
+    int errors = 0;
+    for (int round = 0; round < 20000; ++round) {
+        size_t slen = (size_t) rand() % sizeof(src);
+        bool url = round & 1;
+        for (size_t i = 0; i < slen; ++i)
+            src[i] = rand() % 4 ? ENC_MAP[rand() % 64] : chars[rand() % (sizeof(chars) - 1)];
+        size_t n = base64_decode_custom(dec, src, slen, url ? URL_DEC_MAP : DEC_MAP);
+
+        dynmem_t dm;
+        dynmem_init(&dm, 16);
+        dynmem_append(&dm, "xyz", 3);
+        dynmem_append(&dm, src, (uint32_t) slen);
+        size_t m = base64_decode_dynmem(ref, &dm, 3, (uint32_t) slen, url);
+        dynmem_clear(&dm);
+        if (n != m || memcmp(dec, ref, n)) ++errors;
+
+#ifdef BASE64_HW
+        size_t (*dec_impl) (uint8_t*, const uint8_t*, size_t, const _dec_lut_t*) = base64_dec_impl;
+        base64_dec_impl = NULL;
+        m = base64_decode_custom(ref, src, slen, url ? URL_DEC_MAP : DEC_MAP);
+        base64_dec_impl = dec_impl;
+        if (n != m || memcmp(dec, ref, n)) ++errors;
+#endif
+    }
+    return errors;
+}
+
 int main() {
     char s[] = "kiven1234567890abcde";
     char d[] = "a2l2ZW4xMjM0NTY3ODkwYWJjZGU=";
@@ -234,7 +701,21 @@ int main() {
         return 1;
     }
 
-    printf("test runing success.");
+    int errors = test_batch();
+    if (errors) {
+        printf("base64 batch (%s) error: %d errors\n", base64_impl_name(), errors);
+        return 1;
+    }
+    if ((errors = test_line_breaks())) {
+        printf("base64 line break error: %d errors\n", errors);
+        return 1;
+    }
+    if ((errors = test_invalid())) {
+        printf("base64 invalid input error: %d errors\n", errors);
+        return 1;
+    }
+
+    printf("test runing success, impl %s.\n", base64_impl_name());
 }
 
 #endif
@@ -12,6 +12,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "dynmem.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,7 +34,12 @@ extern size_t base64_encode_len(size_t srclen, bool padding, bool line_break);
 */
 extern size_t base64_decode_len(uint8_t *src, size_t srclen);
 
-/** 自定义base64编码
+/** 获取当前使用的编解码实现名称, 程序启动时按cpu支持的指令集选择
+ * @return              "avx2", "ssse3" 或者 "table"(逐组查表)
+*/
+extern const char* base64_impl_name();
+
+/** 自定义base64编码, 编码表的前62个字符是标准顺序时(标准和URL变种都是)使用SIMD指令批量编码
  * @param dst           写入编码内容的目标地址
  * @param src           原始内容地址
  * @param slen          原始内容长度
@@ -64,7 +70,9 @@ extern size_t base64_encode(uint8_t* dst, const void* src, size_t slen, bool pad
 */
 extern size_t base64_url_encode(uint8_t* dst, const void* src, size_t slen, bool padding, bool line_break);
 
-/** 自定义base64解码
+/** 自定义base64解码, 使用标准或URL变种的解码表时用SIMD指令批量解码, 遇到换行和非法字符时逐组处理.
+ *  回车换行可以出现在任意位置, 解码时忽略, dst可以与src相同(原地解码).
+ *  合法输入的解码结果为原始内容; 含有非法字符时结果不确定, 但与查表实现和base64_decode_dynmem的结果相同
  * @param dst           写入解码内容的目标地址
  * @param src           编码内容地址
  * @param slen          编码内容长度
@@ -89,6 +97,28 @@ extern size_t base64_decode(void* dst, const uint8_t* src, size_t slen);
 */
 extern size_t base64_url_decode(void* dst, const uint8_t* src, size_t slen);
 
+/** base64编码并追加到dynmem_t缓冲区, 直接编码到缓冲区的页中, 只有跨页的一组内容经过临时缓冲区
+ * @param dst           追加编码内容的缓冲区
+ * @param src           原始内容地址
+ * @param slen          原始内容长度
+ * @param padding       是否添加‘=’号对其4字节
+ * @param line_break    是否每76字节换行
+ * @param url           是否使用URL变种的编码表
+ * @return              实际编码写入的编码字节数量
+*/
+extern size_t base64_encode_dynmem(dynmem_t* dst, const void* src, size_t slen, bool padding, bool line_break, bool url);
+
+/** 从dynmem_t缓冲区的指定范围解码base64, 逐页解码, 跨页的一组字符单独处理, 不需要先把内容复制到连续内存中.
+ *  对任意输入(包括非法字符)的结果都与相同内容在连续内存中用base64_decode_custom解码的结果相同
+ * @param dst           写入解码内容的目标地址, 长度至少为 len / 4 * 3 + 2
+ * @param src           编码内容所在的缓冲区
+ * @param off           编码内容在缓冲区中的起始位置
+ * @param len           编码内容长度, 超出缓冲区有效长度的部分忽略
+ * @param url           是否使用URL变种的解码表
+ * @return              实际解码写入的字节数量
+*/
+extern size_t base64_decode_dynmem(void* dst, dynmem_t* src, uint32_t off, uint32_t len, bool url);
+
 #ifdef __cplusplus
 }
 #endif
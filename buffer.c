@@ -35,13 +35,13 @@ void buffer_init_ex(buffer_t* p, size_t capacity, size_t array_cap) {
     while (acap < array_cap)
         acap <<= 1;
     
-    p->array = malloc(sizeof(void*) * acap);
+    p->array = memtag_malloc(MEMTAG_BUFFER, sizeof(void*) * acap);
     p->ref = 1;
     p->len = 0;
     p->cap = cap;
     p->array_cap = acap;
     for (size_t i = 0; i < alen; ++i)
-        p->array[i] = malloc(C1);
+        p->array[i] = memtag_malloc(MEMTAG_BUFFER, C1);
 }
 
 void buffer_destroy(buffer_t* p) {
@@ -49,9 +49,9 @@ void buffer_destroy(buffer_t* p) {
         // 释放所有分配的块，使用数组索引中的指针进行释放
         size_t alen = p->cap < C1 ? 1 : p->cap >> B1;
         for (void **ap = p->array, **ape = &ap[alen]; ap < ape; ++ap)
-            free(*ap);
+            memtag_free(*ap);
         // 释放二级数组索引
-        free(p->array);
+        memtag_free(p->array);
         memset(p, 0, sizeof(buffer_t));
     }
 }
@@ -61,14 +61,14 @@ void buffer_destroy(buffer_t* p) {
  * @param capacity 新的容量
 */
 static inline void realloc_small(buffer_t* p, size_t capacity) {
-    void* new_data = malloc(capacity);
+    void* new_data = memtag_malloc(MEMTAG_BUFFER, capacity);
     // 复制原有内容到新分配的空间
     if (p->len)
         memcpy(new_data, p->array[0], p->len);
     if (p->array_cap)
-        free(p->array[0]);
+        memtag_free(p->array[0]);
     else
-        p->array = malloc(sizeof(void*));
+        p->array = memtag_malloc(MEMTAG_BUFFER, sizeof(void*));
     p->array[0] = new_data;
 }
 
@@ -77,10 +77,10 @@ static inline void realloc_small(buffer_t* p, size_t capacity) {
  * @param capacity 新的容量
 */
 static inline void realloc_array(buffer_t* p, size_t capacity) {
-    void** array = malloc(sizeof(void*) * capacity);
+    void** array = memtag_malloc(MEMTAG_BUFFER, sizeof(void*) * capacity);
     if (p->array_cap) {
         memcpy(array, p->array, sizeof(void*) * p->array_cap);
-        free(p->array);
+        memtag_free(p->array);
     }
     p->array = array;
     p->array_cap = capacity;
@@ -118,7 +118,7 @@ void buffer_expand_capacity(buffer_t* p, size_t capacity) {
         // 为扩展的容量以1024为单位分配内存，并保存地址到二级指针索引
         void** arr = &(p->array[used_alen]);
         for (size_t i = used_alen; i < new_alen; ++i)
-            *arr++ = malloc(C1);
+            *arr++ = memtag_malloc(MEMTAG_BUFFER, C1);
     }
     p->cap = cap;
 }
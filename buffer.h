@@ -11,6 +11,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include "memtag.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -78,7 +79,7 @@ extern void buffer_destroy(buffer_t* p);
  * @return          返回缓冲区对象
 */
 inline static buffer_t* buffer_malloc_ex(size_t capacity, size_t array_cap) {
-    buffer_t* ret = malloc(sizeof(buffer_t));
+    buffer_t* ret = memtag_malloc(MEMTAG_BUFFER, sizeof(buffer_t));
     buffer_init_ex(ret, capacity, array_cap);
     return ret;
 }
@@ -88,7 +89,7 @@ inline static buffer_t* buffer_malloc_ex(size_t capacity, size_t array_cap) {
  * @return          返回缓冲区对象
 */
 inline static buffer_t* buffer_malloc(size_t capacity, size_t array_capacity) {
-    buffer_t* ret = malloc(sizeof(buffer_t));
+    buffer_t* ret = memtag_malloc(MEMTAG_BUFFER, sizeof(buffer_t));
     buffer_init(ret, capacity);
     return ret;
 }
@@ -99,7 +100,7 @@ inline static buffer_t* buffer_malloc(size_t capacity, size_t array_capacity) {
 inline static void buffer_free(buffer_t* p) {
     buffer_destroy(p);
     if (p && !p->ref)
-        free(p);
+        memtag_free(p);
 }
 
 /** 返回缓冲区容量大小
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "base64.h"
+#include "log.h"
+
+// 编译参数 -- 单个请求采集的最大body长度, 超出部分不写入文件, body_len仍记录原始长度
+#ifndef CAPTURE_MAX_BODY
+#   define CAPTURE_MAX_BODY (64 * 1024)
+#endif
+// 编译参数 -- 采集文件的写入缓冲区大小
+#ifndef CAPTURE_BUF_SIZE
+#   define CAPTURE_BUF_SIZE (64 * 1024)
+#endif
+// 采集文件的刷新间隔(毫秒), 服务被强制终止时最多丢失该时间内的记录
+#define CAPTURE_FLUSH_INTERVAL 1000
+
+bool _capture_enabled = false;
+
+static FILE* _capture_fp = NULL;
+static uint32_t _capture_sample = 1;        // 采样间隔
+static uint32_t _capture_seq = 0;           // 采样计数
+static uint64_t _capture_start = 0;         // 采集开始时间, 纳秒
+static bool _capture_dirty = false;         // 上次刷新后是否有新记录
+static bool _capture_registered = false;
+static uv_timer_t _capture_timer;           // 定时刷新文件的定时器
+static bool _capture_timer_inited = false;
+
+/** 生成记录行的缓冲区, 按需扩大, 只在事件循环线程中使用 */
+static char* _line = NULL;
+static size_t _line_cap = 0;
+/** 从dynmem中读取字段内容的临时缓冲区 */
+static uint8_t* _tmp = NULL;
+static size_t _tmp_cap = 0;
+
+static const char HEX_CHARS[] = "0123456789abcdef";
+
+/** 确保缓冲区容量不小于size */
+static bool ensure(void** buf, size_t* cap, size_t size) {
+    if (size <= *cap) return true;
+    size_t ncap = *cap ? *cap : 4096;
+    while (ncap < size) ncap <<= 1;
+    void* nbuf = realloc(*buf, ncap);
+    if (!nbuf) return false;
+    *buf = nbuf;
+    *cap = ncap;
+    return true;
+}
+
+/** 写入json字符串(包括两端的引号), 返回写入后的位置, dst至少需要 len * 6 + 2 字节空间 */
+static char* json_str(char* dst, const uint8_t* src, uint32_t len) {
+    *dst++ = '"';
+    for (const uint8_t* end = src + len; src < end; ++src) {
+        uint8_t c = *src;
+        if (c == '"' || c == '\\') {
+            *dst++ = '\\';
+            *dst++ = c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            memcpy(dst, "\\u00", 4);
+            dst[4] = HEX_CHARS[c >> 4];
+            dst[5] = HEX_CHARS[c & 0xf];
+            dst += 6;
+        } else {
+            *dst++ = c;
+        }
+    }
+    *dst++ = '"';
+    return dst;
+}
+
+/** 读取请求缓冲区中的字段并写入json字符串 */
+static char* json_value(char* dst, dynmem_t* pbuf, const http_value_t* val) {
+    dynmem_read(pbuf, val->pos, val->len, _tmp);
+    return json_str(dst, _tmp, val->len);
+}
+
+/** 定时刷新采集文件 */
+static void on_flush_timer(uv_timer_t* handle) {
+    if (_capture_dirty && _capture_fp) {
+        _capture_dirty = false;
+        fflush(_capture_fp);
+    }
+}
+
+bool capture_start(uv_loop_t* loop, const char* filename, uint32_t sample) {
+    capture_stop();
+    _capture_fp = fopen(filename, "ab");
+    if (!_capture_fp) {
+        log_error("can't open capture file %s", filename);
+        return false;
+    }
+    setvbuf(_capture_fp, NULL, _IOFBF, CAPTURE_BUF_SIZE);
+
+    _capture_sample = sample ? sample : 1;
+    _capture_seq = 0;
+    _capture_start = uv_hrtime();
+    _capture_enabled = true;
+    if (!_capture_timer_inited) {
+        _capture_timer_inited = true;
+        uv_timer_init(loop ? loop : uv_default_loop(), &_capture_timer);
+        // 定时器不阻止事件循环退出
+        uv_unref((uv_handle_t*) &_capture_timer);
+    }
+    uv_timer_start(&_capture_timer, on_flush_timer, CAPTURE_FLUSH_INTERVAL, CAPTURE_FLUSH_INTERVAL);
+    if (!_capture_registered) {
+        _capture_registered = true;
+        atexit(capture_stop);
+    }
+    log_info("capture requests to %s, sample 1/%u", filename, _capture_sample);
+    return true;
+}
+
+void capture_stop() {
+    _capture_enabled = false;
+    if (_capture_timer_inited) uv_timer_stop(&_capture_timer);
+    if (_capture_fp) {
+        fclose(_capture_fp);
+        _capture_fp = NULL;
+    }
+    free(_line);
+    free(_tmp);
+    _line = NULL;
+    _tmp = NULL;
+    _line_cap = _tmp_cap = 0;
+}
+
+void capture_request(httpctx_t* ctx) {
+    if (!_capture_enabled || ++_capture_seq < _capture_sample) return;
+    _capture_seq = 0;
+
+    httpreq_t* req = &ctx->req;
+    dynmem_t* pbuf = &req->data;
+    uint32_t body_len = req->body.len > CAPTURE_MAX_BODY ? CAPTURE_MAX_BODY : req->body.len;
+
+    // 计算记录行的最大长度, 所有字符串按全部转义计算
+    uint32_t max_field = req->url.len > body_len ? req->url.len : body_len;
+    size_t size = 128 + (size_t) req->url.len * 6 + base64_encode_len(body_len, true, false);
+    http_header_node_t* pos;
+    list_foreach(pos, &req->headers) {
+        size += 8 + (size_t) (pos->data.field.len + pos->data.value.len) * 6;
+        if (pos->data.field.len > max_field) max_field = pos->data.field.len;
+        if (pos->data.value.len > max_field) max_field = pos->data.value.len;
+    }
+    if (!ensure((void**) &_line, &_line_cap, size) || !ensure((void**) &_tmp, &_tmp_cap, max_field + 1)) {
+        log_warn("capture request out of memory, size = %u", (uint32_t) size);
+        return;
+    }
+
+    uint64_t arrival = ctx->timing.first_byte;
+    uint64_t t = arrival > _capture_start ? arrival - _capture_start : 0;
+    char* p = _line;
+    p += sprintf(p, "{\"t_us\": %llu, \"method\": \"%s\", \"url\": ",
+            (unsigned long long) (t / 1000), http_method_str(req->parser.method));
+    // 记录客户端发送的原始url, 回放时服务端重新规范化
+    p = json_str(p, _tmp, httpctx_read_url(ctx, (char*) _tmp));
+
+    memcpy(p, ", \"headers\": [", 14);
+    p += 14;
+    bool first = true;
+    list_foreach(pos, &req->headers) {
+        if (!first) *p++ = ',';
+        first = false;
+        *p++ = '[';
+        p = json_value(p, pbuf, &pos->data.field);
+        *p++ = ',';
+        p = json_value(p, pbuf, &pos->data.value);
+        *p++ = ']';
+    }
+
+    p += sprintf(p, "], \"body_len\": %u, \"body\": \"", req->body.len);
+    if (body_len) {
+        dynmem_read(pbuf, req->body.pos, body_len, _tmp);
+        p += base64_encode((uint8_t*) p, _tmp, body_len, true, false);
+    }
+    memcpy(p, "\"}\n", 3);
+    p += 3;
+
+    fwrite(_line, 1, p - _line, _capture_fp);
+    _capture_dirty = true;
+}
@@ -0,0 +1,53 @@
+/** http请求流量采集, 按采样率将收到的原始请求追加写入jsonl文件, 供hbench回放使用
+ *
+ *  每行一条json记录, 格式如下:
+ *      {"t_us": 1234, "method": "GET", "url": "/a?b=1", "headers": [["Host", "x"]], "body_len": 0, "body": ""}
+ *  t_us 为请求到达时间(相对于采集开始时间的微秒数), body 为base64编码的请求内容,
+ *  字符串中的控制字符、非ascii字符、引号和反斜杠使用 \u00XX 转义, 解码后与原始字节完全一致
+ * @file capture.h
+ * @author Kiven Lee
+ * @date 2021-08-04
+ * @version 1.0
+*/
+
+#pragma once
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "httpctx.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** 采集状态, 由capture_start设置, 请求处理流程中通过capture_enabled判断 */
+extern bool _capture_enabled;
+
+/** 开始采集请求流量, 文件以追加方式打开, 每秒刷新一次, 程序退出时自动关闭
+ * @param loop          刷新定时器使用的事件循环, 为空时使用uv默认的事件循环
+ * @param filename      采集输出的jsonl文件名
+ * @param sample        采样间隔, 每sample个请求采集1个, 0或1表示采集全部请求
+ * @return              成功返回true, 文件无法打开返回false
+*/
+extern bool capture_start(uv_loop_t* loop, const char* filename, uint32_t sample);
+
+/** 停止采集, 刷新并关闭输出文件 */
+extern void capture_stop();
+
+/** 判断是否处于采集状态
+ * @return              true: 正在采集, false: 未开启采集
+*/
+inline static bool capture_enabled() { return _capture_enabled; }
+
+/** 采集一个已解析完成的请求, 未命中采样的请求直接返回
+ * @param ctx           请求上下文对象, 请求必须已经解析完成
+*/
+extern void capture_request(httpctx_t* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __CAPTURE_H__
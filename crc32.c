@@ -1,5 +1,17 @@
+#include <string.h>
 #include "crc32.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#   include <nmmintrin.h>
+#   define CRC32_HW 1
+#endif
+
+// crc32c(Castagnoli)多项式, 反转位序
+#define CRC32C_POLY 0x82f63b78
+// 硬件crc32c三路并行计算的分段长度, 长段用于大块数据, 短段用于剩余部分
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
 static const uint32_t crc32tab[] = {
         0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L, 0x706af48fL, 0xe963a535L, 0x9e6495a3L,
         0x0edb8832L, 0x79dcb8a4L, 0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L, 0x90bf1d91L,
@@ -33,13 +45,227 @@ static const uint32_t crc32tab[] = {
         0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L, 0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
         0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L, 0xcdd70693L, 0x54de5729L, 0x23d967bfL,
         0xb3667a2eL, 0xc4614ab8L, 0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL, 0x2d02ef8dL };
- 
- 
+
+
+// slicing-by-8查找表, 第0张表为逐字节计算使用的标准表, 第k张表为后面跟k个0字节时的结果
+static uint32_t crc32_slice[8][256];
+static uint32_t crc32c_slice[8][256];
+
+/** 由第0张表生成slicing-by-8的其余7张表 */
+static void make_slice_tables(uint32_t tab[8][256]) {
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t c = tab[0][n];
+        for (uint32_t k = 1; k < 8; ++k) {
+            c = tab[0][c & 0xff] ^ (c >> 8);
+            tab[k][n] = c;
+        }
+    }
+}
+
+/** slicing-by-8: 每次处理8个字节, 用8张表各查1次, 小端机器上使用, 不处理初值和结果取反 */
+static uint32_t crc_slice8(const uint32_t tab[8][256], uint32_t crc, const uint8_t* p, size_t size) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; size && ((uintptr_t) p & 7); --size)
+        crc = tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    for (; size >= 8; size -= 8, p += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = tab[7][lo & 0xff] ^ tab[6][(lo >> 8) & 0xff] ^ tab[5][(lo >> 16) & 0xff] ^ tab[4][lo >> 24]
+            ^ tab[3][hi & 0xff] ^ tab[2][(hi >> 8) & 0xff] ^ tab[1][(hi >> 16) & 0xff] ^ tab[0][hi >> 24];
+    }
+#endif
+    for (; size; --size)
+        crc = tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CRC32_HW
+
+// 把crc寄存器值向后移动CRC32C_LONG/CRC32C_SHORT个0字节的查找表, 用于合并三路并行计算的结果
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+/** GF(2)上的32x32矩阵乘以向量 */
+static uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, ++mat)
+        if (vec & 1) sum ^= *mat;
+    return sum;
+}
+
+/** GF(2)上的矩阵平方 */
+static void gf2_matrix_square(uint32_t* square, const uint32_t* mat) {
+    for (uint32_t n = 0; n < 32; ++n)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/** 生成向crc寄存器追加len个0字节的运算矩阵, 矩阵按位平方得到 */
+static void crc32c_zeros_op(uint32_t* even, size_t len) {
+    uint32_t odd[32];
+    // 追加1个0位的运算矩阵
+    odd[0] = CRC32C_POLY;
+    for (uint32_t n = 1, row = 1; n < 32; ++n, row <<= 1)
+        odd[n] = row;
+    gf2_matrix_square(even, odd);       // 2个0位
+    gf2_matrix_square(odd, even);       // 4个0位
+    // 第一次平方得到1个0字节, 之后每次按len的二进制位继续平方
+    do {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (!len) return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    } while (len);
+    memcpy(even, odd, sizeof(odd));
+}
+
+/** 生成追加len个0字节的按字节查找表 */
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len) {
+    uint32_t op[32];
+    crc32c_zeros_op(op, len);
+    for (uint32_t n = 0; n < 256; ++n) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+inline static uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+/** 使用SSE4.2的crc32指令计算, 大块数据分成3段并行计算以掩盖指令延迟, 再移位合并 */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t size) {
+    uint64_t crc0 = crc, crc1, crc2;
+    for (; size && ((uintptr_t) p & 7); --size)
+        crc0 = _mm_crc32_u8((uint32_t) crc0, *p++);
+
+    while (size >= CRC32C_LONG * 3) {
+        crc1 = crc2 = 0;
+        for (const uint8_t* end = p + CRC32C_LONG; p < end; p += 8) {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t*) p);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t*) (p + CRC32C_LONG));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t*) (p + CRC32C_LONG * 2));
+        }
+        crc0 = crc32c_shift(crc32c_long, (uint32_t) crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, (uint32_t) crc0) ^ crc2;
+        p += CRC32C_LONG * 2;
+        size -= CRC32C_LONG * 3;
+    }
+    while (size >= CRC32C_SHORT * 3) {
+        crc1 = crc2 = 0;
+        for (const uint8_t* end = p + CRC32C_SHORT; p < end; p += 8) {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t*) p);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t*) (p + CRC32C_SHORT));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t*) (p + CRC32C_SHORT * 2));
+        }
+        crc0 = crc32c_shift(crc32c_short, (uint32_t) crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, (uint32_t) crc0) ^ crc2;
+        p += CRC32C_SHORT * 2;
+        size -= CRC32C_SHORT * 3;
+    }
+
+    for (; size >= 8; size -= 8, p += 8)
+        crc0 = _mm_crc32_u64(crc0, *(const uint64_t*) p);
+    for (; size; --size)
+        crc0 = _mm_crc32_u8((uint32_t) crc0, *p++);
+    return (uint32_t) crc0;
+}
+
+#endif // CRC32_HW
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, size_t size) {
+    return crc_slice8(crc32c_slice, crc, p, size);
+}
+
+/** crc32c的实现, 程序启动时按cpu支持的指令集选择 */
+static uint32_t (*crc32c_impl) (uint32_t crc, const uint8_t* p, size_t size) = crc32c_sw;
+
+/** 程序启动时生成查找表并选择crc32c的实现, 之后所有函数都是只读访问, 可以在多线程中使用 */
+__attribute__((constructor))
+static void crc32_init() {
+    memcpy(crc32_slice[0], crc32tab, sizeof(crc32tab));
+    make_slice_tables(crc32_slice);
+
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_slice[0][n] = c;
+    }
+    make_slice_tables(crc32c_slice);
+
+#ifdef CRC32_HW
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_zeros(crc32c_long, CRC32C_LONG);
+        crc32c_zeros(crc32c_short, CRC32C_SHORT);
+        crc32c_impl = crc32c_hw;
+    }
+#endif
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t size) {
+    return ~crc_slice8(crc32_slice, ~crc, (const uint8_t*) buf, size);
+}
+
 uint32_t crc32(const void *buf, size_t size) {
-    uint32_t crc = 0xFFFFFFFF;
- 
-    for (uint8_t *b = (uint8_t*) buf, *e = ((uint8_t*) buf) + size; b < e; ++b)
-        crc = crc32tab[(crc ^ *b) & 0xff] ^ (crc >> 8);
- 
-    return crc ^ 0xFFFFFFFF;
-}
\ No newline at end of file
+    return crc32_update(0, buf, size);
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t size) {
+    return ~crc32c_impl(~crc, (const uint8_t*) buf, size);
+}
+
+uint32_t crc32c(const void *buf, size_t size) {
+    return crc32c_update(0, buf, size);
+}
+
+const char* crc32c_impl_name() {
+    return crc32c_impl == crc32c_sw ? "slice8" : "sse4.2";
+}
+
+#ifdef TEST_CRC32
+#include <stdio.h>
+#include <stdlib.h>
+
+// 逐字节计算的参考实现
+static uint32_t ref_crc(uint32_t poly, const uint8_t* p, size_t size) {
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; ++k)
+            crc = crc & 1 ? (crc >> 1) ^ poly : crc >> 1;
+    }
+    return ~crc;
+}
+
+int main() {
+    printf("crc32(\"123456789\") = %08x, expect cbf43926\n", crc32("123456789", 9));
+    printf("crc32c(\"123456789\") = %08x, expect e3069283, impl %s\n", crc32c("123456789", 9), crc32c_impl_name());
+
+    size_t max = CRC32C_LONG * 3 * 2 + 1000;
+    uint8_t* buf = malloc(max + 8);
+    for (size_t i = 0; i < max + 8; ++i) buf[i] = (uint8_t) rand();
+    int errors = 0;
+    size_t sizes[] = { 0, 1, 7, 8, 9, 63, 767, 768, 769, 5000, CRC32C_LONG * 3 - 1, CRC32C_LONG * 3, max };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        for (size_t off = 0; off < 8; off += 3) {
+            const uint8_t* p = buf + off;
+            size_t n = sizes[i], half = n / 3;
+            if (crc32(p, n) != ref_crc(0xedb88320, p, n)) ++errors;
+            if (crc32c(p, n) != ref_crc(CRC32C_POLY, p, n)) ++errors;
+            if (crc32c_sw(0xffffffff, p, n) != ~ref_crc(CRC32C_POLY, p, n)) ++errors;
+            if (crc32c_update(crc32c_update(0, p, half), p + half, n - half) != crc32c(p, n)) ++errors;
+            if (crc32_update(crc32_update(0, p, half), p + half, n - half) != crc32(p, n)) ++errors;
+        }
+    }
+    printf("%s, %d errors\n", errors ? "FAIL" : "OK", errors);
+    free(buf);
+    return errors != 0;
+}
+#endif
@@ -2,14 +2,49 @@
 #ifndef __CRC32_H__
 #define __CRC32_H__
 
+#include <stddef.h>
 #include <inttypes.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** 计算crc32(IEEE 802.3, zlib/gzip使用的多项式), 使用slicing-by-8查表, 每次处理8个字节
+ * @param buf       数据
+ * @param size      数据长度
+ * @return          crc32值
+*/
 extern uint32_t crc32(const void *buf, size_t size);
 
+/** 增量计算crc32, 用于分段数据, 初始值为0, crc32_update(crc32_update(0, a), b) 等于a和b连接后的crc32
+ * @param crc       上一段数据的计算结果, 第一段为0
+ * @param buf       数据
+ * @param size      数据长度
+ * @return          到当前段为止的crc32值
+*/
+extern uint32_t crc32_update(uint32_t crc, const void *buf, size_t size);
+
+/** 计算crc32c(Castagnoli多项式, iSCSI/ext4使用), cpu支持SSE4.2时使用crc32指令三路并行计算, 否则使用slicing-by-8查表,
+ *  程序启动时自动选择, 结果与实现方式无关, 用于内部数据校验和ETag等不要求兼容zlib的场合
+ * @param buf       数据
+ * @param size      数据长度
+ * @return          crc32c值
+*/
+extern uint32_t crc32c(const void *buf, size_t size);
+
+/** 增量计算crc32c, 用法与crc32_update相同
+ * @param crc       上一段数据的计算结果, 第一段为0
+ * @param buf       数据
+ * @param size      数据长度
+ * @return          到当前段为止的crc32c值
+*/
+extern uint32_t crc32c_update(uint32_t crc, const void *buf, size_t size);
+
+/** 当前使用的crc32c实现名称, 用于性能测试输出
+ * @return          "sse4.2" 或 "slice8"
+*/
+extern const char* crc32c_impl_name();
+
 #ifdef __cplusplus
 }
 #endif
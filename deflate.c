@@ -0,0 +1,745 @@
+#include <string.h>
+
+#include "deflate.h"
+#include "crc32.h"
+#include "memtag.h"
+
+#define WSIZE           32768                   // 滑动窗口大小
+#define WMASK           (WSIZE - 1)
+#define WIN_SIZE        (WSIZE * 2)             // 窗口缓冲区大小, 写满后前移WSIZE
+#define HASH_BITS       15
+#define HASH_SIZE       (1 << HASH_BITS)
+#define MIN_MATCH       3
+#define MAX_MATCH       258
+#define MIN_LOOKAHEAD   (MAX_MATCH + MIN_MATCH + 1) // 非结束状态下, 待处理数据少于该值时等待更多输入
+#define MAX_DIST        (WSIZE - MIN_LOOKAHEAD) // 最大匹配距离, 保证窗口前移后匹配位置仍然有效
+#define TOO_FAR         4096                    // 距离超过该值的最短匹配不如直接输出字面值
+#define SYM_SIZE        16384                   // 每个块最多缓存的符号数量
+#define OUT_SIZE        16384                   // 输出缓冲区大小
+
+#define L_CODES         286                     // 字面值/长度符号数量
+#define D_CODES         30                      // 距离符号数量
+#define BL_CODES        19                      // 码长符号数量
+#define LIT_TREE_SIZE   288                     // 固定哈夫曼编码的字面值/长度符号数量
+#define END_BLOCK       256
+#define MAX_BITS        15
+#define MAX_BL_BITS     7
+
+// 压缩级别参数: 达到good后匹配链长度减为1/4, 延迟匹配长度(贪婪模式为插入哈希表的最大匹配长度),
+// 达到nice后停止查找, 最大匹配链长度, 是否使用贪婪匹配
+typedef struct _level_t {
+    uint16_t        good, lazy, nice, chain;
+    bool            greedy;
+} _level_t;
+
+static const _level_t LEVELS[10] = {
+    {  4,   4,   8,    4, true  }, // 0 按1级处理
+    {  4,   4,   8,    4, true  },
+    {  4,   5,  16,    8, true  },
+    {  4,   6,  32,   32, true  },
+    {  4,   4,  16,   16, false },
+    {  8,  16,  32,   32, false },
+    {  8,  16, 128,  128, false },
+    {  8,  32, 128,  256, false },
+    { 32, 128, 258, 1024, false },
+    { 32, 258, 258, 4096, false },
+};
+
+// 长度符号的起始长度(减去MIN_MATCH)及额外位数
+static const uint8_t LEN_BASE[29] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 16, 20, 24, 28, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 255 };
+static const uint8_t LEN_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+// 距离符号的起始距离(减去1)及额外位数
+static const uint16_t DIST_BASE[D_CODES] = {
+    0, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768,
+    1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576 };
+static const uint8_t DIST_EXTRA[D_CODES] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+// 码长符号的输出顺序
+static const uint8_t BL_ORDER[BL_CODES] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+struct deflate_t {
+    deflate_format_t format;
+    _level_t        cfg;                        // 压缩级别参数
+    deflate_out_cb  cb;
+    void*           arg;
+    uint32_t        checksum;                   // zlib为adler32, gzip为crc32
+    uint32_t        total_in;
+    uint32_t        total_out;
+
+    uint32_t        strstart;                   // 当前处理位置
+    uint32_t        lookahead;                  // 窗口中待处理的数据长度
+    uint32_t        block_start;                // 当前块在窗口中的起始位置
+    uint32_t        block_len;                  // 当前块已缓存符号对应的原始数据长度
+    uint32_t        match_start;                // 最近一次匹配的起始位置
+    uint32_t        match_length;               // 最近一次匹配的长度
+    uint32_t        prev_length;                // 延迟匹配: 上一位置的匹配长度
+    bool            match_available;            // 延迟匹配: 上一位置的字面值尚未输出
+
+    uint32_t        sym_count;                  // 当前块缓存的符号数量
+    uint32_t        lit_freq[LIT_TREE_SIZE];    // 字面值/长度符号频率
+    uint32_t        dist_freq[D_CODES];         // 距离符号频率
+
+    uint64_t        bitbuf;                     // 尚未输出的位, 低位先输出
+    uint32_t        bitcnt;
+    uint32_t        out_len;
+
+    uint8_t         len_code[256];              // 匹配长度(减去MIN_MATCH)对应的长度符号
+    uint8_t         dist_code[512];             // 距离(减去1)对应的距离符号, 256以上按128分组
+    uint8_t         fixed_ll[LIT_TREE_SIZE];    // 固定哈夫曼编码的码长和编码
+    uint16_t        fixed_lc[LIT_TREE_SIZE];
+    uint8_t         fixed_dl[D_CODES];
+    uint16_t        fixed_dc[D_CODES];
+
+    uint8_t         sym_lc[SYM_SIZE];           // 字面值或匹配长度(减去MIN_MATCH)
+    uint16_t        sym_dist[SYM_SIZE];         // 匹配距离, 0表示字面值
+    uint16_t        head[HASH_SIZE];            // 哈希链表头, 0表示空
+    uint16_t        prev[WSIZE];                // 哈希链表, 按位置索引
+    uint8_t         out[OUT_SIZE];
+    uint8_t         window[WIN_SIZE + MAX_MATCH + 8]; // 尾部预留匹配比较时越界读取的空间
+};
+
+// ========== 输出 ==========
+
+static void flush_out(deflate_t* s) {
+    if (!s->out_len) return;
+    s->cb(s->arg, s->out, s->out_len);
+    s->total_out += s->out_len;
+    s->out_len = 0;
+}
+
+inline static void put_byte(deflate_t* s, uint8_t b) {
+    if (s->out_len == OUT_SIZE) flush_out(s);
+    s->out[s->out_len++] = b;
+}
+
+/** 输出不超过16位的数据, 低位在前 */
+inline static void put_bits(deflate_t* s, uint32_t value, uint32_t len) {
+    s->bitbuf |= (uint64_t) value << s->bitcnt;
+    s->bitcnt += len;
+    if (s->bitcnt >= 32) {
+        if (s->out_len > OUT_SIZE - 4) flush_out(s);
+        uint8_t* p = s->out + s->out_len;
+        uint32_t v = (uint32_t) s->bitbuf;
+        p[0] = (uint8_t) v;
+        p[1] = (uint8_t) (v >> 8);
+        p[2] = (uint8_t) (v >> 16);
+        p[3] = (uint8_t) (v >> 24);
+        s->out_len += 4;
+        s->bitbuf >>= 32;
+        s->bitcnt -= 32;
+    }
+}
+
+/** 输出剩余的位并按字节对齐 */
+static void align_bits(deflate_t* s) {
+    while (s->bitcnt > 0) {
+        put_byte(s, (uint8_t) s->bitbuf);
+        s->bitbuf >>= 8;
+        s->bitcnt = s->bitcnt > 8 ? s->bitcnt - 8 : 0;
+    }
+    s->bitbuf = 0;
+}
+
+// ========== 哈夫曼编码 ==========
+
+typedef struct _sym_freq_t {
+    uint16_t        freq;
+    uint16_t        sym;
+} _sym_freq_t;
+
+/** 按频率升序排列, 两趟基数排序 */
+static _sym_freq_t* sort_syms(_sym_freq_t* a, _sym_freq_t* tmp, uint32_t n) {
+    for (uint32_t shift = 0; shift < 16; shift += 8) {
+        uint32_t count[256] = { 0 };
+        for (uint32_t i = 0; i < n; ++i) ++count[(a[i].freq >> shift) & 0xff];
+        for (uint32_t i = 0, sum = 0; i < 256; ++i) {
+            uint32_t c = count[i];
+            count[i] = sum;
+            sum += c;
+        }
+        for (uint32_t i = 0; i < n; ++i) tmp[count[(a[i].freq >> shift) & 0xff]++] = a[i];
+        _sym_freq_t* t = a;
+        a = tmp;
+        tmp = t;
+    }
+    return a;
+}
+
+/** 就地计算最小冗余编码的码长(Moffat-Katajainen), 输入为升序排列的频率, 输出对应的码长 */
+static void min_redundancy(int* a, int n) {
+    int root, leaf, next, avbl, used, dpth;
+    if (n == 1) {
+        a[0] = 1;
+        return;
+    }
+    a[0] += a[1];
+    root = 0;
+    leaf = 2;
+    for (next = 1; next < n - 1; ++next) {
+        if (leaf >= n || a[root] < a[leaf]) {
+            a[next] = a[root];
+            a[root++] = next;
+        } else {
+            a[next] = a[leaf++];
+        }
+        if (leaf >= n || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root++] = next;
+        } else {
+            a[next] += a[leaf++];
+        }
+    }
+    a[n - 2] = 0;
+    for (next = n - 3; next >= 0; --next) a[next] = a[a[next]] + 1;
+    avbl = 1;
+    used = dpth = 0;
+    root = n - 2;
+    next = n - 1;
+    while (avbl > 0) {
+        while (root >= 0 && a[root] == dpth) {
+            ++used;
+            --root;
+        }
+        while (avbl > used) {
+            a[next--] = dpth;
+            --avbl;
+        }
+        avbl = 2 * used;
+        ++dpth;
+        used = 0;
+    }
+}
+
+/** 根据符号频率生成不超过max_bits的码长, 至少生成2个编码, 保证编码是完整的 */
+static void build_lengths(const uint32_t* freq, uint32_t n, uint32_t max_bits, uint8_t* lengths) {
+    _sym_freq_t buf[LIT_TREE_SIZE], tmp[LIT_TREE_SIZE];
+    int a[LIT_TREE_SIZE] = { 0 };
+    uint32_t used = 0;
+    memset(lengths, 0, n);
+    for (uint32_t i = 0; i < n; ++i)
+        if (freq[i]) buf[used++] = (_sym_freq_t) { (uint16_t) (freq[i] > 0xffff ? 0xffff : freq[i]), (uint16_t) i };
+    for (uint32_t i = 0; used < 2 && i < n; ++i)
+        if (!freq[i]) buf[used++] = (_sym_freq_t) { 1, (uint16_t) i };
+
+    _sym_freq_t* syms = sort_syms(buf, tmp, used);
+    for (uint32_t i = 0; i < used; ++i) a[i] = syms[i].freq;
+    min_redundancy(a, (int) used);
+
+    // 统计各码长的数量, 超过max_bits的编码调整为max_bits, 再拆分较短的编码使其重新满足Kraft等式
+    uint32_t count[33] = { 0 };
+    for (uint32_t i = 0; i < used; ++i) ++count[a[i] < 32 ? a[i] : 32];
+    for (uint32_t i = max_bits + 1; i <= 32; ++i) {
+        count[max_bits] += count[i];
+        count[i] = 0;
+    }
+    uint32_t total = 0;
+    for (uint32_t i = 1; i <= max_bits; ++i) total += count[i] << (max_bits - i);
+    while (total != (1u << max_bits)) {
+        --count[max_bits];
+        for (uint32_t i = max_bits - 1; i > 0; --i) {
+            if (count[i]) {
+                --count[i];
+                count[i + 1] += 2;
+                break;
+            }
+        }
+        --total;
+    }
+
+    // 频率越高的符号码长越短
+    for (uint32_t len = 1, j = used; len <= max_bits; ++len)
+        for (uint32_t k = count[len]; k; --k)
+            lengths[syms[--j].sym] = (uint8_t) len;
+}
+
+/** 根据码长生成范式哈夫曼编码, 编码按位反转, 便于低位先输出 */
+static void build_codes(const uint8_t* lengths, uint32_t n, uint16_t* codes) {
+    uint32_t count[MAX_BITS + 1] = { 0 }, next[MAX_BITS + 1];
+    for (uint32_t i = 0; i < n; ++i) ++count[lengths[i]];
+    count[0] = 0;
+    uint32_t code = 0;
+    for (uint32_t bits = 1; bits <= MAX_BITS; ++bits) {
+        code = (code + count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t len = lengths[i];
+        if (!len) continue;
+        uint32_t c = next[len]++, r = 0;
+        for (uint32_t j = 0; j < len; ++j, c >>= 1) r = (r << 1) | (c & 1);
+        codes[i] = (uint16_t) r;
+    }
+}
+
+inline static uint32_t d_code(const deflate_t* s, uint32_t dist) {
+    return dist < 256 ? s->dist_code[dist] : s->dist_code[256 + (dist >> 7)];
+}
+
+/** 计算当前块的符号用指定编码输出需要的位数 */
+static uint64_t data_bits(const deflate_t* s, const uint8_t* ll, const uint8_t* dl) {
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i <= END_BLOCK; ++i) bits += (uint64_t) s->lit_freq[i] * ll[i];
+    for (uint32_t i = 0; i < 29; ++i)
+        bits += (uint64_t) s->lit_freq[END_BLOCK + 1 + i] * (ll[END_BLOCK + 1 + i] + LEN_EXTRA[i]);
+    for (uint32_t i = 0; i < D_CODES; ++i) bits += (uint64_t) s->dist_freq[i] * (dl[i] + DIST_EXTRA[i]);
+    return bits;
+}
+
+/** 输出当前块缓存的全部符号 */
+static void compress_block(deflate_t* s, const uint8_t* ll, const uint16_t* lc, const uint8_t* dl, const uint16_t* dc) {
+    for (uint32_t i = 0; i < s->sym_count; ++i) {
+        uint32_t dist = s->sym_dist[i], v = s->sym_lc[i];
+        if (!dist) {
+            put_bits(s, lc[v], ll[v]);
+            continue;
+        }
+        uint32_t code = s->len_code[v];
+        put_bits(s, lc[END_BLOCK + 1 + code], ll[END_BLOCK + 1 + code]);
+        if (LEN_EXTRA[code]) put_bits(s, v - LEN_BASE[code], LEN_EXTRA[code]);
+        --dist;
+        code = d_code(s, dist);
+        put_bits(s, dc[code], dl[code]);
+        if (DIST_EXTRA[code]) put_bits(s, dist - DIST_BASE[code], DIST_EXTRA[code]);
+    }
+    put_bits(s, lc[END_BLOCK], ll[END_BLOCK]);
+}
+
+/** 结束当前块, 选择动态哈夫曼、固定哈夫曼或不压缩中最短的方式输出 */
+static void flush_block(deflate_t* s, bool last) {
+    uint8_t ll[LIT_TREE_SIZE], dl[D_CODES], bll[BL_CODES];
+    uint16_t lc[LIT_TREE_SIZE], dc[D_CODES], blc[BL_CODES];
+    s->lit_freq[END_BLOCK] = 1;
+    build_lengths(s->lit_freq, L_CODES, MAX_BITS, ll);
+    build_lengths(s->dist_freq, D_CODES, MAX_BITS, dl);
+
+    uint32_t nlit = L_CODES, ndist = D_CODES;
+    while (nlit > 257 && !ll[nlit - 1]) --nlit;
+    while (ndist > 1 && !dl[ndist - 1]) --ndist;
+
+    // 码长序列按行程编码, 16: 重复前一个码长3-6次, 17: 3-10个0, 18: 11-138个0
+    uint8_t lens[L_CODES + D_CODES], rle[L_CODES + D_CODES], rle_extra[L_CODES + D_CODES];
+    uint32_t n = nlit + ndist, nrle = 0, bl_freq[BL_CODES] = { 0 };
+    memcpy(lens, ll, nlit);
+    memcpy(lens + nlit, dl, ndist);
+    for (uint32_t i = 0; i < n; ) {
+        uint32_t cur = lens[i], run = 1;
+        while (i + run < n && lens[i + run] == cur) ++run;
+        i += run;
+        if (!cur) {
+            while (run >= 11) {
+                uint32_t r = run > 138 ? 138 : run;
+                rle[nrle] = 18;
+                rle_extra[nrle++] = (uint8_t) (r - 11);
+                run -= r;
+            }
+            if (run >= 3) {
+                rle[nrle] = 17;
+                rle_extra[nrle++] = (uint8_t) (run - 3);
+                run = 0;
+            }
+        } else {
+            rle[nrle++] = (uint8_t) cur;
+            --run;
+            while (run >= 3) {
+                uint32_t r = run > 6 ? 6 : run;
+                rle[nrle] = 16;
+                rle_extra[nrle++] = (uint8_t) (r - 3);
+                run -= r;
+            }
+        }
+        while (run--) rle[nrle++] = (uint8_t) cur;
+    }
+    for (uint32_t i = 0; i < nrle; ++i) ++bl_freq[rle[i]];
+    build_lengths(bl_freq, BL_CODES, MAX_BL_BITS, bll);
+    uint32_t nbl = BL_CODES;
+    while (nbl > 4 && !bll[BL_ORDER[nbl - 1]]) --nbl;
+
+    uint64_t dyn_bits = 3 + 14 + nbl * 3 + data_bits(s, ll, dl);
+    for (uint32_t i = 0; i < nrle; ++i) dyn_bits += bll[rle[i]] + (rle[i] == 16 ? 2 : rle[i] == 17 ? 3 : rle[i] == 18 ? 7 : 0);
+    uint64_t fixed_bits = 3 + data_bits(s, s->fixed_ll, s->fixed_dl);
+    uint64_t stored_bits = s->block_len <= 0xffff ? 3 + 7 + 32 + (uint64_t) s->block_len * 8 : UINT64_MAX;
+
+    if (stored_bits <= dyn_bits && stored_bits <= fixed_bits) {
+        put_bits(s, last, 3);
+        align_bits(s);
+        uint32_t len = s->block_len;
+        put_byte(s, (uint8_t) len);
+        put_byte(s, (uint8_t) (len >> 8));
+        put_byte(s, (uint8_t) ~len);
+        put_byte(s, (uint8_t) (~len >> 8));
+        for (const uint8_t *p = s->window + s->block_start, *e = p + len; p < e; ) {
+            if (s->out_len == OUT_SIZE) flush_out(s);
+            uint32_t c = OUT_SIZE - s->out_len;
+            if (c > (uint32_t) (e - p)) c = (uint32_t) (e - p);
+            memcpy(s->out + s->out_len, p, c);
+            s->out_len += c;
+            p += c;
+        }
+    } else if (fixed_bits <= dyn_bits) {
+        put_bits(s, last | (1 << 1), 3);
+        compress_block(s, s->fixed_ll, s->fixed_lc, s->fixed_dl, s->fixed_dc);
+    } else {
+        build_codes(ll, L_CODES, lc);
+        build_codes(dl, D_CODES, dc);
+        build_codes(bll, BL_CODES, blc);
+        put_bits(s, last | (2 << 1), 3);
+        put_bits(s, nlit - 257, 5);
+        put_bits(s, ndist - 1, 5);
+        put_bits(s, nbl - 4, 4);
+        for (uint32_t i = 0; i < nbl; ++i) put_bits(s, bll[BL_ORDER[i]], 3);
+        for (uint32_t i = 0; i < nrle; ++i) {
+            uint32_t c = rle[i];
+            put_bits(s, blc[c], bll[c]);
+            if (c == 16) put_bits(s, rle_extra[i], 2);
+            else if (c == 17) put_bits(s, rle_extra[i], 3);
+            else if (c == 18) put_bits(s, rle_extra[i], 7);
+        }
+        compress_block(s, ll, lc, dl, dc);
+    }
+
+    memset(s->lit_freq, 0, sizeof(s->lit_freq));
+    memset(s->dist_freq, 0, sizeof(s->dist_freq));
+    s->sym_count = 0;
+    s->block_start += s->block_len;
+    s->block_len = 0;
+}
+
+// ========== LZ77匹配 ==========
+
+inline static uint32_t hash3(const uint8_t* p) {
+    uint32_t v = p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16);
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/** 将指定位置插入哈希链, 返回链上前一个相同哈希值的位置 */
+inline static uint32_t insert_string(deflate_t* s, uint32_t pos) {
+    uint32_t h = hash3(s->window + pos), ret = s->head[h];
+    s->prev[pos & WMASK] = (uint16_t) ret;
+    s->head[h] = (uint16_t) pos;
+    return ret;
+}
+
+/** 比较两个位置的相同长度, 最多MAX_MATCH */
+inline static uint32_t compare_len(const uint8_t* a, const uint8_t* b) {
+    for (uint32_t len = 0; len < MAX_MATCH; len += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + len, 8);
+        memcpy(&y, b + len, 8);
+        uint64_t d = x ^ y;
+        if (d) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            len += __builtin_clzll(d) >> 3;
+#else
+            len += __builtin_ctzll(d) >> 3;
+#endif
+            return len < MAX_MATCH ? len : MAX_MATCH;
+        }
+    }
+    return MAX_MATCH;
+}
+
+/** 沿哈希链查找最长匹配, 结果位置保存在match_start, 返回匹配长度(不超过lookahead) */
+static uint32_t longest_match(deflate_t* s, uint32_t cur_match) {
+    uint32_t chain = s->cfg.chain, nice = s->cfg.nice;
+    uint32_t best_len = s->prev_length > MIN_MATCH - 1 ? s->prev_length : MIN_MATCH - 1;
+    uint32_t limit = s->strstart > MAX_DIST ? s->strstart - MAX_DIST : 0;
+    const uint8_t* win = s->window;
+    const uint8_t* scan = win + s->strstart;
+
+    if (best_len >= s->cfg.good) chain >>= 2;
+    if (nice > s->lookahead) nice = s->lookahead;
+
+    do {
+        const uint8_t* match = win + cur_match;
+        if (match[best_len] != scan[best_len] || match[best_len - 1] != scan[best_len - 1]
+                || match[0] != scan[0] || match[1] != scan[1])
+            continue;
+        uint32_t len = compare_len(scan, match);
+        if (len > best_len) {
+            s->match_start = cur_match;
+            best_len = len;
+            if (len >= nice) break;
+        }
+    } while ((cur_match = s->prev[cur_match & WMASK]) > limit && --chain);
+
+    return best_len <= s->lookahead ? best_len : s->lookahead;
+}
+
+inline static bool tally_lit(deflate_t* s, uint8_t c) {
+    s->sym_dist[s->sym_count] = 0;
+    s->sym_lc[s->sym_count++] = c;
+    ++s->lit_freq[c];
+    ++s->block_len;
+    return s->sym_count == SYM_SIZE;
+}
+
+inline static bool tally_match(deflate_t* s, uint32_t dist, uint32_t len) {
+    s->sym_dist[s->sym_count] = (uint16_t) dist;
+    s->sym_lc[s->sym_count++] = (uint8_t) (len - MIN_MATCH);
+    ++s->lit_freq[END_BLOCK + 1 + s->len_code[len - MIN_MATCH]];
+    ++s->dist_freq[d_code(s, dist - 1)];
+    s->block_len += len;
+    return s->sym_count == SYM_SIZE;
+}
+
+/** 贪婪匹配, 找到匹配立即输出 */
+static void deflate_fast(deflate_t* s, bool finish) {
+    while (s->lookahead >= MIN_LOOKAHEAD || (finish && s->lookahead)) {
+        uint32_t hash_head = 0;
+        if (s->lookahead >= MIN_MATCH) hash_head = insert_string(s, s->strstart);
+
+        s->match_length = 0;
+        if (hash_head && s->strstart - hash_head <= MAX_DIST)
+            s->match_length = longest_match(s, hash_head);
+
+        bool full;
+        if (s->match_length >= MIN_MATCH) {
+            uint32_t len = s->match_length;
+            full = tally_match(s, s->strstart - s->match_start, len);
+            s->lookahead -= len;
+            // 较短的匹配将匹配内的每个位置都插入哈希链
+            if (len <= s->cfg.lazy && s->lookahead >= MIN_MATCH) {
+                while (--len) insert_string(s, ++s->strstart);
+                ++s->strstart;
+            } else {
+                s->strstart += len;
+            }
+        } else {
+            full = tally_lit(s, s->window[s->strstart]);
+            --s->lookahead;
+            ++s->strstart;
+        }
+        if (full) flush_block(s, false);
+    }
+}
+
+/** 延迟匹配, 下一位置的匹配更长时, 当前位置改为输出字面值 */
+static void deflate_slow(deflate_t* s, bool finish) {
+    while (s->lookahead >= MIN_LOOKAHEAD || (finish && s->lookahead)) {
+        uint32_t hash_head = 0;
+        if (s->lookahead >= MIN_MATCH) hash_head = insert_string(s, s->strstart);
+
+        s->prev_length = s->match_length;
+        uint32_t prev_match = s->match_start;
+        s->match_length = MIN_MATCH - 1;
+
+        if (hash_head && s->prev_length < s->cfg.lazy && s->strstart - hash_head <= MAX_DIST) {
+            s->match_length = longest_match(s, hash_head);
+            if (s->match_length == MIN_MATCH && s->strstart - s->match_start > TOO_FAR)
+                s->match_length = MIN_MATCH - 1;
+        }
+
+        if (s->prev_length >= MIN_MATCH && s->match_length <= s->prev_length) {
+            // 上一位置的匹配更好, 输出上一位置的匹配
+            uint32_t max_insert = s->strstart + s->lookahead - MIN_MATCH;
+            bool full = tally_match(s, s->strstart - 1 - prev_match, s->prev_length);
+            s->lookahead -= s->prev_length - 1;
+            s->prev_length -= 2;
+            do {
+                if (++s->strstart <= max_insert) insert_string(s, s->strstart);
+            } while (--s->prev_length);
+            s->match_available = false;
+            s->match_length = MIN_MATCH - 1;
+            ++s->strstart;
+            if (full) flush_block(s, false);
+        } else if (s->match_available) {
+            // 当前位置的匹配更好, 上一位置输出字面值
+            if (tally_lit(s, s->window[s->strstart - 1])) flush_block(s, false);
+            ++s->strstart;
+            --s->lookahead;
+        } else {
+            s->match_available = true;
+            ++s->strstart;
+            --s->lookahead;
+        }
+    }
+    if (finish && s->match_available) {
+        tally_lit(s, s->window[s->strstart - 1]);
+        s->match_available = false;
+    }
+}
+
+inline static void process(deflate_t* s, bool finish) {
+    if (s->cfg.greedy)
+        deflate_fast(s, finish);
+    else
+        deflate_slow(s, finish);
+}
+
+/** 窗口写满时将后半部分前移, 前移前输出当前块, 保证不压缩的块能从窗口中取得原始数据 */
+static void slide_window(deflate_t* s) {
+    if (s->sym_count) flush_block(s, false);
+    memcpy(s->window, s->window + WSIZE, WSIZE);
+    s->strstart -= WSIZE;
+    s->block_start -= WSIZE;
+    s->match_start = s->match_start >= WSIZE ? s->match_start - WSIZE : 0;
+    for (uint32_t i = 0; i < HASH_SIZE; ++i)
+        s->head[i] = s->head[i] >= WSIZE ? s->head[i] - WSIZE : 0;
+    for (uint32_t i = 0; i < WSIZE; ++i)
+        s->prev[i] = s->prev[i] >= WSIZE ? s->prev[i] - WSIZE : 0;
+}
+
+// ========== 校验和 ==========
+
+static uint32_t adler32_update(uint32_t adler, const uint8_t* p, uint32_t len) {
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (len) {
+        // 5552是保证b不溢出的最大分段长度
+        uint32_t n = len > 5552 ? 5552 : len;
+        len -= n;
+        while (n--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+// ========== 对外接口 ==========
+
+deflate_t* deflate_create() {
+    deflate_t* s = memtag_calloc(MEMTAG_DEFLATE, sizeof(deflate_t));
+    if (!s) return NULL;
+
+    // 长度和距离到符号的映射表
+    for (uint32_t code = 0, len = 0; code < 28; ++code)
+        for (uint32_t n = 0; n < (1u << LEN_EXTRA[code]); ++n)
+            s->len_code[len++] = (uint8_t) code;
+    s->len_code[255] = 28;
+    uint32_t dist = 0, code = 0;
+    for (; code < 16; ++code)
+        for (uint32_t n = 0; n < (1u << DIST_EXTRA[code]); ++n)
+            s->dist_code[dist++] = (uint8_t) code;
+    for (dist >>= 7; code < D_CODES; ++code)
+        for (uint32_t n = 0; n < (1u << (DIST_EXTRA[code] - 7)); ++n)
+            s->dist_code[256 + dist++] = (uint8_t) code;
+
+    // 固定哈夫曼编码
+    for (uint32_t i = 0; i < LIT_TREE_SIZE; ++i)
+        s->fixed_ll[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    memset(s->fixed_dl, 5, D_CODES);
+    build_codes(s->fixed_ll, LIT_TREE_SIZE, s->fixed_lc);
+    build_codes(s->fixed_dl, D_CODES, s->fixed_dc);
+    return s;
+}
+
+void deflate_free(deflate_t* self) {
+    memtag_free(self);
+}
+
+void deflate_begin(deflate_t* s, deflate_format_t format, int level, deflate_out_cb cb, void* arg) {
+    if (level < 1) level = 1;
+    if (level > 9) level = 9;
+    s->format = format;
+    s->cfg = LEVELS[level];
+    s->cb = cb;
+    s->arg = arg;
+    s->checksum = format == DEFLATE_ZLIB ? 1 : 0;
+    s->total_in = 0;
+    s->total_out = 0;
+
+    s->strstart = 0;
+    s->lookahead = 0;
+    s->block_start = 0;
+    s->block_len = 0;
+    s->match_start = 0;
+    s->match_length = MIN_MATCH - 1;
+    s->prev_length = MIN_MATCH - 1;
+    s->match_available = false;
+    s->sym_count = 0;
+    memset(s->lit_freq, 0, sizeof(s->lit_freq));
+    memset(s->dist_freq, 0, sizeof(s->dist_freq));
+    // 哈希链只能通过链表头进入, 只需清空链表头
+    memset(s->head, 0, sizeof(s->head));
+
+    s->bitbuf = 0;
+    s->bitcnt = 0;
+    s->out_len = 0;
+
+    if (format == DEFLATE_ZLIB) {
+        // CMF: 32K窗口的deflate, FLG: 压缩级别提示, 使(CMF*256+FLG)能被31整除
+        put_byte(s, 0x78);
+        put_byte(s, level == 1 ? 0x01 : level < 6 ? 0x5e : level == 6 ? 0x9c : 0xda);
+    } else if (format == DEFLATE_GZIP) {
+        static const uint8_t GZIP_HEAD[8] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0 };
+        for (uint32_t i = 0; i < sizeof(GZIP_HEAD); ++i) put_byte(s, GZIP_HEAD[i]);
+        put_byte(s, level == 9 ? 2 : level == 1 ? 4 : 0);
+        put_byte(s, 3); // unix
+    }
+}
+
+void deflate_update(deflate_t* s, const void* data, uint32_t len) {
+    const uint8_t* p = (const uint8_t*) data;
+    if (s->format == DEFLATE_ZLIB)
+        s->checksum = adler32_update(s->checksum, p, len);
+    else if (s->format == DEFLATE_GZIP)
+        s->checksum = crc32_update(s->checksum, p, len);
+    s->total_in += len;
+
+    while (len) {
+        uint32_t end = s->strstart + s->lookahead;
+        if (end == WIN_SIZE) {
+            slide_window(s);
+            end = s->strstart + s->lookahead;
+        }
+        uint32_t n = WIN_SIZE - end;
+        if (n > len) n = len;
+        memcpy(s->window + end, p, n);
+        p += n;
+        len -= n;
+        s->lookahead += n;
+        process(s, false);
+    }
+}
+
+uint32_t deflate_end(deflate_t* s) {
+    process(s, true);
+    flush_block(s, true);
+    align_bits(s);
+
+    uint32_t c = s->checksum;
+    if (s->format == DEFLATE_ZLIB) {
+        put_byte(s, (uint8_t) (c >> 24));
+        put_byte(s, (uint8_t) (c >> 16));
+        put_byte(s, (uint8_t) (c >> 8));
+        put_byte(s, (uint8_t) c);
+    } else if (s->format == DEFLATE_GZIP) {
+        uint32_t n = s->total_in;
+        for (uint32_t i = 0; i < 32; i += 8) put_byte(s, (uint8_t) (c >> i));
+        for (uint32_t i = 0; i < 32; i += 8) put_byte(s, (uint8_t) (n >> i));
+    }
+    flush_out(s);
+    return s->total_out;
+}
+
+//==========================================================================
+// #define TEST_DEFLATE
+#ifdef TEST_DEFLATE
+#include <stdio.h>
+#include <stdlib.h>
+
+static void on_out(void* arg, const void* data, uint32_t len) {
+    fwrite(data, 1, len, (FILE*) arg);
+}
+
+// 压缩标准输入到标准输出, 范例: ./deflate 6 gzip < file > file.gz
+int main(int argc, char** argv) {
+    int level = argc > 1 ? atoi(argv[1]) : 6;
+    deflate_format_t fmt = argc > 2 && !strcmp(argv[2], "gzip") ? DEFLATE_GZIP
+            : argc > 2 && !strcmp(argv[2], "zlib") ? DEFLATE_ZLIB : DEFLATE_RAW;
+    deflate_t* d = deflate_create();
+    deflate_begin(d, fmt, level, on_out, stdout);
+    char buf[7000];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+        deflate_update(d, buf, (uint32_t) n);
+    uint32_t total = deflate_end(d);
+    fprintf(stderr, "in %u out %u\n", d->total_in, total);
+    deflate_free(d);
+    return 0;
+}
+#endif // TEST_DEFLATE
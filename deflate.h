@@ -0,0 +1,74 @@
+/** deflate流式压缩(RFC1951), 支持raw/zlib(RFC1950)/gzip(RFC1952)三种封装格式
+ *
+ *  使用32K滑动窗口和哈希链查找重复串, 1-3级使用贪婪匹配, 4-9级使用延迟匹配,
+ *  每个块按实际符号频率选择动态哈夫曼、固定哈夫曼或不压缩中编码最短的方式.
+ *  输入可以分多次提供, 压缩结果通过回调函数分段输出, 不要求输入或输出是连续内存.
+ *  压缩对象约占用260K内存, 创建后可重复用于多次压缩, 同一对象不能被多个线程同时使用
+ * @file deflate.h
+ * @author Kiven Lee
+ * @date 2021-08-09
+ * @version 1.0
+*/
+
+#pragma once
+#ifndef __DEFLATE_H__
+#define __DEFLATE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** 压缩结果的封装格式 */
+typedef enum {
+    DEFLATE_RAW,            // 无封装的deflate数据
+    DEFLATE_ZLIB,           // zlib封装, http的Content-Encoding: deflate
+    DEFLATE_GZIP,           // gzip封装, http的Content-Encoding: gzip
+} deflate_format_t;
+
+/** 压缩结果的输出回调函数
+ * @param arg           用户自定义参数, deflate_begin时传入
+ * @param data          压缩后的数据
+ * @param len           数据长度
+*/
+typedef void (*deflate_out_cb) (void* arg, const void* data, uint32_t len);
+
+typedef struct deflate_t deflate_t;
+
+/** 创建压缩对象
+ * @return              压缩对象, 内存不足返回NULL
+*/
+extern deflate_t* deflate_create();
+
+/** 释放压缩对象 */
+extern void deflate_free(deflate_t* self);
+
+/** 开始一次新的压缩
+ * @param self          压缩对象
+ * @param format        封装格式
+ * @param level         压缩级别, 1-9, 越大压缩率越高速度越慢
+ * @param cb            压缩结果的输出回调函数
+ * @param arg           回调函数的用户自定义参数
+*/
+extern void deflate_begin(deflate_t* self, deflate_format_t format, int level, deflate_out_cb cb, void* arg);
+
+/** 压缩一段数据, 可多次调用, 压缩结果可能暂存在内部缓冲区直到缓冲区满或者调用deflate_end
+ * @param self          压缩对象
+ * @param data          要压缩的数据
+ * @param len           数据长度
+*/
+extern void deflate_update(deflate_t* self, const void* data, uint32_t len);
+
+/** 结束压缩, 输出剩余的全部压缩结果和封装格式的结尾
+ * @param self          压缩对象
+ * @return              本次压缩输出的总字节数
+*/
+extern uint32_t deflate_end(deflate_t* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __DEFLATE_H__
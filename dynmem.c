@@ -1,6 +1,11 @@
 #include "dynmem.h"
 #include <string.h>
 
+_Thread_local int64_t _dynmem_live_pages = 0;
+
+// 内存页计数, 只有所属线程写入, 原子写入保证其它线程读取时不会读到中间值
+#define PAGES_ADD(n) __atomic_store_n(&_dynmem_live_pages, _dynmem_live_pages + (n), __ATOMIC_RELAXED)
+
 // 字符查找回调函数的用户自定义参数结构
 typedef struct chr_arg_t {
     char        ch;     // 需要查找的字符
@@ -38,7 +43,7 @@ inline static void list_del(_dynmem_node_t *node) {
  * @param head      指针列表头部节点
 */
 inline static _dynmem_node_t* list_new(_dynmem_head_t *head) {
-    _dynmem_node_t *ret = malloc(sizeof(_dynmem_node_t));
+    _dynmem_node_t *ret = memtag_malloc(MEMTAG_DYNMEM, sizeof(_dynmem_node_t));
     list_add(head, ret);
     return ret;
 }
@@ -93,10 +98,11 @@ static uint32_t on_equal(void *arg, void *data, uint32_t len) {
  * @return          新分配的内存页地址
 */
 static uint8_t* dynmem_grow(dynmem_t *self) {
-    uint8_t *buf = malloc(self->page);
+    uint8_t *buf = memtag_malloc(MEMTAG_DYNMEM, self->page);
     _dynmem_node_t *node = list_new(&self->head);
     node->data = buf;
     self->cap += self->page;
+    PAGES_ADD(1);
     return buf;
 }
 
@@ -125,7 +131,7 @@ void dynmem_init(dynmem_t *self, uint32_t page) {
 }
 
 dynmem_t* dynmem_malloc(uint32_t page) {
-    dynmem_t *ret = malloc(sizeof(dynmem_t));
+    dynmem_t *ret = memtag_malloc(MEMTAG_DYNMEM, sizeof(dynmem_t));
     dynmem_init(ret, page);
     return ret;
 }
@@ -134,10 +140,13 @@ void dynmem_clear(dynmem_t *self) {
     // 释放链表指向的内存页和链表自身节点的内存
     _dynmem_node_t *pos, *tmp, *head = (_dynmem_node_t*)(&self->head);
     // 分配是从开头分配，释放的时候从结尾开始释放，方便内存管理器合并内存，减少内存碎片
+    int64_t pages = 0;
     for (pos = head->prev, tmp = pos->prev; pos != head; pos = tmp, tmp = pos->prev) {
-        free(pos->data);
-        free(pos);
+        memtag_free(pos->data);
+        memtag_free(pos);
+        ++pages;
     }
+    if (pages) PAGES_ADD(-pages);
 
     self->len = 0;
     self->cap = 0;
@@ -147,7 +156,7 @@ void dynmem_clear(dynmem_t *self) {
 dynmem_t* dynmem_copy(dynmem_t *self) {
     uint32_t len = self->len, page = self->page;
 
-    dynmem_t *ret = malloc(sizeof(dynmem_t));
+    dynmem_t *ret = memtag_malloc(MEMTAG_DYNMEM, sizeof(dynmem_t));
     ret->page = page;
     ret->cap = 0;
     ret->len = len;
@@ -183,10 +192,11 @@ void dynmem_set_cap(dynmem_t *self, uint32_t newcap) {
         _dynmem_head_t *head = &self->head;
         while (self->cap >= newcap) {
             _dynmem_node_t *pos = head->prev;
-            free(pos->data);
+            memtag_free(pos->data);
             list_del(pos);
-            free(pos);
+            memtag_free(pos);
             self->cap -= page;
+            PAGES_ADD(-1);
         }
     }
 
@@ -212,13 +222,22 @@ void dynmem_lastpage(dynmem_t *self, uint8_t **out_ptr, uint32_t *out_len) {
     if (len == self->cap)
         *out_ptr = dynmem_grow(self);
     else if (len + self->page >= self->cap)
-        *out_ptr = self->head.prev->data;
+        *out_ptr = self->head.prev->data + (len & (self->page - 1));
     else
         *out_ptr = dynmem_get(self, len);
 
     *out_len = dynmem_surplus(self, len);
 }
 
+void dynmem_attach(dynmem_t *self, _dynmem_node_t *node, uint8_t *data, uint32_t page, uint32_t len) {
+    self->page = page;
+    self->len = len;
+    self->cap = page;
+    list_init(&self->head);
+    node->data = data;
+    list_add(&self->head, node);
+}
+
 uint32_t dynmem_offset(dynmem_t *self, const void *pointer) {
     _dynmem_head_t *head = &self->head;
     _dynmem_node_t *node = head->next;
@@ -226,7 +245,7 @@ uint32_t dynmem_offset(dynmem_t *self, const void *pointer) {
     for (uint32_t i = 0; node != (_dynmem_node_t*) head; ++i, node = node->next) {
         uint8_t *data = node->data;
         if ((uint8_t*) pointer >= data && p_end < data)
-            return (uint8_t*)pointer - data;
+            return i * self->page + ((uint8_t*)pointer - data);
     }
     return 0xFFFFFFFF;
 }
@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "memtag.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -48,6 +49,13 @@ typedef struct dynmem_t {
 */
 typedef uint32_t (*dynmem_on_foreach) (void *arg, void *data, uint32_t len);
 
+/** 当前线程分配且尚未释放的内存页数量, 线程局部变量, 在其它线程释放的页计入释放线程,
+ *  所有线程的计数之和为实际存活的内存页数量. 挂载的外部内存(dynmem_attach)不计入 */
+extern _Thread_local int64_t _dynmem_live_pages;
+
+/** 获取当前线程的内存页计数器地址, 统计模块在其它线程中通过该地址读取 */
+inline static const int64_t* dynmem_live_pages() { return &_dynmem_live_pages; }
+
 /** 获取缓冲区长度 */
 inline static uint32_t dynmem_len(dynmem_t *self) { return self->len; }
 
@@ -80,7 +88,7 @@ extern void dynmem_clear(dynmem_t *self);
 */
 inline static void dynmem_free(dynmem_t *self) {
     dynmem_clear(self);
-    free(self);
+    memtag_free(self);
 }
 
 /** 复制一个全新的缓冲区，内容一样(容量不一定一样)
@@ -137,6 +145,26 @@ inline static uint32_t dynmem_surplus(dynmem_t *self, uint32_t offset) {
 */
 extern void dynmem_lastpage(dynmem_t *self, uint8_t **out_ptr, uint32_t *out_len);
 
+/** 将外部内存作为单个页面挂载到缓冲区(借用模式), 缓冲区不拥有该内存
+ *  挂载期间只允许读取和查找操作, 不允许写入超出容量的内容, 用完后必须调用dynmem_detach解除, 不能调用dynmem_clear
+ * 
+ * @param self      缓冲区指针
+ * @param node      调用方提供的页节点, 生命周期需覆盖整个挂载期间(通常位于栈上)
+ * @param data      外部内存地址
+ * @param page      外部内存大小, 必须是2的幂次方
+ * @param len       外部内存中的有效数据长度
+*/
+extern void dynmem_attach(dynmem_t *self, _dynmem_node_t *node, uint8_t *data, uint32_t page, uint32_t len);
+
+/** 解除dynmem_attach挂载的外部内存, 缓冲区重新初始化为空
+ * 
+ * @param self      缓冲区指针
+ * @param page      重新初始化使用的分页大小
+*/
+inline static void dynmem_detach(dynmem_t *self, uint32_t page) {
+    dynmem_init(self, page);
+}
+
 /** 获取缓冲区下一个写入位置的指针
  * 
  * @param self      缓冲区指针
@@ -0,0 +1,965 @@
+/** http压力测试工具, 基于libuv实现, 用于在本机回环地址上测量http服务的吞吐量和延迟分布
+ *
+ *  支持的测试模式:
+ *      1. 闭环模式(缺省): 每个连接保持 pipeline 个请求在途, 收到回复后立即发送下一个请求
+ *      2. 恒定到达率模式(-r): 按固定速率产生请求, 延迟从请求的计划发送时间开始计算,
+ *         服务变慢时排队等待的时间也计入延迟, 避免协调遗漏(coordinated omission)导致的延迟低估
+ *      3. 回放模式(-R): 读取服务采集(main -c)的jsonl文件, 按原始到达时间(-x调整倍速)发送采集的请求,
+ *         -x 0 表示以闭环方式最大速度循环发送, 结果中按路由(不含参数的路径)分别统计吞吐量和延迟
+ *  测试结果以json格式输出, 包含每秒请求数和延迟百分位分布
+ * @file hbench.c
+ * @author Kiven Lee
+ * @date 2021-08-02
+ * @version 1.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+#ifndef _WIN32
+#   include <strings.h>
+#   define strnicmp strncasecmp
+#endif
+
+#include "uv.h"
+#include "http_parser.h"
+#include "histogram.h"
+#include "base64.h"
+#define JSMN_STATIC
+#include "jsmn.h"
+
+/** 管线化请求的最大深度 */
+#define MAX_PIPELINE 64
+/** 等待被测服务启动的最大重试次数, 每次间隔50毫秒 */
+#define MAX_PROBE 100
+/** 启动被测服务的命令行最大参数个数 */
+#define MAX_ARGS 32
+/** 回放模式单独统计的最大路由数量, 超出的路由合并统计 */
+#define MAX_ROUTES 256
+/** 计划发送模式距离下一个计划时间超过该值(纳秒)时用定时器休眠, 否则在空闲回调中轮询 */
+#define SPIN_AHEAD 2000000
+
+// 测试参数
+typedef struct bench_cfg_t {
+    char*       host;                   // 服务地址
+    int         port;                   // 服务端口
+    char*       path;                   // 请求路径
+    uint32_t    connections;            // 连接数量
+    uint32_t    pipeline;               // 每个连接的管线化深度
+    uint32_t    duration;               // 测试时长(秒)
+    uint32_t    warmup;                 // 预热时长(秒), 预热期间的结果不计入统计
+    double      rate;                   // 恒定到达率模式的每秒请求数, 0表示闭环模式
+    bool        keep_alive;             // 是否使用长连接, false时每个请求使用新连接
+    char*       server_cmd;             // 被测服务启动命令, NULL表示使用已运行的服务
+    char*       output;                 // 结果输出文件, NULL表示输出到控制台
+    char*       replay;                 // 回放的采集文件, NULL表示使用固定的请求路径
+    double      speed;                  // 回放倍速, 1表示按原始时间回放, 0表示最大速度
+} bench_cfg_t;
+
+// 请求记录, 非回放模式只有一个记录
+typedef struct req_rec_t {
+    uint64_t        time;               // 回放模式下请求的计划发送时间(相对于测试开始的纳秒数)
+    char*           data;               // 请求报文
+    uint32_t        len;                // 请求报文长度
+    uint32_t        route;              // 所属路由序号
+    bool            head;               // 是否HEAD请求, HEAD请求的回复没有body
+} req_rec_t;
+
+// 路由统计结果
+typedef struct route_stat_t {
+    char*           path;               // 路由路径
+    uint64_t        requests;           // 统计窗口内完成的请求数
+    uint64_t        non_2xx;            // 统计窗口内状态码不是2xx的回复数
+    hist_t          latency;            // 延迟直方图(纳秒)
+} route_stat_t;
+
+// 等待发送的计划请求
+typedef struct pending_t {
+    uint64_t        start;              // 计划发送时间(纳秒)
+    uint32_t        rec;                // 请求记录序号
+} pending_t;
+
+// 连接对象
+typedef struct conn_t {
+    uv_tcp_t        tcp;                // tcp连接对象, 必须是第一个字段
+    uv_connect_t    connect;            // 连接请求
+    http_parser     parser;             // 回复解析器
+    bool            connected;          // 连接是否已建立
+    bool            closing;            // 连接是否正在关闭
+    uint32_t        inflight;           // 在途请求数量
+    uint32_t        head;               // 最早的在途请求在starts中的位置
+    pending_t       slots[MAX_PIPELINE]; // 在途请求的起始时间和请求记录, 环形数组
+} conn_t;
+
+// 测试统计结果
+typedef struct bench_stat_t {
+    uint64_t    requests;               // 统计窗口内完成的请求数
+    uint64_t    non_2xx;                // 统计窗口内状态码不是2xx的回复数
+    uint64_t    errors;                 // 连接/读取/解析错误数
+    uint64_t    connects;               // 建立的连接数
+    uint64_t    bytes_in;               // 统计窗口内读取的字节数
+    hist_t      latency;                // 延迟直方图(纳秒)
+    hist_t      gen_lag;                // 计划发送模式下产生请求的时间落后于计划时间的直方图(纳秒)
+} bench_stat_t;
+
+static bench_cfg_t g_cfg = {
+    .host           = "127.0.0.1",
+    .port           = 8888,
+    .path           = "/",
+    .connections    = 32,
+    .pipeline       = 1,
+    .duration       = 10,
+    .warmup         = 1,
+    .rate           = 0,
+    .keep_alive     = true,
+    .speed          = 1,
+};
+
+static char *g_app_name;
+static uv_loop_t *g_loop;
+static conn_t *g_conns;
+static bench_stat_t g_stat;
+static struct sockaddr_in g_addr;
+
+/** 预生成的请求记录, 所有连接共用 */
+static req_rec_t *g_recs;
+static uint32_t g_rec_count;
+/** 回放文件中因内容不完整被跳过的记录数 */
+static uint32_t g_rec_skipped;
+/** 回放模式的路由统计 */
+static route_stat_t *g_routes[MAX_ROUTES];
+static uint32_t g_route_count;
+/** 在途请求总数 */
+static uint64_t g_inflight;
+/** 所有连接共用的读取缓冲区, 读取回调完成前不会再次分配 */
+static char g_rbuf[65536];
+
+static bool g_running;
+static uint64_t g_start_time, g_measure_start, g_measure_end;
+
+/** 计划发送模式下已经到达计划时间但还没有连接可发送的请求, 环形队列 */
+static pending_t *g_backlog;
+static uint32_t g_backlog_cap, g_backlog_head, g_backlog_len;
+/** 已经产生的计划请求数量, 闭环模式下为已发送的请求数量 */
+static uint64_t g_scheduled;
+/** 下一个检查空闲槽位的连接序号 */
+static uint32_t g_cursor;
+
+static uv_process_t g_server;
+static bool g_server_spawned;
+static uv_timer_t g_probe_timer, g_rate_timer, g_end_timer;
+static uv_idle_t g_rate_idle;
+static uv_tcp_t g_probe;
+static uv_connect_t g_probe_req;
+static uint32_t g_probe_count;
+
+// 函数预声明--------
+static void conn_open(conn_t* c);
+static void bench_begin();
+static void bench_end();
+
+/** 使用帮助 */
+static void usage() {
+    printf("http benchmark tool, measure throughput and latency over loopback.\n\n");
+    printf("Usage: %s [option]\n\n", g_app_name);
+    printf("Options:\n");
+    printf("    -c count        connections, default %u\n", g_cfg.connections);
+    printf("    -d seconds      test duration, default %u\n", g_cfg.duration);
+    printf("    -h              show this help\n");
+    printf("    -k              disable keep-alive, one connection per request\n");
+    printf("    -o file         write json result to file, default stdout\n");
+    printf("    -p depth        pipeline depth per connection, default %u, max %u\n", g_cfg.pipeline, MAX_PIPELINE);
+    printf("    -r rate         constant arrival rate (requests/second), default closed-loop\n");
+    printf("    -R file         replay requests captured by server (jsonl), per route results\n");
+    printf("    -s command      spawn the server with command before test, killed after test\n");
+    printf("    -u url          request url, default http://%s:%d%s\n", g_cfg.host, g_cfg.port, g_cfg.path);
+    printf("    -w seconds      warmup time excluded from results, default %u, replay default 0\n", g_cfg.warmup);
+    printf("    -x speed        replay speed factor, default %g, 0 means max speed\n", g_cfg.speed);
+    printf("                    replay duration defaults to capture span / speed + 1 second\n");
+    exit(0);
+}
+
+/** 解析url, 格式 [http://]host[:port][/path] */
+static bool parse_url(char* url) {
+    if (!strncmp(url, "http://", 7)) url += 7;
+    char *path = strchr(url, '/');
+    if (path) {
+        g_cfg.path = strdup(path);
+        *path = '\0';
+    }
+    char *port = strchr(url, ':');
+    if (port) {
+        *port++ = '\0';
+        g_cfg.port = atoi(port);
+    }
+    if (*url) g_cfg.host = url;
+    return g_cfg.port > 0 && g_cfg.port < 65536;
+}
+
+/** 处理命令行参数 */
+static void process_cmdline(int argc, char **argv) {
+    int c;
+    bool duration_set = false, warmup_set = false;
+    while ((c = getopt(argc, argv, "c:d:hko:p:r:R:s:u:w:x:")) != -1) {
+        switch (c) {
+            case 'c': g_cfg.connections = atoi(optarg); break;
+            case 'd': g_cfg.duration = atoi(optarg); duration_set = true; break;
+            case 'h': usage(); break;
+            case 'k': g_cfg.keep_alive = false; break;
+            case 'o': g_cfg.output = optarg; break;
+            case 'p': g_cfg.pipeline = atoi(optarg); break;
+            case 'r': g_cfg.rate = atof(optarg); break;
+            case 'R': g_cfg.replay = optarg; break;
+            case 's': g_cfg.server_cmd = optarg; break;
+            case 'u':
+                if (!parse_url(optarg)) {
+                    fprintf(stderr, "invalid url: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'w': g_cfg.warmup = atoi(optarg); warmup_set = true; break;
+            case 'x': g_cfg.speed = atof(optarg); break;
+            default: printf("Try %s -h for more informaton.\n", g_app_name); exit(1);
+        }
+    }
+
+    if (g_cfg.replay) {
+        // 回放模式按采集的时间发送, 忽略恒定到达率, 缺省不预热, 测试时长在加载采集文件后确定
+        g_cfg.rate = 0;
+        if (g_cfg.speed < 0) g_cfg.speed = 0;
+        if (!warmup_set) g_cfg.warmup = 0;
+        if (!duration_set && g_cfg.speed > 0) g_cfg.duration = 0;
+    }
+    if (!g_cfg.connections) g_cfg.connections = 1;
+    if (!g_cfg.duration && !g_cfg.replay) g_cfg.duration = 1;
+    if (!g_cfg.pipeline) g_cfg.pipeline = 1;
+    if (g_cfg.pipeline > MAX_PIPELINE) g_cfg.pipeline = MAX_PIPELINE;
+    // 短连接模式下每个连接只能有一个在途请求
+    if (!g_cfg.keep_alive) g_cfg.pipeline = 1;
+}
+
+/** 连接控制头部, 回放时替换采集请求中的同名头部 */
+inline static const char* conn_header() {
+    return g_cfg.keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+}
+
+/** 是否按计划时间发送请求(恒定到达率模式或按时间回放), 否则为闭环模式 */
+inline static bool is_scheduled() {
+    return g_cfg.rate > 0 || (g_cfg.replay && g_cfg.speed > 0);
+}
+
+/** 生成请求内容 */
+static void make_request() {
+    const char *fmt = "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: hbench/1.0\r\n%s\r\n";
+    int len = snprintf(NULL, 0, fmt, g_cfg.path, g_cfg.host, g_cfg.port, conn_header());
+    g_recs = calloc(1, sizeof(req_rec_t));
+    g_recs->data = malloc(len + 1);
+    g_recs->len = snprintf(g_recs->data, len + 1, fmt, g_cfg.path, g_cfg.host, g_cfg.port, conn_header());
+    g_rec_count = 1;
+}
+
+/** 获取路由序号, 路由不存在时新建, 超出最大数量的路由合并到最后一个路由 */
+static uint32_t route_index(const char* path, size_t len) {
+    for (uint32_t i = 0; i < g_route_count; ++i) {
+        const char *p = g_routes[i]->path;
+        if (!strncmp(p, path, len) && !p[len]) return i;
+    }
+    if (g_route_count == MAX_ROUTES) return MAX_ROUTES - 1;
+    if (g_route_count == MAX_ROUTES - 1) {
+        path = "(other)";
+        len = 7;
+    }
+
+    route_stat_t *r = malloc(sizeof(route_stat_t));
+    r->path = malloc(len + 1);
+    memcpy(r->path, path, len);
+    r->path[len] = '\0';
+    r->requests = r->non_2xx = 0;
+    hist_init(&r->latency);
+    g_routes[g_route_count] = r;
+    return g_route_count++;
+}
+
+/** 读取整个文件内容, 末尾补'\0' */
+static char* read_file(const char* filename, size_t* out_len) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *data = size >= 0 ? malloc(size + 1) : NULL;
+    if (data) {
+        *out_len = fread(data, 1, size, fp);
+        data[*out_len] = '\0';
+    }
+    fclose(fp);
+    return data;
+}
+
+/** 就地解码json字符串token的转义字符, 返回解码后的长度,
+ *  \u00XX 解码为单字节(与服务采集时的编码方式对应), 更大的码点按utf8编码 */
+static size_t tok_str(char* js, const jsmntok_t* t) {
+    char *s = js + t->start, *end = js + t->end, *d = s;
+    while (s < end) {
+        if (*s != '\\' || s + 1 == end) {
+            *d++ = *s++;
+            continue;
+        }
+        char c = s[1];
+        s += 2;
+        switch (c) {
+            case 'b': *d++ = '\b'; break;
+            case 'f': *d++ = '\f'; break;
+            case 'n': *d++ = '\n'; break;
+            case 'r': *d++ = '\r'; break;
+            case 't': *d++ = '\t'; break;
+            case 'u': {
+                if (end - s < 4) break;
+                char hex[5] = { s[0], s[1], s[2], s[3], '\0' };
+                uint32_t u = (uint32_t) strtoul(hex, NULL, 16);
+                s += 4;
+                if (u < 0x100) {
+                    *d++ = (char) u;
+                } else if (u < 0x800) {
+                    *d++ = (char) (0xc0 | (u >> 6));
+                    *d++ = (char) (0x80 | (u & 0x3f));
+                } else {
+                    *d++ = (char) (0xe0 | (u >> 12));
+                    *d++ = (char) (0x80 | ((u >> 6) & 0x3f));
+                    *d++ = (char) (0x80 | (u & 0x3f));
+                }
+                break;
+            }
+            default: *d++ = c; break;
+        }
+    }
+    return d - (js + t->start);
+}
+
+/** 比较json字符串token是否等于指定的键名 */
+inline static bool tok_eq(const char* js, const jsmntok_t* t, const char* key) {
+    size_t len = strlen(key);
+    return t->type == JSMN_STRING && (size_t) (t->end - t->start) == len && !memcmp(js + t->start, key, len);
+}
+
+/** 跳过token及其所有子token, 返回下一个同级token的位置 */
+static int tok_skip(const jsmntok_t* toks, int i) {
+    int next = i + 1;
+    for (int j = 0; j < toks[i].size; ++j)
+        next = tok_skip(toks, next);
+    return next;
+}
+
+/** 回放时需要替换的头部, 连接控制和内容长度由hbench重新生成 */
+static bool is_replaced_header(const char* field, size_t len) {
+    static const char *NAMES[] = { "Connection", "Keep-Alive", "Content-Length", "Transfer-Encoding" };
+    for (size_t i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); ++i) {
+        if (strlen(NAMES[i]) == len && !strnicmp(field, NAMES[i], len))
+            return true;
+    }
+    return false;
+}
+
+/** 解析一行采集记录并生成请求报文, 记录格式见capture.h
+ * @param js            记录内容, 解析过程中会就地修改
+ * @param len           记录长度
+ * @param toks          token缓冲区, 空间不足时自动扩大
+ * @param tok_cap       token缓冲区容量
+ * @param rec           生成的请求记录, time字段为采集时的到达时间(纳秒)
+ * @return              成功返回true, 记录格式错误或者body不完整时返回false
+*/
+static bool parse_record(char* js, size_t len, jsmntok_t** toks, int* tok_cap, req_rec_t* rec) {
+    jsmn_parser p;
+    jsmn_init(&p);
+    int n = jsmn_parse(&p, js, len, NULL, 0);
+    if (n < 1) return false;
+    if (n > *tok_cap) {
+        *tok_cap = n;
+        *toks = realloc(*toks, sizeof(jsmntok_t) * n);
+    }
+    jsmntok_t *t = *toks;
+    jsmn_init(&p);
+    if (jsmn_parse(&p, js, len, t, n) != n || t[0].type != JSMN_OBJECT) return false;
+
+    int method = 0, url = 0, headers = 0, body = 0;
+    uint64_t t_us = 0, body_len = 0;
+    for (int i = 1, k = 0; k < t[0].size && i < n; ++k) {
+        int v = i + 1;
+        if (tok_eq(js, &t[i], "t_us")) t_us = strtoull(js + t[v].start, NULL, 10);
+        else if (tok_eq(js, &t[i], "method")) method = v;
+        else if (tok_eq(js, &t[i], "url")) url = v;
+        else if (tok_eq(js, &t[i], "headers")) headers = v;
+        else if (tok_eq(js, &t[i], "body_len")) body_len = strtoull(js + t[v].start, NULL, 10);
+        else if (tok_eq(js, &t[i], "body")) body = v;
+        i = tok_skip(t, v);
+    }
+    if (!method || !url || t[method].type != JSMN_STRING || t[url].type != JSMN_STRING)
+        return false;
+
+    // 解码body, 采集时被截断的记录无法还原请求, 直接跳过
+    size_t blen = body ? (size_t) (t[body].end - t[body].start) : 0;
+    char *bdata = js + (body ? t[body].start : 0);
+    if (blen) blen = base64_decode(bdata, (const uint8_t*) bdata, blen);
+    if (blen != body_len) return false;
+
+    size_t mlen = tok_str(js, &t[method]), ulen = tok_str(js, &t[url]);
+    char *mstr = js + t[method].start, *ustr = js + t[url].start;
+
+    // 计算请求报文长度并解码头部
+    size_t size = mlen + ulen + 96 + blen;
+    int hcount = headers && t[headers].type == JSMN_ARRAY ? t[headers].size : 0;
+    for (int i = headers + 1, k = 0; k < hcount; ++k, i = tok_skip(t, i)) {
+        if (t[i].type != JSMN_ARRAY || t[i].size != 2) return false;
+        size += t[i + 1].end - t[i + 1].start + t[i + 2].end - t[i + 2].start + 4;
+    }
+
+    char *data = malloc(size), *d = data;
+    memcpy(d, mstr, mlen);
+    d += mlen;
+    *d++ = ' ';
+    memcpy(d, ustr, ulen);
+    d += ulen;
+    d += sprintf(d, " HTTP/1.1\r\n");
+    for (int i = headers + 1, k = 0; k < hcount; ++k, i = tok_skip(t, i)) {
+        size_t flen = tok_str(js, &t[i + 1]), vlen = tok_str(js, &t[i + 2]);
+        if (is_replaced_header(js + t[i + 1].start, flen)) continue;
+        memcpy(d, js + t[i + 1].start, flen);
+        d += flen;
+        *d++ = ':';
+        *d++ = ' ';
+        memcpy(d, js + t[i + 2].start, vlen);
+        d += vlen;
+        *d++ = '\r';
+        *d++ = '\n';
+    }
+    d += sprintf(d, "%s", conn_header());
+    if (blen) d += sprintf(d, "Content-Length: %u\r\n", (uint32_t) blen);
+    *d++ = '\r';
+    *d++ = '\n';
+    memcpy(d, bdata, blen);
+    d += blen;
+
+    // 路由为不含参数的路径
+    char *q = memchr(ustr, '?', ulen);
+    rec->route = route_index(ustr, q ? (size_t) (q - ustr) : ulen);
+    rec->head = mlen == 4 && !memcmp(mstr, "HEAD", 4);
+    rec->time = t_us * 1000;
+    rec->data = data;
+    rec->len = (uint32_t) (d - data);
+    return true;
+}
+
+/** 加载回放文件, 生成所有请求记录, 计划发送时间按回放倍速换算 */
+static bool load_replay(const char* filename) {
+    size_t len;
+    char *js = read_file(filename, &len);
+    if (!js) {
+        fprintf(stderr, "can't read replay file %s\n", filename);
+        return false;
+    }
+
+    uint32_t cap = 1024;
+    g_recs = malloc(sizeof(req_rec_t) * cap);
+    jsmntok_t *toks = NULL;
+    int tok_cap = 0;
+    uint64_t prev = 0, offset = 0;
+    for (char *line = js, *end = js + len; line < end; ) {
+        char *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        if (eol - line > 1) {
+            if (g_rec_count == cap) g_recs = realloc(g_recs, sizeof(req_rec_t) * (cap <<= 1));
+            req_rec_t *rec = &g_recs[g_rec_count];
+            if (parse_record(line, eol - line, &toks, &tok_cap, rec)) {
+                // 采集文件由多次采集追加而成时, 后一次采集的时间紧接着前一次
+                if (rec->time < prev && g_rec_count)
+                    offset = g_recs[g_rec_count - 1].time - rec->time;
+                prev = rec->time;
+                rec->time += offset;
+                ++g_rec_count;
+            } else {
+                ++g_rec_skipped;
+            }
+        }
+        line = eol + 1;
+    }
+    free(toks);
+    free(js);
+    if (!g_rec_count) {
+        fprintf(stderr, "no valid record in replay file %s\n", filename);
+        return false;
+    }
+
+    // 计划发送时间从0开始, 按倍速换算
+    uint64_t first = g_recs[0].time;
+    for (uint32_t i = 0; i < g_rec_count; ++i)
+        g_recs[i].time = g_cfg.speed > 0 ? (uint64_t) ((g_recs[i].time - first) / g_cfg.speed) : 0;
+    if (!g_cfg.duration)
+        g_cfg.duration = (uint32_t) (g_recs[g_rec_count - 1].time / 1000000000) + 1;
+    return true;
+}
+
+/** 判断时间点是否在统计窗口内 */
+inline static bool in_window(uint64_t t) {
+    return t >= g_measure_start && t < g_measure_end;
+}
+
+/** 待发送队列加入一个计划请求 */
+static void backlog_push(uint64_t start, uint32_t rec) {
+    if (g_backlog_len == g_backlog_cap) {
+        uint32_t cap = g_backlog_cap ? g_backlog_cap << 1 : 1024;
+        pending_t *nb = malloc(sizeof(pending_t) * cap);
+        for (uint32_t i = 0; i < g_backlog_len; ++i)
+            nb[i] = g_backlog[(g_backlog_head + i) & (g_backlog_cap - 1)];
+        free(g_backlog);
+        g_backlog = nb;
+        g_backlog_cap = cap;
+        g_backlog_head = 0;
+    }
+    pending_t *p = &g_backlog[(g_backlog_head + g_backlog_len++) & (g_backlog_cap - 1)];
+    p->start = start;
+    p->rec = rec;
+}
+
+/** 待发送队列取出最早的计划请求 */
+inline static pending_t backlog_pop() {
+    pending_t t = g_backlog[g_backlog_head];
+    g_backlog_head = (g_backlog_head + 1) & (g_backlog_cap - 1);
+    --g_backlog_len;
+    return t;
+}
+
+static void on_writed(uv_write_t* req, int status) {
+    if (status < 0 && status != UV_ECANCELED)
+        ++g_stat.errors;
+    free(req);
+}
+
+/** 在连接上发送请求, 闭环模式填满管线并依次循环使用请求记录, 计划发送模式从待发送队列中获取请求 */
+static void conn_fill(conn_t* c) {
+    if (!g_running || !c->connected || c->closing) return;
+
+    uv_buf_t bufs[MAX_PIPELINE];
+    uint32_t n = 0;
+    uint64_t now = uv_hrtime();
+    bool scheduled = is_scheduled();
+    while (c->inflight < g_cfg.pipeline) {
+        pending_t *slot = &c->slots[(c->head + c->inflight) % MAX_PIPELINE];
+        if (scheduled) {
+            if (!g_backlog_len) break;
+            *slot = backlog_pop();
+        } else {
+            slot->start = now;
+            slot->rec = (uint32_t) (g_scheduled++ % g_rec_count);
+        }
+        ++c->inflight;
+        req_rec_t *rec = &g_recs[slot->rec];
+        bufs[n++] = uv_buf_init(rec->data, rec->len);
+    }
+    if (!n) return;
+    g_inflight += n;
+
+    uv_write_t *req = malloc(sizeof(uv_write_t));
+    uv_write(req, (uv_stream_t*) c, bufs, n, on_writed);
+}
+
+static void on_closed(uv_handle_t* handle) {
+    conn_t *c = (conn_t*) handle;
+    c->connected = false;
+    c->closing = false;
+    // 先扣除全部未完成的请求, 重新排队的请求再次发送时重新计数
+    g_inflight -= c->inflight;
+    // 计划发送模式下未完成的请求重新排队, 它们的计划时间不变
+    if (is_scheduled()) {
+        while (c->inflight) {
+            pending_t *slot = &c->slots[c->head];
+            backlog_push(slot->start, slot->rec);
+            c->head = (c->head + 1) % MAX_PIPELINE;
+            --c->inflight;
+        }
+    }
+    c->inflight = 0;
+    c->head = 0;
+    if (g_running) conn_open(c);
+}
+
+/** 关闭连接, 关闭完成后自动重新连接 */
+static void conn_close(conn_t* c) {
+    if (c->closing) return;
+    c->closing = true;
+    uv_close((uv_handle_t*) c, on_closed);
+}
+
+/** 回复头部解析完成, HEAD请求的回复没有body, 返回1通知解析器跳过body */
+static int on_headers_complete(http_parser* parser) {
+    conn_t *c = parser->data;
+    return c->inflight && g_recs[c->slots[c->head].rec].head ? 1 : 0;
+}
+
+static int on_message_complete(http_parser* parser) {
+    conn_t *c = parser->data;
+    if (!c->inflight) return 0;
+
+    uint64_t now = uv_hrtime();
+    pending_t slot = c->slots[c->head];
+    c->head = (c->head + 1) % MAX_PIPELINE;
+    --c->inflight;
+    --g_inflight;
+
+    // 只统计计划发送时间和完成时间都在统计窗口内的请求
+    if (in_window(slot.start) && in_window(now)) {
+        bool non_2xx = parser->status_code < 200 || parser->status_code > 299;
+        ++g_stat.requests;
+        if (non_2xx) ++g_stat.non_2xx;
+        hist_record(&g_stat.latency, now - slot.start);
+        if (g_cfg.replay) {
+            route_stat_t *r = g_routes[g_recs[slot.rec].route];
+            ++r->requests;
+            if (non_2xx) ++r->non_2xx;
+            hist_record(&r->latency, now - slot.start);
+        }
+    }
+
+    // 按时间回放时所有记录完成后提前结束测试
+    if (g_cfg.replay && is_scheduled() && g_scheduled == g_rec_count && !g_inflight && !g_backlog_len) {
+        if (now < g_measure_end) g_measure_end = now > g_measure_start ? now : g_measure_start + 1;
+        bench_end();
+    }
+    return 0;
+}
+
+static http_parser_settings g_parser_settings = {
+    .on_headers_complete = on_headers_complete,
+    .on_message_complete = on_message_complete,
+};
+
+static void on_allocing(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    buf->base = g_rbuf;
+    buf->len = sizeof(g_rbuf);
+}
+
+static void on_readed(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    conn_t *c = (conn_t*) stream;
+    if (nread < 0) {
+        if (g_running && (nread != UV_EOF || c->inflight)) ++g_stat.errors;
+        conn_close(c);
+        return;
+    }
+    if (!nread) return;
+
+    if (in_window(uv_hrtime())) g_stat.bytes_in += nread;
+    size_t parsed = http_parser_execute(&c->parser, &g_parser_settings, buf->base, nread);
+    if (parsed != (size_t) nread || HTTP_PARSER_ERRNO(&c->parser) != HPE_OK) {
+        ++g_stat.errors;
+        conn_close(c);
+        return;
+    }
+
+    // 短连接模式下收到回复后关闭连接, 由关闭回调重新建立连接
+    if (!g_cfg.keep_alive && !c->inflight)
+        conn_close(c);
+    else
+        conn_fill(c);
+}
+
+static void on_connected(uv_connect_t* req, int status) {
+    conn_t *c = (conn_t*) req->handle;
+    if (status < 0) {
+        if (g_running) ++g_stat.errors;
+        conn_close(c);
+        return;
+    }
+    ++g_stat.connects;
+    c->connected = true;
+    http_parser_init(&c->parser, HTTP_RESPONSE);
+    c->parser.data = c;
+    uv_tcp_nodelay(&c->tcp, 1);
+    uv_read_start((uv_stream_t*) c, on_allocing, on_readed);
+    conn_fill(c);
+}
+
+static void conn_open(conn_t* c) {
+    uv_tcp_init(g_loop, &c->tcp);
+    uv_tcp_connect(&c->connect, &c->tcp, (const struct sockaddr*) &g_addr, on_connected);
+}
+
+/** 产生到期的计划请求, 返回下一个计划请求的时间, 没有后续请求时返回UINT64_MAX */
+static uint64_t rate_generate(uint64_t now) {
+    uint64_t elapsed = now - g_start_time, next = UINT64_MAX, start;
+    if (g_cfg.replay) {
+        // 回放模式按采集记录的到达时间产生计划请求, 每个记录只发送一次
+        for (; g_scheduled < g_rec_count && g_recs[g_scheduled].time <= elapsed; ++g_scheduled) {
+            start = g_start_time + g_recs[g_scheduled].time;
+            if (in_window(start)) hist_record(&g_stat.gen_lag, now - start);
+            backlog_push(start, (uint32_t) g_scheduled);
+        }
+        if (g_scheduled < g_rec_count) next = g_start_time + g_recs[g_scheduled].time;
+    } else {
+        double interval = 1e9 / g_cfg.rate;
+        uint64_t due = (uint64_t) (elapsed / interval) + 1;
+        for (; g_scheduled < due; ++g_scheduled) {
+            start = g_start_time + (uint64_t) (g_scheduled * interval);
+            if (in_window(start)) hist_record(&g_stat.gen_lag, now - start);
+            backlog_push(start, 0);
+        }
+        next = g_start_time + (uint64_t) (g_scheduled * interval);
+    }
+    return next;
+}
+
+static void on_rate_timer(uv_timer_t* handle);
+
+/**
+ * 计划发送模式的空闲回调, 空闲回调使事件循环不阻塞等待, 每轮循环都会检查到期的计划请求,
+ * 精度不受定时器毫秒粒度限制; 距离下一个计划时间较远时改用定时器休眠, 避免空转
+ */
+static void on_rate_idle(uv_idle_t* handle) {
+    if (!g_running) {
+        uv_idle_stop(handle);
+        return;
+    }
+    uint64_t now = uv_hrtime();
+    uint64_t next = rate_generate(now);
+
+    for (uint32_t i = 0; i < g_cfg.connections && g_backlog_len; ++i) {
+        conn_fill(&g_conns[g_cursor]);
+        if (++g_cursor == g_cfg.connections) g_cursor = 0;
+    }
+
+    if (next == UINT64_MAX) {
+        uv_idle_stop(handle);
+    } else if (next > now + SPIN_AHEAD) {
+        uv_idle_stop(handle);
+        uv_timer_start(&g_rate_timer, on_rate_timer, (next - now - SPIN_AHEAD) / 1000000, 0);
+    }
+}
+
+/** 休眠结束, 恢复空闲回调轮询 */
+static void on_rate_timer(uv_timer_t* handle) {
+    if (g_running) uv_idle_start(&g_rate_idle, on_rate_idle);
+}
+
+/** 输出json字符串, 转义引号、反斜杠和控制字符 */
+static void print_json_str(FILE* fp, const char* str) {
+    fputc('"', fp);
+    for (const uint8_t *p = (const uint8_t*) str; *p; ++p) {
+        if (*p == '"' || *p == '\\') fprintf(fp, "\\%c", *p);
+        else if (*p < 0x20) fprintf(fp, "\\u%04x", *p);
+        else fputc(*p, fp);
+    }
+    fputc('"', fp);
+}
+
+/** 输出每个路由的统计结果 */
+static void print_routes(FILE* fp, double secs) {
+    fprintf(fp, "  \"routes\": [\n");
+    for (uint32_t i = 0; i < g_route_count; ++i) {
+        route_stat_t *r = g_routes[i];
+        hist_t *h = &r->latency;
+        fprintf(fp, "    {\"route\": ");
+        print_json_str(fp, r->path);
+        fprintf(fp, ", \"requests\": %llu, \"rps\": %.1f, \"non_2xx\": %llu, "
+                "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p99.9_us\": %.1f, \"max_us\": %.1f}%s\n",
+                (unsigned long long) r->requests, r->requests / secs, (unsigned long long) r->non_2xx,
+                hist_mean(h) / 1e3, hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+                hist_percentile(h, 99.9) / 1e3, h->max / 1e3, i + 1 < g_route_count ? "," : "");
+    }
+    fprintf(fp, "  ],\n");
+}
+
+/** 输出测试结果 */
+static void print_result() {
+    FILE *fp = g_cfg.output ? fopen(g_cfg.output, "w") : stdout;
+    if (!fp) {
+        fprintf(stderr, "can't open output file %s\n", g_cfg.output);
+        fp = stdout;
+    }
+
+    hist_t *h = &g_stat.latency;
+    double secs = (double) (g_measure_end - g_measure_start) / 1e9;
+    static const double PERCENTILES[] = { 50, 75, 90, 99, 99.9, 99.99, 100 };
+
+    const char *mode = g_cfg.replay ? (g_cfg.speed > 0 ? "replay" : "replay-max")
+            : (g_cfg.rate > 0 ? "constant-rate" : "closed-loop");
+    fprintf(fp, "{\n");
+    if (g_cfg.replay) {
+        fprintf(fp, "  \"replay\": ");
+        print_json_str(fp, g_cfg.replay);
+        fprintf(fp, ",\n");
+        fprintf(fp, "  \"speed\": %g,\n", g_cfg.speed);
+        fprintf(fp, "  \"records\": %u,\n", g_rec_count);
+        fprintf(fp, "  \"skipped\": %u,\n", g_rec_skipped);
+        fprintf(fp, "  \"sent\": %llu,\n", (unsigned long long) g_scheduled);
+        fprintf(fp, "  \"addr\": \"%s:%d\",\n", g_cfg.host, g_cfg.port);
+    } else {
+        fprintf(fp, "  \"url\": \"http://%s:%d%s\",\n", g_cfg.host, g_cfg.port, g_cfg.path);
+    }
+    fprintf(fp, "  \"mode\": \"%s\",\n", mode);
+    fprintf(fp, "  \"target_rate\": %.1f,\n", g_cfg.rate);
+    fprintf(fp, "  \"connections\": %u,\n", g_cfg.connections);
+    fprintf(fp, "  \"pipeline\": %u,\n", g_cfg.pipeline);
+    fprintf(fp, "  \"keep_alive\": %s,\n", g_cfg.keep_alive ? "true" : "false");
+    fprintf(fp, "  \"duration_s\": %.3f,\n", secs);
+    fprintf(fp, "  \"requests\": %llu,\n", (unsigned long long) g_stat.requests);
+    fprintf(fp, "  \"rps\": %.1f,\n", g_stat.requests / secs);
+    fprintf(fp, "  \"non_2xx\": %llu,\n", (unsigned long long) g_stat.non_2xx);
+    fprintf(fp, "  \"errors\": %llu,\n", (unsigned long long) g_stat.errors);
+    fprintf(fp, "  \"connects\": %llu,\n", (unsigned long long) g_stat.connects);
+    fprintf(fp, "  \"backlog\": %u,\n", g_backlog_len);
+    fprintf(fp, "  \"bytes_in\": %llu,\n", (unsigned long long) g_stat.bytes_in);
+    fprintf(fp, "  \"latency_us\": {\n");
+    fprintf(fp, "    \"min\": %.1f,\n", h->count ? h->min / 1e3 : 0);
+    fprintf(fp, "    \"mean\": %.1f,\n", hist_mean(h) / 1e3);
+    fprintf(fp, "    \"p50\": %.1f,\n", hist_percentile(h, 50) / 1e3);
+    fprintf(fp, "    \"p99\": %.1f,\n", hist_percentile(h, 99) / 1e3);
+    fprintf(fp, "    \"p99.9\": %.1f,\n", hist_percentile(h, 99.9) / 1e3);
+    fprintf(fp, "    \"max\": %.1f\n", h->max / 1e3);
+    fprintf(fp, "  },\n");
+    if (is_scheduled()) {
+        // 产生请求的延迟已计入请求延迟, 单独输出便于区分压测端自身的调度误差
+        hist_t *g = &g_stat.gen_lag;
+        fprintf(fp, "  \"gen_lag_us\": {\n");
+        fprintf(fp, "    \"mean\": %.1f,\n", hist_mean(g) / 1e3);
+        fprintf(fp, "    \"p50\": %.1f,\n", hist_percentile(g, 50) / 1e3);
+        fprintf(fp, "    \"p99\": %.1f,\n", hist_percentile(g, 99) / 1e3);
+        fprintf(fp, "    \"p99.9\": %.1f,\n", hist_percentile(g, 99.9) / 1e3);
+        fprintf(fp, "    \"max\": %.1f\n", g->max / 1e3);
+        fprintf(fp, "  },\n");
+    }
+    if (g_cfg.replay) print_routes(fp, secs);
+    fprintf(fp, "  \"percentiles\": [\n");
+    size_t pc = sizeof(PERCENTILES) / sizeof(PERCENTILES[0]);
+    for (size_t i = 0; i < pc; ++i) {
+        fprintf(fp, "    {\"percentile\": %g, \"value_us\": %.1f}%s\n", PERCENTILES[i],
+                hist_percentile(h, PERCENTILES[i]) / 1e3, i + 1 < pc ? "," : "");
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+
+    if (fp != stdout) fclose(fp);
+}
+
+static void on_server_exit(uv_process_t* process, int64_t exit_status, int term_signal) {
+    uv_close((uv_handle_t*) process, NULL);
+}
+
+/** 测试结束, 输出结果并退出事件循环 */
+static void bench_end() {
+    if (!g_running) return;
+    g_running = false;
+    print_result();
+    if (g_server_spawned) uv_process_kill(&g_server, SIGTERM);
+    uv_stop(g_loop);
+}
+
+static void on_end_timer(uv_timer_t* handle) {
+    bench_end();
+}
+
+/** 开始测试 */
+static void bench_begin() {
+    g_running = true;
+    g_start_time = uv_hrtime();
+    g_measure_start = g_start_time + (uint64_t) g_cfg.warmup * 1000000000;
+    g_measure_end = g_measure_start + (uint64_t) g_cfg.duration * 1000000000;
+    hist_init(&g_stat.latency);
+    hist_init(&g_stat.gen_lag);
+
+    g_conns = calloc(g_cfg.connections, sizeof(conn_t));
+    for (uint32_t i = 0; i < g_cfg.connections; ++i)
+        conn_open(&g_conns[i]);
+
+    if (is_scheduled()) {
+        uv_timer_init(g_loop, &g_rate_timer);
+        uv_idle_init(g_loop, &g_rate_idle);
+        uv_idle_start(&g_rate_idle, on_rate_idle);
+    }
+    uv_timer_init(g_loop, &g_end_timer);
+    uv_timer_start(&g_end_timer, on_end_timer, (uint64_t) (g_cfg.warmup + g_cfg.duration) * 1000, 0);
+}
+
+static void on_probe_timer(uv_timer_t* handle);
+
+static void on_probe_closed(uv_handle_t* handle) {
+    uv_timer_start(&g_probe_timer, on_probe_timer, 50, 0);
+}
+
+static void on_probe_connected(uv_connect_t* req, int status) {
+    if (status < 0) {
+        if (++g_probe_count >= MAX_PROBE) {
+            fprintf(stderr, "server %s:%d not ready: %s\n", g_cfg.host, g_cfg.port, uv_strerror(status));
+            if (g_server_spawned) uv_process_kill(&g_server, SIGTERM);
+            exit(1);
+        }
+        uv_close((uv_handle_t*) &g_probe, on_probe_closed);
+        return;
+    }
+    uv_close((uv_handle_t*) &g_probe, NULL);
+    bench_begin();
+}
+
+/** 等待被测服务就绪, 能够建立连接后开始测试 */
+static void on_probe_timer(uv_timer_t* handle) {
+    uv_tcp_init(g_loop, &g_probe);
+    uv_tcp_connect(&g_probe_req, &g_probe, (const struct sockaddr*) &g_addr, on_probe_connected);
+}
+
+/** 启动被测服务, 命令以空格分隔参数 */
+static bool spawn_server(char* cmd) {
+    char *args[MAX_ARGS + 1];
+    int argc = 0;
+    for (char *p = strtok(cmd, " "); p && argc < MAX_ARGS; p = strtok(NULL, " "))
+        args[argc++] = p;
+    args[argc] = NULL;
+    if (!argc) return false;
+
+    uv_stdio_container_t stdio[3];
+    stdio[0].flags = UV_IGNORE;
+    stdio[1].flags = UV_IGNORE;
+    stdio[2].flags = UV_INHERIT_FD;
+    stdio[2].data.fd = 2;
+
+    uv_process_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.file = args[0];
+    options.args = args;
+    options.exit_cb = on_server_exit;
+    options.stdio_count = 3;
+    options.stdio = stdio;
+
+    int r = uv_spawn(g_loop, &g_server, &options);
+    if (r) {
+        fprintf(stderr, "can't spawn server %s: %s\n", args[0], uv_strerror(r));
+        return false;
+    }
+    g_server_spawned = true;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    g_app_name = strrchr(argv[0], '/');
+    g_app_name = g_app_name ? g_app_name + 1 : argv[0];
+
+    process_cmdline(argc, argv);
+    if (!g_cfg.replay)
+        make_request();
+    else if (!load_replay(g_cfg.replay))
+        return 1;
+
+    g_loop = uv_default_loop();
+    if (uv_ip4_addr(g_cfg.host, g_cfg.port, &g_addr)) {
+        fprintf(stderr, "invalid address %s:%d\n", g_cfg.host, g_cfg.port);
+        return 1;
+    }
+
+    if (g_cfg.server_cmd && !spawn_server(g_cfg.server_cmd))
+        return 1;
+
+    uv_timer_init(g_loop, &g_probe_timer);
+    uv_timer_start(&g_probe_timer, on_probe_timer, g_server_spawned ? 50 : 0, 0);
+
+    uv_run(g_loop, UV_RUN_DEFAULT);
+    return g_stat.requests ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+#include <string.h>
+#include "histogram.h"
+
+/** 获取最高有效位的位置, value不能为0 */
+inline static uint32_t msb_index(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(value);
+#else
+    uint32_t r = 0;
+    while (value >>= 1) ++r;
+    return r;
+#endif
+}
+
+/** 计算记录值对应的桶序号 */
+inline static uint32_t bucket_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT) return (uint32_t) value;
+    if (value >> HIST_MAX_BITS) return HIST_BUCKETS - 1;
+    uint32_t shift = msb_index(value) - HIST_SUB_BITS;
+    return (shift << HIST_SUB_BITS) + (uint32_t) (value >> shift);
+}
+
+void hist_init(hist_t* self) {
+    memset(self, 0, sizeof(hist_t));
+    self->min = UINT64_MAX;
+}
+
+void hist_record(hist_t* self, uint64_t value) {
+    ++self->buckets[bucket_index(value)];
+    ++self->count;
+    self->sum += value;
+    if (value < self->min) self->min = value;
+    if (value > self->max) self->max = value;
+}
+
+void hist_merge(hist_t* self, const hist_t* src) {
+    for (uint32_t i = 0; i < HIST_BUCKETS; ++i)
+        self->buckets[i] += src->buckets[i];
+    self->count += src->count;
+    self->sum += src->sum;
+    if (src->min < self->min) self->min = src->min;
+    if (src->max > self->max) self->max = src->max;
+}
+
+uint64_t hist_bucket_lowest(uint32_t index) {
+    uint32_t group = index >> HIST_SUB_BITS;
+    if (!group) return index;
+    uint32_t shift = group - 1;
+    return (uint64_t) (index - (shift << HIST_SUB_BITS)) << shift;
+}
+
+uint64_t hist_bucket_highest(uint32_t index) {
+    uint32_t group = index >> HIST_SUB_BITS;
+    if (!group) return index;
+    return hist_bucket_lowest(index) + ((uint64_t) 1 << (group - 1)) - 1;
+}
+
+uint64_t hist_percentile(const hist_t* self, double percentile) {
+    if (!self->count) return 0;
+    if (percentile > 100) percentile = 100;
+
+    // 目标记录数向上取整, 至少为1
+    uint64_t target = (uint64_t) (percentile / 100 * self->count + 0.5);
+    if (!target) target = 1;
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < HIST_BUCKETS; ++i) {
+        total += self->buckets[i];
+        if (total >= target) {
+            uint64_t v = hist_bucket_highest(i);
+            return v > self->max ? self->max : v;
+        }
+    }
+    return self->max;
+}
+
+//======================================================================
+// #define TEST_HISTOGRAM
+#ifdef TEST_HISTOGRAM
+#include <stdio.h>
+#include <assert.h>
+
+int main() {
+    static hist_t h;
+    hist_init(&h);
+
+    // 桶序号与取值范围连续且互不重叠
+    for (uint32_t i = 1; i < HIST_BUCKETS; ++i)
+        assert(hist_bucket_lowest(i) == hist_bucket_highest(i - 1) + 1);
+    for (uint64_t v = 0; v < 1000000; v += 7)
+        assert(v >= hist_bucket_lowest(bucket_index(v)) && v <= hist_bucket_highest(bucket_index(v)));
+
+    for (uint64_t v = 1; v <= 10000; ++v)
+        hist_record(&h, v);
+    assert(h.count == 10000 && h.min == 1 && h.max == 10000);
+
+    // 相对误差不超过1/HIST_SUB_COUNT
+    uint64_t p50 = hist_percentile(&h, 50), p99 = hist_percentile(&h, 99);
+    assert(p50 >= 5000 && p50 <= 5000 + 5000 / HIST_SUB_COUNT);
+    assert(p99 >= 9900 && p99 <= 9900 + 9900 / HIST_SUB_COUNT);
+    assert(hist_percentile(&h, 100) == 10000);
+
+    printf("p50 = %llu, p99 = %llu, mean = %.1f\n", (unsigned long long) p50,
+            (unsigned long long) p99, hist_mean(&h));
+    printf("histogram test complete!\n");
+}
+#endif
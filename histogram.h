@@ -0,0 +1,87 @@
+/** 对数分桶的数值直方图(HDR风格), 用于记录延迟分布并计算百分位值
+ *
+ *  每个2的幂次区间再等分为 HIST_SUB_COUNT 个子桶, 记录值的相对误差不超过 1/HIST_SUB_COUNT,
+ *  小于 HIST_SUB_COUNT 的值精确记录, 大于等于 2^HIST_MAX_BITS 的值计入最后一个桶
+ * @file histogram.h
+ * @author Kiven Lee
+ * @date 2021-08-02
+ * @version 1.0
+*/
+
+#pragma once
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** 子桶位数, 7表示每个2的幂次区间细分为128个桶, 相对误差小于1% */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+/** 最大记录值位数, 以纳秒为单位时2^36约为68秒 */
+#define HIST_MAX_BITS 36
+/** 桶的总数量 */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+/** 直方图结构 */
+typedef struct hist_t {
+    uint64_t        count;                  // 记录总数
+    uint64_t        sum;                    // 记录值总和, 用于计算平均值
+    uint64_t        min;                    // 最小记录值
+    uint64_t        max;                    // 最大记录值
+    uint64_t        buckets[HIST_BUCKETS];  // 分桶计数
+} hist_t;
+
+/** 初始化直方图
+ * @param self          直方图对象
+*/
+extern void hist_init(hist_t* self);
+
+/** 记录一个值
+ * @param self          直方图对象
+ * @param value         要记录的值
+*/
+extern void hist_record(hist_t* self, uint64_t value);
+
+/** 合并直方图, 将src的记录累加到self中
+ * @param self          目标直方图对象
+ * @param src           源直方图对象
+*/
+extern void hist_merge(hist_t* self, const hist_t* src);
+
+/** 计算百分位值
+ * @param self          直方图对象
+ * @param percentile    百分位, 取值范围0-100, 例如 99.9
+ * @return              该百分位对应桶的最大等价值, 没有记录时返回0
+*/
+extern uint64_t hist_percentile(const hist_t* self, double percentile);
+
+/** 计算平均值
+ * @param self          直方图对象
+ * @return              平均值, 没有记录时返回0
+*/
+inline static double hist_mean(const hist_t* self) {
+    return self->count ? (double) self->sum / self->count : 0;
+}
+
+/** 获取桶序号对应的最小值
+ * @param index         桶序号
+ * @return              该桶能记录的最小值
+*/
+extern uint64_t hist_bucket_lowest(uint32_t index);
+
+/** 获取桶序号对应的最大等价值
+ * @param index         桶序号
+ * @return              该桶能记录的最大值
+*/
+extern uint64_t hist_bucket_highest(uint32_t index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HISTOGRAM_H__
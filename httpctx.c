@@ -1,4 +1,5 @@
 #include "httpctx.h"
+#include "urlencode.h"
 #include "log.h"
 
 // 编译参数 -- 消息处理缓冲区分页大小
@@ -6,6 +7,11 @@
 #   define HTTPCTX_PAGE_SIZE 2048
 #endif
 
+// 编译参数 -- 请求解析完成后就地解码并规范化路径, 为0时路径保持原样
+#ifndef HTTPCTX_NORMALIZE_PATH
+#   define HTTPCTX_NORMALIZE_PATH 1
+#endif
+
 #define PARSER_OF_CTX(ptr) ((httpctx_t*) ((char*) ptr - (size_t) &(((httpctx_t*)0)->req.parser)))
 
 // 解析状态枚举值
@@ -30,6 +36,8 @@ inline static void reset_headers(pool_t pool, list_head_t *head) {
 }
 
 void httpctx_free_data(httpctx_t* pctx) {
+    memtag_free(pctx->req.raw_path);
+    if (pctx->req.query) pool_put(pctx->pool->query_pool, pctx->req.query);
     dynmem_clear(&pctx->res.data);
     dynmem_clear(&pctx->req.data);
     reset_headers(pctx->pool->headers_pool, &pctx->res.headers);
@@ -140,15 +148,56 @@ static uint32_t get_http_header_uint(list_head_t *head, dynmem_t *pbuf, const ch
     return atoi(tmp);
 }
 
+#if HTTPCTX_NORMALIZE_PATH
+/** 从缓冲区复制到连续内存的回调函数, 按容量访问, 解析期间本次读入的内容还没有计入缓冲区长度 */
+static uint32_t on_copy_out(void *arg, void *data, uint32_t len) {
+    memcpy(*(char**) arg, data, len);
+    *(char**) arg += len;
+    return len;
+}
+
+/** 从连续内存写回缓冲区的回调函数, 不改变缓冲区长度 */
+static uint32_t on_copy_in(void *arg, void *data, uint32_t len) {
+    memcpy(data, *(char**) arg, len);
+    *(char**) arg += len;
+    return len;
+}
+
+/** 解码并规范化请求路径, 结果写回路径原来的位置. url的位置和长度以及参数部分都保持不变,
+ *  路径变短后剩余的位置不再使用; 路径改变时保存原始路径, 访问日志和流量采集通过httpctx_read_url
+ *  读取客户端发送的原始url. 路径可能跨页, 复制到栈上处理后写回
+*/
+static void normalize_path(httpreq_t* req) {
+    dynmem_t* reqbuf = &req->data;
+    uint32_t pos = req->path.pos, plen = req->path.len;
+    char tmp[plen ? plen : 1], *p = tmp;
+    dynmem_foreach(reqbuf, &p, pos, plen, on_copy_out);
+
+    uint32_t nlen = (uint32_t) url_path_normalize(tmp, plen);
+    if (nlen == plen) return;
+
+    // 规范化只会删除字符, 长度不变时内容也不变, 只有长度改变时才需要保存原始路径
+    req->raw_path = memtag_malloc(MEMTAG_OTHER, plen);
+    p = req->raw_path;
+    dynmem_foreach(reqbuf, &p, pos, plen, on_copy_out);
+    req->raw_path_len = plen;
+    p = tmp;
+    dynmem_foreach(reqbuf, &p, pos, nlen, on_copy_in);
+    req->path.len = nlen;
+}
+#endif
+
 // http报文解析--起始回调函数
 static int on_message_begin(http_parser* parser) {
     // log_trace("***HTTP_PARSER MESSAGE BEGIN***");
+    PARSER_OF_CTX(parser)->timing.first_byte = uv_hrtime();
     return 0;
 }
 
 // http报文解析--头部解析完成回调函数
 static int on_headers_complete(http_parser* parser) {
     // log_trace("***HTTP_PARSER HEADERS COMPLETE***");
+    PARSER_OF_CTX(parser)->timing.headers = uv_hrtime();
     return 0;
 }
 
@@ -180,12 +229,19 @@ static int on_message_complete(http_parser* parser) {
         req->url_param.pos = 0;
         req->url_param.len = 0;
     }
+#if HTTPCTX_NORMALIZE_PATH
+    // 解码并规范化路径, 路由匹配和回复缓存的键都使用规范化后的路径
+    normalize_path(req);
+#endif
     // 如果路径以斜杠结尾，则删除斜杠
-    if (*dynmem_get(reqbuf, req->path.pos + req->path.len - 1) == '/')
+    if (req->path.len && *dynmem_get(reqbuf, req->path.pos + req->path.len - 1) == '/')
         --req->path.len;
 
     // 设置解析完成标志
     req->parser_state = HTTP_PARSER_COMPLETE;
+    pctx->timing.message = uv_hrtime();
+    // 暂停解析, 同一次读取中的后续请求不能覆盖当前请求, 重置上下文对象时重新初始化解析器
+    http_parser_pause(parser, 1);
     return 0;
 }
 
@@ -280,21 +336,31 @@ size_t httpctx_parser_execute(httpctx_t* pctx, char* buf, size_t len) {
     return http_parser_execute(&pctx->req.parser, &_parser_settings, buf, len);
 }
 
+uint32_t httpctx_read_url(httpctx_t* self, char* dst) {
+    httpreq_t* req = &self->req;
+    uint32_t n = 0;
+    if (req->raw_path) {
+        memcpy(dst, req->raw_path, req->raw_path_len);
+        n = req->raw_path_len;
+    }
+    return n + dynmem_read(&req->data, req->url.pos + n, req->url.len - n, dst + n);
+}
+
 const char* httpctx_get_method(httpctx_t *self) {
     static const char* HTTP_METHODS[] = {"GET", "POST", "PUT", "DELETE" };
     uint8_t method = self->req.method;
     return (method >=0 && method < sizeof(HTTP_METHODS)) ? HTTP_METHODS[method] : "UNKNOWN";
 }
 
-const http_value_t* httpctx_get_header(httpctx_t* self, const str_t name) {
+const http_value_t* httpctx_get_header(httpctx_t* self, const char* name) {
     return get_http_header(&self->req.headers, &self->req.data, name);
 }
 
-bool httpctx_path_equal(httpctx_t* self, const str_t path) {
+bool httpctx_path_equal(httpctx_t* self, const char* path) {
     dynmem_t* pbuf = &self->req.data;
     http_value_t* value = &self->req.path;
     // 去除要比较的路径末尾的斜杠
-    uint32_t path_len = str_len(path);
+    uint32_t path_len = strlen(path);
     bool sflag = path[path_len - 1] == '/';
     if (sflag) --path_len;
 
@@ -305,10 +371,10 @@ bool httpctx_path_equal(httpctx_t* self, const str_t path) {
     return dynmem_equal(pbuf, value->pos, path_len, path);
 }
 
-bool httpctx_path_prefix(httpctx_t* self, const str_t path) {
+bool httpctx_path_prefix(httpctx_t* self, const char* path) {
     dynmem_t* pbuf = &self->req.data;
     http_value_t* value = &self->req.path;
-    uint32_t path_len = str_len(path);
+    uint32_t path_len = strlen(path);
     bool sflag = path[path_len - 1] == '/';
     if (sflag) --path_len;
 
@@ -327,3 +393,100 @@ bool httpctx_path_prefix(httpctx_t* self, const str_t path) {
     char ch = *dynmem_get(pbuf, value->pos + path_len);
     return ch == '/' || ch == '?';
 }
+
+// 查询参数名的哈希值(FNV-1a)
+inline static uint32_t query_hash(const char* s, uint32_t len) {
+    uint32_t h = 2166136261u;
+    for (const char* end = s + len; s < end; ++s)
+        h = (h ^ (uint8_t) *s) * 16777619u;
+    return h;
+}
+
+// 建立查询参数索引, 参数名和参数值都指向请求缓冲区中的原始内容, 只对含有编码字符的参数名解码后计算哈希值.
+// 索引对象在有查询参数时才从内存池分配
+static void parse_query(httpctx_t* pctx) {
+    httpreq_t* req = &pctx->req;
+    req->query_parsed = 1;
+    uint32_t base = req->url_param.pos, qlen = req->url_param.len;
+    if (!qlen) return;
+
+    req->query = pool_get(pctx->pool->query_pool);
+    char query[qlen];
+    dynmem_read(&req->data, base, qlen, query);
+    for (char *s = query, *end = query + qlen; s < end; ) {
+        char* e = memchr(s, '&', end - s);
+        if (!e) e = end;
+        if (e > s) {
+            if (req->query_count == HTTPCTX_QUERY_MAX) {
+                req->query_overflow = 1;
+                return;
+            }
+            char* eq = memchr(s, '=', e - s);
+            uint32_t klen = (eq ? eq : e) - s;
+            http_header_t* q = &req->query->items[req->query_count];
+            q->field.pos = base + (s - query);
+            q->field.len = klen;
+            // 没有'='时值的位置在参数段末尾, 保证 value.pos + value.len 总是参数段的结束位置
+            q->value.pos = base + (eq ? eq + 1 - query : e - query);
+            q->value.len = eq ? e - eq - 1 : 0;
+
+            uint32_t h;
+            if (memchr(s, '%', klen) || memchr(s, '+', klen)) {
+                char key[klen];
+                h = query_hash(key, url_component_decode(s, klen, key, klen));
+            } else {
+                h = query_hash(s, klen);
+            }
+            req->query->hash[req->query_count++] = h;
+        }
+        s = e + 1;
+    }
+}
+
+// 比较查询参数名解码后的内容是否与name相同, 解码后的长度不会超过原始长度
+static bool query_name_equal(httpreq_t* req, const http_value_t* field, const char* name, uint32_t len) {
+    if (field->len < len) return false;
+    if (!field->len) return true;
+    if (field->len == len && dynmem_equal(&req->data, field->pos, len, name)) return true;
+
+    char key[field->len];
+    dynmem_read(&req->data, field->pos, field->len, key);
+    return url_component_decode(key, field->len, key, field->len) == len && !memcmp(key, name, len);
+}
+
+uint32_t httpctx_query_count(httpctx_t* self) {
+    if (!self->req.query_parsed) parse_query(self);
+    return self->req.query_count;
+}
+
+const http_header_t* httpctx_query_at(httpctx_t* self, uint32_t index) {
+    return index < httpctx_query_count(self) ? &self->req.query->items[index] : NULL;
+}
+
+const http_header_t* httpctx_query_find(httpctx_t* self, const char* name, const http_header_t* prev) {
+    httpreq_t* req = &self->req;
+    uint32_t count = httpctx_query_count(self), len = strlen(name), h = query_hash(name, len);
+    for (uint32_t i = prev ? prev - req->query->items + 1 : 0; i < count; ++i) {
+        if (req->query->hash[i] == h && query_name_equal(req, &req->query->items[i].field, name, len))
+            return &req->query->items[i];
+    }
+    return NULL;
+}
+
+uint32_t httpctx_query_decode(httpctx_t* self, const http_value_t* value, char* dst, uint32_t dst_len) {
+    dynmem_t* pbuf = &self->req.data;
+    uint32_t len = value->len;
+    // 解码后不会变长, 容量足够时直接在dst中就地解码
+    if (len <= dst_len) {
+        dynmem_read(pbuf, value->pos, len, dst);
+        return url_component_decode(dst, len, dst, len);
+    }
+    char tmp[len];
+    dynmem_read(pbuf, value->pos, len, tmp);
+    return url_component_decode(tmp, len, dst, dst_len);
+}
+
+int httpctx_query_get(httpctx_t* self, const char* name, char* dst, uint32_t dst_len) {
+    const http_header_t* q = httpctx_query_find(self, name, NULL);
+    return q ? (int) httpctx_query_decode(self, &q->value, dst, dst_len) : -1;
+}
@@ -10,6 +10,7 @@
 #include "list.h"
 #include "dynmem.h"
 #include "pool.h"
+#include "memtag.h"
 #include "str.h"
 #include "http_parser.h"
 #include "uv.h"
@@ -21,6 +22,11 @@ extern "C" {
 /** http请求解析完成的状态值 http_req_t.parser_state */
 #define HTTP_PARSER_COMPLETE 100
 
+// 编译参数 -- 每个请求最多建立索引的查询参数数量, 超出部分不建立索引
+#ifndef HTTPCTX_QUERY_MAX
+#   define HTTPCTX_QUERY_MAX 32
+#endif
+
 #ifndef HI_UINT32
 #   define HI_UINT32(x) ((uint32_t) ((uint64_t) x >> 32))
 #endif
@@ -34,6 +40,7 @@ extern "C" {
 typedef enum { HC_HTTP10, HC_HTTP11, HC_HTTP20 } hc_http_version_t; // HTTP 版本枚举
 typedef enum { HC_HTTP_GET, HC_HTTP_POST, HC_HTTP_PUT, HC_HTTP_DELETE } hc_http_method_t; // HTTP请求类型枚举
 typedef enum { HC_BODY_MEMORY, HC_BODY_CALLBACK } hc_body_type_t; // 回调函数生成body的类型
+typedef enum { HC_ENCODING_IDENTITY, HC_ENCODING_GZIP, HC_ENCODING_DEFLATE } hc_encoding_t; // 回复内容的压缩编码
 
 typedef struct httpctx_t httpctx_t;
 
@@ -43,7 +50,11 @@ typedef int (*on_httpctx_serve_cb) (httpctx_t*);
 // 内存池对象, 每个独立的http服务创建1个
 typedef struct httpctx_pool_t {
     pool_t     headers_pool;            // 头部对象池，用于设置头部内容时，从池中分配
+    pool_t     query_pool;              // 查询参数索引对象池, 第一次访问查询参数时从池中分配
     pool_t     ctx_pool;                // 请求上下文对象池, 每次新连接可从池中分配1个上下文对象
+    uint8_t*   recv_slab;               // 共享接收缓冲区, 同一事件循环的所有连接共用, 为NULL时每个连接使用自己的缓冲区读取
+    uint32_t   recv_slab_size;          // 共享接收缓冲区大小, 2的幂次方
+    struct metrics_t* metrics;          // 运行指标统计对象, 每个服务(事件循环)一个
 } httpctx_pool_t;
 
 // 字符串对象
@@ -64,13 +75,23 @@ typedef struct http_header_node_t {
     http_header_t   data;               // 自定义的节点数据
 } http_header_node_t;
 
+// 查询参数索引, 只在第一次访问查询参数时分配, 不访问查询参数的请求不占用
+typedef struct http_query_t {
+    http_header_t   items[HTTPCTX_QUERY_MAX]; // field为参数名, value为参数值, 均指向未解码的原始内容
+    uint32_t        hash[HTTPCTX_QUERY_MAX];  // 解码后的参数名的哈希值, 按名称查找时先比较哈希值
+} http_query_t;
+
 // http 请求对象
 typedef struct httpreq_t {
-    http_value_t    url;                // 请求url
+    http_value_t    url;                // 请求url, 规范化后路径部分可能已被改写, 原样读取使用httpctx_read_url
     http_value_t*   host;               // 主机名，没有设置时为NULL
     http_value_t*   content_type;       // 请求内容类型，没有设置时为NULL
-    http_value_t    path;               // 解析url得到的path（去除参数）
+    http_value_t    path;               // 解析url得到的path（去除参数, 已解码并规范化, 参见HTTPCTX_NORMALIZE_PATH）
     http_value_t    url_param;          // 解析url得到的param
+    char*           raw_path;           // 规范化之前的原始路径, 只在规范化改变了路径时保存, 否则为NULL
+    uint32_t        raw_path_len;       // 原始路径长度
+    http_query_t*   query;              // 查询参数索引, 第一次访问时建立, 没有查询参数时为NULL
+    uint16_t        query_count;        // 已建立索引的查询参数数量
     uint32_t        content_length;     // 请求内容长度
     list_head_t     headers;            // 请求头部字段链表, 指向http_header_node_t结构
     http_value_t    body;               // 请求内容
@@ -82,6 +103,8 @@ typedef struct httpreq_t {
     uint8_t         version     : 2;    // 协议版本：hc_http_version_t: 1.0/1.1/2.0
     uint8_t         method      : 2;    // 请求类型, hc_http_method_t：GET/POST/PUT/DELETE
     uint8_t         keep_alive  : 1;    // 保持连接请求标志
+    uint8_t         query_parsed : 1;   // 查询参数索引已建立
+    uint8_t         query_overflow : 1; // 查询参数数量超过HTTPCTX_QUERY_MAX, 超出部分未建立索引
 
     void*           userdata;           // 用户自定义数据，用于用户回调处理请求时链式处理的上下文传递
 } httpreq_t;
@@ -90,7 +113,10 @@ typedef struct httpreq_t {
 typedef struct httpres_t {
     uint16_t        status;             // 回复状态 200/401/403/404/500
     uint8_t         keep_alive;         // 包含保持连接的标志
+    uint8_t         encoding    : 2;    // 回复内容的压缩编码, hc_encoding_t, 非identity时输出Content-Encoding
+    uint8_t         vary        : 1;    // 回复内容按Accept-Encoding协商, 输出Vary: Accept-Encoding
     uint32_t        content_length;     // 回复内容长度，
+    uint64_t        etag;               // 弱ETag, 高32位为原始内容长度, 低32位为内容的crc32c, 0表示不输出
     http_value_t    content_type;       // 回复内容类型
     list_head_t     headers;            // 回复头部内容链表, 指向http_header_node_t结构
     hc_body_type_t  body_type;          // 回复内容类型，直接指向data的内存地址/通过回调实现的分段内容
@@ -102,24 +128,54 @@ typedef struct httpres_t {
     uv_buf_t*       write_bufs;         // 回复内容数据区数组，.base = NULL结尾，由tcp服务自行管理内存
 } httpres_t;
 
+// 请求处理各阶段的时间戳(uv_hrtime纳秒值), 未到达的阶段为0
+typedef struct httpctx_timing_t {
+    uint64_t        accept;             // 连接建立时间, 同一连接的所有请求共用
+    uint64_t        first_byte;         // 读取到请求的第一个字节(开始解析请求报文)
+    uint64_t        headers;            // 请求头部解析完成
+    uint64_t        message;            // 请求报文解析完成
+    uint64_t        handler_begin;      // 进入服务回调函数
+    uint64_t        handler_end;        // 退出服务回调函数
+    uint64_t        written;            // 回复写入完成回调
+    uint32_t        req_size;           // 请求报文长度
+    uint32_t        res_size;           // 回复报文长度(包括头部)
+    http_value_t    path;               // 请求路径在回复缓冲区中的副本, 仅在开启慢请求日志时保存
+} httpctx_timing_t;
+
 // http 上下文对象, 每个http连接创建1个
 struct httpctx_t {
     uv_tcp_t        tcp;                // tcp连接对象, 兼容 uv_tcp_t, uv_stream_t, uv_handle_t
     httpreq_t       req;                // 请求对象
     httpres_t       res;                // 回复对象
+    httpctx_timing_t timing;            // 请求处理各阶段的时间戳
+    char            remote_addr[48];    // 客户端地址, 访问日志第一次使用时获取, 同一连接的所有请求共用
     httpctx_pool_t* pool;               // 内存池对象，指向为自身分配内存的内存池对象，释放内存时使用
     on_httpctx_serve_cb serve_cb;       // 服务回调处理函数
+    uint8_t*        pipeline;           // 流水线请求: 当前回复写入完成前已收到的后续请求内容, 由tcp服务管理内存
+    uint32_t        pipeline_pos;       // 流水线请求内容中已取出处理的长度
+    uint32_t        pipeline_len;       // 流水线请求内容的总长度
+    uint32_t        pipeline_cap;       // 流水线请求缓冲区容量
+    uint8_t         read_paused;        // 待处理的流水线请求过多, 已暂停读取
 };
 
 /** 创建httpctx内存池分配对象
  * @param headers_count     http_header_node_t头部链表对象预分配数量
  * @param ctx_count         httpctx_t上下文对象预分配数量
+ * @param query_count       http_query_t查询参数索引对象预分配数量
  * @return                  新建的内存池对象
 */
-inline static httpctx_pool_t* httpctx_pool_malloc(uint32_t headers_count, uint32_t ctx_count) {
-    httpctx_pool_t* pool = malloc(sizeof(httpctx_pool_t));
+inline static httpctx_pool_t* httpctx_pool_malloc(uint32_t headers_count, uint32_t ctx_count, uint32_t query_count) {
+    httpctx_pool_t* pool = memtag_malloc(MEMTAG_SERVER, sizeof(httpctx_pool_t));
     pool->headers_pool = pool_malloc(headers_count, sizeof(http_header_node_t));
+    pool->query_pool = pool_malloc(query_count, sizeof(http_query_t));
     pool->ctx_pool = pool_malloc(ctx_count, sizeof(httpctx_t));
+    // 池用完后单独分配的对象分开统计, 用于区分头部节点溢出和连接数溢出, 查询参数索引计入头部
+    pool_set_tag(pool->headers_pool, MEMTAG_HEADER);
+    pool_set_tag(pool->query_pool, MEMTAG_HEADER);
+    pool_set_tag(pool->ctx_pool, MEMTAG_CTX);
+    pool->recv_slab = NULL;
+    pool->recv_slab_size = 0;
+    pool->metrics = NULL;
     return pool;
 }
 
@@ -128,8 +184,10 @@ inline static httpctx_pool_t* httpctx_pool_malloc(uint32_t headers_count, uint32
 */
 inline static void httpctx_pool_free(httpctx_pool_t *self) {
     pool_free(self->ctx_pool);
+    pool_free(self->query_pool);
     pool_free(self->headers_pool);
-    free(self);
+    if (self->recv_slab) memtag_free(self->recv_slab);
+    memtag_free(self);
 }
 
 /** 初始化httpctx内存池对象
@@ -169,6 +227,10 @@ inline static void httpctx_free(httpctx_t* self) {
 inline static void httpctx_reset(httpctx_t* self) {
     httpctx_free_data(self);
     memset(&self->req, 0, sizeof(httpreq_t) + sizeof(httpres_t));
+    // 连接建立时间对同一连接的后续请求保持不变
+    uint64_t accept = self->timing.accept;
+    memset(&self->timing, 0, sizeof(httpctx_timing_t));
+    self->timing.accept = accept;
     httpctx_init(self);
 }
 
@@ -182,9 +244,11 @@ inline static void httpctx_headers_free(httpctx_t* self, http_header_node_t* hea
 }
 
 /** 解析http协议内容(当收到新的数据时调用，分段接收时可多次调用)
+ *  请求报文结束时暂停解析, 之后的内容属于下一个请求, 重置上下文对象后才能继续解析
  * @param self              httpctx上下文对象
  * @param buf               收到的数据缓冲区
  * @param len               数据缓冲区长度 
+ * @return                  已解析的长度
 */
 extern size_t httpctx_parser_execute(httpctx_t* self, char* buf, size_t len);
 
@@ -192,9 +256,9 @@ extern size_t httpctx_parser_execute(httpctx_t* self, char* buf, size_t len);
  * @param self              httpctx上下文对象
  * @param value             Comtent-Type值，字符串形式
 */
-inline static void httpctx_set_content_type(httpctx_t* self, const str_t value) {
+inline static void httpctx_set_content_type(httpctx_t* self, const char* value) {
     self->res.content_type.pos = dynmem_len(&self->res.data);
-    self->res.content_type.len = dynmem_append(&self->res.data, value, str_len(value));
+    self->res.content_type.len = dynmem_append(&self->res.data, value, strlen(value));
 }
 
 /** 增加回复消息的头部字段
@@ -202,13 +266,13 @@ inline static void httpctx_set_content_type(httpctx_t* self, const str_t value)
  * @param field             头部字段名，字符串
  * @param value             头部字段值，字符串
 */
-inline static void httpctx_add_header(httpctx_t* self, const str_t field, const str_t value) {
+inline static void httpctx_add_header(httpctx_t* self, const char* field, const char* value) {
     dynmem_t* pbuf = &self->res.data;
     http_header_node_t* h = pool_get(self->pool->headers_pool); // 从链表缓冲池中取一个元素
     h->data.field.pos = dynmem_len(pbuf);
-    h->data.field.len = dynmem_append(pbuf, field, str_len(field));
+    h->data.field.len = dynmem_append(pbuf, field, strlen(field));
     h->data.value.pos = dynmem_len(pbuf);
-    h->data.value.len = dynmem_append(pbuf, value, str_len(value));
+    h->data.value.len = dynmem_append(pbuf, value, strlen(value));
     // 添加到头部链表末尾
     list_add_tail((list_head_t*) h, &self->res.headers);
 }
@@ -240,6 +304,13 @@ inline static void httpctx_body_append(httpctx_t* self, const void* src, uint32_
 */
 inline static void httpctx_body_end(httpctx_t* self) { }
 
+/** 读取客户端发送的原始url, 不受路径规范化(HTTPCTX_NORMALIZE_PATH)影响, 用于访问日志和流量采集等需要原样记录的场合
+ * @param self              请求上下文对象
+ * @param dst               写入位置, 长度至少为req.url.len
+ * @return                  写入的长度
+*/
+extern uint32_t httpctx_read_url(httpctx_t* self, char* dst);
+
 /** 获取请求的method字符串
  * @param self              请求上下文对象
  * @return                  请求字符串
@@ -250,21 +321,60 @@ extern const char* httpctx_get_method(httpctx_t* self);
  * @param self              请求上下文对象
  * @return                  找到的头部对象
 */
-extern const http_value_t* httpctx_get_header(httpctx_t* self, const str_t name);
+extern const http_value_t* httpctx_get_header(httpctx_t* self, const char* name);
 
 /** 路径匹配, 路径匹配返回true
  * @param self              请求上下文对象
  * @param path              要比较的路径
  * @return                  true：匹配成功，false：匹配失败
 */
-extern bool httpctx_path_equal(httpctx_t* self, const str_t path);
+extern bool httpctx_path_equal(httpctx_t* self, const char* path);
 
 /** 路径匹配, 前缀路径匹配上就返回true, 例如: path = "/x", 不匹配 "/x1", 匹配 "/x", "/x/", "/x?t=", "/x/?t=", "/x/y/z", "/x/y?t="
  * @param self              请求上下文对象
  * @param path              要比较的路径
  * @return                  true：匹配成功，false：匹配失败
 */
-extern bool httpctx_path_prefix(httpctx_t* self, const str_t path);
+extern bool httpctx_path_prefix(httpctx_t* self, const char* path);
+
+/** 获取查询参数数量, 第一次访问查询参数时解析url_param并建立索引, 空的参数段(例如"a=1&&b=2"中间的部分)忽略
+ * @param self              请求上下文对象
+ * @return                  已建立索引的参数数量, 超过HTTPCTX_QUERY_MAX时req.query_overflow置1
+*/
+extern uint32_t httpctx_query_count(httpctx_t* self);
+
+/** 按序号获取查询参数, 参数顺序与url中的顺序相同
+ * @param self              请求上下文对象
+ * @param index             参数序号
+ * @return                  参数对象, field为参数名, value为参数值(没有'='时长度为0), 均未解码; 序号超出范围返回NULL
+*/
+extern const http_header_t* httpctx_query_at(httpctx_t* self, uint32_t index);
+
+/** 按参数名查找查询参数, 参数名按解码后的内容比较, 区分大小写
+ * @param self              请求上下文对象
+ * @param name              参数名, 以'\0'结尾的字符串
+ * @param prev              为NULL时返回第一个同名参数, 否则返回prev之后的下一个同名参数, 用于处理重复的参数
+ * @return                  找到的参数对象, 找不到返回NULL
+*/
+extern const http_header_t* httpctx_query_find(httpctx_t* self, const char* name, const http_header_t* prev);
+
+/** 解码查询参数的名称或值('+'解码为空格), 请求缓冲区中的原始内容保持不变
+ * @param self              请求上下文对象
+ * @param value             httpctx_query_at/httpctx_query_find返回对象的field或value
+ * @param dst               解码结果写入地址, 不添加结尾的'\0'
+ * @param dst_len           dst的容量, 解码结果超出部分被截断
+ * @return                  写入dst的长度
+*/
+extern uint32_t httpctx_query_decode(httpctx_t* self, const http_value_t* value, char* dst, uint32_t dst_len);
+
+/** 按参数名获取解码后的参数值, 重复的参数返回第一个
+ * @param self              请求上下文对象
+ * @param name              参数名, 以'\0'结尾的字符串
+ * @param dst               解码结果写入地址, 不添加结尾的'\0'
+ * @param dst_len           dst的容量, 解码结果超出部分被截断
+ * @return                  写入dst的长度, 参数不存在时返回-1
+*/
+extern int httpctx_query_get(httpctx_t* self, const char* name, char* dst, uint32_t dst_len);
 
 #ifdef __cplusplus
 }
@@ -2,6 +2,12 @@
 #include "http_parser.h"
 #include "log.h"
 #include "list.h"
+#include "capture.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "httpzip.h"
+#include "respcache.h"
+#include "crc32.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,6 +22,22 @@
 #ifndef HS_HEAD_POOL_SIZE
 #   define HS_HEAD_POOL_SIZE   (HS_CTX_POOL_SIZE * 8)
 #endif
+// http_query_t 查询参数索引对象内存池大小, 只有访问查询参数的请求才占用
+#ifndef HS_QUERY_POOL_SIZE
+#   define HS_QUERY_POOL_SIZE  HS_CTX_POOL_SIZE
+#endif
+// 共享接收缓冲区大小(必须是2的幂次方), 同一服务的所有连接共用, 为0时每个连接使用自己的缓冲区读取
+#ifndef HS_RECV_SLAB_SIZE
+#   define HS_RECV_SLAB_SIZE   65536
+#endif
+// 慢请求日志中记录的请求路径最大长度
+#ifndef HS_SLOW_PATH_MAX
+#   define HS_SLOW_PATH_MAX    256
+#endif
+// 每个连接在回复写入完成前最多保存的流水线请求内容长度, 超过后暂停读取, 直到处理到该长度以下
+#ifndef HS_PIPELINE_MAX
+#   define HS_PIPELINE_MAX     65536
+#endif
 
 /** 所有http服务使用的内存池，用于退出时集中释放 */
 typedef struct _pool_list_node_t {
@@ -27,17 +49,34 @@ typedef struct _pool_list_node_t {
 typedef struct resp_write_t {
 	uv_write_t          write;
 	httpctx_t*          httpctx;
+	ptr_t               shared;         // 写入回复缓存中的共享内容时持有的引用, 写入完成后释放
 } resp_write_t;
 
 static LIST_HEAD(httpctx_pool_list);
 static _Bool httpctx_pool_destroy_registered = 0;
 
+/** 慢请求日志设置, 阈值为纳秒 */
+static _Bool slowlog_enabled = 0;
+static uint64_t slowlog_threshold = 0;
+static uint32_t slowlog_sample = 0;
+/** 慢请求采样计数, 每个事件循环线程独立计数 */
+static _Thread_local uint32_t slowlog_seq = 0;
+/** 是否为回复内容生成ETag */
+static _Bool etag_enabled = 0;
+
 static const char RESP_STATUS[] = "HTTP/1.1 %u %s\r\nServer: khs/0.50\r\nContent-Length: %u\r\n";
 static const char KEEP_ALIVE[] = "Connection: keep-alive\r\n";
 static const char CONTENT_TYPE[] = "Content-Type: ";
+static const char CONTENT_ENCODING[][32] = { "", "Content-Encoding: gzip\r\n", "Content-Encoding: deflate\r\n" };
+static const char VARY_ENCODING[] = "Vary: Accept-Encoding\r\n";
+static const char ETAG_FORMAT[] = "ETag: W/\"%08x-%x\"\r\n";
+static const char IF_NONE_MATCH[] = "if-none-match";
 
 // 函数预声明--------
 static void on_writed(uv_write_t *req, int status);
+static void on_allocing(uv_handle_t* client, size_t suggested_size, uv_buf_t* buf);
+static void on_readed(uv_stream_t* uv_stream, ssize_t nread, const uv_buf_t* buf);
+static void process_read(httpctx_t* client, const uv_buf_t* buf, uint32_t nread);
 
 static void log_trace_req(httpctx_t* pctx) {
 	httpreq_t* preq = &pctx->req;
@@ -56,7 +95,7 @@ static void log_trace_req(httpctx_t* pctx) {
 	memcpy(p, method, m_len);
 	p[m_len] = ' ';
 	p += m_len + 1;
-	p += dynmem_read(preqbuf, preq->url.pos, preq->url.len, p);
+	p += httpctx_read_url(pctx, p);
 	*p++ = '\n';
 
 	list_foreach(pos, head) {
@@ -73,6 +112,41 @@ static void log_trace_req(httpctx_t* pctx) {
 	log_trace("-------- http header info --------\n%s-------------------------------------", buf);
 }
 
+/** 输出慢请求记录, 各阶段耗时单位为微秒:
+ *  conn: 连接建立到请求开始, read: 读取请求头部, body: 读取请求内容, queue: 解析完成到进入服务回调,
+ *  handler: 服务回调, write: 退出服务回调到写入完成
+*/
+static void log_slow_req(httpctx_t* pctx, uint64_t total, _Bool slow) {
+	httpctx_timing_t* t = &pctx->timing;
+	char path[HS_SLOW_PATH_MAX + 1];
+	uint32_t plen = dynmem_read(&pctx->res.data, t->path.pos, t->path.len, path);
+	path[plen] = '\0';
+
+	// 连接建立时间只有第一个请求才有意义, 后续请求的conn包括连接上之前请求的时间,
+	// 开启二进制日志时只复制参数, 采样率较高时也不会在事件循环中进行格式化
+	log_level_t level = slow ? LOG_WARN : LOG_INFO;
+	log_bin(level, "%s %s %s %u in=%u out=%u total=%llu conn=%llu read=%llu body=%llu queue=%llu handler=%llu write=%llu",
+			slow ? "slow-request" : "sampled-request", http_method_str(pctx->req.parser.method),
+			path, pctx->res.status, t->req_size, t->res_size,
+			(unsigned long long) total / 1000,
+			(unsigned long long) (t->first_byte - t->accept) / 1000,
+			(unsigned long long) (t->headers - t->first_byte) / 1000,
+			(unsigned long long) (t->message - t->headers) / 1000,
+			(unsigned long long) (t->handler_begin - t->message) / 1000,
+			(unsigned long long) (t->handler_end - t->handler_begin) / 1000,
+			(unsigned long long) (t->written - t->handler_end) / 1000);
+}
+
+/** 请求路径复制到回复缓冲区, 请求缓冲区在写入完成前已经释放, 输出慢请求日志时使用 */
+static void save_slow_path(httpctx_t* pctx) {
+	http_value_t* path = &pctx->req.path;
+	uint32_t len = path->len > HS_SLOW_PATH_MAX ? HS_SLOW_PATH_MAX : path->len;
+	char tmp[HS_SLOW_PATH_MAX];
+	dynmem_read(&pctx->req.data, path->pos, len, tmp);
+	pctx->timing.path.pos = dynmem_len(&pctx->res.data);
+	pctx->timing.path.len = dynmem_append(&pctx->res.data, tmp, len);
+}
+
 static void log_write_status(uv_write_t *req, int status) {
 	uv_buf_t* pbufs = ((resp_write_t*) req)->httpctx->res.write_bufs;
 	int count = 0;
@@ -88,7 +162,7 @@ static void on_httpctx_pool_destroy() {
 	// 反向遍历，最后分配的最先释放，有利于内存合并
 	list_foreach_reverse(pos, &httpctx_pool_list) {
 		httpctx_pool_free(pos->data);
-		free(pos);
+		memtag_free(pos);
 	}
 }
 
@@ -112,11 +186,12 @@ static void mem_array_copyfrom(dynmem_t* pbuf, http_value_t* src) {
 */
 static uint32_t fill_uv_buf_ts(uv_buf_t* bufs, dynmem_t* pbuf, uint32_t offset, uint32_t len) {
 	uv_buf_t* p = bufs;
-	for (uint32_t omax = offset + len; offset < omax; ++p) {
+	for (; len; ++p) {
 		p->base = (char*) dynmem_get(pbuf, offset);
 		uint32_t max_len = dynmem_surplus(pbuf, offset);
 		p->len = len > max_len ? max_len : len;
 		offset += p->len;
+		len -= p->len;
 	}
 	return p - bufs;
 }
@@ -154,7 +229,7 @@ static uint32_t write_http_header(httpctx_t* pctx) {
 	// 生成http回复状态消息和消息长度
 	char* status_message = get_message_by_status(res->status);
 	int prlen = snprintf((char*) dynmem_next_pos(pbuf), dynmem_next_surplus(pbuf), RESP_STATUS, res->status, status_message, body_len);
-	dynmem_grow(pbuf, prlen);
+	dynmem_set_len(pbuf, dynmem_len(pbuf) + prlen);
 
 	// 如果需要保持连接，写入保持连接的头部
 	if (res->keep_alive)
@@ -165,6 +240,16 @@ static uint32_t write_http_header(httpctx_t* pctx) {
 		mem_array_copyfrom(pbuf, &res->content_type);
 		dynmem_append(pbuf, "\r\n", 2);
 	}
+	// 压缩编码及内容协商
+	if (res->encoding)
+		dynmem_append(pbuf, CONTENT_ENCODING[res->encoding], strlen(CONTENT_ENCODING[res->encoding]));
+	if (res->vary)
+		dynmem_append(pbuf, VARY_ENCODING, sizeof(VARY_ENCODING) - 1);
+	if (res->etag) {
+		char etag[48];
+		int elen = snprintf(etag, sizeof(etag), ETAG_FORMAT, (uint32_t) res->etag, (uint32_t) (res->etag >> 32));
+		dynmem_append(pbuf, etag, elen);
+	}
 
 	// 处理其他头部字段
 	http_header_node_t* hpos;
@@ -181,21 +266,75 @@ static uint32_t write_http_header(httpctx_t* pctx) {
 	return dynmem_len(pbuf) - write_start;
 }
 
-// 向客户端写入回复内容
-static void write_http_resp(httpctx_t* pctx) {
+/** crc32c增量计算回调, 逐页计算回复内容 */
+static uint32_t on_etag_page(void* arg, void* data, uint32_t len) {
+	*(uint32_t*) arg = crc32c_update(*(uint32_t*) arg, data, len);
+	return len;
+}
+
+/** 查找请求头部, 名称为小写, 比较时不区分大小写 */
+static http_value_t* find_req_header(httpctx_t* pctx, const char* name, uint32_t len) {
+	dynmem_t* pbuf = &pctx->req.data;
+	http_header_node_t* pos;
+	list_foreach(pos, &pctx->req.headers) {
+		if (pos->data.field.len != len) continue;
+		char field[len];
+		dynmem_read(pbuf, pos->data.field.pos, len, field);
+		uint32_t i = 0;
+		while (i < len && (field[i] | 0x20) == name[i]) ++i;
+		if (i == len) return &pos->data.value;
+	}
+	return NULL;
+}
+
+/** 请求的If-None-Match包含回复的ETag时改为回复304并清空内容
+ * @return              是否已改为回复304
+*/
+static _Bool check_not_modified(httpctx_t* pctx) {
+	httpres_t* res = &pctx->res;
+	if (!res->etag) return 0;
+	http_value_t* inm = find_req_header(pctx, IF_NONE_MATCH, sizeof(IF_NONE_MATCH) - 1);
+	if (!inm || !inm->len) return 0;
+	// 比较时忽略W/前缀, 只查找引号内的部分
+	char tag[32], val[inm->len + 1];
+	snprintf(tag, sizeof(tag), "\"%08x-%x\"", (uint32_t) res->etag, (uint32_t) (res->etag >> 32));
+	dynmem_read(&pctx->req.data, inm->pos, inm->len, val);
+	val[inm->len] = '\0';
+	if (!strstr(val, tag) && !(inm->len == 1 && val[0] == '*')) return 0;
+	res->status = 304;
+	res->body.len = 0;
+	return 1;
+}
+
+/** 为回复内容生成弱ETag, 请求的If-None-Match包含相同的ETag时改为回复304并清空内容.
+ *  在压缩之前按原始内容计算, 同一内容的不同压缩编码使用相同的弱ETag
+*/
+static void apply_etag(httpctx_t* pctx) {
+	httpres_t* res = &pctx->res;
+	if (res->status != 200 || res->body_type != HC_BODY_MEMORY || !res->body.len || res->encoding)
+		return;
+	uint32_t crc = 0;
+	dynmem_foreach(&res->data, &crc, res->body.pos, res->body.len, on_etag_page);
+	res->etag = ((uint64_t) res->body.len << 32) | crc;
+	check_not_modified(pctx);
+}
+
+// 向客户端写入回复内容, 返回写入的总长度
+static uint32_t write_http_resp(httpctx_t* pctx) {
 	httpres_t* res = &pctx->res;
 	dynmem_t* pres_data = &res->data;
 	uint32_t write_start = dynmem_align(pres_data);
 
 	// 写入回复头部信息
 	uint32_t head_size = write_http_header(pctx);
-	// 计算uv_buf_t数组长度: header长度 + body长度
+	// 计算uv_buf_t数组长度: header占用的页数 + body占用的页数, body的起始位置不一定按页对齐
 	uint32_t body_size = res->body.len;
 	uint32_t ps = pres_data->page;
-	uint32_t bufs_size = (head_size + ps - 1) / ps + (body_size + ps - 1) / ps;
+	uint32_t body_skip = body_size ? (res->body.pos & (ps - 1)) : 0;
+	uint32_t bufs_size = (head_size + ps - 1) / ps + (body_skip + body_size + ps - 1) / ps;
 
 	// 生成uv_buf_t数组, 作为uv_write写入函数的数据区
-	uv_buf_t* bufs = malloc(sizeof(uv_buf_t) * (bufs_size + 1));
+	uv_buf_t* bufs = memtag_malloc(MEMTAG_WRITE, sizeof(uv_buf_t) * (bufs_size + 1));
 	bufs[bufs_size].base = NULL;
 	res->write_bufs = bufs;
 
@@ -204,11 +343,28 @@ static void write_http_resp(httpctx_t* pctx) {
 	idx += fill_uv_buf_ts(bufs, pres_data, write_start, head_size);
 	// 处理body的uv_buf_t
 	idx += fill_uv_buf_ts(bufs + idx, pres_data, res->body.pos, res->body.len);
+	bufs[idx].base = NULL;
 
 	// 将生成的回复数据用uv_write写入到客户端
-	resp_write_t *wri = malloc(sizeof(resp_write_t));
+	resp_write_t *wri = memtag_malloc(MEMTAG_WRITE, sizeof(resp_write_t));
+	wri->httpctx = pctx;
+	wri->shared = NULL;
+	uv_write((uv_write_t*) wri, (uv_stream_t*) pctx, res->write_bufs, idx, on_writed);
+	return head_size + body_size;
+}
+
+// 向客户端写入回复缓存中序列化的完整回复, 不复制内容, 返回写入的总长度
+static uint32_t write_cached_resp(httpctx_t* pctx, ptr_t data) {
+	uv_buf_t* bufs = memtag_malloc(MEMTAG_WRITE, sizeof(uv_buf_t) * 2);
+	bufs[0] = uv_buf_init((char*) data, ptr_len(data));
+	bufs[1].base = NULL;
+	pctx->res.write_bufs = bufs;
+
+	resp_write_t *wri = memtag_malloc(MEMTAG_WRITE, sizeof(resp_write_t));
 	wri->httpctx = pctx;
-	uv_write((uv_write_t*) wri, (uv_stream_t*) pctx, res->write_bufs, bufs_size, on_writed);
+	wri->shared = data;
+	uv_write((uv_write_t*) wri, (uv_stream_t*) pctx, bufs, 1, on_writed);
+	return ptr_len(data);
 }
 
 /** 调用uv_close时的自动回调函数 */
@@ -217,32 +373,120 @@ static void on_closed(uv_handle_t* handle) {
 
 	// 如果在写入时非正常关闭，清理写入数据区
 	uv_buf_t* bufs = ((httpctx_t*) handle)->res.write_bufs;
-	if (bufs) free(bufs);
+	if (bufs) memtag_free(bufs);
+	memtag_free(((httpctx_t*) handle)->pipeline);
+
+	// 连接关闭时可能有未处理完的请求
+	metrics_t* m = ((httpctx_t*) handle)->pool->metrics;
+	METRICS_ADD(m->connections, -1);
+	if (((httpctx_t*) handle)->timing.first_byte) METRICS_ADD(m->active, -1);
 
 	httpctx_free((httpctx_t*) handle);
 }
 
+/** 保存流水线请求内容, front为真时放回开头(请求报文之后未处理的剩余内容), 否则追加到末尾(回复期间收到的内容) */
+static void pipeline_put(httpctx_t* pctx, bool front, const char* data, uint32_t len) {
+	// 剩余内容都是刚从开头取出的, 直接回退已处理的位置
+	if (front && len <= pctx->pipeline_pos) {
+		pctx->pipeline_pos -= len;
+		memcpy(pctx->pipeline + pctx->pipeline_pos, data, len);
+		return;
+	}
+	uint32_t rest = pctx->pipeline_len - pctx->pipeline_pos;
+	if (front || pctx->pipeline_len + len > pctx->pipeline_cap) {
+		// 未处理的内容移动到缓冲区开头, 放回开头时预留位置, 容量不够时扩大
+		uint32_t cap = pctx->pipeline_cap ? pctx->pipeline_cap : HTTPCTX_PAGE_SIZE;
+		while (cap < rest + len) cap <<= 1;
+		uint8_t* nbuf = cap == pctx->pipeline_cap ? pctx->pipeline : memtag_malloc(MEMTAG_SERVER, cap);
+		if (rest) memmove(nbuf + (front ? len : 0), pctx->pipeline + pctx->pipeline_pos, rest);
+		if (nbuf != pctx->pipeline) {
+			memtag_free(pctx->pipeline);
+			pctx->pipeline = nbuf;
+			pctx->pipeline_cap = cap;
+		}
+		pctx->pipeline_pos = 0;
+		pctx->pipeline_len = rest;
+	}
+	memcpy(pctx->pipeline + (front ? 0 : pctx->pipeline_len), data, len);
+	pctx->pipeline_len += len;
+}
+
+/** 回复写入完成后继续处理已收到的流水线请求, 按读取的方式逐段处理, 直到下一个请求开始回复 */
+static void pipeline_resume(httpctx_t* pctx) {
+	while (pctx->pipeline_pos < pctx->pipeline_len && pctx->req.parser_state != HTTP_PARSER_COMPLETE) {
+		uv_buf_t buf;
+		uint32_t n = pctx->pipeline_len - pctx->pipeline_pos;
+		on_allocing((uv_handle_t*) pctx, n, &buf);
+		if (n > buf.len) n = (uint32_t) buf.len;
+		memcpy(buf.base, pctx->pipeline + pctx->pipeline_pos, n);
+		pctx->pipeline_pos += n;
+		process_read(pctx, &buf, n);
+	}
+	// 全部处理完后释放缓冲区, 空闲连接不占用
+	if (pctx->pipeline_pos == pctx->pipeline_len) {
+		memtag_free(pctx->pipeline);
+		pctx->pipeline = NULL;
+		pctx->pipeline_pos = pctx->pipeline_len = pctx->pipeline_cap = 0;
+	}
+	if (pctx->read_paused && pctx->pipeline_len - pctx->pipeline_pos < HS_PIPELINE_MAX) {
+		pctx->read_paused = 0;
+		uv_read_start((uv_stream_t*) pctx, on_allocing, on_readed);
+	}
+}
+
 /** 调用uv_write进行一次性写入时的自动回调函数 */
 static void on_writed(uv_write_t *req, int status) {
 	log_write_status(req, status);
 
 	// 写入完成后释放内存
 	uv_buf_t** pbufs = &((resp_write_t*) req)->httpctx->res.write_bufs;
-	if (*pbufs) free(*pbufs);
+	if (*pbufs) memtag_free(*pbufs);
 	*pbufs = NULL;
 
+	// 请求处理完毕, 连接转为空闲状态
+	httpctx_t* pctx = ((resp_write_t*) req)->httpctx;
+	metrics_t* m = pctx->pool->metrics;
+	METRICS_ADD(m->active, -1);
+
+	// 超过阈值或者命中采样的请求输出各阶段耗时
+	pctx->timing.written = uv_hrtime();
+	if (slowlog_enabled && status == 0) {
+		uint64_t total = pctx->timing.written - pctx->timing.first_byte;
+		if (slowlog_threshold && total >= slowlog_threshold) {
+			log_slow_req(pctx, total, 1);
+		} else if (slowlog_sample && ++slowlog_seq >= slowlog_sample) {
+			slowlog_seq = 0;
+			log_slow_req(pctx, total, 0);
+		}
+	}
+
 	// 重置httpctx上下文对象，为下一次读取做准备
 	httpctx_reset(((resp_write_t*) req)->httpctx);
 
-	// 释放为写入申请的resp_write_t类型的对象
-	free(req);
+	// 释放为写入申请的resp_write_t类型的对象及持有的缓存内容引用
+	if (((resp_write_t*) req)->shared) ptr_free(((resp_write_t*) req)->shared);
+	memtag_free(req);
+
+	// 处理回复期间已收到的后续请求
+	if (pctx->pipeline && !uv_is_closing((uv_handle_t*) pctx)) pipeline_resume(pctx);
 }
 
 /** uv每次读取客户端数据前回调的内存分配函数 */
 static void on_allocing(uv_handle_t* client, size_t suggested_size, uv_buf_t* buf) {
 	log_trace("http on alloc, suggested_size = %u", (uint32_t) suggested_size);
+	dynmem_t* preqbuf = &((httpctx_t*)client)->req.data;
+	httpctx_pool_t* pool = ((httpctx_t*)client)->pool;
+
+	// 没有未完成的请求时读取到共享接收缓冲区, 空闲连接不占用读取缓冲区
+	// uv在读取回调完成前不会再次分配, 所以共享缓冲区不会被同时使用
+	if (pool->recv_slab && !dynmem_cap(preqbuf)) {
+		buf->base = (char*) pool->recv_slab;
+		buf->len = pool->recv_slab_size;
+		return;
+	}
+
 	uint32_t out_len = 0;
-	dynmem_lastpage(&((httpctx_t*)client)->req.data, (uint8_t**)&buf->base, &out_len);
+	dynmem_lastpage(preqbuf, (uint8_t**)&buf->base, &out_len);
 	buf->len = out_len;
 }
 
@@ -257,29 +501,102 @@ static void on_readed(uv_stream_t* uv_stream, ssize_t nread, const uv_buf_t* buf
 	} else if (nread == 0) {
 		return;
 	}
+	METRICS_ADD(client->pool->metrics->bytes_in, nread);
+
+	// 上一个请求的回复还没有写入完成, 收到的内容先保存, 写入完成后再处理
+	if (client->req.parser_state == HTTP_PARSER_COMPLETE) {
+		pipeline_put(client, false, buf->base, (uint32_t) nread);
+		if ((uint8_t*) buf->base != client->pool->recv_slab) dynmem_clear(&client->req.data);
+		if (client->pipeline_len - client->pipeline_pos >= HS_PIPELINE_MAX) {
+			uv_read_stop(uv_stream);
+			client->read_paused = 1;
+		}
+		return;
+	}
+	process_read(client, buf, (uint32_t) nread);
+}
 
-	// 对收到的数据进行解析
-	httpctx_parser_execute(client, buf->base, buf->len);
-	// 设置读取缓冲区的当前长度
-	dynmem_grow(&client->req.data, buf->len);
+/** 解析读取到的内容, 请求报文完整时处理请求并写入回复, 报文之后的内容保存为流水线请求 */
+static void process_read(httpctx_t* client, const uv_buf_t* buf, uint32_t nread) {
+	dynmem_t* preqbuf = &client->req.data;
+	httpctx_pool_t* pool = client->pool;
+	metrics_t* m = pool->metrics;
+	uint32_t page = preqbuf->page;
+	// 连接上还没有开始的请求, 解析到报文起始时设置到达时间, 连接转为活动状态
+	bool idle = !client->timing.first_byte;
+	bool in_slab = pool->recv_slab && (uint8_t*) buf->base == pool->recv_slab;
+	_dynmem_node_t slab_node;
+	uint32_t used;
+
+	if (in_slab) {
+		// 数据位于共享接收缓冲区, 临时挂载为请求缓冲区, 就地解析和处理
+		dynmem_attach(preqbuf, &slab_node, pool->recv_slab, pool->recv_slab_size, nread);
+		used = (uint32_t) httpctx_parser_execute(client, buf->base, nread);
+		dynmem_set_len(preqbuf, used);
+	} else {
+		// 对收到的数据进行解析
+		used = (uint32_t) httpctx_parser_execute(client, buf->base, nread);
+		// 设置读取缓冲区的当前长度
+		dynmem_set_len(preqbuf, dynmem_len(preqbuf) + used);
+	}
+	if (idle && client->timing.first_byte) METRICS_ADD(m->active, 1);
 
 	// 读取的请求数据尚未结束
 	if (client->req.parser_state != HTTP_PARSER_COMPLETE) {
+		// 共享接收缓冲区需要给其它连接使用, 将已读取内容复制到连接自己的缓冲区, 已解析的偏移位置保持不变
+		if (in_slab) {
+			dynmem_detach(preqbuf, page);
+			dynmem_append(preqbuf, buf->base, nread);
+		}
 		log_trace("on_readed can't read end, continue...");
 		return;
 	}
+	// 同一次读取中报文之后的内容属于后续请求, 本次回复写入完成后再处理
+	if (used < nread) pipeline_put(client, true, buf->base + used, nread - used);
 
 	// 输出调试信息
 	if (log_is_trace_enabled()) log_trace_req(client);
-
-	// 调用回调函数进行处理
-	client->serve_cb(client);
-	// 向客户端写入回复信息
-	write_http_resp(client);
+	// 按采样率采集请求流量
+	if (capture_enabled()) capture_request(client);
+
+	// 调用回调函数进行处理, 指标输出路径由统计模块处理, 命中回复缓存时不调用回调函数
+	ptr_t cached = NULL;
+	client->timing.req_size = dynmem_len(preqbuf);
+	client->timing.handler_begin = uv_hrtime();
+	if (metrics_match(client))
+		metrics_serve(client);
+	else if (!respcache_enabled() || !(cached = respcache_lookup(client)))
+		client->serve_cb(client);
+	client->timing.handler_end = uv_hrtime();
+	if (etag_enabled) {
+		if (!cached) {
+			apply_etag(client);
+		} else if (check_not_modified(client)) {
+			// 缓存命中但客户端已有相同内容, 不写入缓存的完整回复, 改为只回复304头部
+			ptr_free(cached);
+			cached = NULL;
+		}
+	}
+	if (cached) {
+		// 直接写入共享的序列化回复
+		client->timing.res_size = write_cached_resp(client, cached);
+	} else {
+		// 按客户端接受的编码压缩回复内容
+		if (httpzip_enabled()) httpzip_response(client);
+		// 向客户端写入回复信息
+		client->timing.res_size = write_http_resp(client);
+		if (respcache_enabled()) respcache_store(client);
+	}
+	metrics_request(m, client, client->timing.res_size);
+	if (accesslog_enabled()) accesslog_request(client);
+	if (slowlog_enabled) save_slow_path(client);
 
 	// 写入是异步操作，这里为了充分利用内存，先行将请求对象占用的内存进行释放
 	// 回复对象占用的内存及其它小内存占用，等到写入完成再释放
-	dynmem_clear(&client->req.data);
+	if (in_slab)
+		dynmem_detach(preqbuf, page);
+	else
+		dynmem_clear(preqbuf);
 }
 
 /** http服务每次有新连接时的回调函数 */
@@ -291,10 +608,15 @@ static void on_new_connection(uv_stream_t* server, int status) {
 	}
 
 	httpctx_t* client = httpctx_pool_get(((http_server_t*) server)->pool, ((http_server_t*) server)->serve_cb);
+	// 连接数在on_closed中减少, 接受失败时也会调用on_closed
+	metrics_t* m = client->pool->metrics;
+	METRICS_ADD(m->connections, 1);
 	// uv_tcp_t *client = (uv_tcp_t*) malloc(sizeof(uv_tcp_t));
 	uv_tcp_init(uv_default_loop(), (uv_tcp_t*) client);
 	if (uv_accept(server, (uv_stream_t*) client) == 0) {
 		log_trace("http connection ok");
+		METRICS_ADD(m->accepted, 1);
+		client->timing.accept = uv_hrtime();
 		uv_read_start((uv_stream_t*) client, on_allocing, on_readed);
 	} else {
 		log_trace("uv_accept error");
@@ -319,12 +641,16 @@ bool http_server(uv_loop_t* puv_loop, http_server_t* pserver, const char* listen
 	if (!httpctx_pool_destroy_registered) atexit(on_httpctx_pool_destroy);
 
 	// 初始化服务关联的上下文内存池
-	pserver->pool = httpctx_pool_malloc(HS_HEAD_POOL_SIZE, HS_CTX_POOL_SIZE);
+	pserver->pool = httpctx_pool_malloc(HS_HEAD_POOL_SIZE, HS_CTX_POOL_SIZE, HS_QUERY_POOL_SIZE);
+	if (HS_RECV_SLAB_SIZE) {
+		pserver->pool->recv_slab = memtag_malloc(MEMTAG_SERVER, HS_RECV_SLAB_SIZE);
+		pserver->pool->recv_slab_size = HS_RECV_SLAB_SIZE;
+	}
 	// 设置服务的回调处理函数
 	pserver->serve_cb = callback;
 
 	// 把新创建的内存池加入到待释放的内存池链表中
-	_pool_list_node_t* plist = malloc(sizeof(_pool_list_node_t));
+	_pool_list_node_t* plist = memtag_malloc(MEMTAG_SERVER, sizeof(_pool_list_node_t));
 	plist->data = pserver->pool;
 	list_add_tail(&plist->node, &httpctx_pool_list);
 
@@ -332,6 +658,8 @@ bool http_server(uv_loop_t* puv_loop, http_server_t* pserver, const char* listen
 	struct sockaddr_in addr;
 	if (puv_loop == NULL)
 		puv_loop = uv_default_loop();
+	// 创建服务的运行指标统计对象
+	pserver->pool->metrics = metrics_create(puv_loop, pserver->pool);
 	uv_tcp_init(puv_loop, (uv_tcp_t*) pserver);
 	uv_ip4_addr(host, port, &addr);
 
@@ -348,6 +676,16 @@ bool http_server(uv_loop_t* puv_loop, http_server_t* pserver, const char* listen
 	return true;
 }
 
+void http_server_slowlog(uint32_t threshold_ms, uint32_t sample) {
+	slowlog_threshold = (uint64_t) threshold_ms * 1000000;
+	slowlog_sample = sample;
+	slowlog_enabled = threshold_ms || sample;
+}
+
+void http_server_etag(_Bool enable) {
+	etag_enabled = enable;
+}
+
 static int http_static_serve(httpctx_t* ctx) {
 	//
 }
@@ -390,8 +728,7 @@ inline static http_route_node_t* _get_route(rb_root_t* root, const char* str, ui
 	http_route_node_t* node = rb_search(root, &tmp, _route_cmp);
 	if (!node) {
 		uint32_t node_size = sizeof(http_route_node_t) + len + 1;
-		node = (http_route_node_t*) malloc(node_size);
-		memset(node, 0, node_size);
+		node = (http_route_node_t*) memtag_calloc(MEMTAG_SERVER, node_size);
 		node->plen = len;
 		node->path = (char*)node + sizeof(http_route_node_t);
 		strcpy(node->path, str);
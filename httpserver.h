@@ -56,6 +56,17 @@ extern bool http_server(uv_loop_t* puv_loop, http_server_t* pserver,
  */
 extern bool http_service(uv_loop_t* puv_loop, http_route_t* route, const char* listen, int backlog);
 
+/** 设置慢请求日志, 处理时间超过阈值或命中采样的请求在写入完成后输出一行各阶段耗时记录
+ * @param threshold_ms  慢请求阈值(毫秒), 超过阈值以WARN级别输出, 0表示不按阈值输出
+ * @param sample        采样间隔, 每sample个请求以INFO级别输出1个, 0表示不采样
+*/
+extern void http_server_slowlog(uint32_t threshold_ms, uint32_t sample);
+
+/** 设置是否为回复内容生成ETag, 开启后对状态码200的内容按crc32c生成弱ETag, 并按If-None-Match回复304
+ * @param enable        true: 开启, false: 关闭
+*/
+extern void http_server_etag(bool enable);
+
 extern void http_route_init(http_route_t* route);
 
 extern _Bool http_route_add(const http_route_t* self, const str_t path, on_http_serve_cb func);
@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "httpzip.h"
+#include "deflate.h"
+#include "memtag.h"
+#include "log.h"
+
+// 编译参数 -- 可单独设置压缩级别的内容类型数量
+#ifndef HTTPZIP_MAX_TYPES
+#   define HTTPZIP_MAX_TYPES 16
+#endif
+// 静态内容只压缩一次, 使用最高压缩级别
+#ifndef HTTPZIP_STATIC_LEVEL
+#   define HTTPZIP_STATIC_LEVEL 9
+#endif
+// Accept-Encoding头部的最大处理长度
+#define ACCEPT_MAX 256
+
+// 内容类型对应的压缩级别
+typedef struct _type_level_t {
+    char*           prefix;             // 内容类型前缀, 小写
+    uint32_t        len;
+    int             level;
+} _type_level_t;
+
+struct httpzip_static_t {
+    uint8_t*        data[3];            // 按hc_encoding_t索引的各版本内容, 压缩后没有变小的版本指向原始内容
+    uint32_t        len[3];
+    char*           content_type;
+    uint32_t        type_len;
+};
+
+bool _httpzip_enabled = false;
+
+static uint32_t _min_size = 1024;
+static int _default_level = 6;
+static _type_level_t _types[HTTPZIP_MAX_TYPES];
+static uint32_t _type_count = 0;
+
+/** 每个事件循环线程使用自己的压缩对象, 第一次压缩时创建 */
+static _Thread_local deflate_t* _zip = NULL;
+
+inline static deflate_t* local_zip() {
+    if (!_zip) _zip = deflate_create();
+    return _zip;
+}
+
+inline static char to_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+void httpzip_start(uint32_t min_size, int level) {
+    _min_size = min_size;
+    _default_level = level;
+    _httpzip_enabled = true;
+    log_info("response compression for bodies >= %u bytes, default level %d", min_size, level);
+}
+
+bool httpzip_set_level(const char* content_type, int level) {
+    if (_type_count == HTTPZIP_MAX_TYPES) return false;
+    _type_level_t* t = &_types[_type_count++];
+    t->len = (uint32_t) strlen(content_type);
+    t->prefix = memtag_malloc(MEMTAG_DEFLATE, t->len + 1);
+    for (uint32_t i = 0; i <= t->len; ++i) t->prefix[i] = to_lower(content_type[i]);
+    t->level = level;
+    return true;
+}
+
+/** 按最长前缀查找回复内容类型的压缩级别 */
+static int type_level(httpres_t* res) {
+    char ct[64];
+    uint32_t len = res->content_type.len < sizeof(ct) ? res->content_type.len : sizeof(ct);
+    len = dynmem_read(&res->data, res->content_type.pos, len, ct);
+    for (uint32_t i = 0; i < len; ++i) ct[i] = to_lower(ct[i]);
+
+    int level = _default_level;
+    uint32_t best = 0;
+    for (uint32_t i = 0; i < _type_count; ++i) {
+        _type_level_t* t = &_types[i];
+        if (t->len <= len && t->len > best && !memcmp(ct, t->prefix, t->len)) {
+            level = t->level;
+            best = t->len;
+        }
+    }
+    return level;
+}
+
+/** 查找请求头部, 名称不区分大小写 */
+static http_value_t* find_header(httpctx_t* ctx, const char* name, uint32_t len) {
+    dynmem_t* pbuf = &ctx->req.data;
+    http_header_node_t* pos;
+    list_foreach(pos, &ctx->req.headers) {
+        if (pos->data.field.len != len) continue;
+        char field[len];
+        dynmem_read(pbuf, pos->data.field.pos, len, field);
+        uint32_t i = 0;
+        while (i < len && to_lower(field[i]) == name[i]) ++i;
+        if (i == len) return &pos->data.value;
+    }
+    return NULL;
+}
+
+/** 解析q值, 返回0-1000 */
+static uint32_t parse_q(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    if (end - p < 2 || to_lower(p[0]) != 'q' || p[1] != '=') return 1000;
+    p += 2;
+    uint32_t q = 0;
+    if (p < end && *p == '1') return 1000;
+    if (p < end && *p == '0') ++p;
+    if (p < end && *p == '.') {
+        ++p;
+        for (uint32_t scale = 100; scale && p < end && *p >= '0' && *p <= '9'; scale /= 10, ++p)
+            q += (*p - '0') * scale;
+    }
+    return q;
+}
+
+hc_encoding_t httpzip_accept(httpctx_t* ctx) {
+    http_value_t* val = find_header(ctx, "accept-encoding", 15);
+    if (!val) return HC_ENCODING_IDENTITY;
+
+    char buf[ACCEPT_MAX];
+    uint32_t len = dynmem_read(&ctx->req.data, val->pos, val->len < ACCEPT_MAX ? val->len : ACCEPT_MAX, buf);
+    // q值, -1表示未列出
+    int gzip = -1, deflate = -1, any = -1;
+    for (const char *p = buf, *end = buf + len; p < end; ) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+        const char* name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') ++p;
+        uint32_t nlen = (uint32_t) (p - name);
+        const char* param = p;
+        while (p < end && *p != ',') ++p;
+        const char* semi = memchr(param, ';', p - param);
+        int q = (int) (semi ? parse_q(semi + 1, p) : 1000);
+
+        char lower[8];
+        if (nlen > sizeof(lower)) continue;
+        for (uint32_t i = 0; i < nlen; ++i) lower[i] = to_lower(name[i]);
+        if ((nlen == 4 && !memcmp(lower, "gzip", 4)) || (nlen == 6 && !memcmp(lower, "x-gzip", 6)))
+            gzip = q;
+        else if (nlen == 7 && !memcmp(lower, "deflate", 7))
+            deflate = q;
+        else if (nlen == 1 && lower[0] == '*')
+            any = q;
+    }
+
+    if (gzip < 0) gzip = any;
+    if (deflate < 0) deflate = any;
+    if (gzip <= 0 && deflate <= 0) return HC_ENCODING_IDENTITY;
+    return gzip >= deflate ? HC_ENCODING_GZIP : HC_ENCODING_DEFLATE;
+}
+
+/** 压缩输入回调, 从回复缓冲区的内存页逐段读取 */
+static uint32_t on_zip_in(void* arg, void* data, uint32_t len) {
+    deflate_update((deflate_t*) arg, data, len);
+    return len;
+}
+
+/** 压缩输出回调, 追加到回复缓冲区 */
+static void on_zip_out(void* arg, const void* data, uint32_t len) {
+    dynmem_append((dynmem_t*) arg, data, len);
+}
+
+void httpzip_response(httpctx_t* ctx) {
+    httpres_t* res = &ctx->res;
+    if (res->body_type != HC_BODY_MEMORY || res->encoding || res->vary || res->body.len < _min_size
+            || res->status == 204 || res->status == 304)
+        return;
+    int level = type_level(res);
+    if (level <= 0) return;
+
+    // 可以压缩的内容需要告知缓存按Accept-Encoding区分
+    res->vary = 1;
+    hc_encoding_t enc = httpzip_accept(ctx);
+    if (enc == HC_ENCODING_IDENTITY) return;
+    deflate_t* zip = local_zip();
+    if (!zip) return;
+
+    dynmem_t* pbuf = &res->data;
+    uint32_t start = dynmem_len(pbuf);
+    deflate_begin(zip, enc == HC_ENCODING_GZIP ? DEFLATE_GZIP : DEFLATE_ZLIB, level, on_zip_out, pbuf);
+    dynmem_foreach(pbuf, zip, res->body.pos, res->body.len, on_zip_in);
+    uint32_t len = deflate_end(zip);
+
+    // 压缩后没有变小则使用原始内容
+    if (len >= res->body.len) {
+        dynmem_set_len(pbuf, start);
+        return;
+    }
+    res->body.pos = start;
+    res->body.len = len;
+    res->encoding = enc;
+}
+
+// 连续内存的压缩输出
+typedef struct _zbuf_t {
+    uint8_t*        data;
+    uint32_t        len;
+    uint32_t        cap;
+} _zbuf_t;
+
+static void on_zbuf_out(void* arg, const void* data, uint32_t len) {
+    _zbuf_t* b = (_zbuf_t*) arg;
+    if (b->len + len > b->cap) {
+        uint32_t cap = b->cap;
+        while (cap < b->len + len) cap <<= 1;
+        uint8_t* nd = memtag_malloc(MEMTAG_DEFLATE, cap);
+        memcpy(nd, b->data, b->len);
+        memtag_free(b->data);
+        b->data = nd;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/** 生成静态内容的指定编码版本并发布, 多个线程同时生成时只保留第一个 */
+static uint8_t* make_variant(httpzip_static_t* self, hc_encoding_t enc) {
+    uint8_t* ret = self->data[HC_ENCODING_IDENTITY];
+    uint32_t raw_len = self->len[HC_ENCODING_IDENTITY], len = raw_len;
+    deflate_t* zip = local_zip();
+    if (zip) {
+        _zbuf_t b = { memtag_malloc(MEMTAG_DEFLATE, raw_len / 4 + 64), 0, raw_len / 4 + 64 };
+        deflate_begin(zip, enc == HC_ENCODING_GZIP ? DEFLATE_GZIP : DEFLATE_ZLIB, HTTPZIP_STATIC_LEVEL, on_zbuf_out, &b);
+        deflate_update(zip, ret, raw_len);
+        deflate_end(zip);
+        if (b.len < raw_len) {
+            ret = b.data;
+            len = b.len;
+        } else {
+            memtag_free(b.data);
+        }
+    }
+
+    uint8_t* expected = NULL;
+    __atomic_store_n(&self->len[enc], len, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&self->data[enc], &expected, ret, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        if (ret != self->data[HC_ENCODING_IDENTITY]) memtag_free(ret);
+        ret = expected;
+    }
+    return ret;
+}
+
+httpzip_static_t* httpzip_static_create(const void* data, uint32_t len, const char* content_type, bool eager) {
+    httpzip_static_t* self = memtag_calloc(MEMTAG_DEFLATE, sizeof(httpzip_static_t));
+    self->data[HC_ENCODING_IDENTITY] = memtag_malloc(MEMTAG_DEFLATE, len ? len : 1);
+    memcpy(self->data[HC_ENCODING_IDENTITY], data, len);
+    self->len[HC_ENCODING_IDENTITY] = len;
+    self->type_len = (uint32_t) strlen(content_type);
+    self->content_type = memtag_malloc(MEMTAG_DEFLATE, self->type_len + 1);
+    memcpy(self->content_type, content_type, self->type_len + 1);
+    if (eager) {
+        make_variant(self, HC_ENCODING_GZIP);
+        make_variant(self, HC_ENCODING_DEFLATE);
+    }
+    return self;
+}
+
+void httpzip_static_free(httpzip_static_t* self) {
+    uint8_t* raw = self->data[HC_ENCODING_IDENTITY];
+    for (uint32_t i = HC_ENCODING_GZIP; i <= HC_ENCODING_DEFLATE; ++i)
+        if (self->data[i] && self->data[i] != raw) memtag_free(self->data[i]);
+    memtag_free(raw);
+    memtag_free(self->content_type);
+    memtag_free(self);
+}
+
+void httpzip_static_serve(httpctx_t* ctx, httpzip_static_t* self) {
+    httpres_t* res = &ctx->res;
+    uint8_t* data = self->data[HC_ENCODING_IDENTITY];
+    uint32_t len = self->len[HC_ENCODING_IDENTITY];
+
+    res->vary = 1;
+    hc_encoding_t enc = httpzip_accept(ctx);
+    if (enc != HC_ENCODING_IDENTITY) {
+        uint8_t* v = __atomic_load_n(&self->data[enc], __ATOMIC_ACQUIRE);
+        if (!v) v = make_variant(self, enc);
+        if (v != data) {
+            data = v;
+            len = __atomic_load_n(&self->len[enc], __ATOMIC_RELAXED);
+            res->encoding = enc;
+        }
+    }
+
+    res->content_type.pos = dynmem_len(&res->data);
+    res->content_type.len = dynmem_append(&res->data, self->content_type, self->type_len);
+    httpctx_set_body(ctx, data, len);
+}
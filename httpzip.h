@@ -0,0 +1,83 @@
+/** http回复内容压缩, 按请求的Accept-Encoding协商使用gzip或deflate编码
+ *
+ *  动态内容: 服务回调函数生成的回复内容超过阈值时, 按内容类型对应的压缩级别流式压缩,
+ *  直接从回复缓冲区的内存页读取并把结果追加到同一缓冲区, 不需要连续内存. 压缩级别为0的内容类型不压缩.
+ *  静态内容: 使用httpzip_static_t保存原始内容及各编码的预压缩结果, 预压缩在创建时或第一次请求时进行,
+ *  以后的请求直接复制对应的版本, 不再重复压缩
+ * @file httpzip.h
+ * @author Kiven Lee
+ * @date 2021-08-09
+ * @version 1.0
+*/
+
+#pragma once
+#ifndef __HTTPZIP_H__
+#define __HTTPZIP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "httpctx.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** 动态内容压缩状态, 由httpzip_start设置, 请求处理流程中通过httpzip_enabled判断 */
+extern bool _httpzip_enabled;
+
+/** 开启动态内容压缩, 必须在服务启动前调用
+ * @param min_size      回复内容不小于该长度时才进行压缩
+ * @param level         未单独设置的内容类型使用的压缩级别, 1-9, 0表示不压缩
+*/
+extern void httpzip_start(uint32_t min_size, int level);
+
+/** 设置内容类型的压缩级别, 按最长前缀匹配Content-Type, 不区分大小写, 必须在服务启动前调用
+ * @param content_type  内容类型前缀, 例如 "application/json", "image/"
+ * @param level         压缩级别, 1-9, 0表示不压缩
+ * @return              成功返回true, 超出最大数量返回false
+*/
+extern bool httpzip_set_level(const char* content_type, int level);
+
+/** 判断是否开启了动态内容压缩
+ * @return              true: 已开启, false: 未开启
+*/
+inline static bool httpzip_enabled() { return _httpzip_enabled; }
+
+/** 解析请求的Accept-Encoding, 选择客户端可以接受的编码, 同等权重时优先gzip
+ * @param ctx           请求上下文对象
+ * @return              选择的编码, 客户端不接受压缩时返回HC_ENCODING_IDENTITY
+*/
+extern hc_encoding_t httpzip_accept(httpctx_t* ctx);
+
+/** 按协商结果压缩服务回调函数生成的回复内容, 在服务回调函数之后、写入回复之前调用,
+ *  已经设置了编码或者已经协商过的回复(例如httpzip_static_serve)不再处理
+ * @param ctx           请求上下文对象
+*/
+extern void httpzip_response(httpctx_t* ctx);
+
+/** 预压缩的静态内容 */
+typedef struct httpzip_static_t httpzip_static_t;
+
+/** 创建静态内容, 复制原始内容
+ * @param data          原始内容
+ * @param len           原始内容长度
+ * @param content_type  内容类型
+ * @param eager         true: 立即生成全部压缩版本, false: 每种编码在第一次请求时生成
+ * @return              静态内容对象
+*/
+extern httpzip_static_t* httpzip_static_create(const void* data, uint32_t len, const char* content_type, bool eager);
+
+/** 释放静态内容对象, 调用时不能有正在使用该对象的请求 */
+extern void httpzip_static_free(httpzip_static_t* self);
+
+/** 按协商结果设置回复的内容类型和内容, 可以在多个事件循环线程中同时调用
+ * @param ctx           请求上下文对象
+ * @param self          静态内容对象
+*/
+extern void httpzip_static_serve(httpctx_t* ctx, httpzip_static_t* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HTTPZIP_H__
@@ -2,9 +2,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <time.h>
 
+#include "uv.h"
 #include "log.h"
+#include "deflate.h"
 
 size_t log_strcpy(char* dst, const char* src) {
 	const char *osrc = src;
@@ -63,6 +67,76 @@ size_t get_fielpath(char* dst, size_t dstlen, const char* filename) {
 	return cpylen;
 }
 
+bool log_spec_parse(const char* fmt, log_spec_t* spec) {
+	const char* p = fmt + 1;
+	memset(spec, 0, sizeof(log_spec_t));
+	spec->prec = -1;
+
+	if (*p != '%') {
+		// 标志, 宽度, 精度
+		while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0') ++p;
+		if (*p == '*') {
+			++spec->stars;
+			++p;
+		} else
+			while (*p >= '0' && *p <= '9') ++p;
+		if (*p == '.') {
+			if (*++p == '*') {
+				++spec->stars;
+				++p;
+			} else {
+				spec->prec = 0;
+				while (*p >= '0' && *p <= '9') spec->prec = spec->prec * 10 + (*p++ - '0');
+			}
+		}
+
+		// 长度修饰符
+		switch (*p) {
+			case 'h':
+				spec->length = 'h';
+				if (*++p == 'h') ++p;
+				break;
+			case 'l':
+				spec->length = 'l';
+				if (*++p == 'l') {
+					spec->length = 'q';
+					++p;
+				}
+				break;
+			case 'q': case 'L': case 'z': case 'j': case 't':
+				spec->length = *p++;
+				break;
+		}
+	}
+
+	spec->conv = *p;
+	switch (*p) {
+		case '%':
+			spec->type = LOG_ARG_NONE;
+			break;
+		case 'c':
+			spec->type = LOG_ARG_INT;
+			break;
+		case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+			spec->type = spec->length && spec->length != 'h' ? LOG_ARG_INT64 : LOG_ARG_INT;
+			break;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			spec->type = LOG_ARG_DOUBLE;
+			break;
+		case 's':
+			if (spec->length) return false;
+			spec->type = LOG_ARG_STR;
+			break;
+		case 'p':
+			spec->type = LOG_ARG_PTR;
+			break;
+		default:
+			return false;
+	}
+	spec->len = p + 1 - fmt;
+	return true;
+}
+
 // 条件编译语句
 #ifndef NLOG
 
@@ -74,9 +148,46 @@ size_t get_fielpath(char* dst, size_t dstlen, const char* filename) {
 
 // 日志起始位置的长度, "[yyyy-MM-dd HH:mm:ss] [DEBUG] ", 共30字节
 #define LOG_HEAD_LEN 30
+// 日志级别标识的长度, "[DEBUG] ", 共8字节
+#define LOG_LEVEL_LEN 8
 // _HEX输出的每行长度
 #define LOG_HEX_LINE  (4 + 16 * 3)
 
+// 编译参数 -- 异步日志环形缓冲区的缺省大小, 必须是2的幂
+#ifndef LOG_RING_SIZE
+#   define LOG_RING_SIZE (1024 * 1024)
+#endif
+// 编译参数 -- 异步日志后台线程批量写入的缓冲区大小
+#ifndef LOG_BATCH_SIZE
+#   define LOG_BATCH_SIZE (64 * 1024)
+#endif
+// 编译参数 -- 二进制日志允许注册的最大格式数量
+#ifndef LOG_BIN_MAX_SITES
+#   define LOG_BIN_MAX_SITES 1024
+#endif
+// 编译参数 -- 单条二进制日志的最大参数长度, 超出时截断字符串参数
+#ifndef LOG_BIN_ARGS_MAX
+#   define LOG_BIN_ARGS_MAX 1024
+#endif
+// 格式字符串不支持二进制编码时的格式编号, 按文本格式输出
+#define LOG_BIN_TEXT 0xffffffffU
+// 访问日志记录的格式编号, 内容原样写入访问日志文件
+#define LOG_SITE_ACCESS 0xfffffffeU
+// 后台线程空闲时的等待时间(毫秒), 积压较少时不唤醒后台线程, 日志最多延迟该时间写入
+#define LOG_IDLE_WAIT 100
+// 环形缓冲区末尾的填充记录标志, 保存在记录长度的最高位
+#define LOG_REC_SKIP 0x80000000U
+// 编译参数 -- 缺省保留的历史日志文件数量
+#ifndef LOG_KEEP_FILES
+#   define LOG_KEEP_FILES 5
+#endif
+// 编译参数 -- 压缩历史日志文件的压缩级别, 1-9
+#ifndef LOG_GZIP_LEVEL
+#   define LOG_GZIP_LEVEL 6
+#endif
+// 记录按8字节对齐
+#define LOG_REC_ALIGN(x) (((x) + 7) & ~(size_t) 7)
+
 /** 当前日志级别 */
 log_level_t _log_level = LOG_DEBUG;
 
@@ -87,33 +198,187 @@ static bool _disable_console = false;
 static char *_log_name = NULL;
 /** 日志文件指针 */
 static FILE *_log_fp = NULL;
-/** 允许的最大日志文件长度, 超出将重建 */
+/** 允许的最大日志文件长度, 超出将轮转, 0表示不按大小轮转 */
 static size_t _log_max_size = 0;
 /** 当前日志文件长度 */
 static size_t _log_cur_size = 0;
+/** 按时间轮转的间隔(秒), 0表示不按时间轮转 */
+static uint32_t _log_interval = 0;
+/** 下一次按时间轮转的时间 */
+static time_t _log_next_rotate = 0;
+/** 保留的历史日志文件数量, 历史文件名为 日志文件名.1 到 日志文件名.N, 数字越小越新 */
+static uint32_t _log_keep = LOG_KEEP_FILES;
+/** 是否压缩轮转后的日志文件 */
+static bool _log_compress = false;
+/** 是否需要重新打开日志文件, 由log_reopen设置 */
+static int _log_reopen_flag = 0;
 
 /** 日志输出级别对应的输出内容 */
-static char _log_levels[][9] = {"[TRACE]", "[DEBUG] ", "[INFO ] ", "[WARN ] ", "[ERROR] ", "[OFF  ]"};
+static const char _log_levels[][LOG_LEVEL_LEN + 1] = {"[TRACE] ", "[DEBUG] ", "[INFO ] ", "[WARN ] ", "[ERROR] ", "[OFF  ] "};
 /** 16进制转换常量 */
 static const char _HEX[] = "0123456789abcdef";
 
-static inline bool _check_log_size() {
-	return _log_fp && _log_cur_size >= _log_max_size;
+/** 环形缓冲区中的日志记录头部, 日志内容紧随其后 */
+typedef struct _log_rec_t {
+	uint32_t size;      // 记录总长度(包括头部和对齐填充), 内容写完后最后写入, 0表示尚未提交
+	uint32_t len;       // 日志内容长度
+	int64_t  time;      // 日志时间, 秒
+	uint32_t level;     // 日志级别
+	uint32_t site;      // 二进制日志的格式编号, 0表示内容为文本, LOG_SITE_ACCESS表示访问日志
+} _log_rec_t;
+
+/** 异步日志的多生产者单消费者无锁环形缓冲区
+ *  生产者通过CAS移动head预留空间, 写入内容后提交记录长度, 后台线程按顺序读取已提交的记录,
+ *  处理完成后将已读取的区域清零再移动tail, 因此未提交的记录头部始终为0
+*/
+typedef struct _log_ring_t {
+	char*             buf;              // 缓冲区
+	size_t            size;             // 缓冲区大小, 2的幂
+	size_t            mask;             // 取模掩码
+	size_t            head;             // 生产者预留位置, 单调递增
+	size_t            tail;             // 消费者读取位置, 单调递增
+	uint64_t          dropped;          // 缓冲区已满时丢弃的日志数
+	int               waiting;          // 后台线程是否正在等待唤醒
+	int               stopping;         // 是否要求后台线程退出
+	log_full_policy_t policy;           // 缓冲区已满时的处理策略
+	uv_mutex_t        mutex;            // 唤醒后台线程使用的锁
+	uv_cond_t         cond;             // 唤醒后台线程使用的条件变量
+	uv_thread_t       thread;           // 后台写入线程
+} _log_ring_t;
+
+/** 是否处于异步日志模式 */
+static bool _log_async = false;
+static bool _log_async_registered = false;
+static _log_ring_t _log_ring;
+
+/** 二进制日志的格式定义 */
+typedef struct _log_site_t {
+	const char*     fmt;                // 格式字符串
+	uint32_t        fmt_len;            // 格式字符串长度
+	uint32_t        fixed;              // 除字符串内容外的参数编码长度
+	uint32_t        count;              // 带参数的格式说明数量
+	log_spec_t      specs[];            // 带参数的格式说明
+} _log_site_t;
+
+/** 二进制日志文件, 由后台线程写入, 与文本日志使用相同的轮转策略 */
+static FILE* _bin_fp = NULL;
+static char* _bin_name = NULL;
+static bool _bin_dirty = false;
+static size_t _bin_cur_size = 0;
+static time_t _bin_next_rotate = 0;
+static int _bin_reopen_flag = 0;
+/** 访问日志文件, 异步模式下由后台线程写入, 与文本日志使用相同的轮转策略 */
+static FILE* _access_fp = NULL;
+static char* _access_name = NULL;
+static bool _access_dirty = false;
+static size_t _access_cur_size = 0;
+static time_t _access_next_rotate = 0;
+static int _access_reopen_flag = 0;
+/** 已注册的格式, 编号从1开始 */
+static _log_site_t* _bin_sites[LOG_BIN_MAX_SITES + 1];
+static uint32_t _bin_count = 0;
+/** 格式定义是否已写入当前二进制文件, 只由后台线程访问 */
+static bool _bin_defined[LOG_BIN_MAX_SITES + 1];
+static uv_mutex_t _bin_lock;
+static uv_once_t _bin_once = UV_ONCE_INIT;
+
+/** 计算下一次按时间轮转的时间, 以本地时间当天零点为起点按间隔对齐 */
+static time_t _next_rotate_time(time_t now) {
+	struct tm tm;
+	localtime_r(&now, &tm);
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	time_t base = mktime(&tm);
+	return base + ((now - base) / _log_interval + 1) * _log_interval;
 }
 
-/** 日志文件超出长度, 重命名为bak文件 */
-static void _log_truncate() {
-	fclose(_log_fp);
-	size_t flen = strlen(_log_name);
-	// 重命名
-	char bak_name[flen + 5];
-	strcpy(bak_name, _log_name);
-	strcpy(bak_name + flen, ".bak");
-	// 删除旧的日志文件
-	remove(bak_name);
-	// 新建日志文件
-	if (!rename(_log_name, bak_name))
-		_log_fp = fopen(_log_name, "wb");
+/** 判断日志文件是否需要轮转或重新打开, 异步模式下只在后台线程中调用 */
+static inline bool _check_log_rotate() {
+	if (!_log_fp) return _log_name && __atomic_load_n(&_log_reopen_flag, __ATOMIC_RELAXED);
+	return (_log_max_size && _log_cur_size >= _log_max_size)
+		|| (_log_interval && time(NULL) >= _log_next_rotate)
+		|| __atomic_load_n(&_log_reopen_flag, __ATOMIC_RELAXED);
+}
+
+/** 压缩结果写入文件的回调函数 */
+static void _log_gzip_out(void* arg, const void* data, uint32_t len) {
+	fwrite(data, 1, len, (FILE*) arg);
+}
+
+/** 压缩历史日志文件为gzip格式的 文件名.gz, 成功后删除原文件, 失败时保留原文件.
+ *  在执行轮转的线程中压缩, 异步模式下为后台线程
+*/
+static void _log_gzip(const char* filename) {
+	char gz[strlen(filename) + 4], buf[16 * 1024];
+	sprintf(gz, "%s.gz", filename);
+	FILE* in = fopen(filename, "rb");
+	if (!in) return;
+	FILE* out = fopen(gz, "wb");
+	deflate_t* z = out ? deflate_create() : NULL;
+	bool ok = z != NULL;
+	if (ok) {
+		deflate_begin(z, DEFLATE_GZIP, LOG_GZIP_LEVEL, _log_gzip_out, out);
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+			deflate_update(z, buf, (uint32_t) n);
+		deflate_end(z);
+		deflate_free(z);
+		ok = !ferror(in) && !ferror(out);
+	}
+	fclose(in);
+	if (out && fclose(out)) ok = false;
+	remove(ok ? filename : gz);
+}
+
+/** 重命名历史日志文件, 同时处理压缩后的文件 */
+static void _log_rename(const char* from, const char* to) {
+	char gz_from[strlen(from) + 4], gz_to[strlen(to) + 4];
+	sprintf(gz_from, "%s.gz", from);
+	sprintf(gz_to, "%s.gz", to);
+	rename(from, to);
+	rename(gz_from, gz_to);
+}
+
+/** 打开日志文件, 以追加方式写入 */
+static void _log_open() {
+	_log_fp = fopen(_log_name, "ab");
+	_log_cur_size = _log_fp ? ftell(_log_fp) : 0;
+}
+
+/** 历史文件依次改名为 .2 到 .N, 超出数量的删除, 当前文件改名为 .1, 需要时压缩
+ * @param name          日志文件名, 调用前文件必须已关闭
+*/
+static void _log_shift(const char* name) {
+	size_t flen = strlen(name);
+	char from[flen + 16], to[flen + 16];
+	sprintf(to, "%s.%u", name, _log_keep);
+	remove(to);
+	sprintf(to, "%s.%u.gz", name, _log_keep);
+	remove(to);
+	for (uint32_t i = _log_keep - 1; i > 0; --i) {
+		sprintf(from, "%s.%u", name, i);
+		sprintf(to, "%s.%u", name, i + 1);
+		_log_rename(from, to);
+	}
+	sprintf(to, "%s.1", name);
+	rename(name, to);
+	if (_log_compress) _log_gzip(to);
+}
+
+/** 日志文件轮转: 当前文件改名为 .1 后新建, 外部工具已移动日志文件时(log_reopen)只重新打开.
+ *  异步模式下在后台线程中执行, 不阻塞日志调用
+*/
+static void _log_rotate() {
+	if (_log_fp) fclose(_log_fp);
+	_log_fp = NULL;
+	if (__atomic_exchange_n(&_log_reopen_flag, 0, __ATOMIC_RELAXED)) {
+		_log_open();
+		return;
+	}
+
+	_log_shift(_log_name);
+	_log_open();
+	if (_log_interval) _log_next_rotate = _next_rotate_time(time(NULL));
 }
 
 // 程序退出时执行的函数
@@ -151,6 +416,7 @@ void log_start(const char* filename, size_t maxsize) {
 	// 设置日志单元的一些全局变量的初始值
 	_log_cur_size = ftell(_log_fp);
 	_log_max_size = maxsize;
+	if (_log_interval) _log_next_rotate = _next_rotate_time(time(NULL));
 
 	// 复制文件名到本地
 	size_t ls = strlen(filename) + 1;
@@ -161,6 +427,20 @@ void log_start(const char* filename, size_t maxsize) {
 	atexit(_log_deinit);
 }
 
+void log_rotate(size_t max_size, uint32_t interval, uint32_t keep, bool compress) {
+	_log_max_size = max_size;
+	_log_interval = interval;
+	_log_keep = keep ? keep : 1;
+	_log_compress = compress;
+	if (interval) _log_next_rotate = _next_rotate_time(time(NULL));
+}
+
+void log_reopen() {
+	__atomic_store_n(&_log_reopen_flag, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&_bin_reopen_flag, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&_access_reopen_flag, 1, __ATOMIC_RELAXED);
+}
+
 /** 往日志中写入一个字符 */
 static inline void _log_putc(char c) {
 	if (!_disable_console)
@@ -190,59 +470,636 @@ static inline bool _check_disabled(log_level_t level) {
 	return level < _log_level || (_disable_console && !_log_fp);
 }
 
-/** 写入日志头部 */
-static void _log_head(log_level_t level) {
+/** 写入日志头部 "[yyyy-MM-dd HH:mm:ss] [DEBUG] ", 时间部分在同一秒内重复使用上次的格式化结果
+ * @return              写入的长度
+*/
+static size_t _log_head(char* dst, time_t t, log_level_t level) {
+	static _Thread_local time_t last = -1;
+	static _Thread_local char cache[32];
+	static _Thread_local size_t cache_len;
+	if (t != last) {
+		struct tm tm;
+		localtime_r(&t, &tm);
+		cache_len = strftime(cache, sizeof(cache), "[%Y-%m-%d %H:%M:%S] ", &tm);
+		last = t;
+	}
+	memcpy(dst, cache, cache_len);
+	memcpy(dst + cache_len, _log_levels[level], LOG_LEVEL_LEN);
+	return cache_len + LOG_LEVEL_LEN;
+}
+
+/** 唤醒正在等待的后台线程 */
+static void _ring_wakeup() {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&_log_ring.waiting, __ATOMIC_RELAXED)) {
+		uv_mutex_lock(&_log_ring.mutex);
+		uv_cond_signal(&_log_ring.cond);
+		uv_mutex_unlock(&_log_ring.mutex);
+	}
+}
+
+/** 在环形缓冲区中预留size字节, 记录跨越缓冲区末尾时先写入填充记录, 从缓冲区开始处预留
+ * @return              记录头部地址, 缓冲区已满且策略为丢弃时返回NULL
+*/
+static _log_rec_t* _ring_reserve(size_t size) {
+	_log_ring_t* r = &_log_ring;
+	size_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	for (;;) {
+		size_t off = pos & r->mask;
+		size_t total = off + size > r->size ? r->size - off + size : size;
+		if (pos + total - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->size) {
+			if (r->policy == LOG_FULL_DROP) {
+				__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+				return NULL;
+			}
+			_ring_wakeup();
+			uv_sleep(1);
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (!__atomic_compare_exchange_n(&r->head, &pos, pos + total, true,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		if (total != size) {
+			__atomic_store_n((uint32_t*) (r->buf + off), (uint32_t) (total - size) | LOG_REC_SKIP, __ATOMIC_RELEASE);
+			off = 0;
+		}
+		return (_log_rec_t*) (r->buf + off);
+	}
+}
+
+/** 写入一条记录到环形缓冲区, 单条记录最多占用缓冲区的1/4, 超出部分截断
+ * @param t             日志时间
+ * @param level         日志级别
+ * @param site          二进制日志的格式编号, 0表示文本
+ * @param data          记录内容
+ * @param len           记录内容长度
+*/
+static void _ring_push(time_t t, log_level_t level, uint32_t site, const void* data, size_t len) {
+	size_t max = (_log_ring.size >> 2) - sizeof(_log_rec_t);
+	if (len > max) len = max;
+	size_t size = LOG_REC_ALIGN(sizeof(_log_rec_t) + len);
+	_log_rec_t* rec = _ring_reserve(size);
+	if (!rec) return;
+
+	rec->len = (uint32_t) len;
+	rec->time = t;
+	rec->level = level;
+	rec->site = site;
+	memcpy(rec + 1, data, len);
+	__atomic_store_n(&rec->size, (uint32_t) size, __ATOMIC_RELEASE);
+	// 积压超过缓冲区的1/8时才唤醒后台线程, 否则由其定时醒来处理, 避免每条日志都产生一次唤醒的系统调用
+	_log_ring_t* r = &_log_ring;
+	if (__atomic_load_n(&r->head, __ATOMIC_RELAXED) - __atomic_load_n(&r->tail, __ATOMIC_RELAXED) >= (r->size >> 3))
+		_ring_wakeup();
+}
+
+/** 输出一条完整的日志, 同步模式直接写入, 异步模式写入环形缓冲区
+ * @param level         日志级别
+ * @param data          日志内容, 不包括日志头部和末尾的换行符
+ * @param len           日志内容长度
+*/
+static void _log_emit(log_level_t level, const char* data, size_t len) {
 	time_t t = time(NULL);
-	struct tm tm;
-	localtime_r(&t, &tm);
-	char buf[64];
-	size_t c = strftime(buf, sizeof(buf), "[%Y-%m-%d %H:%M:%S] ", &tm);
-	memcpy(buf + c, _log_levels[level], sizeof(_log_levels[0]));
-	_log_write(buf, c + sizeof(_log_levels[0]));
+
+	if (!_log_async) {
+		if (_check_log_rotate()) _log_rotate();
+		char head[64];
+		_log_write(head, _log_head(head, t, level));
+		_log_write(data, len);
+		_log_putc('\n');
+		_log_flush();
+		return;
+	}
+
+	_ring_push(t, level, 0, data, len);
 }
 
-static inline void _log_write_head(log_level_t level, const char* title) {
-	if (_check_log_size()) _log_truncate();
-	_log_head(level);
+/** 后台线程的批量写入缓冲区 */
+typedef struct _log_batch_t {
+	size_t          len;
+	char            data[LOG_BATCH_SIZE];
+} _log_batch_t;
 
-	if (title) {
-		int len = strlen(title);
-		_log_write(title, len);
+/** 批量写入缓冲区中的内容到控制台和日志文件 */
+static void _batch_flush(_log_batch_t* b) {
+	if (_check_log_rotate()) _log_rotate();
+	if (!b->len) return;
+	_log_write(b->data, b->len);
+	if (!_disable_console) fflush(stdout);
+	_log_flush();
+	b->len = 0;
+}
+
+/** 添加一条日志到批量写入缓冲区 */
+static void _batch_add(_log_batch_t* b, time_t t, log_level_t level, const char* data, size_t len) {
+	if (b->len + LOG_HEAD_LEN + len + 1 > sizeof(b->data)) _batch_flush(b);
+	b->len += _log_head(b->data + b->len, t, level);
+	// 超长的日志直接写入
+	if (b->len + len + 1 > sizeof(b->data)) {
+		_batch_flush(b);
+		_log_write(data, len);
 		_log_putc('\n');
+		return;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	b->data[b->len++] = '\n';
+}
+
+/** 写入一行访问日志, 文件打开失败时丢弃 */
+static void _access_add(const char* data, size_t len) {
+	if (!_access_fp) return;
+	fwrite(data, 1, len, _access_fp);
+	fputc('\n', _access_fp);
+	_access_cur_size += len + 1;
+	_access_dirty = true;
+}
+
+/** 打开访问日志文件, 以追加方式写入 */
+static FILE* _access_open(const char* filename) {
+	FILE* fp = fopen(filename, "ab");
+	if (!fp) return NULL;
+	setvbuf(fp, NULL, _IOFBF, LOG_BATCH_SIZE);
+	_access_cur_size = ftell(fp);
+	return fp;
+}
+
+/** 判断访问日志文件是否需要轮转或重新打开, 只在后台线程中调用 */
+static inline bool _check_access_rotate() {
+	if (!__atomic_load_n(&_access_name, __ATOMIC_ACQUIRE)) return false;
+	if (!_access_fp) return __atomic_load_n(&_access_reopen_flag, __ATOMIC_RELAXED);
+	return (_log_max_size && _access_cur_size >= _log_max_size)
+		|| (_log_interval && time(NULL) >= _access_next_rotate)
+		|| __atomic_load_n(&_access_reopen_flag, __ATOMIC_RELAXED);
+}
+
+/** 访问日志文件轮转, 规则与文本日志相同, 打开失败时丢弃访问日志直到下一次重新打开 */
+static void _access_rotate() {
+	if (_access_fp) fclose(_access_fp);
+	if (!__atomic_exchange_n(&_access_reopen_flag, 0, __ATOMIC_RELAXED)) {
+		_log_shift(_access_name);
+		if (_log_interval) _access_next_rotate = _next_rotate_time(time(NULL));
+	}
+	_access_dirty = false;
+	__atomic_store_n(&_access_fp, _access_open(_access_name), __ATOMIC_RELEASE);
+}
+
+/** 写入一条二进制日志, 格式第一次出现时先写入格式定义 */
+static void _bin_add(_log_rec_t* rec) {
+	if (!_bin_fp) return;
+	uint32_t id = rec->site;
+	if (!_bin_defined[id]) {
+		_log_site_t* site = _bin_sites[id];
+		uint8_t def[9] = { LOG_BIN_SITE };
+		memcpy(def + 1, &id, 4);
+		memcpy(def + 5, &site->fmt_len, 4);
+		fwrite(def, 1, sizeof(def), _bin_fp);
+		fwrite(site->fmt, 1, site->fmt_len, _bin_fp);
+		_bin_defined[id] = true;
+	}
+
+	uint8_t head[18] = { LOG_BIN_ENTRY, (uint8_t) rec->level };
+	memcpy(head + 2, &id, 4);
+	memcpy(head + 6, &rec->time, 8);
+	memcpy(head + 14, &rec->len, 4);
+	fwrite(head, 1, sizeof(head), _bin_fp);
+	fwrite(rec + 1, 1, rec->len, _bin_fp);
+	_bin_cur_size += sizeof(head) + rec->len;
+	_bin_dirty = true;
+}
+
+/** 打开二进制日志文件并写入会话头部, 新会话中的格式定义需要重新写入 */
+static FILE* _bin_open(const char* filename) {
+	FILE* fp = fopen(filename, "ab");
+	if (!fp) return NULL;
+	setvbuf(fp, NULL, _IOFBF, LOG_BATCH_SIZE);
+	// 每次打开都写入会话头部, 解码时格式编号从该位置重新开始
+	fwrite(LOG_BIN_MAGIC, 1, LOG_BIN_MAGIC_LEN, fp);
+	fflush(fp);
+	_bin_cur_size = ftell(fp);
+	memset(_bin_defined, 0, sizeof(_bin_defined));
+	return fp;
+}
+
+/** 判断二进制日志文件是否需要轮转或重新打开, 只在后台线程中调用 */
+static inline bool _check_bin_rotate() {
+	if (!__atomic_load_n(&_bin_name, __ATOMIC_ACQUIRE)) return false;
+	if (!_bin_fp) return __atomic_load_n(&_bin_reopen_flag, __ATOMIC_RELAXED);
+	return (_log_max_size && _bin_cur_size >= _log_max_size)
+		|| (_log_interval && time(NULL) >= _bin_next_rotate)
+		|| __atomic_load_n(&_bin_reopen_flag, __ATOMIC_RELAXED);
+}
+
+/** 二进制日志文件轮转, 规则与文本日志相同, 打开失败时log_bin系列调用按文本格式输出 */
+static void _bin_rotate() {
+	if (_bin_fp) fclose(_bin_fp);
+	if (!__atomic_exchange_n(&_bin_reopen_flag, 0, __ATOMIC_RELAXED)) {
+		_log_shift(_bin_name);
+		if (_log_interval) _bin_next_rotate = _next_rotate_time(time(NULL));
+	}
+	_bin_dirty = false;
+	__atomic_store_n(&_bin_fp, _bin_open(_bin_name), __ATOMIC_RELEASE);
+}
+
+/** 读取环形缓冲区中所有已提交的日志并写入
+ * @return              读取的记录数量
+*/
+static uint32_t _ring_drain(_log_batch_t* b) {
+	_log_ring_t* r = &_log_ring;
+	size_t tail = r->tail, head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint32_t count = 0;
+	while (tail != head) {
+		size_t off = tail & r->mask;
+		_log_rec_t* rec = (_log_rec_t*) (r->buf + off);
+		uint32_t size = __atomic_load_n(&rec->size, __ATOMIC_ACQUIRE);
+		if (!size) break;
+		if (size & LOG_REC_SKIP) {
+			size &= ~LOG_REC_SKIP;
+			rec->size = 0;
+		} else {
+			if (rec->site == LOG_SITE_ACCESS)
+				_access_add((const char*) (rec + 1), rec->len);
+			else if (rec->site)
+				_bin_add(rec);
+			else
+				_batch_add(b, (time_t) rec->time, (log_level_t) rec->level, (const char*) (rec + 1), rec->len);
+			memset(rec, 0, size);
+			++count;
+		}
+		tail += size;
+		// 每处理一批记录释放一次空间, 避免阻塞策略下生产者长时间等待
+		if ((count & 63) == 0) __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	return count;
+}
+
+/** 后台写入线程 */
+static void _log_writer(void* arg) {
+	_log_ring_t* r = &_log_ring;
+	_log_batch_t* b = malloc(sizeof(_log_batch_t));
+	b->len = 0;
+	uint64_t reported = 0;
+
+	for (;;) {
+		uint32_t count = _ring_drain(b);
+
+		// 报告因缓冲区已满而丢弃的日志数量
+		uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+		if (dropped != reported) {
+			char msg[64];
+			int n = snprintf(msg, sizeof(msg), "log buffer full, %llu entries dropped",
+					(unsigned long long) (dropped - reported));
+			_batch_add(b, time(NULL), LOG_WARN, msg, n);
+			reported = dropped;
+		}
+		_batch_flush(b);
+		if (_bin_dirty) {
+			fflush(_bin_fp);
+			_bin_dirty = false;
+		}
+		if (_check_bin_rotate()) _bin_rotate();
+		if (_access_dirty) {
+			fflush(_access_fp);
+			_access_dirty = false;
+		}
+		if (_check_access_rotate()) _access_rotate();
+		if (count) continue;
+
+		if (__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE)) {
+			// 退出前再读取一次, 确保停止前提交的日志全部写入
+			if (_ring_drain(b)) continue;
+			break;
+		}
+
+		// 缓冲区为空, 等待生产者唤醒
+		uv_mutex_lock(&r->mutex);
+		__atomic_store_n(&r->waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		_log_rec_t* rec = (_log_rec_t*) (r->buf + (r->tail & r->mask));
+		if (!__atomic_load_n(&rec->size, __ATOMIC_ACQUIRE) && !__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE))
+			uv_cond_timedwait(&r->cond, &r->mutex, (uint64_t) LOG_IDLE_WAIT * 1000000);
+		__atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+		uv_mutex_unlock(&r->mutex);
 	}
+
+	free(b);
+}
+
+bool log_async_start(size_t ring_size, log_full_policy_t policy) {
+	if (_log_async) return true;
+
+	size_t size = 4096;
+	if (!ring_size) ring_size = LOG_RING_SIZE;
+	while (size < ring_size) size <<= 1;
+
+	_log_ring_t* r = &_log_ring;
+	// 缓冲区初始内容必须为0, 表示所有位置都没有已提交的记录
+	r->buf = calloc(1, size);
+	if (!r->buf) return false;
+	r->size = size;
+	r->mask = size - 1;
+	r->head = r->tail = 0;
+	r->dropped = 0;
+	r->waiting = r->stopping = 0;
+	r->policy = policy;
+	uv_mutex_init(&r->mutex);
+	uv_cond_init(&r->cond);
+	if (uv_thread_create(&r->thread, _log_writer, NULL)) {
+		uv_cond_destroy(&r->cond);
+		uv_mutex_destroy(&r->mutex);
+		free(r->buf);
+		return false;
+	}
+
+	_log_async = true;
+	// 在_log_deinit之前执行, 确保日志全部写入后再关闭文件
+	if (!_log_async_registered) {
+		_log_async_registered = true;
+		atexit(log_async_stop);
+	}
+	return true;
+}
+
+void log_async_stop() {
+	if (!_log_async) return;
+	_log_async = false;
+
+	_log_ring_t* r = &_log_ring;
+	__atomic_store_n(&r->stopping, 1, __ATOMIC_RELEASE);
+	uv_mutex_lock(&r->mutex);
+	uv_cond_signal(&r->cond);
+	uv_mutex_unlock(&r->mutex);
+	uv_thread_join(&r->thread);
+	// 其它线程可能仍持有缓冲区中预留的记录, 缓冲区不释放
+
+	if (_access_fp) fflush(_access_fp);
+	// 二进制日志只能由后台线程写入, 停止后之后的log_bin调用按文本格式输出
+	if (_bin_fp) {
+		fclose(_bin_fp);
+		_bin_fp = NULL;
+	}
+	free(_bin_name);
+	_bin_name = NULL;
+}
+
+uint64_t log_dropped() {
+	return __atomic_load_n(&_log_ring.dropped, __ATOMIC_RELAXED);
+}
+
+/** 日志内容的拼接缓冲区, 内容较少时使用栈空间, 超出时从堆中分配 */
+typedef struct _log_buf_t {
+	char*           data;
+	size_t          len;
+	size_t          cap;
+	char            stack[2048];
+} _log_buf_t;
+
+static inline void _buf_init(_log_buf_t* b) {
+	b->data = b->stack;
+	b->len = 0;
+	b->cap = sizeof(b->stack);
+}
+
+static void _buf_append(_log_buf_t* b, const void* data, size_t len) {
+	if (b->len + len > b->cap) {
+		size_t cap = b->cap << 1;
+		while (cap < b->len + len) cap <<= 1;
+		char* nbuf = malloc(cap);
+		memcpy(nbuf, b->data, b->len);
+		if (b->data != b->stack) free(b->data);
+		b->data = nbuf;
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static inline void _buf_free(_log_buf_t* b) {
+	if (b->data != b->stack) free(b->data);
+}
+
+/** 写入日志标题, 标题单独占一行 */
+static inline void _buf_title(_log_buf_t* b, const char* title) {
+	if (title) {
+		_buf_append(b, title, strlen(title));
+		_buf_append(b, "\n", 1);
+	}
+}
+
+/** 格式化日志内容并输出 */
+static void _log_vformat(log_level_t level, const char* fmt, va_list args) {
+	char stack_buf[2048], *buf = stack_buf;
+	va_list args2;
+	va_copy(args2, args);
+	// 先尝试格式化到栈变量中, 超过stack_buf可以容纳的大小时再从堆中分配内存重新格式化
+	int len = vsnprintf(stack_buf, sizeof(stack_buf), fmt, args);
+	if (len >= (int) sizeof(stack_buf)) {
+		buf = malloc(len + 1);
+		len = vsnprintf(buf, len + 1, fmt, args2);
+	}
+	va_end(args2);
+
+	if (len > 0) _log_emit(level, buf, len);
+	// 释放分配的内存
+	if (buf != stack_buf) free(buf);
 }
 
 void log_format(log_level_t level, const char* fmt, ...) {
 	if (_check_disabled(level)) return;
-	_log_write_head(level, NULL);
-
 	va_list args;
 	va_start(args, fmt);
+	_log_vformat(level, fmt, args);
+	va_end(args);
+}
+
+static void _bin_init_lock() {
+	uv_mutex_init(&_bin_lock);
+}
+
+/** 解析格式字符串并注册, 同一调用点并发注册时只注册一次
+ * @return              格式编号, 格式字符串不支持二进制编码或超出最大注册数量时返回LOG_BIN_TEXT
+*/
+static uint32_t _bin_register(uint32_t* site, const char* fmt) {
+	uv_once(&_bin_once, _bin_init_lock);
+	uv_mutex_lock(&_bin_lock);
+	uint32_t id = *site;
+	if (!id) {
+		id = LOG_BIN_TEXT;
+		// 统计带参数的格式说明数量并检查是否都支持
+		uint32_t count = 0;
+		bool ok = true;
+		log_spec_t spec;
+		for (const char* p = fmt; *p && ok; ++p) {
+			if (*p != '%') continue;
+			ok = log_spec_parse(p, &spec);
+			if (ok && spec.type != LOG_ARG_NONE) ++count;
+			if (ok) p += spec.len - 1;
+		}
+
+		_log_site_t* s = ok && _bin_count < LOG_BIN_MAX_SITES
+				? malloc(sizeof(_log_site_t) + sizeof(log_spec_t) * count) : NULL;
+		if (s) {
+			s->fmt = fmt;
+			s->fmt_len = (uint32_t) strlen(fmt);
+			s->fixed = 0;
+			s->count = 0;
+			for (const char* p = fmt; *p; ++p) {
+				if (*p != '%') continue;
+				log_spec_parse(p, &spec);
+				p += spec.len - 1;
+				if (spec.type == LOG_ARG_NONE) continue;
+				s->specs[s->count++] = spec;
+				s->fixed += spec.stars * 4 + (spec.type == LOG_ARG_INT || spec.type == LOG_ARG_STR ? 4 : 8);
+			}
+			if (s->fixed <= LOG_BIN_ARGS_MAX) {
+				_bin_sites[++_bin_count] = s;
+				id = _bin_count;
+			} else
+				free(s);
+		}
+		__atomic_store_n(site, id, __ATOMIC_RELEASE);
+	}
+	uv_mutex_unlock(&_bin_lock);
+	return id;
+}
+
+/** 按格式定义复制参数的原始内容, 字符串超出剩余空间时截断
+ * @return              编码后的参数长度
+*/
+static size_t _bin_encode(const _log_site_t* site, char* dst, va_list* args) {
+	char* p = dst;
+	// 字符串内容可以使用的空间
+	size_t avail = LOG_BIN_ARGS_MAX - site->fixed;
+	for (uint32_t i = 0; i < site->count; ++i) {
+		const log_spec_t* spec = &site->specs[i];
+		int32_t star = 0, prec = spec->prec;
+		for (uint32_t j = 0; j < spec->stars; ++j) {
+			star = va_arg(*args, int);
+			memcpy(p, &star, 4);
+			p += 4;
+		}
+		// 精度由*参数指定时, 最后一个*参数就是精度
+		if (spec->stars && spec->prec == -1 && spec->type == LOG_ARG_STR) prec = star;
+
+		switch (spec->type) {
+			case LOG_ARG_INT: {
+				int32_t v = va_arg(*args, int);
+				memcpy(p, &v, 4);
+				p += 4;
+				break;
+			}
+			case LOG_ARG_INT64: {
+				bool u = spec->conv == 'u' || spec->conv == 'o' || spec->conv == 'x' || spec->conv == 'X';
+				int64_t v;
+				switch (spec->length) {
+					case 'l': v = u ? (int64_t) va_arg(*args, unsigned long) : va_arg(*args, long); break;
+					case 'z': v = (int64_t) va_arg(*args, size_t); break;
+					case 'j': v = va_arg(*args, intmax_t); break;
+					case 't': v = va_arg(*args, ptrdiff_t); break;
+					default: v = va_arg(*args, long long); break;
+				}
+				memcpy(p, &v, 8);
+				p += 8;
+				break;
+			}
+			case LOG_ARG_DOUBLE: {
+				double v = spec->length == 'L' ? (double) va_arg(*args, long double) : va_arg(*args, double);
+				memcpy(p, &v, 8);
+				p += 8;
+				break;
+			}
+			case LOG_ARG_STR: {
+				const char* v = va_arg(*args, const char*);
+				if (!v) v = "(null)";
+				size_t n = 0;
+				while (n < avail && (prec < 0 || n < (size_t) prec) && v[n]) ++n;
+				avail -= n;
+				uint32_t n32 = (uint32_t) n;
+				memcpy(p, &n32, 4);
+				memcpy(p + 4, v, n);
+				p += 4 + n;
+				break;
+			}
+			case LOG_ARG_PTR: {
+				uint64_t v = (uintptr_t) va_arg(*args, void*);
+				memcpy(p, &v, 8);
+				p += 8;
+				break;
+			}
+		}
+	}
+	return p - dst;
+}
 
-	char stack_buf[2048], *buf;
-	// 计算日志内容长度, 结果加1，表示带上NULL结尾字符，到时候替换成换行符
-	int len = vsnprintf(NULL, 0, fmt, args) + 1;
-	// 本条目日志超过栈变量stack_buf可以容纳的大小，则从堆中分配内存
-	if (len > sizeof(stack_buf)) {
-		buf = malloc(len);
-	} else
-		buf = stack_buf;
+bool log_bin_start(const char* filename) {
+	if (_bin_fp) return true;
+	if (!_log_async && !log_async_start(0, LOG_FULL_DROP)) return false;
+
+	FILE* fp = _bin_open(filename);
+	if (!fp) {
+		log_error("can't open binary log file %s", filename);
+		return false;
+	}
+	size_t len = strlen(filename) + 1;
+	char* name = malloc(len);
+	memcpy(name, filename, len);
+	__atomic_store_n(&_bin_name, name, __ATOMIC_RELEASE);
+	if (_log_interval) _bin_next_rotate = _next_rotate_time(time(NULL));
+	__atomic_store_n(&_bin_fp, fp, __ATOMIC_RELEASE);
+	return true;
+}
 
-	// 写入日志内容到缓冲区
+bool log_access_start(const char* filename) {
+	if (_access_fp) return true;
+	FILE* fp = _access_open(filename);
+	if (!fp) {
+		log_error("can't open access log file %s", filename);
+		return false;
+	}
+	size_t len = strlen(filename) + 1;
+	char* name = malloc(len);
+	memcpy(name, filename, len);
+	__atomic_store_n(&_access_name, name, __ATOMIC_RELEASE);
+	if (_log_interval) _access_next_rotate = _next_rotate_time(time(NULL));
+	__atomic_store_n(&_access_fp, fp, __ATOMIC_RELEASE);
+	return true;
+}
+
+void log_access(const char* data, size_t len) {
+	if (_log_async) {
+		if (__atomic_load_n(&_access_fp, __ATOMIC_ACQUIRE))
+			_ring_push(0, LOG_INFO, LOG_SITE_ACCESS, data, len);
+	} else if (_access_fp) {
+		// 同步模式下直接写入, 不处理轮转和重新打开请求
+		fwrite(data, 1, len, _access_fp);
+		fputc('\n', _access_fp);
+		fflush(_access_fp);
+	}
+}
+
+void log_bin_write(uint32_t* site, log_level_t level, const char* fmt, ...) {
+	va_list args;
 	va_start(args, fmt);
-	len = vsnprintf(buf, len, fmt, args);
-	buf[len] = '\n';
-	// 缓冲区内容写入日志
-	_log_write(buf, len + 1);
-	// 释放分配的内存
-	if (buf != stack_buf) free(buf);
+	uint32_t id = __atomic_load_n(site, __ATOMIC_ACQUIRE);
+	if (!id) id = _bin_register(site, fmt);
 
-	_log_flush();
+	if (id != LOG_BIN_TEXT && _log_async && __atomic_load_n(&_bin_fp, __ATOMIC_ACQUIRE)) {
+		char buf[LOG_BIN_ARGS_MAX];
+		size_t len = _bin_encode(_bin_sites[id], buf, &args);
+		_ring_push(time(NULL), level, id, buf, len);
+	} else if (!_check_disabled(level))
+		_log_vformat(level, fmt, args);
+
+	va_end(args);
 }
 
 void log_hex(log_level_t level, const char *title, const void *data, size_t size) {
 	if (_check_disabled(level)) return;
-	_log_write_head(level, title);
+	_log_buf_t b;
+	_buf_init(&b);
+	_buf_title(&b, title);
 
 	char buf[LOG_HEX_LINE]; // 一行hex显示格式所需大小
 	memset(buf, ' ', LOG_HEX_LINE);
@@ -255,33 +1112,38 @@ void log_hex(log_level_t level, const char *title, const void *data, size_t size
 			buf[pos] = _HEX[*p >> 4];
 			buf[pos + 1] = _HEX[*p & 0xf];
 		}
+		// 最后一行的换行符由_log_emit写入
 		buf[pos - 1] = '\n';
-		_log_write(buf, pos);
+		_buf_append(&b, buf, p < pe ? pos : pos - 1);
 	}
 
-	_log_flush();
+	_log_emit(level, b.data, b.len);
+	_buf_free(&b);
 }
 
 void log_text(log_level_t level, const char *title, const char *data, size_t size) {
 	if (_check_disabled(level)) return;
-	_log_write_head(level, title);
-
-	_log_write(data, size);
-	_log_putc('\n');
-	_log_flush();
+	_log_buf_t b;
+	_buf_init(&b);
+	_buf_title(&b, title);
+	_buf_append(&b, data, size);
+	_log_emit(level, b.data, b.len);
+	_buf_free(&b);
 }
 
 void log_dump(log_level_t level, const char *title, void* arg, LOG_DUMP_FUNC callback) {
 	if (_check_disabled(level)) return;
-	_log_write_head(level, title);
+	_log_buf_t b;
+	_buf_init(&b);
+	_buf_title(&b, title);
 
 	char buf[2048];
 	size_t len;
 	while ((len = callback(arg, buf, sizeof(buf))))
-		_log_write(buf, len);
+		_buf_append(&b, buf, len);
 
-	_log_putc('\n');
-	_log_flush();
+	_log_emit(level, b.data, b.len);
+	_buf_free(&b);
 }
 
 #endif // NLOG
\ No newline at end of file
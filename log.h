@@ -27,6 +27,9 @@ extern "C" {
 // 日志级别宏定义
 typedef enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF } log_level_t;
 
+// 异步日志缓冲区已满时的处理策略, 丢弃并计数/等待后台线程写入
+typedef enum { LOG_FULL_DROP, LOG_FULL_BLOCK } log_full_policy_t;
+
 /** log_dump函数回调接口, 回调函数负责写入buf, 并返回写入长度
  * 
  * @param arg 回调函数时传递的变量
@@ -51,6 +54,38 @@ extern size_t get_basename(char* dst, size_t dstlen, const char* filename);
 /** 获取文件的路径，去掉文件名, dst为NULL时，只计算路径长度, 返回-1表示失败, 其它值表示成功 */
 extern size_t get_fielpath(char* dst, size_t dstlen, const char* filename);
 
+/** 二进制日志文件的会话头部, 每次打开文件时写入, 之后出现的格式编号只在本会话内有效 */
+#define LOG_BIN_MAGIC "FHBLOG1\n"
+#define LOG_BIN_MAGIC_LEN 8
+/** 二进制日志的格式定义记录: uint8 类型, uint32 格式编号, uint32 格式长度, 格式字符串 */
+#define LOG_BIN_SITE 1
+/** 二进制日志的日志记录: uint8 类型, uint8 级别, uint32 格式编号, int64 时间(秒), uint32 参数长度, 参数内容
+ *  参数按格式说明的顺序编码, 整数和长度均为本机字节序: 宽度/精度的*参数和int为4字节, 64位整数、double和指针为8字节,
+ *  字符串为4字节长度加字符串内容
+*/
+#define LOG_BIN_ENTRY 2
+
+/** 格式说明对应的参数编码类型 */
+typedef enum { LOG_ARG_NONE, LOG_ARG_INT, LOG_ARG_INT64, LOG_ARG_DOUBLE, LOG_ARG_STR, LOG_ARG_PTR } log_arg_t;
+
+/** printf格式说明的解析结果 */
+typedef struct log_spec_t {
+	uint8_t     type;               // 参数编码类型 log_arg_t, "%%"为LOG_ARG_NONE
+	uint8_t     length;             // 长度修饰符, 0: 无, h: h/hh, l: l, q: ll, 其它为原字符 L/z/j/t
+	uint8_t     conv;               // 转换字符
+	uint8_t     stars;              // 宽度和精度中*参数的数量
+	int32_t     prec;               // 精度, -1表示未指定或由*参数指定
+	uint32_t    len;                // 格式说明的长度, 包括开头的%
+} log_spec_t;
+
+/** 解析一个printf格式说明
+ *
+ * @param fmt       格式说明的起始地址, 指向%
+ * @param spec      解析结果
+ * @return          成功返回true, 不支持的格式说明(如%n, %ls)返回false
+*/
+extern bool log_spec_parse(const char* fmt, log_spec_t* spec);
+
 #ifdef NLOG
 
 #define log_set_level(...) ((void)0)
@@ -59,6 +94,20 @@ extern size_t get_fielpath(char* dst, size_t dstlen, const char* filename);
 #define log_is_debug_enabled(X) 0
 #define log_disable_console(...) ((void)0)
 #define log_start(...) ((void)0)
+#define log_rotate(...) ((void)0)
+#define log_reopen(...) ((void)0)
+#define log_async_start(...) true
+#define log_async_stop(...) ((void)0)
+#define log_dropped(...) 0
+#define log_bin_start(...) true
+#define log_access_start(...) true
+#define log_access(...) ((void)0)
+#define log_bin(...) ((void)0)
+#define log_bin_trace(...) ((void)0)
+#define log_bin_debug(...) ((void)0)
+#define log_bin_info(...) ((void)0)
+#define log_bin_warn(...) ((void)0)
+#define log_bin_error(...) ((void)0)
 #define log_trace(...) ((void)0)
 #define log_debug(...) ((void)0)
 #define log_info(...) ((void)0)
@@ -128,6 +177,85 @@ extern void log_disable_console();
 */
 extern void log_start(const char* filename, size_t maxsize);
 
+/** 设置日志文件轮转策略, 满足任一条件时轮转, 历史文件保存为 日志文件名.1 到 日志文件名.N, 数字越小越新.
+ *  异步模式下轮转和压缩都在后台线程中进行, 不阻塞日志调用
+ * 
+ * @param max_size          文件超过该长度时轮转, 0表示不按大小轮转, 覆盖log_start的maxsize参数
+ * @param interval          按时间轮转的间隔(秒), 从本地时间零点开始对齐, 例如86400表示每天零点轮转, 0表示不按时间轮转
+ * @param keep              保留的历史文件数量, 最少为1
+ * @param compress          是否压缩历史文件, 在轮转的线程中以gzip格式压缩为 日志文件名.N.gz
+*/
+extern void log_rotate(size_t max_size, uint32_t interval, uint32_t keep, bool compress);
+
+/** 重新打开日志文件, 用于logrotate等外部工具移动日志文件之后, 只设置标志, 可以在信号处理函数中调用 */
+extern void log_reopen();
+
+/** 启用异步日志, 日志调用只把内容写入无锁环形缓冲区, 由后台线程添加时间头部后批量写入控制台和日志文件,
+ *  应在log_start之后调用, 程序退出时自动写完缓冲区中剩余的日志
+ * 
+ * @param ring_size         环形缓冲区大小, 向上取整为2的幂, 0表示使用缺省值, 单条日志最多占用其1/4
+ * @param policy            缓冲区已满时的处理策略, LOG_FULL_DROP: 丢弃并计数, LOG_FULL_BLOCK: 等待后台线程写入
+ * @return                  成功返回true, 内存不足或无法创建线程返回false, 此时仍为同步写入
+*/
+extern bool log_async_start(size_t ring_size, log_full_policy_t policy);
+
+/** 停止异步日志, 等待后台线程写完缓冲区中的日志后返回, 之后恢复为同步写入 */
+extern void log_async_stop();
+
+/** 返回异步日志因缓冲区已满而丢弃的日志条数 */
+extern uint64_t log_dropped();
+
+/** 开启二进制日志, 之后log_bin系列调用只把格式编号和原始参数写入异步日志缓冲区,
+ *  由后台线程追加写入二进制文件, 使用logdecode工具转换为与文本日志相同的格式.
+ *  未启用异步日志时自动以LOG_FULL_DROP策略启用. 按log_rotate设置的策略轮转, 收到log_reopen请求时重新打开,
+ *  每个新文件都以会话头部开始, 可以单独解码
+ *
+ * @param filename          二进制日志文件名, 以追加方式打开
+ * @return                  成功返回true, 失败时log_bin系列调用仍按文本格式输出
+*/
+extern bool log_bin_start(const char* filename);
+
+/** 开启访问日志, 访问日志单独写入指定文件, 不添加日志头部, 不受日志级别限制.
+ *  异步模式下按log_rotate设置的策略轮转, 收到log_reopen请求时重新打开, 同步模式下只追加写入
+ *
+ * @param filename          访问日志文件名, 以追加方式打开
+ * @return                  成功返回true
+*/
+extern bool log_access_start(const char* filename);
+
+/** 写入一行访问日志, 异步模式下只复制到日志缓冲区, 由后台线程写入, 未开启访问日志时忽略
+ *
+ * @param data              日志内容, 不包括末尾的换行符
+ * @param len               日志内容长度
+*/
+extern void log_access(const char* data, size_t len);
+
+/** 记录二进制日志, 由log_bin宏调用, 未开启二进制日志或格式字符串不支持时按文本格式输出
+ *
+ * @param site              调用点的格式编号变量, 0表示尚未注册
+ * @param level             日志级别
+ * @param fmt               格式化字符串, 必须是字符串常量, 注册后不再解析
+ * @param ...               格式化参数
+*/
+extern void log_bin_write(uint32_t* site, log_level_t level, const char* fmt, ...);
+
+/** 记录指定级别的二进制日志, 每个调用点第一次执行时注册格式字符串, 之后只复制参数, 不进行格式化
+ *
+ * @param level             日志级别
+ * @param fmt               格式化字符串, 必须是字符串常量
+ * @param ...               格式化参数
+ */
+#define log_bin(level, fmt, ...) do { \
+	static uint32_t _log_site = 0; \
+	if ((level) >= _log_level) log_bin_write(&_log_site, level, fmt, ##__VA_ARGS__); \
+} while (0)
+
+#define log_bin_trace(fmt, ...) log_bin(LOG_TRACE, fmt, ##__VA_ARGS__)
+#define log_bin_debug(fmt, ...) log_bin(LOG_DEBUG, fmt, ##__VA_ARGS__)
+#define log_bin_info(fmt, ...) log_bin(LOG_INFO, fmt, ##__VA_ARGS__)
+#define log_bin_warn(fmt, ...) log_bin(LOG_WARN, fmt, ##__VA_ARGS__)
+#define log_bin_error(fmt, ...) log_bin(LOG_ERROR, fmt, ##__VA_ARGS__)
+
 /** 记录debug级别日志
  * 
  * @param fmt               格式化字符串, 使用与printf同样的格式
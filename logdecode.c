@@ -0,0 +1,275 @@
+/** 二进制日志解码工具, 将log_bin_start生成的二进制日志转换为与文本日志相同的格式
+ *
+ *  文件由若干会话组成, 每个会话以LOG_BIN_MAGIC开始, 格式定义记录在该格式第一次使用前写入,
+ *  格式编号只在所属会话内有效. 文件末尾不完整的记录(程序被强制终止时产生)会被忽略
+ * @file logdecode.c
+ * @author Kiven Lee
+ * @date 2021-08-06
+ * @version 1.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "log.h"
+
+#ifdef _WIN32
+#   ifndef localtime_r
+#       define localtime_r(x, y) localtime_s(y, x)
+#   endif
+#endif
+
+/** 格式定义 */
+typedef struct site_t {
+    const char*     fmt;                // 格式字符串, 指向文件内容
+    uint32_t        len;                // 格式字符串长度
+} site_t;
+
+static char *g_app_name;
+static FILE *g_out;
+
+static site_t *g_sites = NULL;
+static uint32_t g_site_cap = 0;
+
+static const char LEVELS[][9] = {"[TRACE] ", "[DEBUG] ", "[INFO ] ", "[WARN ] ", "[ERROR] ", "[OFF  ] "};
+
+/** 读取文件全部内容 */
+static uint8_t* load_file(const char* filename, size_t* size) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t *buf = malloc(len > 0 ? len : 1);
+    *size = fread(buf, 1, len, fp);
+    fclose(fp);
+    return buf;
+}
+
+/** 从参数内容中读取定长数据, 长度不足时返回false */
+static bool read_arg(const uint8_t** p, const uint8_t* end, void* dst, size_t len) {
+    if ((size_t) (end - *p) < len) return false;
+    memcpy(dst, *p, len);
+    *p += len;
+    return true;
+}
+
+/** 按格式说明输出一个参数, 64位整数统一使用ll修饰符, double去掉L修饰符
+ * @return          参数内容不足时返回false
+*/
+static bool print_spec(const char* text, const log_spec_t* spec, const uint8_t** p, const uint8_t* end) {
+    char f[64];
+    uint32_t n = spec->len - 1;
+    if (n >= sizeof(f) - 4) return false;
+    memcpy(f, text, n);
+    if (spec->type == LOG_ARG_INT64 || spec->type == LOG_ARG_DOUBLE) {
+        while (n && strchr("hlqLzjt", f[n - 1])) --n;
+        if (spec->type == LOG_ARG_INT64) {
+            f[n++] = 'l';
+            f[n++] = 'l';
+        }
+    }
+    f[n++] = spec->conv;
+    f[n] = '\0';
+
+    int32_t star[2] = { 0, 0 };
+    for (uint32_t i = 0; i < spec->stars; ++i)
+        if (!read_arg(p, end, &star[i], 4)) return false;
+
+    // 根据*参数数量传递不同的参数
+#define PRINT_ARG(v) (spec->stars == 0 ? fprintf(g_out, f, v) \
+        : spec->stars == 1 ? fprintf(g_out, f, star[0], v) : fprintf(g_out, f, star[0], star[1], v))
+
+    switch (spec->type) {
+        case LOG_ARG_INT: {
+            int32_t v;
+            if (!read_arg(p, end, &v, 4)) return false;
+            PRINT_ARG(v);
+            break;
+        }
+        case LOG_ARG_INT64: {
+            long long v;
+            if (!read_arg(p, end, &v, 8)) return false;
+            PRINT_ARG(v);
+            break;
+        }
+        case LOG_ARG_DOUBLE: {
+            double v;
+            if (!read_arg(p, end, &v, 8)) return false;
+            PRINT_ARG(v);
+            break;
+        }
+        case LOG_ARG_STR: {
+            uint32_t len;
+            if (!read_arg(p, end, &len, 4) || (size_t) (end - *p) < len) return false;
+            char *v = malloc(len + 1);
+            memcpy(v, *p, len);
+            v[len] = '\0';
+            *p += len;
+            PRINT_ARG(v);
+            free(v);
+            break;
+        }
+        case LOG_ARG_PTR: {
+            uint64_t v;
+            if (!read_arg(p, end, &v, 8)) return false;
+            PRINT_ARG((void*) (uintptr_t) v);
+            break;
+        }
+    }
+#undef PRINT_ARG
+    return true;
+}
+
+/** 输出一条日志, 格式为 "[yyyy-MM-dd HH:mm:ss] [INFO ] 内容" */
+static bool print_entry(const site_t* site, uint8_t level, int64_t t, const uint8_t* args, uint32_t args_len) {
+    char head[64];
+    time_t tt = (time_t) t;
+    struct tm tm;
+    localtime_r(&tt, &tm);
+    size_t c = strftime(head, sizeof(head), "[%Y-%m-%d %H:%M:%S] ", &tm);
+    fwrite(head, 1, c, g_out);
+    fputs(LEVELS[level < LOG_OFF ? level : LOG_OFF], g_out);
+
+    // 格式字符串不以0结尾, 复制后再解析
+    char *fmt = malloc(site->len + 1);
+    memcpy(fmt, site->fmt, site->len);
+    fmt[site->len] = '\0';
+
+    const uint8_t *p = args, *end = args + args_len;
+    bool ok = true;
+    const char *s = fmt;
+    while (*s && ok) {
+        const char *pct = strchr(s, '%');
+        if (!pct) {
+            fputs(s, g_out);
+            break;
+        }
+        fwrite(s, 1, pct - s, g_out);
+        log_spec_t spec;
+        if (!log_spec_parse(pct, &spec)) {
+            ok = false;
+            break;
+        }
+        if (spec.type == LOG_ARG_NONE)
+            fputc('%', g_out);
+        else
+            ok = print_spec(pct, &spec, &p, end);
+        s = pct + spec.len;
+    }
+    fputc('\n', g_out);
+    free(fmt);
+    return ok;
+}
+
+/** 解码一个二进制日志文件
+ * @return          解码的日志条数, 文件格式错误返回-1
+*/
+static long decode(const char* filename) {
+    size_t size;
+    uint8_t *buf = load_file(filename, &size);
+    if (!buf) {
+        fprintf(stderr, "can't open file %s\n", filename);
+        return -1;
+    }
+
+    long count = 0;
+    const uint8_t *p = buf, *end = buf + size;
+    while (p < end) {
+        // 新的会话, 之前的格式定义全部失效
+        if ((size_t) (end - p) >= LOG_BIN_MAGIC_LEN && !memcmp(p, LOG_BIN_MAGIC, LOG_BIN_MAGIC_LEN)) {
+            if (g_sites) memset(g_sites, 0, sizeof(site_t) * g_site_cap);
+            p += LOG_BIN_MAGIC_LEN;
+            continue;
+        }
+
+        if (*p == LOG_BIN_SITE) {
+            uint32_t id, len;
+            if (end - p < 9) break;
+            memcpy(&id, p + 1, 4);
+            memcpy(&len, p + 5, 4);
+            if ((size_t) (end - p - 9) < len) break;
+            if (id >= g_site_cap) {
+                uint32_t cap = g_site_cap ? g_site_cap : 64;
+                while (cap <= id) cap <<= 1;
+                g_sites = realloc(g_sites, sizeof(site_t) * cap);
+                memset(g_sites + g_site_cap, 0, sizeof(site_t) * (cap - g_site_cap));
+                g_site_cap = cap;
+            }
+            g_sites[id].fmt = (const char*) p + 9;
+            g_sites[id].len = len;
+            p += 9 + len;
+        } else if (*p == LOG_BIN_ENTRY) {
+            uint32_t id, len;
+            int64_t t;
+            if (end - p < 18) break;
+            uint8_t level = p[1];
+            memcpy(&id, p + 2, 4);
+            memcpy(&t, p + 6, 8);
+            memcpy(&len, p + 14, 4);
+            if ((size_t) (end - p - 18) < len) break;
+            if (id >= g_site_cap || !g_sites[id].fmt) {
+                fprintf(stderr, "%s: undefined format id %u at offset %ld\n", filename, id, (long) (p - buf));
+                free(buf);
+                return -1;
+            }
+            if (!print_entry(&g_sites[id], level, t, p + 18, len))
+                fprintf(stderr, "%s: bad arguments at offset %ld\n", filename, (long) (p - buf));
+            p += 18 + len;
+            ++count;
+        } else {
+            fprintf(stderr, "%s: bad record type %u at offset %ld\n", filename, *p, (long) (p - buf));
+            free(buf);
+            return -1;
+        }
+    }
+    if (p < end)
+        fprintf(stderr, "%s: ignore incomplete record at offset %ld\n", filename, (long) (p - buf));
+
+    free(buf);
+    return count;
+}
+
+/** 使用帮助 */
+static void usage() {
+    printf("decode binary log files written by log_bin_start.\n\n");
+    printf("Usage: %s [option] file...\n\n", g_app_name);
+    printf("Options:\n");
+    printf("    -h              show this help\n");
+    printf("    -o file         write text log to file, default stdout\n");
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    g_app_name = strrchr(argv[0], PATH_SEP);
+    g_app_name = g_app_name ? g_app_name + 1 : argv[0];
+    g_out = stdout;
+
+    int c;
+    while ((c = getopt(argc, argv, "ho:")) != -1) {
+        switch (c) {
+            case 'h': usage(); break;
+            case 'o':
+                if (!(g_out = fopen(optarg, "w"))) {
+                    fprintf(stderr, "can't open output file %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default: printf("Try %s -h for more informaton.\n", g_app_name); return 1;
+        }
+    }
+    if (optind >= argc) usage();
+
+    int ret = 0;
+    for (int i = optind; i < argc; ++i)
+        if (decode(argv[i]) < 0) ret = 1;
+
+    if (g_out != stdout) fclose(g_out);
+    free(g_sites);
+    return ret;
+}
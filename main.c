@@ -15,6 +15,11 @@
 #include "log.h"
 #include "aidb.h"
 #include "httpserver.h"
+#include "capture.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "httpzip.h"
+#include "respcache.h"
 #include "list.h"
 // #include "memwatch.h"
 
@@ -23,6 +28,13 @@ const char APP_VERSION[] = "1.02";
 const char APP_COPYLEFT[] = "2019-2020 Kivensoft";
 
 typedef struct config_t {
+    char* access;
+    char* access_pattern;
+    char* async;
+    char* binlog;
+    uint32_t keep;
+    uint32_t interval;
+    bool compress;
     char* debug;
     char* listen;
     char* make;
@@ -30,10 +42,19 @@ typedef struct config_t {
     char* username;
     char* workdir;
     char* decrypt;
+    char* capture;
+    uint32_t sample;
+    char* metrics;
+    uint32_t slow_ms;
+    uint32_t slow_sample;
+    uint32_t zip_size;
+    uint32_t cache_ms;
+    bool etag;
 } config_t;
 
 config_t g_app_cfg = {
     .listen   = "0.0.0.0:8888",
+    .keep     = 5,
     .username = "admin",
     .password = "password"
 };
@@ -42,19 +63,38 @@ const char g_key[] = "account info web server, version 1.0";
 
 char *g_app_name;
 
+// 预压缩的静态脚本文件
+httpzip_static_t* g_hcjs;
+
 /** 使用帮助 */
 static void usage() {
 	printf("%s, version %s, copyleft by %s.\n\n", APP_NAME, APP_VERSION, APP_COPYLEFT);
 	printf("Usage: %s [option]\n\n", g_app_name);
 	printf("Options:\n");
+	printf("    -A file         access log file, in combined format unless -F is given\n");
+	printf("    -a policy       log write policy, drop/block when log buffer is full, or sync, default drop\n");
+	printf("    -b file         binary log file for high rate logs, decode with logdecode\n");
+	printf("    -c file         capture sampled requests to jsonl file, replay with hbench -R\n");
+	printf("    -C msec         cache /hello and /index responses for msec milliseconds\n");
 	printf("    -d file         log file name\n");
+	printf("    -e              send weak ETag for responses, reply 304 on If-None-Match\n");
+	printf("    -E type=level   compress level of content type prefix, 0 disable, e.g. image/=0\n");
+	printf("    -F pattern      access log pattern, e.g. '%%h %%t \"%%r\" %%s %%b %%D'\n");
+	printf("    -g              gzip rotated log files\n");
 	printf("    -h              show this help\n");
+	printf("    -i sec          rotate log file every sec seconds, aligned to local midnight\n");
+	printf("    -k count        rotated log files to keep, default %u\n", g_app_cfg.keep);
 	printf("    -l address      listen address, default %s\n", g_app_cfg.listen);
-	printf("    -m filename     encrypt xml to aidb file\n");
+	printf("    -m filename     encrypt text file to aidb file, one record per line\n");
+	printf("    -M path         serve prometheus metrics at path, e.g. /metrics\n");
 	printf("    -p password     login password, default %s\n", g_app_cfg.password);
+	printf("    -r count        log phase timing of one of every count requests\n");
+	printf("    -s count        capture one of every count requests, default 1\n");
+	printf("    -t msec         log phase timing of requests slower than msec\n");
 	printf("    -u username     login username, default %s\n", g_app_cfg.username);
 	printf("    -w dir          set work dir, default current dir\n");
-	printf("    -x filename     decrypt aidb to xml file\n");
+	printf("    -x filename     decrypt aidb or legacy encrypted file to xml file\n");
+	printf("    -Z bytes        gzip/deflate response bodies not less than bytes\n");
 	printf("    -z              show chinese help\n");
     exit(0);
 }
@@ -63,32 +103,76 @@ static void usage_chinese() {
 	printf("%s, 版本 %s, 版权所有 %s.\n\n", "账户信息web服务", APP_VERSION, APP_COPYLEFT);
 	printf("用法: %s [选项]\n\n", g_app_name);
 	printf("选项:\n");
+	printf("    -A 文件名       访问日志文件, 缺省使用combined格式\n");
+	printf("    -a 策略         日志写入策略, 缓冲区已满时丢弃(drop)或等待(block), sync为同步写入, 缺省为: drop\n");
+	printf("    -b 文件名       高频日志使用的二进制日志文件, 使用logdecode解码\n");
+	printf("    -c 文件名       按采样率采集请求到jsonl文件, 可用 hbench -R 回放\n");
+	printf("    -C 毫秒         缓存 /hello 和 /index 的回复, 有效时间为指定毫秒数\n");
 	printf("    -d 文件名       指定日志文件名\n");
+	printf("    -e              为回复内容生成弱ETag, 按If-None-Match回复304\n");
+	printf("    -E 类型=级别    指定内容类型前缀的压缩级别, 0为不压缩, 例如 image/=0\n");
+	printf("    -F 模板         访问日志格式模板, 例如 '%%h %%t \"%%r\" %%s %%b %%D'\n");
+	printf("    -g              使用gzip压缩轮转后的日志文件\n");
 	printf("    -h              显示帮助\n");
+	printf("    -i 秒数         每隔指定秒数轮转日志文件, 从本地时间零点开始对齐\n");
+	printf("    -k 数量         保留的历史日志文件数量, 缺省为: %u\n", g_app_cfg.keep);
 	printf("    -l 监听地址     指定服务监听地址, 缺省为: %s\n", g_app_cfg.listen);
-	printf("    -m 文件名       加密xml文件到aidb文件\n");
+	printf("    -m 文件名       加密文本文件到aidb文件, 每行作为一条记录\n");
+	printf("    -M 路径         在指定路径输出Prometheus格式的运行指标, 例如 /metrics\n");
 	printf("    -p 口令         登录口令, 缺省为: %s\n", g_app_cfg.password);
+	printf("    -r 数量         每多少个请求输出1个请求的各阶段耗时\n");
+	printf("    -s 数量         每多少个请求采集1个, 缺省为: 1\n");
+	printf("    -t 毫秒         输出处理时间超过指定毫秒数的请求的各阶段耗时\n");
 	printf("    -u 用户名       登录用户名, 缺省为: %s\n", g_app_cfg.username);
 	printf("    -w 目录         设置工作目录, 缺省为当前目录\n");
-	printf("    -x 文件名       解密aidb文件到xml文件\n");
+	printf("    -x 文件名       解密aidb文件或旧格式的加密文件到xml文件\n");
+	printf("    -Z 字节数       回复内容不小于指定字节数时使用gzip/deflate压缩\n");
 	printf("    -z              显示中文帮助信息\n");
     exit(0);
 }
 
 
+/** 解析 类型=级别 格式的压缩级别参数 */
+static void set_zip_level(char* arg) {
+    char* eq = strrchr(arg, '=');
+    if (!eq) {
+        printf("invalid compress level %s, expect type=level\n", arg);
+        return;
+    }
+    *eq = '\0';
+    if (!httpzip_set_level(arg, atoi(eq + 1)))
+        printf("too many compress levels, ignore %s\n", arg);
+}
+
 /** 处理命令行参数 */
 void process_cmdline(int argc, char **argv) {
     int c;
-	while ((c = getopt(argc, argv, "d:hl:m:p:u:w:x:z")) != -1) {
+	while ((c = getopt(argc, argv, "A:a:b:c:C:d:eE:F:ghi:k:l:m:M:p:r:s:t:u:w:x:Z:z")) != -1) {
 		switch (c) {
+			case 'A': g_app_cfg.access = optarg; break;
+			case 'a': g_app_cfg.async = optarg; break;
+			case 'b': g_app_cfg.binlog = optarg; break;
+			case 'c': g_app_cfg.capture = optarg; break;
+			case 'C': g_app_cfg.cache_ms = atoi(optarg); break;
 			case 'd': g_app_cfg.debug = optarg; break;
+			case 'e': g_app_cfg.etag = true; break;
+			case 'E': set_zip_level(optarg); break;
+			case 'F': g_app_cfg.access_pattern = optarg; break;
+			case 'g': g_app_cfg.compress = true; break;
 			case 'h': usage(); break;
+			case 'i': g_app_cfg.interval = atoi(optarg); break;
+			case 'k': g_app_cfg.keep = atoi(optarg); break;
             case 'l': g_app_cfg.listen = optarg; break;
 			case 'm': g_app_cfg.make = optarg; break;
+			case 'M': g_app_cfg.metrics = optarg; break;
 			case 'p': g_app_cfg.password = optarg; break;
+			case 'r': g_app_cfg.slow_sample = atoi(optarg); break;
+			case 's': g_app_cfg.sample = atoi(optarg); break;
+			case 't': g_app_cfg.slow_ms = atoi(optarg); break;
 			case 'u': g_app_cfg.username = optarg; break;
 			case 'w': g_app_cfg.workdir = optarg; break;
 			case 'x': g_app_cfg.decrypt = optarg; break;
+			case 'Z': g_app_cfg.zip_size = atoi(optarg); break;
 			case 'z': usage_chinese(); break;
 			default: printf("Try %s -h for more informaton.\n", g_app_name);
 		}
@@ -99,25 +183,110 @@ inline static void mk_out_name(char* out, const char* file, const char* ext) {
     strcpy(out, file);
     char *op = strrchr(out, '.');
     if (op) *op = '\0';
-    strcat(op, ext);
+    strcat(out, ext);
 }
 
+/** 文本文件每行作为一条记录写入aidb文件, 空行忽略 */
 int process_encrypt() {
     size_t len = strlen(g_app_cfg.make);
     char outfile[len + 8];
     mk_out_name(outfile, g_app_cfg.make, ".aidb");
-    make_aidb_file(g_app_cfg.make, outfile, g_key);
+
+    FILE* f = fopen(g_app_cfg.make, "rb");
+    if (!f) {
+        printf("can't open %s\n", g_app_cfg.make);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = malloc(size > 0 ? size : 1);
+    size_t n = fread(data, 1, size, f);
+    fclose(f);
+
+    aidb_t* db = malloc(aidb_sizeof());
+    AIDB_ERROR err = aidb_create(db, outfile, g_key);
+    if (err != AIDB_OK) {
+        printf("can't create %s, error %d\n", outfile, err);
+        free(db);
+        free(data);
+        return 1;
+    }
+    for (char *p = data, *end = data + n; p < end; ) {
+        char* nl = memchr(p, '\n', end - p);
+        size_t line = (nl ? nl : end) - p;
+        // 兼容windows换行符
+        if (line && p[line - 1] == '\r') --line;
+        if (line) aidb_put(db, p, (uint32_t) line);
+        p = nl ? nl + 1 : end;
+    }
+    free(data);
+    err = aidb_sync(db);
+    aidb_close(db);
+    free(db);
+    if (err != AIDB_OK) {
+        printf("can't write %s, error %d\n", outfile, err);
+        return 1;
+    }
+    printf("encrypt %s to %s\n", g_app_cfg.make, outfile);
     return 0;
 }
 
+/** 解密记录写入文本文件的回调, 每条记录一行 */
+static _Bool on_decrypt_read(void* param, const char* src, uint32_t len) {
+    FILE* f = param;
+    return fwrite(src, 1, len, f) == len && fputc('\n', f) != EOF;
+}
+
+/** aidb文件解密为文本文件, 每条记录一行, 旧格式(整个文件CBC加密)的文件同样支持 */
 int process_derypt() {
     size_t len = strlen(g_app_cfg.decrypt);
     char outfile[len + 8];
     mk_out_name(outfile, g_app_cfg.decrypt, ".xml");
-    make_xml_file(g_app_cfg.decrypt, outfile, g_key);
+
+    FILE* f = fopen(outfile, "wb");
+    if (!f) {
+        printf("can't create %s\n", outfile);
+        return 1;
+    }
+    aidb_t* db = malloc(aidb_sizeof());
+    AIDB_ERROR err = aidb_open(db, g_app_cfg.decrypt, g_key);
+    if (err == AIDB_OK) {
+        err = aidb_load(db, f, on_decrypt_read, NULL);
+        aidb_close(db);
+    } else if (err == AIDB_ERR_MAGIC || err == AIDB_ERR_TOO_SMALL) {
+        err = aidb_load_legacy(g_app_cfg.decrypt, g_key, f, on_decrypt_read, NULL);
+    }
+    free(db);
+    if (fclose(f) && err == AIDB_OK) err = AIDB_ERR_WRITE;
+    if (err != AIDB_OK) {
+        printf("can't decrypt %s, error %d\n", g_app_cfg.decrypt, err);
+        return 1;
+    }
+    printf("decrypt %s to %s\n", g_app_cfg.decrypt, outfile);
     return 0;
 }
 
+/** 加载静态文件并预先生成压缩版本, 文件不存在时返回NULL */
+static httpzip_static_t* load_static(const char* file, const char* content_type) {
+    FILE* f = fopen(file, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = malloc(len > 0 ? len : 1);
+    size_t n = fread(data, 1, len, f);
+    fclose(f);
+    httpzip_static_t* ret = httpzip_static_create(data, (uint32_t) n, content_type, true);
+    free(data);
+    return ret;
+}
+
+/** 收到SIGHUP时重新打开日志文件, 配合logrotate等外部工具使用 */
+static void on_sighup(uv_signal_t* handle, int signum) {
+    log_reopen();
+}
+
 uint32_t g_count = 0;
 void on_idle(uv_idle_t *handle) {
     printf("idle call %d ok\n", ++g_count);
@@ -135,14 +304,14 @@ int on_http_serve(httpctx_t* pctx) {
 
     const char* cct = "application/json; charset=UTF-8";
 
-    if (httpctx_path_prefix(preq, "/hello/")) {
+    if (httpctx_path_prefix(pctx, "/hello/")) {
         httpctx_set_content_type(pctx, "text/plain");
 
         httpctx_body_begin(pctx);
         httpctx_body_append(pctx, "Hello", 5);
         httpctx_body_append(pctx, " World!", 7);
         httpctx_body_end(pctx);
-    } else if (httpctx_path_prefix(preq, "/index")) {
+    } else if (httpctx_path_prefix(pctx, "/index")) {
         httpctx_set_content_type(pctx, cct);
         httpctx_add_header(pctx, "Cookie", "Kiven");
 
@@ -154,6 +323,8 @@ int on_http_serve(httpctx_t* pctx) {
         size_t c = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
 
         httpctx_set_body(pctx, buf, c);
+    } else if (g_hcjs && !strcmp(path, "/hc.js")) {
+        httpzip_static_serve(pctx, g_hcjs);
     } else {
         pres->status = 404;
         httpctx_set_content_type(pctx, cct);
@@ -186,6 +357,34 @@ int main(int argc, char **argv) {
     
     // 设置日志服务
     log_start(g_app_cfg.debug, 1024 * 1024);
+    log_rotate(1024 * 1024, g_app_cfg.interval, g_app_cfg.keep, g_app_cfg.compress);
+    // 日志由后台线程写入, 避免在事件循环中等待磁盘io
+    if (!g_app_cfg.async || strcmp(g_app_cfg.async, "sync"))
+        log_async_start(0, g_app_cfg.async && !strcmp(g_app_cfg.async, "block") ? LOG_FULL_BLOCK : LOG_FULL_DROP);
+    // 采样请求等高频日志只记录原始参数, 由logdecode离线格式化
+    if (g_app_cfg.binlog)
+        log_bin_start(g_app_cfg.binlog);
+    if (g_app_cfg.access && !accesslog_start(g_app_cfg.access, g_app_cfg.access_pattern))
+        return 1;
+    // 开启请求流量采集
+    if (g_app_cfg.capture && !capture_start(NULL, g_app_cfg.capture, g_app_cfg.sample))
+        return 1;
+    // 运行指标按路由分别统计, 路由与on_http_serve中的处理路径一致
+    metrics_set_path(g_app_cfg.metrics);
+    metrics_route_add("/hello");
+    metrics_route_add("/index");
+    http_server_slowlog(g_app_cfg.slow_ms, g_app_cfg.slow_sample);
+    http_server_etag(g_app_cfg.etag);
+    // 开启回复内容压缩, 静态文件在启动时预压缩, 请求时按协商结果直接复制
+    if (g_app_cfg.zip_size)
+        httpzip_start(g_app_cfg.zip_size, 6);
+    // 内容在有效时间内不变的路由缓存完整回复, 命中时不调用on_http_serve
+    if (g_app_cfg.cache_ms) {
+        respcache_start(16 * 1024 * 1024, 1024 * 1024);
+        respcache_route_add("/hello", g_app_cfg.cache_ms);
+        respcache_route_add("/index", g_app_cfg.cache_ms);
+    }
+    g_hcjs = load_static("hc.js", "application/javascript; charset=UTF-8");
 
     // 正常web启动处理流程==========================
     uv_loop_t* ploop = uv_default_loop();
@@ -195,6 +394,11 @@ int main(int argc, char **argv) {
     http_server_t server;
     http_server(ploop, &server, g_app_cfg.listen, 5, on_http_serve);
 
+    uv_signal_t sighup;
+    uv_signal_init(ploop, &sighup);
+    uv_signal_start(&sighup, on_sighup, SIGHUP);
+    uv_unref((uv_handle_t*) &sighup);
+
     uv_run(ploop, UV_RUN_DEFAULT);
     uv_loop_close(ploop);
 
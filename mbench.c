@@ -0,0 +1,512 @@
+/** 工具库微基准测试, 测量常用辅助函数的单次操作耗时(ns/op)和吞吐量(GB/s)
+ *
+ *  每个测试项自动调整迭代次数使单轮运行时间不少于 -m 指定的毫秒数, 重复多轮取最快的一轮,
+ *  结果每行输出一个json对象, 保存后可用 -b 参数作为基线进行比较, 超过阈值的退化将以非0值退出
+ * @file mbench.c
+ * @author Kiven Lee
+ * @date 2021-08-03
+ * @version 1.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+
+#include "uv.h"
+#include "dynmem.h"
+#include "pool.h"
+#include "rbtree.h"
+#include "base64.h"
+#include "urlencode.h"
+#include "crc32.h"
+#include "md5.h"
+#include "sha1.h"
+#include "aes.h"
+
+/** 基线文件中允许的最大测试项数量 */
+#define MAX_CASES 128
+
+/** 测试函数, 执行iters次操作
+ * @param iters     执行次数
+ * @return          用于防止编译器优化掉计算过程的校验值
+*/
+typedef uint64_t (*bench_fn) (uint64_t iters);
+
+// 测试项定义
+typedef struct bench_case_t {
+    const char*     name;               // 测试项名称
+    uint32_t        bytes;              // 每次操作处理的字节数, 0表示不计算吞吐量
+    bench_fn        fn;                 // 测试函数
+} bench_case_t;
+
+// 测试结果
+typedef struct bench_result_t {
+    char            name[64];           // 测试项名称
+    double          ns_op;              // 每次操作耗时(纳秒)
+    double          gbps;               // 吞吐量(GB/s)
+} bench_result_t;
+
+static char *g_app_name;
+static const char *g_filter = NULL;
+static const char *g_baseline = NULL;
+static const char *g_output = NULL;
+static uint32_t g_min_ms = 200;
+static uint32_t g_rounds = 5;
+static double g_threshold = 10;
+
+/** 防止计算结果被编译器优化掉 */
+static volatile uint64_t g_sink;
+
+/** 测试数据, 启动时用伪随机数填充 */
+static uint8_t g_data[65536];
+static uint8_t g_out[65536 * 2];
+
+// 一个带有中文和需要转义字符的典型查询参数, 用于url编解码测试
+static const char URL_TEXT[] = "name=张三&address=广东省深圳市南山区科技园 1栋&tag=a+b/c?d=e&page=1&size=20"
+        "&keyword=fast http server&callback=https://www.example.com/path?x=1&y=2";
+
+//==================== 测试项实现 ====================
+
+static uint64_t bench_dynmem_append(uint64_t iters) {
+    dynmem_t m;
+    dynmem_init(&m, 1024);
+    for (uint64_t i = 0; i < iters; ++i) {
+        if (dynmem_len(&m) >= 65536) dynmem_clear(&m);
+        dynmem_append(&m, g_data + (i & 1023), 64);
+    }
+    uint64_t r = dynmem_len(&m);
+    dynmem_clear(&m);
+    return r;
+}
+
+static dynmem_t g_read_mem;
+
+static uint64_t bench_dynmem_read(uint64_t iters) {
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i)
+        r += dynmem_read(&g_read_mem, (uint32_t) (i & 4095), 4096, g_out);
+    return r;
+}
+
+static uint64_t bench_dynmem_chr(uint64_t iters) {
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i)
+        r += dynmem_chr(&g_read_mem, 0, 4096, '\0');
+    return r;
+}
+
+static uint64_t bench_dynmem_offset(uint64_t iters) {
+    uint64_t r = 0;
+    uint8_t *p = dynmem_get(&g_read_mem, 7000);
+    for (uint64_t i = 0; i < iters; ++i)
+        r += dynmem_offset(&g_read_mem, p + (i & 63));
+    return r;
+}
+
+static uint64_t bench_pool_get_put(uint64_t iters) {
+    pool_t pool = pool_malloc(64, 128);
+    void *items[16];
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; i += 16) {
+        for (int j = 0; j < 16; ++j) items[j] = pool_get(pool);
+        r += (uintptr_t) items[i & 15];
+        for (int j = 15; j >= 0; --j) pool_put(pool, items[j]);
+    }
+    pool_free(pool);
+    return r;
+}
+
+static uint64_t bench_pool_overflow(uint64_t iters) {
+    // 内存池容量已满, 每次分配都走malloc
+    pool_t pool = pool_malloc(32, 128);
+    void *full[32];
+    for (int j = 0; j < 32; ++j) full[j] = pool_get(pool);
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i) {
+        void *p = pool_get(pool);
+        r += (uintptr_t) p;
+        pool_put(pool, p);
+    }
+    for (int j = 0; j < 32; ++j) pool_put(pool, full[j]);
+    pool_free(pool);
+    return r;
+}
+
+// 红黑树测试节点
+typedef struct rb_bench_node_t {
+    rb_node_t       node;
+    uint32_t        key;
+} rb_bench_node_t;
+
+#define RB_NODES 1024
+static rb_bench_node_t g_rb_nodes[RB_NODES];         // 搜索测试使用的树节点
+static rb_bench_node_t g_rb_insert_nodes[RB_NODES];  // 插入测试每轮重建树使用的节点
+static uint32_t g_rb_keys[RB_NODES];
+
+static uint64_t bench_rb_insert(uint64_t iters) {
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; i += RB_NODES) {
+        rb_root_t root = { NULL };
+        for (uint32_t j = 0; j < RB_NODES; ++j) {
+            g_rb_insert_nodes[j].key = g_rb_keys[j];
+            r += rb_insert(&root, &g_rb_insert_nodes[j].node, rb_uint32cmp);
+        }
+    }
+    return r;
+}
+
+static rb_root_t g_rb_root;
+
+static uint64_t bench_rb_search(uint64_t iters) {
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i)
+        r += (uintptr_t) rb_search(&g_rb_root, &g_rb_keys[i & (RB_NODES - 1)], rb_uint32cmp);
+    return r;
+}
+
+static uint64_t bench_base64_encode(uint64_t iters) {
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i)
+        r += base64_encode(g_out, g_data, 1024, true, false);
+    return r;
+}
+
+static uint8_t g_base64_text[2048];
+static size_t g_base64_len;
+
+static uint64_t bench_base64_decode(uint64_t iters) {
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i)
+        r += base64_decode(g_out, g_base64_text, g_base64_len);
+    return r;
+}
+
+static uint64_t bench_base64_encode_dynmem(uint64_t iters) {
+    dynmem_t m;
+    dynmem_init(&m, 1024);
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i) {
+        dynmem_set_len(&m, 0);
+        r += base64_encode_dynmem(&m, g_data, 4096, true, false, false);
+    }
+    dynmem_clear(&m);
+    return r;
+}
+
+static dynmem_t g_base64_mem;
+
+static uint64_t bench_base64_decode_dynmem(uint64_t iters) {
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i)
+        r += base64_decode_dynmem(g_out, &g_base64_mem, 0, dynmem_len(&g_base64_mem), false);
+    return r;
+}
+
+static uint64_t bench_url_encode(uint64_t iters) {
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i)
+        r += url_component_encode(URL_TEXT, sizeof(URL_TEXT) - 1, (char*) g_out, sizeof(g_out));
+    return r;
+}
+
+static char g_url_text[1024];
+static size_t g_url_len;
+
+static uint64_t bench_url_decode(uint64_t iters) {
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i)
+        r += url_decode(g_url_text, g_url_len, (char*) g_out, sizeof(g_out));
+    return r;
+}
+
+static uint64_t bench_crc32(uint64_t iters) {
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i)
+        r += crc32(g_data, 4096);
+    return r;
+}
+
+static uint64_t bench_crc32c(uint64_t iters) {
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i)
+        r += crc32c(g_data, 4096);
+    return r;
+}
+
+static uint64_t bench_md5(uint64_t iters, uint32_t len) {
+    uint64_t r = 0;
+    uint8_t digest[16];
+    for (uint64_t i = 0; i < iters; ++i) {
+        md5_bin(digest, g_data, len);
+        r += digest[0];
+    }
+    return r;
+}
+
+static uint64_t bench_md5_64(uint64_t iters) { return bench_md5(iters, 64); }
+static uint64_t bench_md5_4k(uint64_t iters) { return bench_md5(iters, 4096); }
+
+// 批量计算的短消息, 每次操作计算一批, 与逐条计算按吞吐量比较
+#define HASH_BATCH 8
+
+static uint64_t bench_md5_batch(uint64_t iters) {
+    uint64_t r = 0;
+    uint8_t digest[16];
+    for (uint64_t i = 0; i < iters; ++i) {
+        for (int j = 0; j < HASH_BATCH; ++j) {
+            md5_bin(digest, g_data + j * 64, 64);
+            r += digest[0];
+        }
+    }
+    return r;
+}
+
+static uint64_t bench_md5_multi(uint64_t iters) {
+    const void *inputs[HASH_BATCH];
+    size_t lens[HASH_BATCH];
+    uint8_t digests[HASH_BATCH][16];
+    for (int j = 0; j < HASH_BATCH; ++j) {
+        inputs[j] = g_data + j * 64;
+        lens[j] = 64;
+    }
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i) {
+        md5_multi(HASH_BATCH, inputs, lens, digests);
+        r += digests[i & (HASH_BATCH - 1)][0];
+    }
+    return r;
+}
+
+static uint64_t bench_sha1(uint64_t iters, uint32_t len) {
+    uint64_t r = 0;
+    uint8_t digest[20];
+    for (uint64_t i = 0; i < iters; ++i) {
+        sha1(g_data, len, digest);
+        r += digest[0];
+    }
+    return r;
+}
+
+static uint64_t bench_sha1_64(uint64_t iters) { return bench_sha1(iters, 64); }
+static uint64_t bench_sha1_4k(uint64_t iters) { return bench_sha1(iters, 4096); }
+
+static uint64_t bench_sha1_multi(uint64_t iters) {
+    const void *inputs[HASH_BATCH];
+    size_t lens[HASH_BATCH];
+    uint8_t digests[HASH_BATCH][20];
+    for (int j = 0; j < HASH_BATCH; ++j) {
+        inputs[j] = g_data + j * 64;
+        lens[j] = 64;
+    }
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i) {
+        sha1_multi(HASH_BATCH, inputs, lens, digests);
+        r += digests[i & (HASH_BATCH - 1)][0];
+    }
+    return r;
+}
+
+static uint64_t bench_aes(uint64_t iters, int mode) {
+    static const uint8_t key[16] = "0123456789abcdef", iv[16] = "fedcba9876543210";
+    aes_ctx_t ctx;
+    aes_init(&ctx, mode, key, 128, iv);
+    uint64_t r = 0;
+    for (uint64_t i = 0; i < iters; ++i)
+        r += aes_update(&ctx, g_data, 4096, g_out);
+    return r;
+}
+
+static uint64_t bench_aes_enc(uint64_t iters) { return bench_aes(iters, AES_ENCRYPT); }
+static uint64_t bench_aes_dec(uint64_t iters) { return bench_aes(iters, AES_DECRYPT); }
+
+static const bench_case_t CASES[] = {
+    { "dynmem_append/64",       64,     bench_dynmem_append },
+    { "dynmem_read/4k",         4096,   bench_dynmem_read },
+    { "dynmem_chr/4k",          4096,   bench_dynmem_chr },
+    { "dynmem_offset/16k",      0,      bench_dynmem_offset },
+    { "pool_get_put/128",       0,      bench_pool_get_put },
+    { "pool_get_put/overflow",  0,      bench_pool_overflow },
+    { "rb_insert/1k",           0,      bench_rb_insert },
+    { "rb_search/1k",           0,      bench_rb_search },
+    { "base64_encode/1k",       1024,   bench_base64_encode },
+    { "base64_decode/1k",       1024,   bench_base64_decode },
+    { "base64_encode_dynmem/4k", 4096,  bench_base64_encode_dynmem },
+    { "base64_decode_dynmem/4k", 4096,  bench_base64_decode_dynmem },
+    { "url_encode/query",       sizeof(URL_TEXT) - 1, bench_url_encode },
+    { "url_decode/query",       sizeof(URL_TEXT) - 1, bench_url_decode },
+    { "crc32/4k",               4096,   bench_crc32 },
+    { "crc32c/4k",              4096,   bench_crc32c },
+    { "md5/64",                 64,     bench_md5_64 },
+    { "md5/4k",                 4096,   bench_md5_4k },
+    { "md5/8x64",               8 * 64, bench_md5_batch },
+    { "md5_multi/8x64",         8 * 64, bench_md5_multi },
+    { "sha1/64",                64,     bench_sha1_64 },
+    { "sha1/4k",                4096,   bench_sha1_4k },
+    { "sha1_multi/8x64",        8 * 64, bench_sha1_multi },
+    { "aes_update/enc/4k",      4096,   bench_aes_enc },
+    { "aes_update/dec/4k",      4096,   bench_aes_dec },
+};
+
+//==================== 测试框架 ====================
+
+/** 准备测试数据 */
+static void setup() {
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < sizeof(g_data); ++i) {
+        seed = seed * 1103515245 + 12345;
+        g_data[i] = (uint8_t) (seed >> 16) | 1; // 不含0, 使dynmem_chr扫描整个范围
+    }
+
+    dynmem_init(&g_read_mem, 1024);
+    dynmem_append(&g_read_mem, g_data, 16384);
+
+    for (uint32_t i = 0; i < RB_NODES; ++i)
+        g_rb_keys[i] = (i * 2654435761u) ^ 0x5bd1e995;
+    for (uint32_t i = 0; i < RB_NODES; ++i) {
+        g_rb_nodes[i].key = g_rb_keys[i];
+        rb_insert(&g_rb_root, &g_rb_nodes[i].node, rb_uint32cmp);
+    }
+
+    g_base64_len = base64_encode(g_base64_text, g_data, 1024, true, false);
+    dynmem_init(&g_base64_mem, 1024);
+    base64_encode_dynmem(&g_base64_mem, g_data, 4096, true, false, false);
+    g_url_len = url_component_encode(URL_TEXT, sizeof(URL_TEXT) - 1, g_url_text, sizeof(g_url_text));
+}
+
+/** 运行单个测试项 */
+static void run_case(const bench_case_t* bc, bench_result_t* out) {
+    uint64_t iters = 1, min_ns = (uint64_t) g_min_ms * 1000000;
+
+    // 预估迭代次数, 使单轮运行时间达到要求
+    for (;;) {
+        uint64_t t = uv_hrtime();
+        g_sink += bc->fn(iters);
+        t = uv_hrtime() - t;
+        if (t >= min_ns / 4) {
+            iters = (uint64_t) ((double) iters * min_ns / (t ? t : 1)) + 1;
+            break;
+        }
+        iters *= t < min_ns / 100 ? 10 : 2;
+    }
+
+    double best = 0;
+    for (uint32_t r = 0; r < g_rounds; ++r) {
+        uint64_t t = uv_hrtime();
+        g_sink += bc->fn(iters);
+        t = uv_hrtime() - t;
+        double ns_op = (double) t / iters;
+        if (!r || ns_op < best) best = ns_op;
+    }
+
+    snprintf(out->name, sizeof(out->name), "%s", bc->name);
+    out->ns_op = best;
+    out->gbps = bc->bytes ? bc->bytes / best : 0; // 字节/纳秒 等于 GB/s
+}
+
+/** 加载基线文件, 格式为本程序输出的每行一个json对象 */
+static uint32_t load_baseline(const char* file, bench_result_t* results) {
+    FILE *fp = fopen(file, "r");
+    if (!fp) {
+        fprintf(stderr, "can't open baseline file %s\n", file);
+        exit(1);
+    }
+    char line[256];
+    uint32_t count = 0;
+    while (count < MAX_CASES && fgets(line, sizeof(line), fp)) {
+        bench_result_t *r = &results[count];
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"ns_op\": %lf, \"gbps\": %lf",
+                r->name, &r->ns_op, &r->gbps) == 3)
+            ++count;
+    }
+    fclose(fp);
+    return count;
+}
+
+static const bench_result_t* find_result(const bench_result_t* results, uint32_t count, const char* name) {
+    for (uint32_t i = 0; i < count; ++i)
+        if (!strcmp(results[i].name, name)) return &results[i];
+    return NULL;
+}
+
+/** 使用帮助 */
+static void usage() {
+    printf("micro benchmark for utility libraries.\n\n");
+    printf("Usage: %s [option]\n\n", g_app_name);
+    printf("Options:\n");
+    printf("    -b file         compare with baseline file\n");
+    printf("    -f text         only run cases whose name contains text\n");
+    printf("    -h              show this help\n");
+    printf("    -l              list cases\n");
+    printf("    -m ms           minimum time per round, default %u\n", g_min_ms);
+    printf("    -n rounds       rounds per case (best is kept), default %u\n", g_rounds);
+    printf("    -o file         save results to file, can be used as baseline\n");
+    printf("    -t percent      regression threshold for baseline compare, default %.0f\n", g_threshold);
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    g_app_name = strrchr(argv[0], '/');
+    g_app_name = g_app_name ? g_app_name + 1 : argv[0];
+    size_t case_count = sizeof(CASES) / sizeof(CASES[0]);
+
+    int c;
+    while ((c = getopt(argc, argv, "b:f:hlm:n:o:t:")) != -1) {
+        switch (c) {
+            case 'b': g_baseline = optarg; break;
+            case 'f': g_filter = optarg; break;
+            case 'h': usage(); break;
+            case 'l':
+                for (size_t i = 0; i < case_count; ++i) printf("%s\n", CASES[i].name);
+                return 0;
+            case 'm': g_min_ms = atoi(optarg); break;
+            case 'n': g_rounds = atoi(optarg); break;
+            case 'o': g_output = optarg; break;
+            case 't': g_threshold = atof(optarg); break;
+            default: printf("Try %s -h for more informaton.\n", g_app_name); return 1;
+        }
+    }
+    if (!g_rounds) g_rounds = 1;
+
+    static bench_result_t base[MAX_CASES];
+    uint32_t base_count = g_baseline ? load_baseline(g_baseline, base) : 0;
+
+    FILE *fp = NULL;
+    if (g_output && !(fp = fopen(g_output, "w"))) {
+        fprintf(stderr, "can't open output file %s\n", g_output);
+        return 1;
+    }
+
+    setup();
+
+    uint32_t regressions = 0;
+    for (size_t i = 0; i < case_count; ++i) {
+        if (g_filter && !strstr(CASES[i].name, g_filter)) continue;
+
+        bench_result_t r;
+        run_case(&CASES[i], &r);
+
+        char line[256];
+        int len = snprintf(line, sizeof(line), "{\"name\": \"%s\", \"ns_op\": %.3f, \"gbps\": %.3f",
+                r.name, r.ns_op, r.gbps);
+        if (fp) fprintf(fp, "%s}\n", line);
+
+        const bench_result_t *b = find_result(base, base_count, r.name);
+        if (b && b->ns_op > 0) {
+            double change = (r.ns_op - b->ns_op) / b->ns_op * 100;
+            bool regressed = change > g_threshold;
+            if (regressed) ++regressions;
+            snprintf(line + len, sizeof(line) - len, ", \"base_ns_op\": %.3f, \"change_pct\": %.1f, \"regressed\": %s",
+                    b->ns_op, change, regressed ? "true" : "false");
+        }
+        printf("%s}\n", line);
+        fflush(stdout);
+    }
+
+    if (fp) fclose(fp);
+    if (regressions)
+        fprintf(stderr, "%u case(s) regressed more than %.0f%%\n", regressions, g_threshold);
+    return regressions ? 2 : 0;
+}
@@ -1,6 +1,11 @@
 #include <string.h>
+#include <stdbool.h>
 #include "md5.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#	define MD5_HW 1
+#endif
+
 /*md5转换用到的常量，算法本身规定的*/
 enum MD5_CONST {
 	S11=7, S12=12, S13=17, S14=22, S21=5, S22=9, S23=14, S24=20,
@@ -41,7 +46,7 @@ static char HEX[] = "0123456789abcdef";
  * @param input：欲转换的四字节的整数形式的数组
  * @param len：output缓冲区的长度，要求是4的整数倍
  */
-static void _encode(uint8_t *output, uint32_t *input, size_t len) {
+static void _encode(uint8_t *output, const uint32_t *input, size_t len) {
 	for (size_t i = 0, j = 0; j < len; i++, j += 4) {
 		output[j    ] = (uint8_t)(input[i] & 0xff);
 		output[j + 1] = (uint8_t)((input[i] >> 8) & 0xff);
@@ -263,3 +268,178 @@ char* md5_string(char dst[33], const void *input, size_t len) {
 	dst[count] = '\0';
 	return dst;
 }
+
+/** 多路计算的向量类型, 每个元素是一路消息的32位字. 没有AVX2时编译器拆成两个128位向量计算 */
+typedef uint32_t md5_vec_t __attribute__((vector_size(MD5_LANES * 4)));
+
+/** 每一步的加法常量、循环左移位数和使用的消息字序号 */
+static const uint32_t MD5_K[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+static const uint8_t MD5_R[64] = {
+	S11, S12, S13, S14, S11, S12, S13, S14, S11, S12, S13, S14, S11, S12, S13, S14,
+	S21, S22, S23, S24, S21, S22, S23, S24, S21, S22, S23, S24, S21, S22, S23, S24,
+	S31, S32, S33, S34, S31, S32, S33, S34, S31, S32, S33, S34, S31, S32, S33, S34,
+	S41, S42, S43, S44, S41, S42, S43, S44, S41, S42, S43, S44, S41, S42, S43, S44 };
+static const uint8_t MD5_G[64] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	1, 6, 11, 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12,
+	5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2,
+	0, 7, 14, 5, 12, 3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9 };
+
+/** 多路md5的一次转换, 与_md5_transform相同的64步运算, 每个向量元素是一路消息. 循环完全展开后各表都是常量 */
+__attribute__((always_inline))
+inline static void _md5_transform_lanes(md5_vec_t state[4], const md5_vec_t x[16]) {
+	md5_vec_t a = state[0], b = state[1], c = state[2], d = state[3], f;
+#pragma GCC unroll 64
+	for (int i = 0; i < 64; ++i) {
+		if (i < 16) f = d ^ (b & (c ^ d));
+		else if (i < 32) f = c ^ (d & (b ^ c));
+		else if (i < 48) f = b ^ c ^ d;
+		else f = c ^ (b | ~d);
+		f += a + MD5_K[i] + x[MD5_G[i]];
+		a = d;
+		d = c;
+		c = b;
+		b += f << MD5_R[i] | f >> (32 - MD5_R[i]);
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+static void _md5_lanes_sse(md5_vec_t state[4], const md5_vec_t x[16]) {
+	_md5_transform_lanes(state, x);
+}
+
+/** 多路转换的实现, 程序启动时按cpu支持的指令集选择 */
+static void (*_md5_lanes) (md5_vec_t state[4], const md5_vec_t x[16]) = _md5_lanes_sse;
+
+#ifdef MD5_HW
+__attribute__((target("avx2")))
+static void _md5_lanes_avx2(md5_vec_t state[4], const md5_vec_t x[16]) {
+	_md5_transform_lanes(state, x);
+}
+
+__attribute__((constructor))
+static void _md5_init_lanes() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		_md5_lanes = _md5_lanes_avx2;
+}
+#endif
+
+/** 多路计算中一路消息的状态, 最后不足64字节的内容和填充放在tail中 */
+typedef struct {
+	const uint8_t *data;	// 消息内容
+	size_t full;			// 完整的64字节块数量
+	size_t blocks;			// 加上填充后的总块数
+	uint8_t tail[128];		// 剩余内容 + 0x80 + 0... + 64位小端序的bits长度
+} _md5_lane_t;
+
+static void _md5_lane_init(_md5_lane_t *lane, const void *input, size_t len) {
+	size_t rem = len & 63, tail_len = rem < 56 ? 64 : 128;
+	uint64_t bits = (uint64_t) len << 3;
+	lane->data = (const uint8_t*) input;
+	lane->full = len >> 6;
+	lane->blocks = lane->full + tail_len / 64;
+	memcpy(lane->tail, lane->data + (len - rem), rem);
+	lane->tail[rem] = 0x80;
+	memset(lane->tail + rem + 1, 0, tail_len - rem - 1);
+	for (int i = 0; i < 8; ++i)
+		lane->tail[tail_len - 8 + i] = (uint8_t) (bits >> (i * 8));
+}
+
+void md5_multi(uint32_t count, const void *const inputs[], const size_t lens[], uint8_t digests[][16]) {
+	for (uint32_t base = 0; base < count; base += MD5_LANES) {
+		uint32_t n = count - base < MD5_LANES ? count - base : MD5_LANES;
+		// 只有一条时标量计算更快
+		if (n == 1) {
+			md5_bin(digests[base], inputs[base], lens[base]);
+			continue;
+		}
+
+		_md5_lane_t lanes[MD5_LANES];
+		size_t max_blocks = 0;
+		for (uint32_t l = 0; l < MD5_LANES; ++l) {
+			if (l < n) _md5_lane_init(&lanes[l], inputs[base + l], lens[base + l]);
+			else _md5_lane_init(&lanes[l], "", 0);
+			if (l < n && lanes[l].blocks > max_blocks) max_blocks = lanes[l].blocks;
+		}
+
+		md5_vec_t state[4], saved[4], x[16];
+		static const uint32_t IV[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+		for (int i = 0; i < 4; ++i)
+			state[i] = (md5_vec_t) {} + IV[i];
+
+		for (size_t k = 0; k < max_blocks; ++k) {
+			bool partial = false;
+			for (uint32_t l = 0; l < MD5_LANES; ++l) {
+				_md5_lane_t *lane = &lanes[l];
+				// 已经完成的消息重复计算最后一块, 结果丢弃
+				size_t b = k < lane->blocks ? k : lane->blocks - 1;
+				const uint8_t *p = b < lane->full ? lane->data + b * 64 : lane->tail + (b - lane->full) * 64;
+				for (int w = 0; w < 16; ++w, p += 4)
+					x[w][l] = (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+				partial |= k >= lane->blocks;
+			}
+			if (partial) memcpy(saved, state, sizeof(state));
+			_md5_lanes(state, x);
+			for (uint32_t l = 0; partial && l < MD5_LANES; ++l) {
+				if (k < lanes[l].blocks) continue;
+				for (int i = 0; i < 4; ++i)
+					state[i][l] = saved[i][l];
+			}
+		}
+
+		for (uint32_t l = 0; l < n; ++l) {
+			uint32_t words[4] = { state[0][l], state[1][l], state[2][l], state[3][l] };
+			_encode(digests[base + l], words, 16);
+		}
+	}
+}
+
+const char* md5_impl_name() {
+#ifdef MD5_HW
+	if (_md5_lanes == _md5_lanes_avx2) return "avx2";
+#endif
+	return "sse";
+}
+
+#ifdef TEST_MD5
+#include <stdio.h>
+#include <stdlib.h>
+
+int main() {
+	char hex[33];
+	printf("md5(\"abc\") = %s, expect 900150983cd24fb0d6963f7d28e17f72\n", md5_string(hex, "abc", 3));
+
+	// 多路计算与逐条计算比较, 覆盖不同的消息数量和填充边界附近的长度
+	static uint8_t data[1024];
+	for (size_t i = 0; i < sizeof(data); ++i) data[i] = (uint8_t) rand();
+	int errors = 0;
+	for (uint32_t count = 1; count <= MD5_LANES * 2 + 3; ++count) {
+		for (size_t len = 0; len < 300; len += count < 4 ? 1 : 7) {
+			const void *inputs[MD5_LANES * 2 + 3];
+			size_t lens[MD5_LANES * 2 + 3];
+			uint8_t digests[MD5_LANES * 2 + 3][16], expect[16];
+			for (uint32_t i = 0; i < count; ++i) {
+				inputs[i] = data + i * 13;
+				lens[i] = (len + i * 29) % 700;
+			}
+			md5_multi(count, inputs, lens, digests);
+			for (uint32_t i = 0; i < count; ++i)
+				if (memcmp(md5_bin(expect, inputs[i], lens[i]), digests[i], 16)) ++errors;
+		}
+	}
+	printf("md5_multi (%s): %s, %d errors\n", md5_impl_name(), errors ? "fail" : "succeed", errors);
+	return errors != 0;
+}
+#endif
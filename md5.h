@@ -16,6 +16,9 @@
 extern "C" {
 #endif
 
+/** md5_multi同时计算的消息数量 */
+#define MD5_LANES 8
+
 typedef struct {
     /** state (ABCD) 四个32bits数，用于存放最终计算得到的消息摘要。当消息长度〉512bits时，也用于存放每个512bits的中间结果 */
     uint32_t state[4];
@@ -63,6 +66,18 @@ uint8_t* md5_bin(uint8_t dst[16], const void *input, size_t len);
  */
 char* md5_string(char dst[33], const void *input, size_t len);
 
+/** 同时计算多条独立消息的md5值, 每MD5_LANES条消息在SIMD向量的各路中一起计算, 适合大量的短消息.
+ *  消息长度不同时按最长的一条计算, 已完成的路结果保持不变
+ * @param count         消息数量, 不限, 按MD5_LANES条分组计算
+ * @param inputs        消息内容地址数组
+ * @param lens          消息长度数组(字节为单位)
+ * @param digests       写入md5结果的数组
+ */
+void md5_multi(uint32_t count, const void *const inputs[], const size_t lens[], uint8_t digests[][16]);
+
+/** md5_multi当前使用的实现名称, cpu支持AVX2时为"avx2", 否则为"sse" */
+const char* md5_impl_name();
+
 #ifdef __cplusplus
 }
 #endif
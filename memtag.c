@@ -0,0 +1,115 @@
+#include <stdbool.h>
+#include <string.h>
+#include "memtag.h"
+
+static const char* TAG_NAMES[MEMTAG_COUNT] = {
+    "other", "pool", "ctx", "header", "dynmem", "str", "buffer", "write", "server", "deflate", "cache", "app"
+};
+
+const char* memtag_name(memtag_t tag) {
+    return (uint32_t) tag < MEMTAG_COUNT ? TAG_NAMES[tag] : "other";
+}
+
+#ifndef NMEMTAG
+
+// 分配头部, 16字节保证返回地址与malloc的对齐方式相同
+typedef struct _memtag_head_t {
+    uint64_t        size;           // 分配长度, 不包括头部
+    uint64_t        tag;            // 分类标签
+} _memtag_head_t;
+
+// 注册到全局链表的线程统计对象, 线程退出后不释放, 保证汇总结果包含已退出线程的计数
+typedef struct _memtag_node_t {
+    memtag_stat_t   stat;
+    struct _memtag_node_t* next;
+} _memtag_node_t;
+
+static _memtag_node_t* _memtag_list = NULL;
+static _Thread_local _memtag_node_t* _memtag_local = NULL;
+
+/** 创建当前线程的统计对象, 无锁插入全局链表头部, 链表只增不减 */
+static memtag_stat_t* local_register() {
+    _memtag_node_t* node = calloc(1, sizeof(_memtag_node_t));
+    node->next = __atomic_load_n(&_memtag_list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&_memtag_list, &node->next, node, true,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    _memtag_local = node;
+    return &node->stat;
+}
+
+/** 修改当前线程的计数, 只有所属线程写入, 原子写入保证其它线程读取时不会读到中间值 */
+inline static void local_add(uint64_t tag, int64_t size, int64_t count) {
+    memtag_stat_t* s = _memtag_local ? &_memtag_local->stat : local_register();
+    __atomic_store_n(&s->bytes[tag], s->bytes[tag] + size, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->count[tag], s->count[tag] + count, __ATOMIC_RELAXED);
+}
+
+void* memtag_malloc(memtag_t tag, size_t size) {
+    _memtag_head_t* head = malloc(sizeof(_memtag_head_t) + size);
+    if (!head) return NULL;
+    head->size = size;
+    head->tag = (uint32_t) tag < MEMTAG_COUNT ? tag : MEMTAG_OTHER;
+    local_add(head->tag, (int64_t) size, 1);
+    return head + 1;
+}
+
+void* memtag_calloc(memtag_t tag, size_t size) {
+    void* ret = memtag_malloc(tag, size);
+    if (ret) memset(ret, 0, size);
+    return ret;
+}
+
+void memtag_free(void* ptr) {
+    if (!ptr) return;
+    _memtag_head_t* head = (_memtag_head_t*) ptr - 1;
+    local_add(head->tag, -(int64_t) head->size, -1);
+    free(head);
+}
+
+void memtag_stat(memtag_stat_t* out) {
+    memset(out, 0, sizeof(memtag_stat_t));
+    for (_memtag_node_t* n = __atomic_load_n(&_memtag_list, __ATOMIC_ACQUIRE); n; n = n->next) {
+        for (uint32_t i = 0; i < MEMTAG_COUNT; ++i) {
+            out->bytes[i] += __atomic_load_n(&n->stat.bytes[i], __ATOMIC_RELAXED);
+            out->count[i] += __atomic_load_n(&n->stat.count[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+#else
+
+void memtag_stat(memtag_stat_t* out) {
+    memset(out, 0, sizeof(memtag_stat_t));
+}
+
+#endif // NMEMTAG
+
+//==========================================================================
+// #define TEST_MEMTAG
+#ifdef TEST_MEMTAG
+#include <stdio.h>
+#include <assert.h>
+
+int main() {
+    memtag_stat_t s;
+    void* a = memtag_malloc(MEMTAG_STR, 100);
+    char* b = memtag_calloc(MEMTAG_STR, 28);
+    void* c = memtag_malloc(MEMTAG_DYNMEM, 1024);
+    assert(((uintptr_t) a & 15) == 0 && b[27] == 0);
+
+    memtag_stat(&s);
+    assert(s.bytes[MEMTAG_STR] == 128 && s.count[MEMTAG_STR] == 2);
+    assert(s.bytes[MEMTAG_DYNMEM] == 1024 && s.count[MEMTAG_DYNMEM] == 1);
+
+    memtag_free(a);
+    memtag_free(c);
+    memtag_free(NULL);
+    memtag_stat(&s);
+    assert(s.bytes[MEMTAG_STR] == 28 && s.count[MEMTAG_STR] == 1);
+    assert(s.bytes[MEMTAG_DYNMEM] == 0 && s.count[MEMTAG_DYNMEM] == 0);
+
+    memtag_free(b);
+    printf("test success\n");
+    return 0;
+}
+#endif // TEST_MEMTAG
@@ -0,0 +1,92 @@
+/** 按子系统分类的内存分配统计, 供生产环境使用的轻量级分配记账
+ *
+ *  内部的内存分配(pool, dynmem, str, buffer, 头部节点, 写入请求等)通过memtag_malloc/memtag_free进行,
+ *  每次分配在内存块前面增加16字节的头部, 记录分配长度和分类标签, 释放时按头部信息扣减统计.
+ *  统计数据为每个线程独立的计数器, 只由所属线程写入, 不加锁; 在其它线程释放的内存计入释放线程,
+ *  因此单个线程的计数可能为负数, 所有线程的计数之和为实际存活的内存.
+ *  编译时定义NMEMTAG则直接调用malloc/free, 不增加头部也不统计
+ * @file memtag.h
+ * @author Kiven Lee
+ * @date 2021-08-08
+ * @version 1.0
+*/
+
+#pragma once
+#ifndef __MEMTAG_H__
+#define __MEMTAG_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** 内存分配的分类标签 */
+typedef enum {
+    MEMTAG_OTHER,           // 未分类
+    MEMTAG_POOL,            // 内存池预分配的内存块
+    MEMTAG_CTX,             // 内存池用完后单独分配的httpctx上下文对象
+    MEMTAG_HEADER,          // 内存池用完后单独分配的头部节点
+    MEMTAG_DYNMEM,          // dynmem内存页及链表节点
+    MEMTAG_STR,             // str_t字符串
+    MEMTAG_BUFFER,          // buffer_t缓冲区
+    MEMTAG_WRITE,           // 回复写入请求及uv_buf_t数组
+    MEMTAG_SERVER,          // http服务对象, 接收缓冲区, 路由节点
+    MEMTAG_DEFLATE,         // 压缩对象及预压缩的回复内容
+    MEMTAG_CACHE,           // 回复缓存的条目及序列化的完整回复
+    MEMTAG_APP,             // 服务回调函数等应用代码
+    MEMTAG_COUNT
+} memtag_t;
+
+/** 单个线程的分配统计 */
+typedef struct memtag_stat_t {
+    int64_t         bytes[MEMTAG_COUNT];    // 存活的字节数, 不包括分配头部
+    int64_t         count[MEMTAG_COUNT];    // 存活的分配次数
+} memtag_stat_t;
+
+/** 获取分类标签的名称, 用于统计输出
+ * @param tag           分类标签
+ * @return              标签名称, 例如 "dynmem"
+*/
+extern const char* memtag_name(memtag_t tag);
+
+/** 汇总所有线程的分配统计, 可以在任意线程中调用, 定义NMEMTAG时输出全0
+ * @param out           输出参数, 汇总结果
+*/
+extern void memtag_stat(memtag_stat_t* out);
+
+#ifndef NMEMTAG
+
+/** 分配内存并记录到指定分类
+ * @param tag           分类标签
+ * @param size          分配长度
+ * @return              分配的内存地址, 失败返回NULL
+*/
+extern void* memtag_malloc(memtag_t tag, size_t size);
+
+/** 分配内存并清零, 记录到指定分类
+ * @param tag           分类标签
+ * @param size          分配长度
+ * @return              分配的内存地址, 失败返回NULL
+*/
+extern void* memtag_calloc(memtag_t tag, size_t size);
+
+/** 释放memtag_malloc/memtag_calloc分配的内存, 并从所属分类中扣减
+ * @param ptr           内存地址, 可以为NULL
+*/
+extern void memtag_free(void* ptr);
+
+#else
+
+#define memtag_malloc(tag, size) malloc(size)
+#define memtag_calloc(tag, size) calloc(1, size)
+#define memtag_free(ptr) free(ptr)
+
+#endif // NMEMTAG
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __MEMTAG_H__
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "log.h"
+#include "memtag.h"
+#include "respcache.h"
+
+// 读取其它线程写入的计数
+#define METRICS_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+// 路由定义
+typedef struct _route_t {
+    char*           path;               // 路由路径, 去除了末尾的斜杠
+    uint32_t        len;                // 路由路径长度
+} _route_t;
+
+static _route_t _routes[METRICS_MAX_ROUTES];
+static uint32_t _route_count = 0;
+
+static char* _metrics_path = NULL;
+static uint32_t _metrics_path_len = 0;
+
+/** 所有事件循环的统计对象链表, 只在注册和输出时加锁 */
+static metrics_t* _metrics_list = NULL;
+static uv_mutex_t _metrics_lock;
+static uv_once_t _metrics_once = UV_ONCE_INIT;
+
+static const char* CODE_LABELS[METRICS_CODES] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+static const char CONTENT_TYPE[] = "text/plain; version=0.0.4; charset=utf-8";
+
+static void init_lock() {
+    uv_mutex_init(&_metrics_lock);
+}
+
+/** 复制路径并去除末尾的斜杠 */
+static char* copy_path(const char* path, uint32_t* out_len) {
+    uint32_t len = (uint32_t) strlen(path);
+    if (len && path[len - 1] == '/') --len;
+    char* ret = memtag_malloc(MEMTAG_SERVER, len + 1);
+    memcpy(ret, path, len);
+    ret[len] = '\0';
+    *out_len = len;
+    return ret;
+}
+
+bool metrics_route_add(const char* path) {
+    if (_route_count == METRICS_MAX_ROUTES) return false;
+    _route_t* r = &_routes[_route_count];
+    r->path = copy_path(path, &r->len);
+    ++_route_count;
+    return true;
+}
+
+void metrics_set_path(const char* path) {
+    memtag_free(_metrics_path);
+    _metrics_path = path ? copy_path(path, &_metrics_path_len) : NULL;
+}
+
+/** 事件循环每次迭代后的回调 */
+static void on_loop_check(uv_check_t* handle) {
+    metrics_t* self = (metrics_t*) handle->data;
+    METRICS_ADD(self->loop_iterations, 1);
+}
+
+metrics_t* metrics_create(uv_loop_t* loop, httpctx_pool_t* pool) {
+    metrics_t* self = memtag_calloc(MEMTAG_SERVER, sizeof(metrics_t));
+    self->pool = pool;
+    self->dynmem_pages = dynmem_live_pages();
+
+    uv_check_init(loop, &self->check);
+    self->check.data = self;
+    uv_check_start(&self->check, on_loop_check);
+    // 统计用的句柄不阻止事件循环退出
+    uv_unref((uv_handle_t*) &self->check);
+
+    uv_once(&_metrics_once, init_lock);
+    uv_mutex_lock(&_metrics_lock);
+    self->next = _metrics_list;
+    _metrics_list = self;
+    uv_mutex_unlock(&_metrics_lock);
+    return self;
+}
+
+/** 按最长前缀查找请求路径所属的路由, 前缀必须在路径分隔符处结束, 找不到时返回METRICS_MAX_ROUTES */
+static uint32_t find_route(httpctx_t* ctx) {
+    dynmem_t* pbuf = &ctx->req.data;
+    http_value_t* path = &ctx->req.path;
+    uint32_t ret = METRICS_MAX_ROUTES, best = 0;
+    for (uint32_t i = 0; i < _route_count; ++i) {
+        _route_t* r = &_routes[i];
+        if (r->len > path->len || (ret != METRICS_MAX_ROUTES && r->len <= best)) continue;
+        if (r->len < path->len && *dynmem_get(pbuf, path->pos + r->len) != '/') continue;
+        if (!dynmem_equal(pbuf, path->pos, r->len, r->path)) continue;
+        ret = i;
+        best = r->len;
+    }
+    return ret;
+}
+
+/** 计算延迟所在的直方图桶, 第i个桶的上限为2^i微秒 */
+inline static uint32_t bucket_index(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    if (us <= 1) return 0;
+    uint32_t i = 64 - __builtin_clzll(us - 1);
+    return i < METRICS_BUCKETS - 1 ? i : METRICS_BUCKETS - 1;
+}
+
+void metrics_request(metrics_t* self, httpctx_t* ctx, uint32_t bytes_out) {
+    metrics_route_t* r = &self->routes[find_route(ctx)];
+    uint16_t status = ctx->res.status;
+    uint32_t code = status >= 100 && status < 600 ? status / 100 : 0;
+    uint64_t ns = ctx->timing.handler_end - ctx->timing.first_byte;
+
+    METRICS_ADD(r->requests[code], 1);
+    METRICS_ADD(r->buckets[bucket_index(ns)], 1);
+    METRICS_ADD(r->duration_ns, ns);
+    METRICS_ADD(self->bytes_out, bytes_out);
+}
+
+bool metrics_match(httpctx_t* ctx) {
+    http_value_t* path = &ctx->req.path;
+    return _metrics_path && path->len == _metrics_path_len
+            && dynmem_equal(&ctx->req.data, path->pos, path->len, _metrics_path);
+}
+
+// 指标输出的缓冲区, 每行内容先格式化到行缓冲区再追加到回复内容
+typedef struct _writer_t {
+    httpctx_t*      ctx;
+    char            line[512];
+} _writer_t;
+
+static void emit(_writer_t* w, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(w->line, sizeof(w->line), fmt, args);
+    va_end(args);
+    if (len > (int) sizeof(w->line) - 1) len = sizeof(w->line) - 1;
+    if (len > 0) httpctx_body_append(w->ctx, w->line, len);
+}
+
+/** 输出指标的说明和类型 */
+static void emit_head(_writer_t* w, const char* name, const char* type, const char* help) {
+    emit(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/** 获取路由的标签值, 转义反斜杠和引号 */
+static const char* route_label(uint32_t index, char* buf, size_t size) {
+    if (index == METRICS_MAX_ROUTES) return "other";
+    const char* src = _routes[index].path;
+    if (!*src) return "/";
+    char* p = buf, *end = buf + size - 2;
+    for (; *src && p < end; ++src) {
+        if (*src == '\\' || *src == '"') *p++ = '\\';
+        *p++ = *src;
+    }
+    *p = '\0';
+    return buf;
+}
+
+int metrics_serve(httpctx_t* ctx) {
+    // 汇总所有事件循环的统计数据
+    metrics_t* total = memtag_calloc(MEMTAG_SERVER, sizeof(metrics_t));
+    uint64_t ctx_hits = 0, ctx_misses = 0, head_hits = 0, head_misses = 0;
+    int64_t pages = 0;
+    uint32_t loops = 0;
+
+    uv_once(&_metrics_once, init_lock);
+    uv_mutex_lock(&_metrics_lock);
+    for (metrics_t* m = _metrics_list; m; m = m->next, ++loops) {
+        total->bytes_in += METRICS_GET(m->bytes_in);
+        total->bytes_out += METRICS_GET(m->bytes_out);
+        total->accepted += METRICS_GET(m->accepted);
+        total->connections += METRICS_GET(m->connections);
+        total->active += METRICS_GET(m->active);
+        total->loop_iterations += METRICS_GET(m->loop_iterations);
+        for (uint32_t i = 0; i <= METRICS_MAX_ROUTES; ++i) {
+            metrics_route_t *src = &m->routes[i], *dst = &total->routes[i];
+            for (uint32_t j = 0; j < METRICS_CODES; ++j)
+                dst->requests[j] += METRICS_GET(src->requests[j]);
+            for (uint32_t j = 0; j < METRICS_BUCKETS; ++j)
+                dst->buckets[j] += METRICS_GET(src->buckets[j]);
+            dst->duration_ns += METRICS_GET(src->duration_ns);
+        }
+        uint64_t hits, misses;
+        pool_stat(m->pool->ctx_pool, &hits, &misses);
+        ctx_hits += hits;
+        ctx_misses += misses;
+        pool_stat(m->pool->headers_pool, &hits, &misses);
+        head_hits += hits;
+        head_misses += misses;
+        pages += __atomic_load_n(m->dynmem_pages, __ATOMIC_RELAXED);
+    }
+    uv_mutex_unlock(&_metrics_lock);
+    memtag_stat_t mem;
+    memtag_stat(&mem);
+
+    httpres_t* res = &ctx->res;
+    res->content_type.pos = dynmem_len(&res->data);
+    res->content_type.len = dynmem_append(&res->data, CONTENT_TYPE, sizeof(CONTENT_TYPE) - 1);
+    httpctx_body_begin(ctx);
+
+    _writer_t* w = memtag_malloc(MEMTAG_SERVER, sizeof(_writer_t));
+    w->ctx = ctx;
+    char label[256];
+
+    emit_head(w, "http_requests_total", "counter", "Requests by route and status class.");
+    for (uint32_t i = 0; i <= METRICS_MAX_ROUTES; ++i) {
+        if (i < METRICS_MAX_ROUTES && i >= _route_count) continue;
+        const char* route = route_label(i, label, sizeof(label));
+        for (uint32_t j = 0; j < METRICS_CODES; ++j) {
+            if (total->routes[i].requests[j] || j == 2)
+                emit(w, "http_requests_total{route=\"%s\",code=\"%s\"} %llu\n", route, CODE_LABELS[j],
+                        (unsigned long long) total->routes[i].requests[j]);
+        }
+    }
+
+    emit_head(w, "http_request_duration_seconds", "histogram", "Time from first request byte to handler exit.");
+    for (uint32_t i = 0; i <= METRICS_MAX_ROUTES; ++i) {
+        if (i < METRICS_MAX_ROUTES && i >= _route_count) continue;
+        const char* route = route_label(i, label, sizeof(label));
+        metrics_route_t* r = &total->routes[i];
+        uint64_t count = 0;
+        for (uint32_t j = 0; j < METRICS_BUCKETS; ++j) {
+            count += r->buckets[j];
+            if (j < METRICS_BUCKETS - 1)
+                emit(w, "http_request_duration_seconds_bucket{route=\"%s\",le=\"%g\"} %llu\n",
+                        route, (double) (1ULL << j) / 1e6, (unsigned long long) count);
+            else
+                emit(w, "http_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %llu\n",
+                        route, (unsigned long long) count);
+        }
+        emit(w, "http_request_duration_seconds_sum{route=\"%s\"} %.9f\n", route, r->duration_ns / 1e9);
+        emit(w, "http_request_duration_seconds_count{route=\"%s\"} %llu\n", route, (unsigned long long) count);
+    }
+
+    emit_head(w, "http_received_bytes_total", "counter", "Bytes read from clients.");
+    emit(w, "http_received_bytes_total %llu\n", (unsigned long long) total->bytes_in);
+    emit_head(w, "http_sent_bytes_total", "counter", "Response bytes queued for clients.");
+    emit(w, "http_sent_bytes_total %llu\n", (unsigned long long) total->bytes_out);
+    emit_head(w, "http_connections_accepted_total", "counter", "Accepted connections.");
+    emit(w, "http_connections_accepted_total %llu\n", (unsigned long long) total->accepted);
+    emit_head(w, "http_connections", "gauge", "Open connections, active ones have a request in progress.");
+    emit(w, "http_connections{state=\"active\"} %lld\n", (long long) total->active);
+    emit(w, "http_connections{state=\"idle\"} %lld\n", (long long) (total->connections - total->active));
+    emit_head(w, "pool_get_total", "counter", "Pool allocations, hit from pool or fell back to malloc.");
+    emit(w, "pool_get_total{pool=\"ctx\",result=\"hit\"} %llu\n", (unsigned long long) ctx_hits);
+    emit(w, "pool_get_total{pool=\"ctx\",result=\"malloc\"} %llu\n", (unsigned long long) ctx_misses);
+    emit(w, "pool_get_total{pool=\"headers\",result=\"hit\"} %llu\n", (unsigned long long) head_hits);
+    emit(w, "pool_get_total{pool=\"headers\",result=\"malloc\"} %llu\n", (unsigned long long) head_misses);
+    emit_head(w, "dynmem_live_pages", "gauge", "Dynmem pages allocated and not yet freed.");
+    emit(w, "dynmem_live_pages %lld\n", (long long) pages);
+#ifndef NMEMTAG
+    emit_head(w, "mem_live_bytes", "gauge", "Bytes allocated through tagged allocators and not yet freed.");
+    for (uint32_t i = 0; i < MEMTAG_COUNT; ++i)
+        emit(w, "mem_live_bytes{tag=\"%s\"} %lld\n", memtag_name(i), (long long) mem.bytes[i]);
+    emit_head(w, "mem_live_allocs", "gauge", "Tagged allocations not yet freed.");
+    for (uint32_t i = 0; i < MEMTAG_COUNT; ++i)
+        emit(w, "mem_live_allocs{tag=\"%s\"} %lld\n", memtag_name(i), (long long) mem.count[i]);
+#endif
+    if (respcache_enabled()) {
+        respcache_stat_t cache;
+        respcache_stat(&cache);
+        emit_head(w, "respcache_requests_total", "counter", "Cacheable requests, served from cache or by the handler.");
+        emit(w, "respcache_requests_total{result=\"hit\"} %llu\n", (unsigned long long) cache.hits);
+        emit(w, "respcache_requests_total{result=\"miss\"} %llu\n", (unsigned long long) cache.misses);
+        emit_head(w, "respcache_evictions_total", "counter", "Cache entries dropped on expiry or for space.");
+        emit(w, "respcache_evictions_total %llu\n", (unsigned long long) cache.evictions);
+        emit_head(w, "respcache_entries", "gauge", "Cached responses.");
+        emit(w, "respcache_entries %lld\n", (long long) cache.entries);
+        emit_head(w, "respcache_bytes", "gauge", "Bytes of serialized responses held by the cache.");
+        emit(w, "respcache_bytes %lld\n", (long long) cache.bytes);
+    }
+    emit_head(w, "uv_loop_iterations_total", "counter", "Event loop iterations.");
+    emit(w, "uv_loop_iterations_total %llu\n", (unsigned long long) total->loop_iterations);
+    emit_head(w, "uv_loops", "gauge", "Event loops serving http.");
+    emit(w, "uv_loops %u\n", loops);
+
+    httpctx_body_end(ctx);
+    memtag_free(w);
+    memtag_free(total);
+    return 0;
+}
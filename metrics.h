@@ -0,0 +1,101 @@
+/** http服务运行指标统计, 以Prometheus文本格式输出
+ *
+ *  每个http服务(事件循环)拥有独立的统计对象, 计数只由所属事件循环线程写入,
+ *  写入时不加锁也不分配内存, 采集请求到达时汇总所有已注册的统计对象后输出.
+ *  统计内容包括: 按路由和状态码分类的请求数及延迟直方图, 收发字节数, 活动/空闲连接数,
+ *  内存池分配命中/malloc次数, dynmem存活内存页数量, 按子系统分类的存活内存(memtag), 事件循环迭代次数
+ * @file metrics.h
+ * @author Kiven Lee
+ * @date 2021-08-05
+ * @version 1.0
+*/
+
+#pragma once
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "uv.h"
+#include "httpctx.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** 可单独统计的最大路由数量, 未匹配任何路由的请求计入"other" */
+#ifndef METRICS_MAX_ROUTES
+#   define METRICS_MAX_ROUTES 32
+#endif
+/** 延迟直方图桶数量, 第i个桶的上限为2^i微秒, 最后一个桶为+Inf, 24个桶覆盖1微秒到4.2秒 */
+#define METRICS_BUCKETS 24
+/** 按状态码分类的数量, 0: 其它, 1-5: 1xx-5xx */
+#define METRICS_CODES 6
+
+/** 单个路由的统计数据 */
+typedef struct metrics_route_t {
+    uint64_t        requests[METRICS_CODES];    // 按状态码分类的请求数
+    uint64_t        buckets[METRICS_BUCKETS];   // 延迟直方图, 非累计
+    uint64_t        duration_ns;                // 延迟总和, 纳秒
+} metrics_route_t;
+
+/** 单个事件循环的统计数据 */
+typedef struct metrics_t {
+    uint64_t        bytes_in;                   // 接收字节数
+    uint64_t        bytes_out;                  // 发送字节数
+    uint64_t        accepted;                   // 接受的连接总数
+    int64_t         connections;                // 当前打开的连接数
+    int64_t         active;                     // 当前正在处理请求的连接数
+    uint64_t        loop_iterations;            // 事件循环迭代次数
+    metrics_route_t routes[METRICS_MAX_ROUTES + 1]; // 路由统计, 最后一项为未匹配的请求
+    httpctx_pool_t* pool;                       // 所属服务的内存池, 用于读取分配统计
+    const int64_t*  dynmem_pages;               // 所属线程的dynmem内存页计数器
+    uv_check_t      check;                      // 统计事件循环迭代次数
+    struct metrics_t* next;                     // 注册链表
+} metrics_t;
+
+/** 计数增加, 只能在所属事件循环线程中调用 */
+#define METRICS_ADD(var, n) __atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+
+/** 注册需要单独统计的路由, 按最长前缀匹配请求路径, 必须在服务启动前调用
+ * @param path          路由路径, 例如 /api/user
+ * @return              成功返回true, 超出最大路由数量返回false
+*/
+extern bool metrics_route_add(const char* path);
+
+/** 设置指标输出路径, 请求该路径时输出指标而不调用服务的回调函数
+ * @param path          输出路径, 例如 /metrics, NULL表示不输出
+*/
+extern void metrics_set_path(const char* path);
+
+/** 创建事件循环的统计对象并注册到全局链表, 必须在事件循环所属线程中调用
+ * @param loop          事件循环
+ * @param pool          http服务的内存池对象
+ * @return              新建的统计对象
+*/
+extern metrics_t* metrics_create(uv_loop_t* loop, httpctx_pool_t* pool);
+
+/** 记录一个已完成处理的请求, 在回复写入队列后调用, 延迟为读取到第一个字节到退出服务回调函数的时间
+ * @param self          统计对象
+ * @param ctx           请求上下文对象
+ * @param bytes_out     回复内容长度(包括头部)
+*/
+extern void metrics_request(metrics_t* self, httpctx_t* ctx, uint32_t bytes_out);
+
+/** 判断请求是否为指标输出请求
+ * @param ctx           请求上下文对象
+ * @return              true: 是指标输出请求
+*/
+extern bool metrics_match(httpctx_t* ctx);
+
+/** 汇总所有事件循环的统计数据并写入回复内容
+ * @param ctx           请求上下文对象
+ * @return              0: 成功
+*/
+extern int metrics_serve(httpctx_t* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __METRICS_H__
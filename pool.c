@@ -16,6 +16,9 @@ struct _pool_head_t {
     uint32_t        capacity;       // 内存池容量, 指定内存池总共有多少个分配对象, 容量总是以32倍数对齐
     uint32_t        size;           // 分配对象大小
     uint32_t        last;           // 最后操作的索引值，保存该值是为了加快分配速度
+    memtag_t        tag;            // 池用完后单独分配的对象所属的分配统计分类
+    uint64_t        hits;           // 从池中分配的次数
+    uint64_t        misses;         // 池已用完改用malloc分配的次数
     _pool_list_t    head;           // 动态分配的对象链表
     uint8_t         data[];         // 内存池位图数组及内存池地址，内存池位图数组大小为capacity/32, 内存池大小为capacity*size
 };
@@ -28,9 +31,10 @@ pool_t pool_malloc(uint32_t capacity, uint32_t size) {
     uint32_t ptr_size = capacity * size;
     uint32_t pool_size = sizeof(struct _pool_head_t) + bits_size + ptr_size;
 
-    pool_t pool = (pool_t) calloc(pool_size, 1);
+    pool_t pool = (pool_t) memtag_calloc(MEMTAG_POOL, pool_size);
     pool->capacity = capacity;
     pool->size = size;
+    pool->tag = MEMTAG_POOL;
     pool->head.prev = &pool->head;
     pool->head.next = &pool->head;
 
@@ -40,9 +44,9 @@ pool_t pool_malloc(uint32_t capacity, uint32_t size) {
 void pool_free(pool_t self) {
     _pool_list_t *head = &self->head, *pos = head->prev, *tmp = pos->prev;
     for (; pos != head; pos = tmp, tmp = pos->prev) {
-        free(pos);
+        memtag_free(pos);
     }
-    free(self);
+    memtag_free(self);
 }
 
 /** 从内存池获取可用对象, 内存池使用满了后，使用malloc进行分配 */
@@ -57,6 +61,8 @@ void* pool_get(pool_t self) {
                 if (!(b & c)) {
                     self->last = i;
                     bits[i] |= c;
+                    // 只有所属线程写入, 原子写入保证其它线程读取统计时不会读到中间值
+                    __atomic_store_n(&self->hits, self->hits + 1, __ATOMIC_RELAXED);
                     return self->data + (bits_cap << PBB) + ((i << PB) | j) * self->size;
                 }
             }
@@ -64,9 +70,10 @@ void* pool_get(pool_t self) {
     }
 
     self->last = bits_cap; // 内存池已经全部被使用，设置last为无效索引
+    __atomic_store_n(&self->misses, self->misses + 1, __ATOMIC_RELAXED);
 
     // 使用malloc进行动态内存分配并加入到链表
-    _pool_list_t *entry = malloc(sizeof(_pool_list_t) + self->size);
+    _pool_list_t *entry = memtag_malloc(self->tag, sizeof(_pool_list_t) + self->size);
     _pool_list_t *prev = self->head.prev, *next = &self->head;
 
     next->prev = entry;
@@ -94,13 +101,22 @@ void pool_put(pool_t self, void* entry) {
             if (pos == node) {
                 pos->next->prev = pos->prev;
                 pos->prev->next = pos->next;
-                free(pos);
+                memtag_free(pos);
                 break;
             }
         }
     }
 }
 
+void pool_set_tag(pool_t self, memtag_t tag) {
+    self->tag = tag;
+}
+
+void pool_stat(pool_t self, uint64_t* hits, uint64_t* misses) {
+    *hits = __atomic_load_n(&self->hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&self->misses, __ATOMIC_RELAXED);
+}
+
 //==========================================================================
 // #define TEST_POOL
 #ifdef TEST_POOL
@@ -7,6 +7,7 @@
 #define __POOL_H__
 
 #include <stdint.h>
+#include "memtag.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,6 +34,19 @@ extern void* pool_get(pool_t self);
 */
 extern void pool_put(pool_t self, void* entry);
 
+/** 设置池用完后单独分配的对象所属的分配统计分类, 默认为MEMTAG_POOL
+ * @param self          内存池对象
+ * @param tag           分配统计分类
+*/
+extern void pool_set_tag(pool_t self, memtag_t tag);
+
+/** 获取内存池的分配统计, 可以在其它线程中读取
+ * @param self          内存池对象
+ * @param hits          输出参数, 从池中分配的次数
+ * @param misses        输出参数, 池已用完改用malloc分配的次数
+*/
+extern void pool_stat(pool_t self, uint64_t* hits, uint64_t* misses);
+
 #ifdef __cplusplus
 }
 #endif
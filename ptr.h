@@ -1,4 +1,4 @@
-/** 共享指针，带引用计数
+/** 共享指针，带引用计数, 引用计数不加锁, 同一资源的引用只能在同一线程中增减
  * @author kiven lee
  * @version 1.0
 */
@@ -9,12 +9,13 @@
 #include <stdint.h>
 #include <memory.h>
 #include <stdlib.h>
+#include "memtag.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-typedef struct _ptr_head_t {
+struct _ptr_head_t {
     uint32_t    ref;
     uint32_t    len;
     uint8_t     data[];
@@ -24,31 +25,42 @@ typedef uint8_t* ptr_t;
 
 #define PTR_OFFSET_HEAD(x) ((struct _ptr_head_t*) ((x) - sizeof(struct _ptr_head_t)))
 
-/** 分配内存资源并创建强引用
+/** 分配内存资源并创建强引用, 内存计入指定的分配分类
  * 
+ * @param tag 分配分类
  * @param size 资源长度
  */
-inline ptr_t ptr_malloc(size_t size) {
-    struct _ptr_head_t* ret = (struct _ptr_head_t*) malloc(sizeof(struct _ptr_head_t) + size);
+inline static ptr_t ptr_tag_malloc(memtag_t tag, size_t size) {
+    struct _ptr_head_t* ret = (struct _ptr_head_t*) memtag_malloc(tag, sizeof(struct _ptr_head_t) + size);
+    if (!ret) return NULL;
     ret->ref = 1;
     ret->len = size;
     return ret->data;
 }
 
+/** 分配内存资源并创建强引用
+ * 
+ * @param size 资源长度
+ */
+inline static ptr_t ptr_malloc(size_t size) { return ptr_tag_malloc(MEMTAG_OTHER, size); }
+
+/** 资源长度 */
+inline static uint32_t ptr_len(ptr_t self) { return PTR_OFFSET_HEAD(self)->len; }
+
 /** 资源的引用计数加1 */
-inline void ptr_addref(ptr_t self) { ++(PTR_OFFSET_HEAD(self)->ref); }
+inline static void ptr_addref(ptr_t self) { ++(PTR_OFFSET_HEAD(self)->ref); }
 
 /** 释放资源，引用计数减1，当引用计数为0时释放资源 */
-inline void ptr_free(ptr_t self) {
-    uint32_t ref = PTR_OFFSET_HEAD(self)->ref;
-    if (ref && !--ref) free(PTR_OFFSET_HEAD(self));
+inline static void ptr_free(ptr_t self) {
+    struct _ptr_head_t* head = PTR_OFFSET_HEAD(self);
+    if (head->ref && !--head->ref) memtag_free(head);
 }
 
 /** 对资源进行扩容
  * 
  * @param size 增加的容量 
  */
-inline void ptr_expand(ptr_t* self, uint32_t size) {
+inline static void ptr_expand(ptr_t* self, uint32_t size) {
     struct _ptr_head_t* s = PTR_OFFSET_HEAD(*self);
     *self = ptr_malloc(s->len + size);
     memcpy(*self, s->data, s->len);
@@ -61,7 +73,7 @@ inline void ptr_expand(ptr_t* self, uint32_t size) {
  * @param src 要写入的内容
  * @param len 要写入内容的长度
  */
-inline void ptr_append(ptr_t* self, uint32_t pos, void* src, uint32_t len) {
+inline static void ptr_append(ptr_t* self, uint32_t pos, void* src, uint32_t len) {
     uint32_t nl = pos + len;
     if (PTR_OFFSET_HEAD(*self)->len < nl)
         ptr_expand(self, nl);
@@ -23,6 +23,11 @@
 #include <string.h>
 #include "rbtree.h"
 
+#ifndef _WIN32
+#   include <strings.h>
+#   define stricmp strcasecmp
+#endif
+
 static void __rb_rotate_left(rb_node_t *node, rb_root_t *root) {
 	rb_node_t *right = node->rb_right;
 	rb_node_t *parent = rb_parent(node);
@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "respcache.h"
+#include "httpzip.h"
+#include "memtag.h"
+#include "list.h"
+#include "log.h"
+
+// 编译参数 -- 每个线程的哈希桶数量(必须是2的幂次方)
+#ifndef RESPCACHE_BUCKETS
+#   define RESPCACHE_BUCKETS 1024
+#endif
+// 编译参数 -- 缓存键最大长度, 路径加查询参数超过该长度的请求不缓存
+#ifndef RESPCACHE_KEY_MAX
+#   define RESPCACHE_KEY_MAX 512
+#endif
+
+// 读取其它线程写入的计数
+#define STAT_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+// 计数增加, 只能在所属线程中调用
+#define STAT_ADD(var, n) __atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+
+// 开启缓存的路由
+typedef struct _route_t {
+    char*           path;               // 路由路径, 去除了末尾的斜杠
+    uint32_t        len;                // 路由路径长度
+    uint64_t        ttl;                // 有效时间, 纳秒
+} _route_t;
+
+// 缓存条目
+typedef struct _entry_t {
+    LIST_FIELDS;                        // LRU链表节点, 链表头部为最近使用
+    struct _entry_t* chain;             // 哈希冲突链表
+    uint64_t        expire;             // 过期时间, uv_hrtime纳秒值
+    ptr_t           data;               // 序列化的完整回复, 缓存持有1个引用
+    uint64_t        etag;               // 回复的弱ETag, 命中时用于判断是否回复304
+    uint32_t        hash;               // 缓存键的哈希值
+    uint32_t        body_len;           // 回复内容长度, 命中时用于访问日志
+    uint16_t        status;             // 回复状态码
+    uint16_t        key_len;            // 缓存键长度
+    char            key[];              // 缓存键
+} _entry_t;
+
+// 单个线程的缓存
+typedef struct _cache_t {
+    _entry_t*       buckets[RESPCACHE_BUCKETS];
+    list_head_t     lru;                // 按使用时间排序的条目链表, 尾部为最久未使用
+    respcache_stat_t stat;              // 只由所属线程写入
+    struct _cache_t* next;              // 注册链表
+} _cache_t;
+
+// 未命中请求的缓存键, 查找和保存在同一次读取回调中顺序执行, 不会被其它请求打断
+typedef struct _pending_t {
+    bool            valid;              // 上一次查找未命中且可以缓存
+    uint16_t        key_len;
+    uint32_t        hash;
+    uint64_t        ttl;
+    char            key[RESPCACHE_KEY_MAX];
+} _pending_t;
+
+// 查询参数在临时缓冲区中的位置
+typedef struct _param_t {
+    const char*     data;
+    uint32_t        len;
+} _param_t;
+
+bool _respcache_enabled = false;
+
+static uint32_t _max_bytes = 0;
+static uint32_t _max_entry = 0;
+static _route_t _routes[RESPCACHE_MAX_ROUTES];
+static uint32_t _route_count = 0;
+
+/** 所有线程的缓存链表, 只增加不删除, 用于汇总统计 */
+static _cache_t* _cache_list = NULL;
+static _Thread_local _cache_t* _cache_local = NULL;
+static _Thread_local _pending_t _pending;
+
+void respcache_start(uint32_t max_bytes, uint32_t max_entry) {
+    _max_bytes = max_bytes;
+    _max_entry = max_entry < max_bytes ? max_entry : max_bytes;
+    _respcache_enabled = true;
+    log_info("response cache enabled, %u bytes per loop, %u bytes per entry", max_bytes, _max_entry);
+}
+
+bool respcache_route_add(const char* path, uint32_t ttl_ms) {
+    if (_route_count == RESPCACHE_MAX_ROUTES) return false;
+    _route_t* r = &_routes[_route_count++];
+    uint32_t len = (uint32_t) strlen(path);
+    if (len && path[len - 1] == '/') --len;
+    r->path = memtag_malloc(MEMTAG_CACHE, len + 1);
+    memcpy(r->path, path, len);
+    r->path[len] = '\0';
+    r->len = len;
+    r->ttl = (uint64_t) ttl_ms * 1000000;
+    return true;
+}
+
+/** 获取当前线程的缓存, 第一次使用时创建并注册到全局链表 */
+static _cache_t* local_cache() {
+    if (_cache_local) return _cache_local;
+    _cache_t* c = memtag_calloc(MEMTAG_CACHE, sizeof(_cache_t));
+    list_head_init(&c->lru);
+    c->next = __atomic_load_n(&_cache_list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&_cache_list, &c->next, c, true,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return _cache_local = c;
+}
+
+/** 按最长前缀查找请求路径所属的路由, 前缀必须在路径分隔符处结束, 找不到时返回NULL */
+static _route_t* find_route(httpctx_t* ctx) {
+    dynmem_t* pbuf = &ctx->req.data;
+    http_value_t* path = &ctx->req.path;
+    _route_t* ret = NULL;
+    for (uint32_t i = 0; i < _route_count; ++i) {
+        _route_t* r = &_routes[i];
+        if (r->len > path->len || (ret && r->len <= ret->len)) continue;
+        if (r->len < path->len && *dynmem_get(pbuf, path->pos + r->len) != '/') continue;
+        if (!dynmem_equal(pbuf, path->pos, r->len, r->path)) continue;
+        ret = r;
+    }
+    return ret;
+}
+
+static int param_cmp(const void* v1, const void* v2) {
+    const _param_t *p1 = v1, *p2 = v2;
+    int ret = memcmp(p1->data, p2->data, p1->len < p2->len ? p1->len : p2->len);
+    return ret ? ret : (int) p1->len - (int) p2->len;
+}
+
+/** 生成缓存键: 编码 + 路径 + '?' + 按字典序排序的查询参数, 超出长度限制或参数数量超过HTTPCTX_QUERY_MAX返回false */
+static bool make_key(httpctx_t* ctx, _pending_t* out) {
+    httpreq_t* req = &ctx->req;
+    uint32_t plen = req->path.len, qlen = req->url_param.len;
+    if (2 + plen + qlen > RESPCACHE_KEY_MAX) return false;
+
+    char* p = out->key;
+    // 同一路径按协商的编码分别缓存
+    *p++ = '0' + httpzip_accept(ctx);
+    p += dynmem_read(&req->data, req->path.pos, plen, p);
+    if (qlen) {
+        // 使用请求的查询参数索引, 每个参数段从参数名开始到参数值结束
+        uint32_t count = httpctx_query_count(ctx);
+        if (req->query_overflow) return false;
+        char query[qlen];
+        dynmem_read(&req->data, req->url_param.pos, qlen, query);
+        _param_t params[HTTPCTX_QUERY_MAX];
+        for (uint32_t i = 0; i < count; ++i) {
+            const http_header_t* q = httpctx_query_at(ctx, i);
+            params[i].data = query + (q->field.pos - req->url_param.pos);
+            params[i].len = q->value.pos + q->value.len - q->field.pos;
+        }
+        qsort(params, count, sizeof(_param_t), param_cmp);
+        *p++ = '?';
+        for (uint32_t i = 0; i < count; ++i) {
+            if (i) *p++ = '&';
+            memcpy(p, params[i].data, params[i].len);
+            p += params[i].len;
+        }
+    }
+    out->key_len = (uint16_t) (p - out->key);
+
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (const char* s = out->key; s < p; ++s)
+        h = (h ^ (uint8_t) *s) * 16777619u;
+    out->hash = h;
+    return true;
+}
+
+/** 从哈希表和LRU链表中删除条目并释放缓存持有的引用, 正在写入的回复持有自己的引用 */
+static void remove_entry(_cache_t* c, _entry_t* e) {
+    _entry_t** pp = &c->buckets[e->hash & (RESPCACHE_BUCKETS - 1)];
+    while (*pp != e) pp = &(*pp)->chain;
+    *pp = e->chain;
+    list_del((list_head_t*) e);
+    STAT_ADD(c->stat.entries, -1);
+    STAT_ADD(c->stat.bytes, -(int64_t) ptr_len(e->data));
+    STAT_ADD(c->stat.evictions, 1);
+    ptr_free(e->data);
+    memtag_free(e);
+}
+
+ptr_t respcache_lookup(httpctx_t* ctx) {
+    _pending.valid = false;
+    if (ctx->req.method != HC_HTTP_GET) return NULL;
+    _route_t* route = find_route(ctx);
+    if (!route || !make_key(ctx, &_pending)) return NULL;
+
+    _cache_t* c = local_cache();
+    uint64_t now = ctx->timing.handler_begin;
+    _entry_t* e = c->buckets[_pending.hash & (RESPCACHE_BUCKETS - 1)];
+    for (; e; e = e->chain) {
+        if (e->hash == _pending.hash && e->key_len == _pending.key_len
+                && !memcmp(e->key, _pending.key, e->key_len))
+            break;
+    }
+    if (e && e->expire <= now) {
+        remove_entry(c, e);
+        e = NULL;
+    }
+
+    if (!e) {
+        STAT_ADD(c->stat.misses, 1);
+        _pending.valid = true;
+        _pending.ttl = route->ttl;
+        return NULL;
+    }
+
+    STAT_ADD(c->stat.hits, 1);
+    list_del((list_head_t*) e);
+    list_add((list_head_t*) e, &c->lru);
+    ctx->res.status = e->status;
+    ctx->res.body.len = e->body_len;
+    ctx->res.etag = e->etag;
+    ptr_addref(e->data);
+    return e->data;
+}
+
+void respcache_bypass() {
+    _pending.valid = false;
+}
+
+void respcache_store(httpctx_t* ctx) {
+    if (!_pending.valid) return;
+    _pending.valid = false;
+    httpres_t* res = &ctx->res;
+    if (res->status != 200 || res->body_type != HC_BODY_MEMORY || !res->write_bufs) return;
+
+    uint32_t len = 0;
+    for (uv_buf_t* b = res->write_bufs; b->base; ++b)
+        len += (uint32_t) b->len;
+    if (len > _max_entry) return;
+
+    _cache_t* c = local_cache();
+    // 空间不足时从最久未使用的条目开始淘汰
+    while (c->stat.bytes + len > _max_bytes && !list_empty(&c->lru))
+        remove_entry(c, list_last(&c->lru));
+
+    ptr_t data = ptr_tag_malloc(MEMTAG_CACHE, len);
+    _entry_t* e = memtag_malloc(MEMTAG_CACHE, sizeof(_entry_t) + _pending.key_len);
+    if (!data || !e) {
+        if (data) ptr_free(data);
+        memtag_free(e);
+        return;
+    }
+    uint8_t* p = data;
+    for (uv_buf_t* b = res->write_bufs; b->base; ++b) {
+        memcpy(p, b->base, b->len);
+        p += b->len;
+    }
+
+    e->expire = ctx->timing.handler_begin + _pending.ttl;
+    e->data = data;
+    e->hash = _pending.hash;
+    e->etag = res->etag;
+    e->body_len = res->body.len;
+    e->status = res->status;
+    e->key_len = _pending.key_len;
+    memcpy(e->key, _pending.key, _pending.key_len);
+    _entry_t** bucket = &c->buckets[e->hash & (RESPCACHE_BUCKETS - 1)];
+    e->chain = *bucket;
+    *bucket = e;
+    list_add((list_head_t*) e, &c->lru);
+    STAT_ADD(c->stat.entries, 1);
+    STAT_ADD(c->stat.bytes, len);
+}
+
+void respcache_stat(respcache_stat_t* out) {
+    memset(out, 0, sizeof(respcache_stat_t));
+    for (_cache_t* c = __atomic_load_n(&_cache_list, __ATOMIC_ACQUIRE); c; c = c->next) {
+        out->hits += STAT_GET(c->stat.hits);
+        out->misses += STAT_GET(c->stat.misses);
+        out->evictions += STAT_GET(c->stat.evictions);
+        out->entries += STAT_GET(c->stat.entries);
+        out->bytes += STAT_GET(c->stat.bytes);
+    }
+}
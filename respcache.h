@@ -0,0 +1,85 @@
+/** 回复缓存(micro-cache), 对指定路由的GET请求缓存序列化后的完整回复(状态行+头部+内容)
+ *
+ *  缓存键为请求路径、按参数名排序后的查询参数以及协商的压缩编码, 每个路由单独设置有效时间.
+ *  缓存内容保存在不可修改的带引用计数的共享内存(ptr_t)中, 命中时不调用服务回调函数,
+ *  也不复制到回复缓冲区, 直接用一次uv_write写入共享内存, 写入完成后释放引用.
+ *  每个事件循环线程使用独立的缓存, 不加锁, 按LRU淘汰, 总大小和单个条目大小均有上限
+ * @file respcache.h
+ * @author Kiven Lee
+ * @date 2021-08-10
+ * @version 1.0
+*/
+
+#pragma once
+#ifndef __RESPCACHE_H__
+#define __RESPCACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "httpctx.h"
+#include "ptr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** 可以开启缓存的最大路由数量 */
+#ifndef RESPCACHE_MAX_ROUTES
+#   define RESPCACHE_MAX_ROUTES 16
+#endif
+
+/** 所有事件循环线程的缓存统计 */
+typedef struct respcache_stat_t {
+    uint64_t        hits;               // 命中次数
+    uint64_t        misses;             // 未命中次数(只统计开启缓存的路由)
+    uint64_t        evictions;          // 因过期或空间不足淘汰的条目数
+    int64_t         entries;            // 当前条目数
+    int64_t         bytes;              // 当前缓存的回复内容总字节数
+} respcache_stat_t;
+
+/** 缓存状态, 由respcache_start设置 */
+extern bool _respcache_enabled;
+
+/** 开启回复缓存, 必须在服务启动前调用
+ * @param max_bytes     每个事件循环线程的缓存总字节数上限
+ * @param max_entry     单个回复的最大字节数, 超过的回复不缓存
+*/
+extern void respcache_start(uint32_t max_bytes, uint32_t max_entry);
+
+/** 对路由开启缓存, 按最长前缀匹配请求路径, 必须在服务启动前调用
+ * @param path          路由路径, 例如 /api/dict
+ * @param ttl_ms        缓存有效时间, 毫秒
+ * @return              成功返回true, 超出最大路由数量返回false
+*/
+extern bool respcache_route_add(const char* path, uint32_t ttl_ms);
+
+/** 判断是否开启了回复缓存
+ * @return              true: 已开启, false: 未开启
+*/
+inline static bool respcache_enabled() { return _respcache_enabled; }
+
+/** 查找请求对应的缓存回复, 在调用服务回调函数前调用.
+ *  命中时设置回复的状态码、内容长度和ETag(供统计、访问日志和条件请求使用), 未命中时记录缓存键, 由随后的respcache_store使用
+ * @param ctx           请求上下文对象
+ * @return              命中时返回序列化的完整回复并增加1个引用, 由调用方写入完成后ptr_free; 未命中返回NULL
+*/
+extern ptr_t respcache_lookup(httpctx_t* ctx);
+
+/** 服务回调函数中调用, 本次请求的回复不写入缓存, 用于按用户生成等不能共享的回复 */
+extern void respcache_bypass();
+
+/** 保存回复到缓存, 在回复写入队列后调用, 只保存上一次respcache_lookup未命中且状态码为200的回复
+ * @param ctx           请求上下文对象, res.write_bufs为序列化后的回复
+*/
+extern void respcache_store(httpctx_t* ctx);
+
+/** 汇总所有事件循环线程的缓存统计, 可以在任意线程中调用
+ * @param out           输出参数, 汇总结果
+*/
+extern void respcache_stat(respcache_stat_t* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RESPCACHE_H__
@@ -28,8 +28,15 @@
  *  http://www.itl.nist.gov/fipspubs/fip180-1.htm
  */
 
+#include <stdbool.h>
 #include "sha1.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#	include <immintrin.h>
+#	include <cpuid.h>
+#	define SHA1_HW 1
+#endif
+
 /** 32-bit integer manipulation macros (big endian) */
 #ifndef GET_UINT32_BE
 #define GET_UINT32_BE(n, b, i)                                                \
@@ -61,9 +68,104 @@ void sha1_starts(sha1_ctx_t* pctx) {
 	pctx->state[4] = 0xC3D2E1F0;
 }
 
+#ifdef SHA1_HW
+
+/** cpu支持SHA-NI指令时为true, 程序启动时检测 */
+static bool sha1_hw = false;
+
+// SHA-NI每条sha1rnds4计算4轮, 第g组(第4g到4g+3轮)使用的消息在m[g&3]中, e交替使用e0/e1,
+// 同时用sha1msg1/sha1msg2和异或生成后面第4组的消息
+#define SHA1_NI_ROUNDS(f, m0, m1, m2, m3, ecur, enext) {	\
+		ecur = _mm_sha1nexte_epu32(ecur, m0);				\
+		enext = abcd;										\
+		m1 = _mm_sha1msg2_epu32(m1, m0);					\
+		abcd = _mm_sha1rnds4_epu32(abcd, ecur, f);			\
+		m3 = _mm_sha1msg1_epu32(m3, m0);					\
+		m2 = _mm_xor_si128(m2, m0);							\
+	}
+
+/** 使用SHA-NI指令处理一个64字节块 */
+__attribute__((target("sha,sse4.1")))
+static void sha1_process_ni(uint32_t state[5], const unsigned char data[64]) {
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) state), 0x1b);
+	__m128i e0 = _mm_set_epi32((int) state[4], 0, 0, 0), e1;
+	__m128i abcd_save = abcd, e0_save = e0;
+	__m128i m0, m1, m2, m3;
+
+	// 第0-15轮, 依次载入消息
+	m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) data), mask);
+	e0 = _mm_add_epi32(e0, m0);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+	m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16)), mask);
+	e1 = _mm_sha1nexte_epu32(e1, m1);
+	e0 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+	m0 = _mm_sha1msg1_epu32(m0, m1);
+
+	m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 32)), mask);
+	e0 = _mm_sha1nexte_epu32(e0, m2);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+	m1 = _mm_sha1msg1_epu32(m1, m2);
+	m0 = _mm_xor_si128(m0, m2);
+
+	m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 48)), mask);
+	SHA1_NI_ROUNDS(0, m3, m0, m1, m2, e1, e0);
+
+	// 第16-67轮
+	SHA1_NI_ROUNDS(0, m0, m1, m2, m3, e0, e1);
+	SHA1_NI_ROUNDS(1, m1, m2, m3, m0, e1, e0);
+	SHA1_NI_ROUNDS(1, m2, m3, m0, m1, e0, e1);
+	SHA1_NI_ROUNDS(1, m3, m0, m1, m2, e1, e0);
+	SHA1_NI_ROUNDS(1, m0, m1, m2, m3, e0, e1);
+	SHA1_NI_ROUNDS(1, m1, m2, m3, m0, e1, e0);
+	SHA1_NI_ROUNDS(2, m2, m3, m0, m1, e0, e1);
+	SHA1_NI_ROUNDS(2, m3, m0, m1, m2, e1, e0);
+	SHA1_NI_ROUNDS(2, m0, m1, m2, m3, e0, e1);
+	SHA1_NI_ROUNDS(2, m1, m2, m3, m0, e1, e0);
+	SHA1_NI_ROUNDS(2, m2, m3, m0, m1, e0, e1);
+	SHA1_NI_ROUNDS(3, m3, m0, m1, m2, e1, e0);
+	SHA1_NI_ROUNDS(3, m0, m1, m2, m3, e0, e1);
+
+	// 第68-79轮, 不再需要生成新的消息
+	e1 = _mm_sha1nexte_epu32(e1, m1);
+	e0 = abcd;
+	m2 = _mm_sha1msg2_epu32(m2, m1);
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+	m3 = _mm_xor_si128(m3, m1);
+
+	e0 = _mm_sha1nexte_epu32(e0, m2);
+	e1 = abcd;
+	m3 = _mm_sha1msg2_epu32(m3, m2);
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+	e1 = _mm_sha1nexte_epu32(e1, m3);
+	e0 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+	e0 = _mm_sha1nexte_epu32(e0, e0_save);
+	abcd = _mm_add_epi32(abcd, abcd_save);
+	_mm_storeu_si128((__m128i*) state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = (uint32_t) _mm_extract_epi32(e0, 3);
+}
+
+#undef SHA1_NI_ROUNDS
+
+#endif // SHA1_HW
+
 static void sha1_process(sha1_ctx_t* pctx, const unsigned char data[64]) {
 	uint32_t temp, W[16], A, B, C, D, E;
 
+#ifdef SHA1_HW
+	if (sha1_hw) {
+		sha1_process_ni(pctx->state, data);
+		return;
+	}
+#endif
+
 	GET_UINT32_BE(W[0], data, 0);
 	GET_UINT32_BE(W[1], data, 4);
 	GET_UINT32_BE(W[2], data, 8);
@@ -333,10 +435,156 @@ void sha1_hmac(const void *key, size_t keylen, const void *input, size_t ilen, u
 	memset(&ctx, 0, sizeof(sha1_ctx_t));
 }
 
+/** 多路计算的向量类型, 每个元素是一路消息的32位字. 没有AVX2时编译器拆成两个128位向量计算 */
+typedef uint32_t sha1_vec_t __attribute__((vector_size(SHA1_LANES * 4)));
+
+/** 多路sha1的一次转换, 与sha1_process相同的80轮运算, 每个向量元素是一路消息. 循环完全展开后轮函数的选择都是常量 */
+__attribute__((always_inline))
+inline static void sha1_transform_lanes(sha1_vec_t state[5], sha1_vec_t W[16]) {
+	sha1_vec_t A = state[0], B = state[1], C = state[2], D = state[3], E = state[4], temp, f;
+	uint32_t k;
+#pragma GCC unroll 80
+	for (int t = 0; t < 80; ++t) {
+		if (t >= 16) {
+			temp = W[(t + 13) & 15] ^ W[(t + 8) & 15] ^ W[(t + 2) & 15] ^ W[t & 15];
+			W[t & 15] = temp << 1 | temp >> 31;
+		}
+		if (t < 20) f = D ^ (B & (C ^ D)), k = 0x5A827999;
+		else if (t < 40) f = B ^ C ^ D, k = 0x6ED9EBA1;
+		else if (t < 60) f = (B & C) | (D & (B | C)), k = 0x8F1BBCDC;
+		else f = B ^ C ^ D, k = 0xCA62C1D6;
+		temp = (A << 5 | A >> 27) + f + E + k + W[t & 15];
+		E = D;
+		D = C;
+		C = B << 30 | B >> 2;
+		B = A;
+		A = temp;
+	}
+	state[0] += A;
+	state[1] += B;
+	state[2] += C;
+	state[3] += D;
+	state[4] += E;
+}
+
+static void sha1_lanes_sse(sha1_vec_t state[5], sha1_vec_t W[16]) {
+	sha1_transform_lanes(state, W);
+}
+
+/** 多路转换的实现, 程序启动时按cpu支持的指令集选择 */
+static void (*sha1_lanes) (sha1_vec_t state[5], sha1_vec_t W[16]) = sha1_lanes_sse;
+
+#ifdef SHA1_HW
+__attribute__((target("avx2")))
+static void sha1_lanes_avx2(sha1_vec_t state[5], sha1_vec_t W[16]) {
+	sha1_transform_lanes(state, W);
+}
+
+/** 程序启动时检测cpu支持的指令集, 之后只读访问, 可以在多线程中使用 */
+__attribute__((constructor))
+static void sha1_init_hw() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		sha1_lanes = sha1_lanes_avx2;
+	// 编译器的cpu检测不包含SHA-NI, 直接读取cpuid第7页的标志位
+	unsigned int eax, ebx, ecx, edx;
+	sha1_hw = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)
+		&& __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+/** 多路计算中一路消息的状态, 最后不足64字节的内容和填充放在tail中 */
+typedef struct {
+	const uint8_t *data;	// 消息内容
+	size_t full;			// 完整的64字节块数量
+	size_t blocks;			// 加上填充后的总块数
+	uint8_t tail[128];		// 剩余内容 + 0x80 + 0... + 64位大端序的bits长度
+} sha1_lane_t;
+
+static void sha1_lane_init(sha1_lane_t *lane, const void *input, size_t len) {
+	size_t rem = len & 63, tail_len = rem < 56 ? 64 : 128;
+	uint64_t bits = (uint64_t) len << 3;
+	lane->data = (const uint8_t*) input;
+	lane->full = len >> 6;
+	lane->blocks = lane->full + tail_len / 64;
+	memcpy(lane->tail, lane->data + (len - rem), rem);
+	lane->tail[rem] = 0x80;
+	memset(lane->tail + rem + 1, 0, tail_len - rem - 1);
+	for (int i = 0; i < 8; ++i)
+		lane->tail[tail_len - 1 - i] = (uint8_t) (bits >> (i * 8));
+}
+
+void sha1_multi(uint32_t count, const void *const inputs[], const size_t lens[], uint8_t outputs[][20]) {
+#ifdef SHA1_HW
+	// SHA-NI逐条计算比多路向量计算更快
+	if (sha1_hw) {
+		for (uint32_t i = 0; i < count; ++i)
+			sha1(inputs[i], lens[i], outputs[i]);
+		return;
+	}
+#endif
+	for (uint32_t base = 0; base < count; base += SHA1_LANES) {
+		uint32_t n = count - base < SHA1_LANES ? count - base : SHA1_LANES;
+		if (n == 1) {
+			sha1(inputs[base], lens[base], outputs[base]);
+			continue;
+		}
+
+		sha1_lane_t lanes[SHA1_LANES];
+		size_t max_blocks = 0;
+		for (uint32_t l = 0; l < SHA1_LANES; ++l) {
+			if (l < n) sha1_lane_init(&lanes[l], inputs[base + l], lens[base + l]);
+			else sha1_lane_init(&lanes[l], "", 0);
+			if (l < n && lanes[l].blocks > max_blocks) max_blocks = lanes[l].blocks;
+		}
+
+		sha1_vec_t state[5], saved[5], W[16];
+		static const uint32_t IV[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+		for (int i = 0; i < 5; ++i)
+			state[i] = (sha1_vec_t) {} + IV[i];
+
+		for (size_t k = 0; k < max_blocks; ++k) {
+			bool partial = false;
+			for (uint32_t l = 0; l < SHA1_LANES; ++l) {
+				sha1_lane_t *lane = &lanes[l];
+				// 已经完成的消息重复计算最后一块, 结果丢弃
+				size_t b = k < lane->blocks ? k : lane->blocks - 1;
+				const uint8_t *p = b < lane->full ? lane->data + b * 64 : lane->tail + (b - lane->full) * 64;
+				for (int w = 0; w < 16; ++w) {
+					uint32_t v;
+					GET_UINT32_BE(v, p, w * 4);
+					W[w][l] = v;
+				}
+				partial |= k >= lane->blocks;
+			}
+			if (partial) memcpy(saved, state, sizeof(state));
+			sha1_lanes(state, W);
+			for (uint32_t l = 0; partial && l < SHA1_LANES; ++l) {
+				if (k < lanes[l].blocks) continue;
+				for (int i = 0; i < 5; ++i)
+					state[i][l] = saved[i][l];
+			}
+		}
+
+		for (uint32_t l = 0; l < n; ++l)
+			for (int i = 0; i < 5; ++i)
+				PUT_UINT32_BE(state[i][l], outputs[base + l], i * 4);
+	}
+}
+
+const char* sha1_impl_name() {
+#ifdef SHA1_HW
+	if (sha1_hw) return "sha-ni";
+	if (sha1_lanes == sha1_lanes_avx2) return "avx2";
+#endif
+	return "sse";
+}
+
 #ifdef SHA1_TEST
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "log.h"
 int main(int argc, char** argv) {
     unsigned char *pwd = (unsigned char*) "password";
     unsigned char data[20];
@@ -355,5 +603,44 @@ int main(int argc, char** argv) {
         log_debug("sha1-hmac fail");
     else
         log_debug("sha1-hmac succeed");
+
+    // SHA-NI、多路向量计算与查表实现比较, 覆盖不同的消息数量和填充边界附近的长度
+    static uint8_t buf[1024];
+    for (size_t i = 0; i < sizeof(buf); ++i) buf[i] = (uint8_t) rand();
+    int errors = 0;
+#ifdef SHA1_HW
+    bool hw = sha1_hw;
+#endif
+    for (uint32_t count = 1; count <= SHA1_LANES * 2 + 3; ++count) {
+        for (size_t len = 0; len < 300; len += count < 4 ? 1 : 7) {
+            const void *inputs[SHA1_LANES * 2 + 3];
+            size_t lens[SHA1_LANES * 2 + 3];
+            uint8_t outputs[SHA1_LANES * 2 + 3][20], expect[20];
+            for (uint32_t i = 0; i < count; ++i) {
+                inputs[i] = buf + i * 13;
+                lens[i] = (len + i * 29) % 700;
+            }
+#ifdef SHA1_HW
+            sha1_hw = false;
+#endif
+            sha1_multi(count, inputs, lens, outputs);
+            for (uint32_t i = 0; i < count; ++i) {
+                sha1(inputs[i], lens[i], expect);
+                if (memcmp(expect, outputs[i], 20)) ++errors;
+#ifdef SHA1_HW
+                uint8_t ni[20];
+                sha1_hw = hw;
+                sha1(inputs[i], lens[i], ni);
+                sha1_hw = false;
+                if (memcmp(expect, ni, 20)) ++errors;
+#endif
+            }
+        }
+    }
+#ifdef SHA1_HW
+    sha1_hw = hw;
+#endif
+    log_debug("sha1_multi and %s: %s, %d errors", sha1_impl_name(), errors ? "fail" : "succeed", errors);
+    return errors != 0;
 }
 #endif
\ No newline at end of file
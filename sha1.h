@@ -52,6 +52,9 @@
 extern "C" {
 #endif
 
+/** sha1_multi同时计算的消息数量 */
+#define SHA1_LANES 8
+
 /** SHA-1 context structure */
 typedef struct {
   uint32_t total[2];        /*!< number of bytes processed  */
@@ -88,6 +91,18 @@ void sha1_finish(sha1_ctx_t* pctx, uint8_t output[20]);
  */
 void sha1(const void *input, size_t ilen, uint8_t output[20]);
 
+/** 同时计算多条独立消息的SHA-1值, 每SHA1_LANES条消息在SIMD向量的各路中一起计算, 适合大量的短消息.
+ *  cpu支持SHA-NI时逐条使用SHA-NI计算, 比多路向量计算更快
+ * @param count    消息数量, 不限, 按SHA1_LANES条分组计算
+ * @param inputs   消息内容地址数组
+ * @param lens     消息长度数组(字节为单位)
+ * @param outputs  写入SHA-1结果的数组
+ */
+void sha1_multi(uint32_t count, const void *const inputs[], const size_t lens[], uint8_t outputs[][20]);
+
+/** 当前使用的实现名称, cpu支持SHA-NI时为"sha-ni", 否则为sha1_multi使用的"avx2"或"sse" */
+const char* sha1_impl_name();
+
 /** SHA-1 HMAC context setup
  * @param pctx     HMAC context to be initialized
  * @param key      HMAC secret key
@@ -13,7 +13,7 @@ str_t str_malloc(uint32_t capacity) {
     while (cap < min_cap)
         if (min_cap <= LARGE_CAP) cap <<= 1; else cap += LARGE_CAP;
 
-    struct _str_head_t *p = malloc(cap);
+    struct _str_head_t *p = memtag_malloc(MEMTAG_STR, cap);
     p->len = 0;
     p->cap = cap - sizeof(struct _str_head_t) - 1;
     p->data[0] = '\0';
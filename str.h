@@ -11,6 +11,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include "ppnarg.h"
+#include "memtag.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -50,7 +51,7 @@ static inline uint32_t str_len(const str_t self) { return STR_OFFSET_HEAD(self)-
 static inline uint32_t str_cap(const str_t self) { return STR_OFFSET_HEAD(self)->cap; }
 
 /** str_t引用计数减一，如果引用计数为0，则释放内存 */
-static inline void str_free(str_t self) { free(STR_OFFSET_HEAD(self)); }
+static inline void str_free(str_t self) { memtag_free(STR_OFFSET_HEAD(self)); }
 
 /** 分配str_t空间，容量为capacity
  * 
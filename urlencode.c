@@ -1,5 +1,11 @@
+#include <string.h>
 #include "urlencode.h"
 
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#   define URL_HW 1
+#endif
+
 const static char HEX[] = "0123456789ABCDEF";
 
 /** URL编码算法中需要编码的位图数组，从空格（32）开始，127结束，标志为1表示需要编码 */
@@ -19,6 +25,33 @@ inline static uint8_t hex_decode_char_fast(uint8_t b1, uint8_t b2) {
     return b1 << 4 | b2;
 }
 
+// 判断是否十六进制字符
+inline static _Bool is_hex(uint8_t ch) {
+    return (ch >= '0' && ch <= '9') || ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f');
+}
+
+// 规范化路径时保持编码的字符: 控制字符(包括%00)、反斜杠和百分号, 解码后可能截断字符串、注入日志或被再次解码
+inline static _Bool keep_encoded(uint8_t ch) {
+    return ch < 0x20 || ch == 0x7f || ch == '\\' || ch == '%';
+}
+
+/** 查找第一个等于c1或c2的字符, 每次比较16个字符
+ * @return          找到的位置, 找不到返回end
+*/
+inline static const char* find_char2(const char* s, const char* end, char c1, char c2) {
+#ifdef URL_HW
+    __m128i v1 = _mm_set1_epi8(c1), v2 = _mm_set1_epi8(c2);
+    for (; end - s >= 16; s += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) s);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, v1), _mm_cmpeq_epi8(v, v2)));
+        if (mask) return s + __builtin_ctz(mask);
+    }
+#endif
+    for (; s < end; ++s)
+        if (*s == c1 || *s == c2) return s;
+    return end;
+}
+
 // 判断字符是否需要编码
 inline static _Bool required_encode(unsigned char ch, const uint8_t* map) {
     if (ch < 32 || ch > 127) return 1;
@@ -109,38 +142,241 @@ size_t url_decode_length(const char* src, size_t src_len) {
     return count;
 }
 
-size_t url_decode(const char* src, size_t src_len, char* dst, size_t dst_len) {
+// url解码, 不需要解码的连续内容整段复制, dst可以与src相同
+static size_t decode(const char* src, size_t src_len, char* dst, size_t dst_len, _Bool plus) {
     if (!src || !src_len || !dst || !dst_len)
         return 0;
-    
+
+    const char *s = src, *src_end = src + src_len;
     char *p = dst, *pmax = dst + dst_len;
-    for (size_t i = 0; i < src_len; ++i) {
-        unsigned char cc = src[i];
-        if (cc == '%') {
-            if (i + 3 > src_len)
-                goto _ret;
-            *p++ = hex_decode_char_fast(src[i + 1], src[i + 2]);
-            i += 2;
+    while (s < src_end) {
+        const char *next = find_char2(s, src_end, '%', plus ? '+' : '%');
+        size_t n = next - s;
+        if (n > (size_t)(pmax - p))
+            n = pmax - p;
+        if (p != s)
+            memmove(p, s, n);
+        p += n, s += n;
+        if (s >= src_end || p >= pmax)
+            break;
+
+        if (*s == '+') {
+            *p++ = ' ';
+            ++s;
         } else {
-            *p++ = cc;
-            if (p >= pmax)
-                goto _ret;
+            if (s + 3 > src_end)
+                break;
+            *p++ = hex_decode_char_fast(s[1], s[2]);
+            s += 3;
         }
     }
 
-_ret:
     return p - dst;
 }
 
+size_t url_decode(const char* src, size_t src_len, char* dst, size_t dst_len) {
+    return decode(src, src_len, dst, dst_len, 0);
+}
+
+size_t url_component_decode(const char* src, size_t src_len, char* dst, size_t dst_len) {
+    return decode(src, src_len, dst, dst_len, 1);
+}
+
+/** 找到路径中第一个需要处理的位置: 百分号, 或者紧跟在斜杠后面的斜杠和点, 每次检查16个字符
+ * @return          需要处理的位置, 路径已经是规范的时候返回end
+*/
+static const char* path_check(const char* s, const char* end) {
+#ifdef URL_HW
+    __m128i pct = _mm_set1_epi8('%'), slash = _mm_set1_epi8('/'), dot = _mm_set1_epi8('.');
+    unsigned carry = 0;
+    for (; end - s >= 16; s += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) s);
+        unsigned ms = _mm_movemask_epi8(_mm_cmpeq_epi8(v, slash));
+        unsigned md = _mm_movemask_epi8(_mm_cmpeq_epi8(v, dot)) | ms;
+        // 斜杠的位置左移一位与斜杠和点的位置相与, 得到斜杠后面的斜杠和点, carry是上一块最后一个字符是否斜杠
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, pct)) | (((ms << 1) | carry) & md);
+        if (mask) return s + __builtin_ctz(mask);
+        carry = ms >> 15;
+    }
+    // 上一块的最后一个字符是斜杠时, 从斜杠开始逐字节检查
+    if (carry) --s;
+#endif
+    for (; s < end; ++s) {
+        if (*s == '%') return s;
+        if (*s == '/' && s + 1 < end && (s[1] == '/' || s[1] == '.')) return s + 1;
+    }
+    return end;
+}
+
+/** 一段路径结束时调用, 空段和"."去掉, ".."去掉并退回到上一段, 其它段在后面添加斜杠
+ * @param path      路径起始地址, 第一个字符是斜杠
+ * @param seg       当前段在输出中的起始位置
+ * @param d         当前输出位置, 即当前段的结束位置
+ * @return          新的输出位置, 也是下一段的起始位置
+*/
+inline static char* end_segment(char* path, char* seg, char* d) {
+    size_t n = d - seg;
+    if (!n || (n == 1 && seg[0] == '.'))
+        return seg;
+    if (n == 2 && seg[0] == '.' && seg[1] == '.') {
+        // 已经在根路径时保持不变
+        if (seg - 1 == path)
+            return seg;
+        for (d = seg - 1; d[-1] != '/'; --d);
+        return d;
+    }
+    *d++ = '/';
+    return d;
+}
+
+size_t url_path_normalize(char* path, size_t len) {
+    if (!path || !len || path[0] != '/')
+        return len;
+
+    const char *end = path + len, *s = path_check(path, end);
+    if (s == end)
+        return len;
+
+    // 从需要处理的位置所在的段开始逐段处理, 之前的内容已经是规范的, 保持不动
+    char *d = (char*) s;
+    while (d[-1] != '/') --d;
+    s = d;
+
+    char *seg = d;
+    for (;;) {
+        // 复制到下一个斜杠或百分号之前的普通字符, 输出位置不会超过读取位置, 可以就地处理
+        const char *next = find_char2(s, end, '/', '%');
+        if (d != s)
+            memmove(d, s, next - s);
+        d += next - s, s = next;
+        if (s >= end)
+            break;
+
+        char ch = *s;
+        if (ch == '%') {
+            // 不完整或非法的百分号编码保持原样
+            if (s + 3 > end || !is_hex(s[1]) || !is_hex(s[2])) {
+                *d++ = *s++;
+                continue;
+            }
+            ch = hex_decode_char_fast(s[1], s[2]);
+            if (keep_encoded((uint8_t) ch)) {
+                *d++ = *s++, *d++ = *s++, *d++ = *s++;
+                continue;
+            }
+            s += 3;
+            if (ch != '/') {
+                *d++ = ch;
+                continue;
+            }
+        } else {
+            ++s;
+        }
+
+        d = seg = end_segment(path, seg, d);
+    }
+
+    // 最后一段是"."或".."时同样处理, 结果以斜杠结尾; 普通的最后一段不添加斜杠
+    size_t n = d - seg;
+    if ((n == 1 && seg[0] == '.') || (n == 2 && seg[0] == '.' && seg[1] == '.'))
+        d = end_segment(path, seg, d);
+
+    return d - path;
+}
+
 
 #ifdef TEST_URLENCODE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+// 规范化的参考实现: 先整体解码, 再按斜杠分段处理
+static size_t ref_normalize(char* path, size_t len) {
+    char dec[len + 1], *segs[len + 1];
+    size_t n = 0, count = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (path[i] == '%' && i + 2 < len && is_hex(path[i + 1]) && is_hex(path[i + 2])
+                && !keep_encoded(hex_decode_char_fast(path[i + 1], path[i + 2]))) {
+            dec[n++] = hex_decode_char_fast(path[i + 1], path[i + 2]);
+            i += 2;
+        } else {
+            dec[n++] = path[i];
+        }
+    }
+    dec[n] = '\0';
+
+    _Bool trailing = 0;
+    for (char *p = dec + 1, *q; ; p = q + 1) {
+        q = memchr(p, '/', dec + n - p);
+        if (!q) q = dec + n;
+        *q = '\0';
+        trailing = !*p || !strcmp(p, ".") || !strcmp(p, "..");
+        if (!strcmp(p, "..")) { if (count) --count; }
+        else if (!trailing) segs[count++] = p;
+        if (q == dec + n) break;
+    }
+
+    char *d = path;
+    *d++ = '/';
+    for (size_t i = 0; i < count; ++i) {
+        size_t sl = strlen(segs[i]);
+        memcpy(d, segs[i], sl);
+        d += sl;
+        if (i + 1 < count || trailing) *d++ = '/';
+    }
+    return d - path;
+}
+
+static int test_normalize() {
+    static const char *cases[][2] = {
+        { "/", "/" }, { "/a/b", "/a/b" }, { "//a//b//", "/a/b/" }, { "/a/./b/.", "/a/b/" },
+        { "/a/b/../c", "/a/c" }, { "/../../a", "/a" }, { "/a/b/..", "/a/" }, { "/a%2Fb", "/a/b" },
+        { "/%2e%2E/x/%2e/y", "/x/y" }, { "/a%zz%4", "/a%zz%4" }, { "/.hidden/..x/x..", "/.hidden/..x/x.." },
+        { "/a+b%20c", "/a+b c" }, { "/0123456789abcdef/0123456789abcdef//x", "/0123456789abcdef/0123456789abcdef/x" },
+        { "/a%00b", "/a%00b" }, { "/x%0D%0ay%7f%1F", "/x%0D%0ay%7f%1F" }, { "/a%5c..%5Cb", "/a%5c..%5Cb" },
+        { "/%5c/../a", "/a" }, { "/a%2541", "/a%2541" }, { "/a%252e%2e/b", "/a%252e./b" },
+    };
+    int errors = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        char buf[128];
+        size_t len = strlen(cases[i][0]);
+        memcpy(buf, cases[i][0], len);
+        len = url_path_normalize(buf, len);
+        if (len != strlen(cases[i][1]) || memcmp(buf, cases[i][1], len)) {
+            printf("url_path_normalize(\"%s\") = \"%.*s\", expect \"%s\"\n", cases[i][0], (int) len, buf, cases[i][1]);
+            ++errors;
+        }
+    }
+
+    // 随机路径与参考实现比较, 字符集中斜杠和点较多, 覆盖跨16字节块的各种组合
+    static const char CHARS[] = "//..ab%2fFeE+05c";
+    for (int round = 0; round < 200000; ++round) {
+        char a[80], b[80];
+        size_t len = 1 + rand() % 70;
+        a[0] = '/';
+        for (size_t i = 1; i < len; ++i) a[i] = CHARS[rand() % (sizeof(CHARS) - 1)];
+        memcpy(b, a, len);
+        size_t n1 = url_path_normalize(a, len), n2 = ref_normalize(b, len);
+        if (n1 != n2 || memcmp(a, b, n1)) {
+            if (++errors < 10) printf("random case error: \"%.*s\" != \"%.*s\"\n", (int) n1, a, (int) n2, b);
+        }
+    }
+
+    // url参数解码, 就地解码与复制解码结果相同
+    char q[] = "a+b%20c%2B%3d%3D0123456789abcdef+%e4%b8%ad", expect[] = "a b c+==0123456789abcdef \xe4\xb8\xad";
+    char out[sizeof(q)];
+    size_t n = url_component_decode(q, sizeof(q) - 1, out, sizeof(out));
+    if (n != sizeof(expect) - 1 || memcmp(out, expect, n)) ++errors;
+    if (url_component_decode(q, sizeof(q) - 1, q, sizeof(q)) != n || memcmp(q, expect, n)) ++errors;
+
+    printf("url_path_normalize and url_component_decode: %s, %d errors\n", errors ? "fail" : "succeed", errors);
+    return errors;
+}
+
 int main(int argc, char** argv) {
     if (argc < 2) {
-        printf("Usage: %s <url>\n", argv[0]);
-        return 0;
+        printf("Usage: %s <url>, run built-in tests without url\n", argv[0]);
+        return test_normalize() != 0;
     }
 
     size_t len = url_encode_length(argv[1], strlen(argv[1]));
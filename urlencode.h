@@ -20,6 +20,20 @@ extern size_t url_decode_length(const char* src, size_t src_len);
 
 extern size_t url_decode(const char* src, size_t src_len, char* dst, size_t dst_len);
 
+/** url参数解码, 与url_decode相同, 另外把'+'解码为空格, dst可以与src相同(就地解码)
+ * @return          解码后的长度
+*/
+extern size_t url_component_decode(const char* src, size_t src_len, char* dst, size_t dst_len);
+
+/** 就地解码并规范化url路径: 解码百分号编码(包括%2F), 合并重复的斜杠, 去掉"."段, ".."段退回上一段(不超出根路径).
+ *  不以斜杠开头的路径不处理, 不完整或非法的百分号编码保持原样, '+'不解码,
+ *  控制字符(%00-%1F, %7F)、反斜杠(%5C)和百分号(%25)保持编码
+ * @param path      路径地址, 处理结果写回原位置
+ * @param len       路径长度
+ * @return          规范化后的长度, 不会超过len
+*/
+extern size_t url_path_normalize(char* path, size_t len);
+
 #ifdef __cplusplus
 }
 #endif